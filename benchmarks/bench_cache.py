@@ -0,0 +1,53 @@
+"""lru.cache against functools.lru_cache.
+
+Run from a checkout after building the extension in place::
+
+    python setup.py build_ext --inplace
+    PYTHONPATH=src python benchmarks/bench_cache.py
+"""
+import functools
+import timeit
+
+import lru
+
+N = 1000
+NUMBER = 200
+
+
+def identity(*args, **kwargs):
+    return args
+
+
+def cases(decorator):
+    one = decorator(maxsize=N)(identity)
+    two = decorator(maxsize=N)(identity)
+    kw = decorator(maxsize=N)(identity)
+    small = decorator(maxsize=N // 2)(identity)
+    keys = list(range(N))
+    strs = [str(k) for k in keys]
+    for k in keys:
+        one(k)
+        one(strs[k])
+        two(k, k)
+        kw(k, b=k)
+    return [
+        ("hit, int", lambda: [one(k) for k in keys]),
+        ("hit, str", lambda: [one(k) for k in strs]),
+        ("hit, 2 args", lambda: [two(k, k) for k in keys]),
+        ("hit, keyword", lambda: [kw(k, b=k) for k in keys]),
+        ("miss + evict", lambda: [small(k) for k in keys]),
+    ]
+
+
+def main():
+    ours = cases(lru.cache)
+    theirs = cases(functools.lru_cache)
+    print("%-16s %12s %12s" % ("", "lru.cache", "functools"))
+    for (name, fn), (_, other) in zip(ours, theirs):
+        t = [min(timeit.repeat(f, number=NUMBER, repeat=5)) / (NUMBER * N) * 1e9
+             for f in (fn, other)]
+        print("%-16s %9.1f ns %9.1f ns" % (name, t[0], t[1]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,49 @@
+"""get() hits by key type and engine.
+
+The keys looked up are equal to the stored ones but not the same objects, as when keys are
+built per request, so every hit compares keys. Run from a checkout after building the
+extension in place::
+
+    python setup.py build_ext --inplace
+    PYTHONPATH=src python benchmarks/bench_keys.py
+"""
+import timeit
+
+from lru import LRU
+
+N = 10000
+NUMBER = 20
+
+
+def copies(keys):
+    if isinstance(keys[0], str):
+        return ["".join(list(k)) for k in keys]
+    if isinstance(keys[0], bytes):
+        return [bytes(bytearray(k)) for k in keys]
+    return [k + 0 * 1 for k in keys]
+
+
+def main():
+    kinds = [
+        ("str", ["user:%d" % i for i in range(N)]),
+        ("bytes", [b"user:%d" % i for i in range(N)]),
+        ("int", [2 ** 40 + i for i in range(N)]),
+    ]
+    print("%-8s %12s %12s" % ("", "dict", "compact"))
+    for name, keys in kinds:
+        lookups = copies(keys)
+        for k in lookups:
+            hash(k)
+        times = []
+        for engine in ("dict", "compact"):
+            l = LRU(N, engine=engine)
+            for k in keys:
+                l[k] = 1
+            get = l.get
+            best = min(timeit.repeat(lambda: [get(k) for k in lookups], number=NUMBER, repeat=7))
+            times.append(best / (NUMBER * N) * 1e9)
+        print("%-8s %9.1f ns %9.1f ns" % (name, times[0], times[1]))
+
+
+if __name__ == "__main__":
+    main()
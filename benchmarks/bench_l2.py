@@ -0,0 +1,72 @@
+"""Memory only LRU against LRU with a disk tier, on a working set larger than memory.
+
+A trace of TRACE lookups draws from KEYS keys with Zipf (s=1) popularity, ten times what
+the LRU of SIZE entries holds in memory. A miss fetches the value from an origin which
+takes ORIGIN microseconds and sets it. With l2_path the entries evicted from memory go
+to a disk tier of L2_SIZE bytes instead, and the misses in memory look there first. The
+hit ratios of the tiers and the time per lookup, origin fetches included, are printed.
+Run from a checkout::
+
+    python setup.py build_ext --inplace
+    PYTHONPATH=src python benchmarks/bench_l2.py [directory]
+
+The disk tier file is created in directory, by default the temporary one.
+"""
+import itertools
+import os
+import random
+import sys
+import tempfile
+import time
+
+from lru import LRU
+
+SIZE = 10000
+KEYS = 10 * SIZE
+TRACE = 200000
+VALUE = 512
+ORIGIN = 50
+L2_SIZE = 2 * KEYS * (VALUE + 64)
+SEED = 1234
+
+
+def origin(key):
+    end = time.perf_counter() + ORIGIN / 1e6
+    while time.perf_counter() < end:
+        pass
+    return b"%d:" % key + b"v" * VALUE
+
+
+def run(cache, trace):
+    get = cache.get
+    t0 = time.perf_counter()
+    for k in trace:
+        if get(k) is None:
+            cache[k] = origin(k)
+    return time.perf_counter() - t0
+
+
+def main():
+    directory = sys.argv[1] if len(sys.argv) > 1 else tempfile.gettempdir()
+    rand = random.Random(SEED)
+    weights = list(itertools.accumulate(1 / (i + 1) for i in range(KEYS)))
+    trace = rand.choices(range(KEYS), cum_weights=weights, k=TRACE)
+    path = os.path.join(directory, "bench_l2.%d" % os.getpid())
+
+    print("%-10s%12s%12s%14s" % ("", "memory hit", "disk hit", "us/lookup"))
+    try:
+        for name, options in (("memory", {}), ("l2", {"l2_path": path, "l2_size": L2_SIZE})):
+            cache = LRU(SIZE, **options)
+            elapsed = run(cache, trace)
+            hits = cache.get_stats()[0]
+            l2_hits = cache.get_l2_stats()[0]
+            print("%-10s%11.1f%%%11.1f%%%14.2f" % (name, 100 * hits / TRACE,
+                                                   100 * l2_hits / TRACE, elapsed / TRACE * 1e6))
+            del cache
+    finally:
+        if os.path.exists(path):
+            os.unlink(path)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,42 @@
+"""Per-call cost of the LRU methods with optional arguments.
+
+Run from a checkout after building the extension in place::
+
+    python setup.py build_ext --inplace
+    PYTHONPATH=src python benchmarks/bench_methods.py
+"""
+import timeit
+
+from lru import LRU
+
+N = 1000
+NUMBER = 200
+
+
+def main():
+    l = LRU(N)
+    for i in range(N):
+        l[i] = i
+    hits = list(range(N))
+    misses = list(range(N, 2 * N))
+    get = l.get
+    has_key = l.has_key
+    setdefault = l.setdefault
+
+    cases = [
+        ("get hit", lambda: [get(k) for k in hits]),
+        ("get hit, default", lambda: [get(k, 0) for k in hits]),
+        ("get miss", lambda: [get(k) for k in misses]),
+        ("get miss, default=", lambda: [get(k, default=0) for k in misses]),
+        ("has_key", lambda: [has_key(k) for k in hits]),
+        ("setdefault hit", lambda: [setdefault(k, 0) for k in hits]),
+        ("pop + set", lambda: [l.__setitem__(k, l.pop(k)) for k in hits]),
+        ("popitem + set", lambda: [l.__setitem__(*l.popitem()) for k in hits]),
+    ]
+    for name, fn in cases:
+        best = min(timeit.repeat(fn, number=NUMBER, repeat=5))
+        print("%-20s %7.1f ns/call" % (name, best / (NUMBER * N) * 1e9))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,84 @@
+"""Per-operation cost of set, update, pop, del and eviction, and how often they hash the key.
+
+Keys are str, whose hash is cached, and a class with a Python __hash__ and __eq__, where
+every extra hash or probe shows, on the dict and the compact engines. Run from a checkout
+after building the extension in place::
+
+    python setup.py build_ext --inplace
+    PYTHONPATH=src python benchmarks/bench_probes.py
+"""
+import timeit
+
+from lru import LRU
+
+N = 1000
+NUMBER = 50
+
+
+class Key:
+    __slots__ = ("n",)
+    hashes = 0
+
+    def __init__(self, n):
+        self.n = n
+
+    def __hash__(self):
+        Key.hashes += 1
+        return hash(self.n)
+
+    def __eq__(self, other):
+        return self.n == other.n
+
+
+def cases(keys, engine):
+    def set_new():
+        l = LRU(N, engine=engine)
+        for k in keys:
+            l[k] = 0
+        return l
+
+    full = set_new()
+
+    def update():
+        for k in keys:
+            full[k] = 1
+
+    def pop_set():
+        for k in keys:
+            full[k] = full.pop(k)
+
+    def del_set():
+        for k in keys:
+            del full[k]
+            full[k] = 0
+
+    def evict():
+        l = LRU(N // 2, engine=engine)
+        for k in keys:
+            l[k] = 0
+
+    return [
+        ("set new", set_new),
+        ("update", update),
+        ("pop + set", pop_set),
+        ("del + set", del_set),
+        ("set + evict", evict),
+    ]
+
+
+def main():
+    for engine in ("dict", "compact"):
+        for name, keys in [("str", [str(i) for i in range(N)]),
+                           ("Key", [Key(i) for i in range(N)])]:
+            print("%s keys, engine=%r" % (name, engine))
+            for op, fn in cases(keys, engine):
+                Key.hashes = 0
+                fn()
+                hashes = Key.hashes / N
+                best = min(timeit.repeat(fn, number=NUMBER, repeat=5))
+                extra = " %4.1f hashes/op" % hashes if name == "Key" else ""
+                print("  %-12s %7.1f ns/op%s" % (op, best / (NUMBER * N) * 1e9, extra))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,91 @@
+"""Throughput of LRU workers in threads against workers in subinterpreters.
+
+Each worker runs OPS lookups of a skewed key stream against its own LRU of SIZE entries,
+setting the key on a miss. N workers run as threads of the main interpreter, which take
+turns on its GIL, then as threads each running an isolated subinterpreter, which has a
+GIL of its own (Python 3.12+, PEP 684) and runs in parallel with the others. Creating the
+interpreters and importing lru in them isn't timed. The best of REPEAT runs is reported
+in lookups per second over all the workers. Run from a checkout::
+
+    python setup.py build_ext --inplace
+    PYTHONPATH=src python benchmarks/bench_subinterpreters.py [N ...]
+
+N defaults to 1, 2, 4 and the number of CPUs.
+"""
+import os
+import sys
+import threading
+import time
+
+try:
+    import _interpreters as interpreters
+except ImportError:
+    import _xxsubinterpreters as interpreters
+
+import lru
+
+SIZE = 10000
+KEYS = 4 * SIZE
+OPS = 1000000
+REPEAT = 3
+
+WORKER = """
+l = lru.LRU(%d)
+get = l.get
+for i in range(%d):
+    k = i * i %% %d
+    if get(k) is None:
+        l[k] = i
+""" % (SIZE, OPS, KEYS)
+
+
+def run_parallel(n, work):
+    threads = [threading.Thread(target=work, args=(i,)) for i in range(n)]
+    t0 = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return time.perf_counter() - t0
+
+
+def bench_threads(n):
+    def work(i):
+        exec(WORKER, {"lru": lru})
+    return run_parallel(n, work)
+
+
+def bench_subinterpreters(n):
+    interps = [interpreters.create() for _ in range(n)]
+    errors = []
+
+    def work(i):
+        error = interpreters.run_string(interps[i], WORKER)
+        if error is not None:
+            errors.append(error)
+
+    try:
+        for interp in interps:
+            interpreters.run_string(interp, "import sys; sys.path[:] = %r; import lru" % sys.path)
+        elapsed = run_parallel(n, work)
+    finally:
+        for interp in interps:
+            interpreters.destroy(interp)
+    if errors:
+        raise RuntimeError("a worker failed: %s" % (errors[0],))
+    return elapsed
+
+
+def main():
+    counts = [int(arg) for arg in sys.argv[1:]] or sorted({1, 2, 4, os.cpu_count() or 1})
+    print("%8s%18s%18s%10s" % ("workers", "threads", "subinterpreters", "speedup"))
+    for n in counts:
+        threads = min(bench_threads(n) for _ in range(REPEAT))
+        subinterpreters = min(bench_subinterpreters(n) for _ in range(REPEAT))
+        print("%8d%16.2fM/s%16.2fM/s%9.2fx" % (n, n * OPS / threads / 1e6,
+                                                n * OPS / subinterpreters / 1e6,
+                                                threads / subinterpreters))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,339 @@
+"""LRU against functools.lru_cache, OrderedDict and dict, over operations and workloads.
+
+Each benchmark is timed with pyperf for every implementation that supports it, as
+``<benchmark>[<implementation>]``, in time per operation. Run from a checkout::
+
+    pip install .[bench]
+    python setup.py build_ext --inplace
+    PYTHONPATH=src python benchmarks/bench_suite.py -o bench.json
+    python benchmarks/bench_suite.py --matrix bench.json
+
+The last command prints the results as a table with a row per benchmark and a column
+per implementation. ``--impl NAME`` and ``--bench NAME``, both repeatable, run a subset
+and the usual pyperf options apply (``--fast``, ``--rigorous``, ...). To look for a
+regression, run the suite on both trees and ``python -m pyperf compare_to before.json
+after.json --table``.
+
+The implementations:
+
+lru, lru-compact
+    LRU(SIZE) with the dict and the compact engine.
+ordereddict
+    The OrderedDict recipe: move_to_end() on hits, popitem(last=False) to evict.
+dict
+    A plain dict, which never evicts: the floor of what a mapping costs. It doesn't run
+    the benchmarks which evict.
+lru_cache, lru.cache
+    functools.lru_cache and lru.cache around a function returning its argument. A call
+    is a lookup which inserts on a miss, so they only run get-hit, insert-at-capacity
+    and the lookup workloads.
+
+The operations run on a full cache of SIZE entries: get-hit, get-miss, update (set an
+existing key), pop, insert-at-capacity (every insert evicts), evict-callback (the same
+with an eviction callback) and items-scan (per item). The workloads look up each key of a
+trace of TRACE keys and set it on a miss: zipf draws from 4 * SIZE keys with Zipf (s=1)
+popularity, uniform from 2 * SIZE keys, scan cycles over 2 * SIZE keys, more than LRU
+can hold, and mixed is zipf with one access in 5 setting the key instead.
+"""
+import collections
+import functools
+import itertools
+import random
+import sys
+import time
+
+import pyperf
+
+import lru
+
+SIZE = 10000
+TRACE = 100000
+SEED = 1234
+
+
+def identity(key):
+    return key
+
+
+class LRUCache:
+    memoizer = False
+    options = {}
+
+    def __init__(self, size, callback=None):
+        self.cache = lru.LRU(size, callback=callback, **self.options)
+        self.get = self.cache.get
+        self.set = self.cache.__setitem__
+        self.pop = self.cache.pop
+        self.items = self.cache.items
+
+
+class CompactLRUCache(LRUCache):
+    options = {"engine": "compact"}
+
+
+class OrderedDictCache:
+    memoizer = False
+
+    def __init__(self, size, callback=None):
+        d = collections.OrderedDict()
+        move_to_end = d.move_to_end
+        popitem = d.popitem
+
+        def get(key, default=None):
+            if key not in d:
+                return default
+            move_to_end(key)
+            return d[key]
+
+        def set(key, value):
+            d[key] = value
+            move_to_end(key)
+            if len(d) > size:
+                evicted = popitem(last=False)
+                if callback:
+                    callback(*evicted)
+
+        self.get = get
+        self.set = set
+        self.pop = d.pop
+        self.items = d.items
+
+
+class DictCache:
+    memoizer = False
+
+    def __init__(self, size, callback=None):
+        d = {}
+        self.get = d.get
+        self.set = d.__setitem__
+        self.pop = d.pop
+        self.items = d.items
+
+
+class LruCacheCache:
+    memoizer = True
+    decorator = staticmethod(functools.lru_cache)
+
+    def __init__(self, size, callback=None):
+        self.lookup = self.decorator(maxsize=size)(identity)
+
+
+class NativeCacheCache(LruCacheCache):
+    decorator = staticmethod(lru.cache)
+
+
+IMPLEMENTATIONS = {
+    "lru": LRUCache,
+    "lru-compact": CompactLRUCache,
+    "ordereddict": OrderedDictCache,
+    "dict": DictCache,
+    "lru_cache": LruCacheCache,
+    "lru.cache": NativeCacheCache,
+}
+
+
+def full(impl, keys):
+    cache = impl(SIZE)
+    if impl.memoizer:
+        for k in keys:
+            cache.lookup(k)
+    else:
+        for k in keys:
+            cache.set(k, k)
+    return cache
+
+
+# Operations, each times loops passes over SIZE keys.
+
+def bench_get_hit(loops, impl):
+    keys = list(range(SIZE))
+    cache = full(impl, keys)
+    get = cache.lookup if impl.memoizer else cache.get
+    t0 = time.perf_counter()
+    for _ in range(loops):
+        for k in keys:
+            get(k)
+    return time.perf_counter() - t0
+
+
+def bench_get_miss(loops, impl):
+    get = full(impl, range(SIZE)).get
+    misses = list(range(SIZE, 2 * SIZE))
+    t0 = time.perf_counter()
+    for _ in range(loops):
+        for k in misses:
+            get(k)
+    return time.perf_counter() - t0
+
+
+def bench_update(loops, impl):
+    keys = list(range(SIZE))
+    set = full(impl, keys).set
+    t0 = time.perf_counter()
+    for _ in range(loops):
+        for k in keys:
+            set(k, k)
+    return time.perf_counter() - t0
+
+
+def bench_pop(loops, impl):
+    keys = list(range(SIZE))
+    cache = full(impl, keys)
+    elapsed = 0.0
+    for _ in range(loops):
+        pop = cache.pop
+        t0 = time.perf_counter()
+        for k in keys:
+            pop(k)
+        elapsed += time.perf_counter() - t0
+        for k in keys:
+            cache.set(k, k)
+    return elapsed
+
+
+def insert(loops, cache, store):
+    # Alternate between two key sets, so that every insert evicts a key of the other.
+    halves = list(range(SIZE)), list(range(SIZE, 2 * SIZE))
+    t0 = time.perf_counter()
+    for keys in itertools.islice(itertools.cycle(halves[::-1]), loops):
+        for k in keys:
+            store(k)
+    return time.perf_counter() - t0
+
+
+def bench_insert(loops, impl):
+    cache = full(impl, range(SIZE))
+    if impl.memoizer:
+        return insert(loops, cache, cache.lookup)
+    set = cache.set
+    return insert(loops, cache, lambda k: set(k, k))
+
+
+def bench_evict_callback(loops, impl):
+    evicted = []
+    cache = impl(SIZE, callback=lambda key, value: evicted.append(key))
+    for k in range(SIZE):
+        cache.set(k, k)
+    set = cache.set
+    result = insert(loops, cache, lambda k: set(k, k))
+    assert len(evicted) == loops * SIZE
+    return result
+
+
+def bench_items_scan(loops, impl):
+    items = full(impl, range(SIZE)).items
+    t0 = time.perf_counter()
+    for _ in range(loops):
+        for _ in items():
+            pass
+    return time.perf_counter() - t0
+
+
+# Workloads, each times loops passes over a trace of TRACE accesses.
+
+@functools.lru_cache(maxsize=None)
+def trace(workload):
+    rand = random.Random(SEED)
+    if workload == "scan":
+        return [(k % (2 * SIZE), False) for k in range(TRACE)]
+    if workload == "uniform":
+        return [(rand.randrange(2 * SIZE), False) for _ in range(TRACE)]
+    keys = list(range(4 * SIZE))
+    weights = list(itertools.accumulate(1 / (i + 1) for i in keys))
+    accesses = rand.choices(keys, cum_weights=weights, k=TRACE)
+    return [(k, workload == "mixed" and rand.random() < 0.2) for k in accesses]
+
+
+def run_workload(loops, impl, workload):
+    accesses = trace(workload)
+    cache = impl(SIZE)
+    if impl.memoizer:
+        lookup = cache.lookup
+        keys = [k for k, _ in accesses]
+        t0 = time.perf_counter()
+        for _ in range(loops):
+            for k in keys:
+                lookup(k)
+        return time.perf_counter() - t0
+
+    get, set = cache.get, cache.set
+    t0 = time.perf_counter()
+    for _ in range(loops):
+        for k, write in accesses:
+            if write or get(k) is None:
+                set(k, k)
+    return time.perf_counter() - t0
+
+
+def workload(name):
+    return functools.partial(run_workload, workload=name)
+
+
+BENCHMARKS = {
+    "get-hit": (bench_get_hit, SIZE),
+    "get-miss": (bench_get_miss, SIZE),
+    "update": (bench_update, SIZE),
+    "pop": (bench_pop, SIZE),
+    "insert-at-capacity": (bench_insert, SIZE),
+    "evict-callback": (bench_evict_callback, SIZE),
+    "items-scan": (bench_items_scan, SIZE),
+    "zipf": (workload("zipf"), TRACE),
+    "uniform": (workload("uniform"), TRACE),
+    "scan": (workload("scan"), TRACE),
+    "mixed": (workload("mixed"), TRACE),
+}
+
+# What the memoizers and dict can run.
+LOOKUP_BENCHMARKS = {"get-hit", "insert-at-capacity", "zipf", "uniform", "scan"}
+EVICTING_BENCHMARKS = {"insert-at-capacity", "evict-callback"}
+
+
+def supported(impl, bench):
+    if impl.memoizer:
+        return bench in LOOKUP_BENCHMARKS
+    return impl is not DictCache or bench not in EVICTING_BENCHMARKS
+
+
+def add_cmdline_args(cmd, args):
+    for name in args.impl or ():
+        cmd.extend(("--impl", name))
+    for name in args.bench or ():
+        cmd.extend(("--bench", name))
+
+
+def matrix(path):
+    means = collections.defaultdict(dict)
+    for benchmark in pyperf.BenchmarkSuite.load(path).get_benchmarks():
+        bench, _, impl = benchmark.get_name()[:-1].partition("[")
+        means[bench][impl] = benchmark.mean()
+    impls = [i for i in IMPLEMENTATIONS if any(i in row for row in means.values())]
+    print("%-20s" % "ns/op" + "".join("%13s" % i for i in impls))
+    for bench in BENCHMARKS:
+        if bench in means:
+            row = means[bench]
+            print("%-20s" % bench + "".join(
+                "%13.1f" % (row[i] * 1e9) if i in row else "%13s" % "-" for i in impls))
+
+
+def main():
+    if sys.argv[1:2] == ["--matrix"] and len(sys.argv) == 3:
+        matrix(sys.argv[2])
+        return
+
+    runner = pyperf.Runner(add_cmdline_args=add_cmdline_args)
+    runner.argparser.add_argument("--impl", action="append", choices=list(IMPLEMENTATIONS))
+    runner.argparser.add_argument("--bench", action="append", choices=list(BENCHMARKS))
+    args = runner.parse_args()
+    runner.metadata["lru_size"] = SIZE
+    for bench, (func, inner_loops) in BENCHMARKS.items():
+        if args.bench and bench not in args.bench:
+            continue
+        for name, impl in IMPLEMENTATIONS.items():
+            if (args.impl and name not in args.impl) or not supported(impl, bench):
+                continue
+            runner.bench_time_func("%s[%s]" % (bench, name), func, impl,
+                                   inner_loops=inner_loops)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,3 +1,52 @@
+from collections import namedtuple
+from functools import update_wrapper
+
 from ._lru import LRU as LRU  # noqa: F401
+from ._lru import ShardedLRU as ShardedLRU  # noqa: F401
+from ._lru import _cache_wrapper
+from ._lru import simulate as simulate  # noqa: F401
+
+__all__ = ["AsyncLRU", "LRU", "ShardedLRU", "cache", "simulate"]
+
+CacheInfo = namedtuple("CacheInfo", ["hits", "misses", "maxsize", "currsize"])
+
+
+def __getattr__(name):
+    # AsyncLRU is imported on first use, to not import asyncio with lru.
+    if name == "AsyncLRU":
+        from ._async import AsyncLRU
+        globals()["AsyncLRU"] = AsyncLRU
+        return AsyncLRU
+    raise AttributeError("module %r has no attribute %r" % (__name__, name))
+
+
+def cache(maxsize=128, typed=False):
+    """Memoizing decorator keeping the results of the maxsize most recent calls.
+
+    A drop-in replacement for functools.lru_cache: maxsize=None caches without
+    bound, with typed=True arguments of different types are cached separately,
+    and the wrapper has cache_info(), cache_clear() and cache_parameters().
+    """
+    if isinstance(maxsize, int):
+        if maxsize < 0:
+            maxsize = 0
+    elif callable(maxsize) and isinstance(typed, bool):
+        # Used as @cache, without arguments.
+        user_function, maxsize = maxsize, 128
+        wrapper = _cache_wrapper(user_function, maxsize, typed, CacheInfo)
+        return update_wrapper(wrapper, user_function)
+    elif maxsize is not None:
+        raise TypeError("Expected first argument to be an integer, a callable, or None")
+
+    def decorating_function(user_function):
+        wrapper = _cache_wrapper(user_function, maxsize, typed, CacheInfo)
+        return update_wrapper(wrapper, user_function)
+
+    return decorating_function
 
-__all__ = ["LRU"]
+try:
+    from ._lru import SharedLRU as SharedLRU  # noqa: F401
+except ImportError:  # pragma: no cover - not available on Windows
+    pass
+else:
+    __all__.append("SharedLRU")
@@ -1,9 +1,14 @@
+import os
 from typing import (
     Any,
+    Awaitable,
     Callable,
     Generic,
     Hashable,
     Iterable,
+    Iterator,
+    Literal,
+    NamedTuple,
     TypeVar,
     overload,
     Protocol
@@ -20,21 +25,121 @@ class __SupportsKeysAndGetItem(Protocol[_KT, _VT_co]):
     def __getitem__(self, __key: _KT) -> _VT_co: ...
 
 
+# With callback_reason=True the callback also gets "capacity", "resize", "expired" or
+# "explicit". With callback_batch=True it gets a list of those argument tuples instead.
+_Callback = (
+    Callable[[_KT, _VT], Any]
+    | Callable[[_KT, _VT, str], Any]
+    | Callable[[list[tuple[Any, ...]]], Any]
+)
+
+
+class _Writer(Protocol):
+    def write(self, __data: bytes) -> Any: ...
+
+
+class _Reader(Protocol):
+    def read(self, __size: int) -> bytes: ...
+
+
+class _LRUView(Generic[_T]):
+    def __len__(self) -> int: ...
+    def __iter__(self) -> Iterator[_T]: ...
+    def __reversed__(self) -> Iterator[_T]: ...
+    def __contains__(self, __o: Any) -> bool: ...
+
+
 class LRU(Generic[_KT, _VT]):
     @overload
-    def __init__(self, size: int) -> None: ...
+    def __init__(
+        self,
+        size: int,
+        *,
+        engine: Literal["dict", "compact"] = ...,
+        read_buffer: int = ...,
+        policy: Literal["lru", "clock", "slru", "2q", "tinylfu"] = ...,
+        ttl: float | None = ...,
+        timer: Callable[[], float] | None = ...,
+        callback_reason: bool = ...,
+        max_weight: int | None = ...,
+        weigher: Callable[[_KT, _VT], int] | None = ...,
+        callback_batch: bool = ...,
+        metrics: bool = ...,
+        mrc: int = ...,
+        trace: int = ...,
+        value_store: Literal["object", "arena"] = ...,
+        copy_values: bool = ...,
+        l2_path: str | os.PathLike[str] | None = ...,
+        l2_size: int = ...,
+    ) -> None: ...
+    @overload
+    def __init__(
+        self,
+        size: int,
+        callback: _Callback[_KT, _VT] | None,
+        engine: Literal["dict", "compact"] = ...,
+        read_buffer: int = ...,
+        policy: Literal["lru", "clock", "slru", "2q", "tinylfu"] = ...,
+        ttl: float | None = ...,
+        timer: Callable[[], float] | None = ...,
+        callback_reason: bool = ...,
+        max_weight: int | None = ...,
+        weigher: Callable[[_KT, _VT], int] | None = ...,
+        callback_batch: bool = ...,
+        metrics: bool = ...,
+        mrc: int = ...,
+        trace: int = ...,
+        value_store: Literal["object", "arena"] = ...,
+        copy_values: bool = ...,
+        l2_path: str | os.PathLike[str] | None = ...,
+        l2_size: int = ...,
+    ) -> None: ...
     @overload
-    def __init__(self, size: int, callback: Callable[[_KT, _VT], Any]) -> None: ...
     def clear(self) -> None: ...
     @overload
-    def get(self, key: _KT) -> _VT | None: ...
+    def clear(self, budget: int) -> int: ...
+    def invalidate_all(self) -> None: ...
+    @overload
+    def get(self, key: _KT, *, promote: bool = ...) -> _VT | None: ...
+    @overload
+    def get(self, key: _KT, instead: _VT | _T, *, promote: bool = ...) -> _VT | _T: ...
+    @overload
+    def peek(self, key: _KT) -> _VT | None: ...
+    @overload
+    def peek(self, key: _KT, default: _VT | _T) -> _VT | _T: ...
+    def contains_many(self, keys: Iterable[_KT]) -> list[bool]: ...
+    @overload
+    def get_many(self, keys: Iterable[_KT]) -> list[_VT | None]: ...
     @overload
-    def get(self, key: _KT, instead: _VT | _T) -> _VT | _T: ...
+    def get_many(self, keys: Iterable[_KT], default: _T) -> list[_VT | _T]: ...
+    def set(
+        self,
+        key: _KT,
+        value: _VT,
+        ttl: float | None = ...,
+        weight: int | None = ...,
+        tags: Iterable[Hashable] | None = ...,
+    ) -> None: ...
+    def invalidate_tag(self, tag: Hashable) -> int: ...
+    def expire(self) -> int: ...
+    def set_many(self, pairs: Iterable[tuple[_KT, _VT]]) -> None: ...
+    def delete_many(self, keys: Iterable[_KT]) -> int: ...
     def get_size(self) -> int: ...
+    def get_current_weight(self) -> int: ...
+    def get_max_weight(self) -> int | None: ...
+    def set_max_weight(self, max_weight: int) -> None: ...
     def has_key(self, key: _KT) -> bool: ...
     def keys(self) -> list[_KT]: ...
     def values(self) -> list[_VT]: ...
     def items(self) -> list[tuple[_KT, _VT]]: ...
+    def iterkeys(self) -> Iterator[_KT]: ...
+    def itervalues(self) -> Iterator[_VT]: ...
+    def iteritems(self) -> Iterator[tuple[_KT, _VT]]: ...
+    def viewkeys(self) -> _LRUView[_KT]: ...
+    def viewvalues(self) -> _LRUView[_VT]: ...
+    def viewitems(self) -> _LRUView[tuple[_KT, _VT]]: ...
+    def dump(self, file: _Writer) -> None: ...
+    def load(self, file: _Reader) -> int: ...
     def peek_first_item(self) -> tuple[_KT, _VT] | None: ...
     def peek_last_item(self) -> tuple[_KT, _VT] | None: ...
     @overload
@@ -42,12 +147,14 @@ class LRU(Generic[_KT, _VT]):
     @overload
     def pop(self, key: _KT, default: _VT | _T) -> _VT | _T: ...
     def popitem(self, least_recent: bool = ...) -> tuple[_KT, _VT]: ...
+    def get_or_load(self, key: _KT, loader: Callable[[_KT], _VT]) -> _VT: ...
     @overload
     def setdefault(self: LRU[_KT, _T | None], key: _KT) -> _T | None: ...
     @overload
     def setdefault(self, key: _KT, default: _VT) -> _VT: ...
-    def set_callback(self, callback: Callable[[_KT, _VT], Any] | None) -> None: ...
-    def set_size(self, size: int) -> None: ...
+    def set_callback(self, callback: _Callback[_KT, _VT] | None) -> None: ...
+    def set_size(self, size: int, incremental: bool = ...) -> None: ...
+    def trim(self, n: int | None = ..., budget_items: int | None = ...) -> list[tuple[_KT, _VT]] | int: ...
     @overload
     def update(self, __m: __SupportsKeysAndGetItem[_KT, _VT], **kwargs: _VT) -> None: ...
     @overload
@@ -55,9 +162,204 @@ class LRU(Generic[_KT, _VT]):
     @overload
     def update(self, **kwargs: _VT) -> None: ...
     def get_stats(self) -> tuple[int, int]: ...
+    def get_metrics(self) -> dict[str, Any]: ...
+    def miss_ratio_curve(self, sizes: Iterable[int] | None = ...) -> list[tuple[int, float]]: ...
+    def flush_trace(self, file: _Writer) -> tuple[int, int]: ...
+    def get_read_buffer_stats(self) -> tuple[int, int]: ...
+    def get_arena_stats(self) -> tuple[int, int]: ...
+    def get_l2_stats(self) -> tuple[int, int, int, int]: ...
     def __contains__(self, __o: Any) -> bool: ...
     def __delitem__(self, key: _KT) -> None: ...
     def __getitem__(self, item: _KT) -> _VT: ...
     def __len__(self) -> int: ...
+    def __iter__(self) -> Iterator[_KT]: ...
+    def __reversed__(self) -> Iterator[_KT]: ...
     def __repr__(self) -> str: ...
     def __setitem__(self, key: _KT, value: _VT) -> None: ...
+
+
+class ShardedLRU(Generic[_KT, _VT]):
+    def __init__(
+        self,
+        size: int,
+        shards: int = ...,
+        *,
+        callback: _Callback[_KT, _VT] | None = ...,
+        engine: Literal["dict", "compact"] = ...,
+        read_buffer: int = ...,
+        policy: Literal["lru", "clock", "slru", "2q", "tinylfu"] = ...,
+        ttl: float | None = ...,
+        timer: Callable[[], float] | None = ...,
+        callback_reason: bool = ...,
+        max_weight: int | None = ...,
+        weigher: Callable[[_KT, _VT], int] | None = ...,
+        callback_batch: bool = ...,
+        metrics: bool = ...,
+        mrc: int = ...,
+        trace: int = ...,
+        value_store: Literal["object", "arena"] = ...,
+        copy_values: bool = ...,
+    ) -> None: ...
+    @overload
+    def clear(self) -> None: ...
+    @overload
+    def clear(self, budget: int) -> int: ...
+    def invalidate_all(self) -> None: ...
+    @overload
+    def get(self, key: _KT, *, promote: bool = ...) -> _VT | None: ...
+    @overload
+    def get(self, key: _KT, default: _VT | _T, *, promote: bool = ...) -> _VT | _T: ...
+    @overload
+    def peek(self, key: _KT) -> _VT | None: ...
+    @overload
+    def peek(self, key: _KT, default: _VT | _T) -> _VT | _T: ...
+    def contains_many(self, keys: Iterable[_KT]) -> list[bool]: ...
+    @overload
+    def get_many(self, keys: Iterable[_KT]) -> list[_VT | None]: ...
+    @overload
+    def get_many(self, keys: Iterable[_KT], default: _T) -> list[_VT | _T]: ...
+    def set(
+        self,
+        key: _KT,
+        value: _VT,
+        ttl: float | None = ...,
+        weight: int | None = ...,
+        tags: Iterable[Hashable] | None = ...,
+    ) -> None: ...
+    def invalidate_tag(self, tag: Hashable) -> int: ...
+    def expire(self) -> int: ...
+    def set_many(self, pairs: Iterable[tuple[_KT, _VT]]) -> None: ...
+    def delete_many(self, keys: Iterable[_KT]) -> int: ...
+    def get_size(self) -> int: ...
+    def get_current_weight(self) -> int: ...
+    def get_max_weight(self) -> int | None: ...
+    def set_max_weight(self, max_weight: int) -> None: ...
+    def get_shards(self) -> int: ...
+    def has_key(self, key: _KT) -> bool: ...
+    def keys(self) -> list[_KT]: ...
+    def values(self) -> list[_VT]: ...
+    def items(self) -> list[tuple[_KT, _VT]]: ...
+    def iterkeys(self) -> Iterator[_KT]: ...
+    def itervalues(self) -> Iterator[_VT]: ...
+    def iteritems(self) -> Iterator[tuple[_KT, _VT]]: ...
+    def viewkeys(self) -> _LRUView[_KT]: ...
+    def viewvalues(self) -> _LRUView[_VT]: ...
+    def viewitems(self) -> _LRUView[tuple[_KT, _VT]]: ...
+    def dump(self, file: _Writer) -> None: ...
+    def load(self, file: _Reader) -> int: ...
+    @overload
+    def pop(self, key: _KT) -> _VT | None: ...
+    @overload
+    def pop(self, key: _KT, default: _VT | _T) -> _VT | _T: ...
+    def popitem(self, least_recent: bool = ...) -> tuple[_KT, _VT]: ...
+    def get_or_load(self, key: _KT, loader: Callable[[_KT], _VT]) -> _VT: ...
+    @overload
+    def setdefault(self: ShardedLRU[_KT, _T | None], key: _KT) -> _T | None: ...
+    @overload
+    def setdefault(self, key: _KT, default: _VT) -> _VT: ...
+    def set_callback(self, callback: _Callback[_KT, _VT] | None) -> None: ...
+    def set_size(self, size: int, incremental: bool = ...) -> None: ...
+    @overload
+    def update(self, __m: __SupportsKeysAndGetItem[_KT, _VT], **kwargs: _VT) -> None: ...
+    @overload
+    def update(self, __m: Iterable[tuple[_KT, _VT]], **kwargs: _VT) -> None: ...
+    @overload
+    def update(self, **kwargs: _VT) -> None: ...
+    def get_stats(self) -> tuple[int, int]: ...
+    def get_metrics(self) -> dict[str, Any]: ...
+    def miss_ratio_curve(self, sizes: Iterable[int] | None = ...) -> list[tuple[int, float]]: ...
+    def flush_trace(self, file: _Writer) -> tuple[int, int]: ...
+    def __contains__(self, __o: Any) -> bool: ...
+    def __delitem__(self, key: _KT) -> None: ...
+    def __getitem__(self, item: _KT) -> _VT: ...
+    def __len__(self) -> int: ...
+    def __iter__(self) -> Iterator[_KT]: ...
+    def __reversed__(self) -> Iterator[_KT]: ...
+    def __repr__(self) -> str: ...
+    def __setitem__(self, key: _KT, value: _VT) -> None: ...
+
+class CacheInfo(NamedTuple):
+    hits: int
+    misses: int
+    maxsize: int | None
+    currsize: int
+
+
+class _CacheWrapper(Generic[_T]):
+    __wrapped__: Callable[..., _T]
+    def __call__(self, *args: Hashable, **kwargs: Hashable) -> _T: ...
+    def cache_info(self) -> CacheInfo: ...
+    def cache_clear(self) -> None: ...
+    def cache_parameters(self) -> dict[str, Any]: ...
+
+
+@overload
+def cache(
+    maxsize: int | None = ..., typed: bool = ...
+) -> Callable[[Callable[..., _T]], _CacheWrapper[_T]]: ...
+@overload
+def cache(maxsize: Callable[..., _T], typed: bool = ...) -> _CacheWrapper[_T]: ...
+
+
+_Policy = Literal["lru", "clock", "slru", "2q", "tinylfu"]
+
+def simulate(
+    trace: bytes | bytearray | memoryview,
+    sizes: Iterable[int],
+    policies: Iterable[_Policy] | None = ...,
+) -> dict[_Policy, list[tuple[int, float]]]: ...
+
+
+class AsyncLRU(Generic[_KT, _VT]):
+    def __init__(
+        self,
+        size: int,
+        callback: _Callback[_KT, _VT] | None = ...,
+        *,
+        ttl: float | None = ...,
+        refresh_ahead: float | None = ...,
+        timer: Callable[[], float] | None = ...,
+        weigher: Callable[[_KT, _VT], int] | None = ...,
+        **options: Any,
+    ) -> None: ...
+    async def get_or_load(self, key: _KT, coro_fn: Callable[[_KT], Awaitable[_VT]]) -> _VT: ...
+    @overload
+    def get(self, key: _KT) -> _VT | None: ...
+    @overload
+    def get(self, key: _KT, default: _VT | _T) -> _VT | _T: ...
+    def set(self, key: _KT, value: _VT) -> None: ...
+    @overload
+    def pop(self, key: _KT) -> _VT | None: ...
+    @overload
+    def pop(self, key: _KT, default: _VT | _T) -> _VT | _T: ...
+    def clear(self) -> None: ...
+    def keys(self) -> list[_KT]: ...
+    def pending(self) -> int: ...
+    def get_stats(self) -> tuple[int, int]: ...
+    def get_size(self) -> int: ...
+    def set_size(self, size: int) -> None: ...
+    def __contains__(self, __o: Any) -> bool: ...
+    def __len__(self) -> int: ...
+
+
+_Bytes = bytes | bytearray | memoryview
+
+class SharedLRU:
+    def __init__(
+        self, path: str | bytes, capacity_bytes: int, max_entries: int | None = ...
+    ) -> None: ...
+    @overload
+    def get(self, key: _Bytes) -> memoryview | None: ...
+    @overload
+    def get(self, key: _Bytes, default: _T) -> memoryview | _T: ...
+    def keys(self) -> list[bytes]: ...
+    def clear(self) -> None: ...
+    def get_stats(self) -> tuple[int, int]: ...
+    def get_capacity(self) -> tuple[int, int]: ...
+    def get_used_bytes(self) -> int: ...
+    def __contains__(self, __o: _Bytes) -> bool: ...
+    def __delitem__(self, key: _Bytes) -> None: ...
+    def __getitem__(self, item: _Bytes) -> memoryview: ...
+    def __len__(self) -> int: ...
+    def __repr__(self) -> str: ...
+    def __setitem__(self, key: _Bytes, value: _Bytes) -> None: ...
@@ -0,0 +1,127 @@
+import asyncio
+import time
+
+from ._lru import LRU
+
+_MISSING = object()
+
+
+class AsyncLRU:
+    """LRU for asyncio code whose misses are filled by awaiting a loader.
+
+    get_or_load(key, coro_fn) returns the cached value of key, or awaits coro_fn(key),
+    caches the result and returns it. Concurrent callers missing the same key await the
+    same load: the pending loads are kept beside the LRU, so they don't count towards its
+    size or weight, can't be evicted and aren't hits. The load runs in its own task, a
+    caller being cancelled doesn't cancel it for the others.
+
+    With ttl and refresh_ahead, a hit less than refresh_ahead seconds before the entry
+    expires starts reloading it in the background and returns the current value
+    meanwhile. The other arguments are passed to LRU. An AsyncLRU belongs to one event
+    loop.
+    """
+
+    def __init__(self, size, callback=None, *, ttl=None, refresh_ahead=None, timer=None,
+                 weigher=None, **options):
+        if refresh_ahead is not None:
+            if ttl is None:
+                raise ValueError("refresh_ahead requires a ttl")
+            if not 0 <= refresh_ahead < ttl:
+                raise ValueError("refresh_ahead must be at least 0 and less than ttl")
+        # Entries are stored as (value, refresh_at), refresh_at None without refresh_ahead.
+        if callback is not None:
+            options["callback"] = lambda key, entry, *reason: callback(key, entry[0], *reason)
+        if weigher is not None:
+            options["weigher"] = lambda key, entry: weigher(key, entry[0])
+        self._values = LRU(size, ttl=ttl, timer=timer, **options)
+        self._pending = {}
+        self._ttl = ttl
+        self._refresh_ahead = refresh_ahead
+        self._timer = timer or time.monotonic
+
+    def __len__(self):
+        return len(self._values)
+
+    def __contains__(self, key):
+        return key in self._values
+
+    def pending(self):
+        """Return the number of loads in flight."""
+        return len(self._pending)
+
+    def get_stats(self):
+        return self._values.get_stats()
+
+    def get_size(self):
+        return self._values.get_size()
+
+    def set_size(self, size):
+        self._values.set_size(size)
+
+    def keys(self):
+        return self._values.keys()
+
+    def get(self, key, default=None):
+        entry = self._values.get(key, _MISSING)
+        return default if entry is _MISSING else entry[0]
+
+    def set(self, key, value):
+        """Cache value for key, replacing the result of a load of key in flight."""
+        self._pending.pop(key, None)
+        self._store(key, value)
+
+    def pop(self, key, default=None):
+        """Remove key, and keep a load of key in flight from caching its result."""
+        self._pending.pop(key, None)
+        entry = self._values.pop(key, _MISSING)
+        return default if entry is _MISSING else entry[0]
+
+    def clear(self):
+        self._pending.clear()
+        self._values.clear()
+
+    async def get_or_load(self, key, coro_fn):
+        entry = self._values.get(key, _MISSING)
+        if entry is not _MISSING:
+            value, refresh_at = entry
+            if refresh_at is not None and key not in self._pending \
+                    and self._timer() >= refresh_at:
+                self._start(key, coro_fn).add_done_callback(self._refreshed)
+            return value
+        task = self._pending.get(key)
+        if task is None:
+            task = self._start(key, coro_fn)
+        return await asyncio.shield(task)
+
+    def _store(self, key, value):
+        refresh_at = None
+        if self._refresh_ahead is not None:
+            refresh_at = self._timer() + self._ttl - self._refresh_ahead
+        self._values[key] = value, refresh_at
+
+    def _start(self, key, coro_fn):
+        task = asyncio.ensure_future(self._load(key, coro_fn))
+        self._pending[key] = task
+        return task
+
+    async def _load(self, key, coro_fn):
+        try:
+            value = await coro_fn(key)
+        except BaseException:
+            if self._pending.get(key) is asyncio.current_task():
+                del self._pending[key]
+            raise
+        # Unless set(), pop() or clear() came first.
+        if self._pending.get(key) is asyncio.current_task():
+            del self._pending[key]
+            self._store(key, value)
+        return value
+
+    @staticmethod
+    def _refreshed(task):
+        if not task.cancelled() and task.exception() is not None:
+            task.get_loop().call_exception_handler({
+                "message": "AsyncLRU refresh failed",
+                "exception": task.exception(),
+                "task": task,
+            })
@@ -1,4 +1,6 @@
 #include <Python.h>
+#include <structmember.h>
+#include <stddef.h>
 
 /*
  * This is a simple implementation of LRU Dict that uses a Python dict and an associated doubly linked
@@ -36,9 +38,66 @@
  #define Py_TYPE(ob) (((PyObject*)(ob))->ob_type)
 #endif
 
+/* Critical sections only exist from 3.13 on, and only lock on free-threaded builds. */
+#ifndef Py_BEGIN_CRITICAL_SECTION
+ #define Py_BEGIN_CRITICAL_SECTION(op) {
+ #define Py_END_CRITICAL_SECTION() }
+#endif
+
+/*
+ * The types are made from specs (see LruState). Like static types they can't be changed,
+ * and the internal ones can't be instantiated from Python.
+ */
+#ifndef Py_TPFLAGS_IMMUTABLETYPE
+ #define Py_TPFLAGS_IMMUTABLETYPE 0
+#endif
+#ifndef Py_TPFLAGS_DISALLOW_INSTANTIATION
+ #define Py_TPFLAGS_DISALLOW_INSTANTIATION 0
+#endif
+#define LRU_TPFLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE)
+#define LRU_TPFLAGS_INTERNAL (LRU_TPFLAGS | Py_TPFLAGS_DISALLOW_INSTANTIATION)
+
+#ifdef MS_WINDOWS
+ #include <windows.h>
+#else
+ #include <time.h>
+#endif
+
+/* Monotonic clock in nanoseconds, the default timer for expiry. */
+static int64_t
+lru_monotonic_ns(void)
+{
+#ifdef MS_WINDOWS
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (!frequency.QuadPart)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (int64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
 #define GET_NODE(d, key) (Node *) Py_TYPE(d)->tp_as_mapping->mp_subscript((d), (key))
 #define PUT_NODE(d, key, node) Py_TYPE(d)->tp_as_mapping->mp_ass_subscript((d), (key), ((PyObject *)node))
 
+/*
+ * Nodes cache the hash of their key, so that a key is hashed once per operation and
+ * evictions don't hash at all: the dict is accessed with the known hash variants, which moved
+ * to the internal API in 3.13 but are still exported.
+ */
+#if PY_VERSION_HEX >= 0x030D0000
+PyAPI_FUNC(int) _PyDict_SetItem_KnownHash(PyObject *mp, PyObject *key, PyObject *item,
+                                          Py_hash_t hash);
+PyAPI_FUNC(int) _PyDict_DelItem_KnownHash(PyObject *mp, PyObject *key, Py_hash_t hash);
+#endif
+#define GET_NODE_HASH(d, key, hash) ((Node *)_PyDict_GetItem_KnownHash((d), (key), (hash)))
+#define PUT_NODE_HASH(d, key, node, hash) _PyDict_SetItem_KnownHash((d), (key), ((PyObject *)node), (hash))
+#define DEL_NODE_HASH(d, key, hash) _PyDict_DelItem_KnownHash((d), (key), (hash))
+
 /* If someone figures out how to enable debug builds with setuptools, you can delete this */
 #if 0
 #undef assert
@@ -60,16 +119,35 @@ typedef struct _Node {
     PyObject * key;
     struct _Node * prev;
     struct _Node * next;
+    unsigned int flags;
+    unsigned int generation;    /* LRU generation the entry was set in, see lru_reclaim */
+    Py_hash_t hash;             /* hash of key, set once the node is in the dict */
+    struct _Timer * timer;      /* expiry of the entry, NULL if it doesn't expire */
+    Py_ssize_t weight;          /* share of max_weight, 0 without max_weight */
+    struct _TagLink * tags;     /* tags of the entry, see lru_set_tags */
+    struct _ArenaBlock * block; /* value_store="arena": the value, which is then NULL */
 } Node;
 
+#define NODE_REFERENCED 0x1     /* policy="clock": accessed since the hand last passed */
+#define NODE_SEGMENT_SHIFT 1    /* bits 1-2: segment of the node, see Segments */
+#define NODE_SEGMENT_MASK (0x3 << NODE_SEGMENT_SHIFT)
+
+static void arena_drop(struct _ArenaBlock *b);
+
 static void
 node_dealloc(Node* self)
 {
-    Py_DECREF(self->key);
-    Py_DECREF(self->value);
+    PyTypeObject *tp = Py_TYPE(self);
+
+    /* Pooled nodes (see lru_node_release) no longer hold a key or value. */
+    Py_XDECREF(self->key);
+    Py_XDECREF(self->value);
+    if (self->block)
+        arena_drop(self->block);
     assert(self->prev == NULL);
     assert(self->next == NULL);
     PyObject_Del((PyObject*)self);
+    Py_DECREF(tp);
 }
 
 static PyObject*
@@ -78,733 +156,9872 @@ node_repr(Node* self)
     return PyObject_Repr(self->value);
 }
 
-static PyTypeObject NodeType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "_lru.Node",              /* tp_name */
-    sizeof(Node),            /* tp_basicsize */
-    0,                       /* tp_itemsize */
-    (destructor)node_dealloc,/* tp_dealloc */
-    0,                       /* tp_print */
-    0,                       /* tp_getattr */
-    0,                       /* tp_setattr */
-    0,                       /* tp_compare */
-    (reprfunc)node_repr,     /* tp_repr */
-    0,                       /* tp_as_number */
-    0,                       /* tp_as_sequence */
-    0,                       /* tp_as_mapping */
-    0,                       /* tp_hash */
-    0,                       /* tp_call */
-    0,                       /* tp_str */
-    0,                       /* tp_getattro */
-    0,                       /* tp_setattro */
-    0,                       /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,      /* tp_flags */
-    "Linked List Node",      /* tp_doc */
-    0,                       /* tp_traverse */
-    0,                       /* tp_clear */
-    0,                       /* tp_richcompare */
-    0,                       /* tp_weaklistoffset */
-    0,                       /* tp_iter */
-    0,                       /* tp_iternext */
-    0,                       /* tp_methods */
-    0,                       /* tp_members */
-    0,                       /* tp_getset */
-    0,                       /* tp_base */
-    0,                       /* tp_dict */
-    0,                       /* tp_descr_get */
-    0,                       /* tp_descr_set */
-    0,                       /* tp_dictoffset */
-    0,                       /* tp_init */
-    0,                       /* tp_alloc */
-    0,                       /* tp_new */
+static PyType_Slot node_slots[] = {
+    {Py_tp_dealloc, node_dealloc},
+    {Py_tp_repr, node_repr},
+    {Py_tp_doc, "Linked List Node"},
+    {0, NULL},
+};
+
+static PyType_Spec node_spec = {
+    "_lru.Node", sizeof(Node), 0, LRU_TPFLAGS_INTERNAL, node_slots,
 };
 
+/*
+ * Why an entry was evicted, passed to the callback as a string with callback_reason=True.
+ * Explicit removals (del, pop, clear...) are only reported with callback_reason=True.
+ */
+enum {
+    EVICT_CAPACITY,
+    EVICT_RESIZE,
+    EVICT_EXPIRED,
+    EVICT_EXPLICIT,
+    EVICT_REASONS,
+};
+
+static const char * const evict_reason_names[EVICT_REASONS] = {
+    "capacity", "resize", "expired", "explicit",
+};
+
+/*
+ * Everything the module owns lives in its state rather than in static variables, and the
+ * types are heap types created by its exec function (multi-phase init, PEP 489). Every
+ * interpreter importing _lru gets its own, which lets it run in subinterpreters with their
+ * own GIL (PEP 684). None of the types can be subclassed, so the type of one of the objects
+ * is always the type the module made and leads back to the module (lru_state_of).
+ */
 typedef struct {
-    PyObject_HEAD
-    PyObject * dict;
-    Node * first;
-    Node * last;
-    Py_ssize_t size;
-    Py_ssize_t hits;
-    Py_ssize_t misses;
-    PyObject *callback;
-} LRU;
+    PyTypeObject *NodeType;
+    PyTypeObject *LRUType;
+    PyTypeObject *ShardedLRUType;
+    PyTypeObject *LRUIterType;
+    PyTypeObject *LRUViewType;
+    PyTypeObject *CacheWrapperType;
+    PyTypeObject *SharedLRUType;
+    PyTypeObject *SharedValueType;
+    PyTypeObject *ArenaValueType;
+    PyObject *evict_reasons[EVICT_REASONS];
+    PyObject *cache_kwd_mark;   /* separates the positional from the keyword arguments in keys */
+} LruState;
 
+#if PY_VERSION_HEX < 0x03090000
+/* Before 3.9 a type doesn't know its module: the state of the first module made is kept for
+ * good, and shared by the interpreters like the static types were. */
+static LruState *lru_legacy_state;
+#endif
 
-static PyObject *
-set_callback(LRU *self, PyObject *args)
+/* Returns the state of the module which made the type of obj. */
+static inline LruState *
+lru_state_of(PyObject *obj)
 {
-    PyObject *result = NULL;
-    PyObject *temp;
+#if PY_VERSION_HEX >= 0x03090000
+    return (LruState *)PyModule_GetState(PyType_GetModule(Py_TYPE(obj)));
+#else
+    return lru_legacy_state;
+#endif
+}
 
-    if (PyArg_ParseTuple(args, "O:set_callback", &temp)) {
-        if (temp == Py_None) {
-            Py_XDECREF(self->callback);
-            self->callback = NULL;
-        } else if (!PyCallable_Check(temp)) {
-            PyErr_SetString(PyExc_TypeError, "parameter must be callable");
-            return NULL;
-        } else {
-            Py_XINCREF(temp);         /* Add a reference to new callback */
-            Py_XDECREF(self->callback);  /* Dispose of previous callback */
-            self->callback = temp;       /* Remember new callback */
-        }
-        Py_RETURN_NONE;
-    }
-    return result;
+/*
+ * Compact storage engine, selected with LRU(size, engine="compact").
+ *
+ * Instead of a dict of key -> Node objects, entries live in one contiguous array and
+ * carry their key, value, cached hash and the prev/next links of the LRU list as 32 bit
+ * indices. A separate open addressing index (linear probing, backward shift deletion)
+ * maps hashes to entry indices. Each slot keeps the low 32 bits of the hash as a tag, so
+ * most probes are rejected without touching the entry array.
+ *
+ * Deleted entries are chained through `next` into a free list and reused by later inserts.
+ */
+
+#define TABLE_NIL ((uint32_t)-1)
+#define TABLE_MIN_SLOTS 8
+#define TABLE_MAX_ENTRIES ((Py_ssize_t)1 << 31)
+
+typedef struct {
+    PyObject * key;
+    PyObject * value;
+    Py_hash_t hash;
+    uint32_t prev;
+    uint32_t next;
+} Entry;
+
+typedef struct {
+    uint32_t index;     /* index into entries, TABLE_NIL if the slot is empty */
+    uint32_t tag;       /* low bits of the hash of the entry */
+} Slot;
+
+typedef struct {
+    Entry * entries;
+    Slot * slots;
+    size_t mask;            /* number of slots - 1 */
+    uint32_t allocated;     /* capacity of entries */
+    uint32_t high;          /* entries[0..high) have been handed out at least once */
+    uint32_t free;          /* head of the free entry list */
+    uint32_t first;         /* MRU entry */
+    uint32_t last;          /* LRU entry */
+    Py_ssize_t used;
+    size_t version;         /* bumped on every change of the entries, slots or list order */
+} Table;
+
+/*
+ * Home slot of hash. Small ints hash to themselves, so consecutive keys would fill one run
+ * of slots that every miss in it scans to the end. Mixing the high bits into the low ones
+ * spreads them.
+ */
+static inline size_t
+table_home(size_t mask, Py_hash_t hash)
+{
+    uint64_t x = (uint64_t)hash;
+    x ^= x >> 33;
+    x *= UINT64_C(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    return (size_t)x & mask;
 }
 
-static void
-lru_remove_node(LRU *self, Node* node)
+static int
+table_init(Table *t)
 {
-    if (self->first == node) {
-        self->first = node->next;
-    }
-    if (self->last == node) {
-        self->last = node->prev;
+    size_t i;
+    t->slots = PyMem_New(Slot, TABLE_MIN_SLOTS);
+    if (!t->slots) {
+        PyErr_NoMemory();
+        return -1;
     }
-    if (node->prev) {
-        node->prev->next = node->next;
+    for (i = 0; i < TABLE_MIN_SLOTS; i++)
+        t->slots[i].index = TABLE_NIL;
+    t->mask = TABLE_MIN_SLOTS - 1;
+    t->entries = NULL;
+    t->allocated = t->high = 0;
+    t->free = t->first = t->last = TABLE_NIL;
+    t->used = 0;
+    t->version = 0;
+    return 0;
+}
+
+static int
+table_resize(Table *t, size_t nslots)
+{
+    Slot *slots = PyMem_New(Slot, nslots);
+    size_t i, j, mask = nslots - 1;
+    if (!slots) {
+        PyErr_NoMemory();
+        return -1;
     }
-    if (node->next) {
-        node->next->prev = node->prev;
+    for (i = 0; i < nslots; i++)
+        slots[i].index = TABLE_NIL;
+    for (i = 0; i <= t->mask; i++) {
+        if (t->slots[i].index == TABLE_NIL)
+            continue;
+        j = table_home(mask, t->entries[t->slots[i].index].hash);
+        while (slots[j].index != TABLE_NIL)
+            j = (j + 1) & mask;
+        slots[j] = t->slots[i];
     }
-    node->next = node->prev = NULL;
+    PyMem_Free(t->slots);
+    t->slots = slots;
+    t->mask = mask;
+    t->version++;
+    return 0;
 }
 
-static void
-lru_add_node_at_head(LRU *self, Node* node)
+/*
+ * Most keys are exact str, int or bytes. Their hash and equality are computed inline instead
+ * of through their type, str keys use the hash cached in the object. Other keys go the generic
+ * way.
+ */
+static inline Py_hash_t
+lru_hash(PyObject *key)
 {
-    node->prev = NULL;
-    if (!self->first) {
-        self->first = self->last = node;
-        node->next = NULL;
-    } else {
-        node->next = self->first;
-        if (node->next) {
-            node->next->prev = node;
-        }
-        self->first = node;
+#ifndef Py_GIL_DISABLED
+    /* Free-threaded builds set the cached hash with an atomic store, leave it to str. */
+    if (PyUnicode_CheckExact(key)) {
+        Py_hash_t hash = ((PyASCIIObject *)key)->hash;
+        if (hash != -1)
+            return hash;
     }
+#endif
+    return PyObject_Hash(key);
 }
 
-static void
-lru_delete_last(LRU *self)
+/*
+ * Compares two keys with the same hash when that can't run Python code. Returns 1 if equal,
+ * 0 if not and -1 if the generic comparison is needed.
+ */
+static inline int
+lru_fast_eq(PyObject *a, PyObject *b)
 {
-    PyObject *arglist;
-    PyObject *result;
-    Node* n = self->last;
+    Py_ssize_t n;
 
-    if (!self->last)
-        return;
-
-    if (self->callback) {
-
-        arglist = Py_BuildValue("OO", n->key, n->value);
-        result = PyObject_CallObject(self->callback, arglist);
-        Py_XDECREF(result);
-        Py_DECREF(arglist);
+    if (Py_TYPE(a) != Py_TYPE(b))
+        return -1;
+    if (PyUnicode_CheckExact(a)) {
+        n = PyUnicode_GET_LENGTH(a);
+        return n == PyUnicode_GET_LENGTH(b) && PyUnicode_KIND(a) == PyUnicode_KIND(b) &&
+               memcmp(PyUnicode_DATA(a), PyUnicode_DATA(b), (size_t)n * PyUnicode_KIND(a)) == 0;
     }
-
-    lru_remove_node(self, n);
-    PUT_NODE(self->dict, n->key, NULL);
+    if (PyBytes_CheckExact(a)) {
+        n = PyBytes_GET_SIZE(a);
+        return n == PyBytes_GET_SIZE(b) &&
+               memcmp(PyBytes_AS_STRING(a), PyBytes_AS_STRING(b), (size_t)n) == 0;
+    }
+    if (PyLong_CheckExact(a))
+        return PyObject_RichCompareBool(a, b, Py_EQ);
+    return -1;
 }
 
-static Py_ssize_t
-lru_length(LRU *self)
+/*
+ * Looks up key in the table. Returns 1 and sets *pindex if found, 0 if missing and -1 on
+ * error. On a miss *pslot is the empty slot where the key would be inserted. That slot is
+ * only valid until the table changes again.
+ */
+static int
+table_lookup(Table *t, PyObject *key, Py_hash_t hash, uint32_t *pindex, size_t *pslot)
 {
-    return PyDict_Size(self->dict);
-}
+    size_t i, version;
+    uint32_t index;
+    Entry *e;
+    PyObject *startkey;
+    int cmp;
 
-static PyObject *
-LRU_contains_key(LRU *self, PyObject *key)
-{
-    if (PyDict_Contains(self->dict, key)) {
-        Py_RETURN_TRUE;
-    } else {
-        Py_RETURN_FALSE;
+restart:
+    i = table_home(t->mask, hash);
+    for (;;) {
+        index = t->slots[i].index;
+        if (index == TABLE_NIL) {
+            if (pslot)
+                *pslot = i;
+            return 0;
+        }
+        if (t->slots[i].tag == (uint32_t)hash) {
+            e = &t->entries[index];
+            if (e->key == key) {
+                *pindex = index;
+                return 1;
+            }
+            if (e->hash == hash && (cmp = lru_fast_eq(e->key, key)) >= 0) {
+                if (cmp > 0) {
+                    *pindex = index;
+                    return 1;
+                }
+            } else if (e->hash == hash) {
+                startkey = e->key;
+                version = t->version;
+                Py_INCREF(startkey);
+                cmp = PyObject_RichCompareBool(startkey, key, Py_EQ);
+                Py_DECREF(startkey);
+                if (cmp < 0)
+                    return -1;
+                if (version != t->version)
+                    goto restart;   /* __eq__ changed the table under us */
+                if (cmp > 0) {
+                    *pindex = index;
+                    return 1;
+                }
+            }
+        }
+        i = (i + 1) & t->mask;
     }
 }
 
-static PyObject *
-LRU_contains(LRU *self, PyObject *args)
+static void
+table_unlink(Table *t, uint32_t index)
 {
-    PyObject *key;
-    if (!PyArg_ParseTuple(args, "O", &key))
-        return NULL;
-    return LRU_contains_key(self, key);
+    Entry *e = &t->entries[index];
+    t->version++;
+    if (e->prev != TABLE_NIL)
+        t->entries[e->prev].next = e->next;
+    else
+        t->first = e->next;
+    if (e->next != TABLE_NIL)
+        t->entries[e->next].prev = e->prev;
+    else
+        t->last = e->prev;
+    e->prev = e->next = TABLE_NIL;
 }
 
-static int
-LRU_seq_contains(LRU *self, PyObject *key)
+static void
+table_link_at_head(Table *t, uint32_t index)
 {
-    return PyDict_Contains(self->dict, key);
+    Entry *e = &t->entries[index];
+    t->version++;
+    e->prev = TABLE_NIL;
+    e->next = t->first;
+    if (t->first != TABLE_NIL)
+        t->entries[t->first].prev = index;
+    else
+        t->last = index;
+    t->first = index;
 }
 
-static PyObject *
-lru_subscript(LRU *self, register PyObject *key)
+/*
+ * Adds a new entry for a key known to be missing, stealing the references to key and value.
+ * The entry becomes the MRU one. max_entries bounds the growth of the entry array.
+ * Returns the new entry index or TABLE_NIL with an exception set.
+ */
+static uint32_t
+table_insert(Table *t, PyObject *key, Py_hash_t hash, PyObject *value, size_t slot,
+             Py_ssize_t max_entries)
 {
-    Node *node = GET_NODE(self->dict, key);
-    if (!node) {
-        self->misses++;
-        return NULL;
-    }
+    uint32_t index;
+    Entry *e;
 
-    assert(PyObject_TypeCheck(node, &NodeType));
+    if ((size_t)(t->used + 1) * 3 > (t->mask + 1) * 2) {
+        if (table_resize(t, (t->mask + 1) * 2) < 0)
+            return TABLE_NIL;
+        slot = table_home(t->mask, hash);
+        while (t->slots[slot].index != TABLE_NIL)
+            slot = (slot + 1) & t->mask;
+    }
 
-    /* We don't need to move the node when it's already self->first. */
-    if (node != self->first) {
-        lru_remove_node(self, node);
-        lru_add_node_at_head(self, node);
+    if (t->free != TABLE_NIL) {
+        index = t->free;
+        t->free = t->entries[index].next;
+    } else {
+        if (t->high == t->allocated) {
+            Py_ssize_t n = t->allocated ? (Py_ssize_t)t->allocated * 2 : 8;
+            Entry *entries;
+            if (n > max_entries)
+                n = max_entries;
+            if (n <= (Py_ssize_t)t->allocated)
+                n = (Py_ssize_t)t->allocated + 1;
+            entries = PyMem_Resize(t->entries, Entry, (size_t)n);
+            if (!entries) {
+                PyErr_NoMemory();
+                return TABLE_NIL;
+            }
+            t->entries = entries;
+            t->allocated = (uint32_t)n;
+        }
+        index = t->high++;
     }
 
-    self->hits++;
-    Py_INCREF(node->value);
-    Py_DECREF(node);
-    return node->value;
+    e = &t->entries[index];
+    e->key = key;
+    e->value = value;
+    e->hash = hash;
+    t->slots[slot].index = index;
+    t->slots[slot].tag = (uint32_t)hash;
+    table_link_at_head(t, index);
+    t->used++;
+    t->version++;
+    return index;
 }
 
-static PyObject *
-LRU_get(LRU *self, PyObject *args, PyObject *keywds)
+/*
+ * Removes the entry at index from the slots and the LRU list. The references to its key and
+ * value are handed to the caller, which must release them once the table is consistent.
+ */
+static void
+table_delete(Table *t, uint32_t index, PyObject **pkey, PyObject **pvalue)
 {
-    PyObject *key;
-    PyObject *default_obj = NULL;
-    PyObject *result;
+    Entry *e = &t->entries[index];
+    size_t i = table_home(t->mask, e->hash), j, home;
 
-    static char *kwlist[] = {"key", "default", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|O", kwlist, &key, &default_obj))
-        return NULL;
-
-    result = lru_subscript(self, key);
-    PyErr_Clear();  /* GET_NODE sets an exception on miss. Shut it up. */
-    if (result)
-        return result;
+    while (t->slots[i].index != index)
+        i = (i + 1) & t->mask;
 
-    if (!default_obj) {
-        Py_RETURN_NONE;
+    /* Backward shift deletion: pull later members of the probe run into the hole. */
+    j = i;
+    for (;;) {
+        j = (j + 1) & t->mask;
+        if (t->slots[j].index == TABLE_NIL)
+            break;
+        home = table_home(t->mask, t->entries[t->slots[j].index].hash);
+        if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
     }
+    t->slots[i].index = TABLE_NIL;
 
-    Py_INCREF(default_obj);
-    return default_obj;
+    table_unlink(t, index);
+    *pkey = e->key;
+    *pvalue = e->value;
+    e->key = e->value = NULL;
+    e->next = t->free;
+    t->free = index;
+    t->used--;
+    t->version++;
 }
 
+/* Empties the table. Keys and values are released only after the table is reset. */
 static int
-lru_ass_sub(LRU *self, PyObject *key, PyObject *value)
+table_clear(Table *t)
 {
-    int res = 0;
-    Node *node = GET_NODE(self->dict, key);
-    PyErr_Clear();  /* GET_NODE sets an exception on miss. Shut it up. */
+    Table old = *t;
+    uint32_t i;
 
-    if (value) {
-        if (node) {
-            Py_INCREF(value);
-            Py_DECREF(node->value);
-            node->value = value;
+    if (table_init(t) < 0) {
+        *t = old;
+        return -1;
+    }
+    t->version = old.version + 1;
+    for (i = old.first; i != TABLE_NIL; i = old.entries[i].next) {
+        Py_DECREF(old.entries[i].key);
+        Py_DECREF(old.entries[i].value);
+    }
+    PyMem_Free(old.entries);
+    PyMem_Free(old.slots);
+    return 0;
+}
 
-            lru_remove_node(self, node);
-            lru_add_node_at_head(self, node);
+static void
+table_free(Table *t)
+{
+    uint32_t i;
+    for (i = t->first; i != TABLE_NIL; i = t->entries[i].next) {
+        Py_DECREF(t->entries[i].key);
+        Py_DECREF(t->entries[i].value);
+    }
+    PyMem_Free(t->entries);
+    PyMem_Free(t->slots);
+}
 
-            res = 0;
-        } else {
-            node = PyObject_NEW(Node, &NodeType);
-            node->key = key;
-            node->value = value;
-            node->next = node->prev = NULL;
+typedef struct {
+    PyObject_HEAD
+    PyObject * dict;
+    Node * first;
+    Node * last;
+    Py_ssize_t size;
+    Py_ssize_t hits;
+    Py_ssize_t misses;
+    PyObject *callback;
+    int policy;             /* LRU_POLICY_* */
+    Table *table;           /* engine="compact" storage, NULL for the dict engine */
+    Node *pool;             /* free nodes kept for reuse, chained through next */
+    Py_ssize_t pool_len;
+    Py_ssize_t pool_max;
+    int batch_depth;        /* > 0 while a batch operation defers eviction callbacks */
+    PyObject *pending;      /* (key, value) tuples evicted during the current batch */
+    PyObject *trimmed;      /* (key, value) tuples evicted by trim() without a callback */
+    struct _ReadBuffer *rbuf;   /* read_buffer mode, see lru_buffered_find */
+    struct _Segments *seg;      /* segmented policies, see seg_victim */
+    struct _Wheel *wheel;       /* expiry timers, see wheel_advance */
+    int callback_reason;        /* pass the eviction reason to the callback */
+    int callback_batch;         /* hand evictions to the callback as one list per call */
+    PyObject *callback_error[3];    /* first callback exception of the call, PyErr_Fetch style */
+    Py_ssize_t max_weight;      /* bound on the total weight, 0 for none */
+    Py_ssize_t weight;          /* total weight of the entries */
+    PyObject *weigher;          /* weigher(key, value) -> weight, NULL for a weight of 1 */
+    size_t version;             /* bumped on every change of the list, see LRUIter */
+    struct _Metrics *metrics;   /* metrics=True counters, see metrics_begin */
+    struct _Mrc *mrc;           /* mrc=n miss ratio curve estimation, see mrc_access */
+    struct _Trace *trace;       /* trace=n access recording, see trace_record */
+    PyObject *inflight;         /* key -> Flight capsule of the get_or_load() loads running */
+    unsigned int generation;    /* bumped by invalidate_all(), see lru_reclaim */
+    Py_ssize_t stale;           /* nodes of an older generation still in the LRU */
+    Node *sweep;                /* next node lru_reclaim looks at, NULL to start at the tail */
+    PyObject *tags;             /* tag -> TagList capsule, see lru_set_tags */
+    struct _TagList *empty_tags;    /* lists left without entries, see lru_drop_empty_tags */
+    struct _Arena *arena;       /* value_store="arena" storage, see arena_alloc */
+    int copy_values;            /* arena values are read as bytes instead of memoryviews */
+    struct _L2 *l2;             /* disk tier of the evicted entries, see l2_spill */
+} LRU;
 
-            Py_INCREF(key);
-            Py_INCREF(value);
+static void l2_spill(LRU *self, Node *node);
+static int l2_find(LRU *self, PyObject *key, Py_hash_t hash, int remove, PyObject **pvalue,
+                   Py_ssize_t *pweight);
+static PyObject *l2_promote(LRU *self, PyObject *key);
+static void l2_clear(struct _L2 *l2);
 
-            res = PUT_NODE(self->dict, key, node);
-            if (res == 0) {
-                if (lru_length(self) > self->size) {
-                    lru_delete_last(self);
-                }
+/*
+ * Value store of LRU(size, value_store="arena"). The bytes of each value are copied into a
+ * block carved from 64 KiB slabs owned by the LRU, so an entry holds no value object:
+ * node->value is NULL and node->block holds the bytes. A block is its 16 byte header and
+ * the bytes, rounded up to a multiple of 16. Freed blocks go on a free list per size and
+ * are reused by the next value of that size, blocks larger than ARENA_MAX_BLOCK are
+ * allocated on their own. Slabs are only freed with the LRU.
+ *
+ * Reads return a read only memoryview of the block, exported by an ArenaValue. The first
+ * read of a block creates it and the block keeps it, so later hits only allocate the view.
+ * A block dropped while exported is only freed once its last view is released, and the
+ * views keep the LRU, and so its slabs, alive. Blocks are allocated and freed with the LRU
+ * locked.
+ */
+#define ARENA_SLAB ((size_t)1 << 16)
+#define ARENA_ALIGN 16
+#define ARENA_MAX_BLOCK 4096
+#define ARENA_CLASSES (ARENA_MAX_BLOCK / ARENA_ALIGN)
+#define ARENA_MAX_LEN ((size_t)UINT32_MAX - ARENA_MAX_BLOCK)
+#define ARENA_EXPORTED 0x1      /* u.exporter is set */
+#define ARENA_DEAD 0x2          /* the entry is gone, freed when its last view is */
 
-                lru_add_node_at_head(self, node);
-            }
+typedef struct _ArenaBlock {
+    union {
+        struct _Arena *arena;           /* owner, while in use */
+        struct _ArenaValue *exporter;   /* with ARENA_EXPORTED, which knows the arena */
+        struct _ArenaBlock *next;       /* next free block of the same size */
+    } u;
+    uint32_t len;
+    uint32_t flags;                     /* ARENA_EXPORTED and ARENA_DEAD */
+    char data[1];
+} ArenaBlock;
+
+#define ARENA_BLOCK_SIZE(len) \
+    ((offsetof(ArenaBlock, data) + (size_t)(len) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct _Arena {
+    char *slab;                 /* slab being carved, its first word links the older ones */
+    size_t slab_used;
+    ArenaBlock *free[ARENA_CLASSES];
+    Py_ssize_t reserved;        /* bytes of the slabs and of the blocks allocated on their own */
+    Py_ssize_t used;            /* bytes of the blocks in use or pinned */
+} Arena;
+
+/* Exports the bytes of a block to memoryviews. */
+typedef struct _ArenaValue {
+    PyObject_HEAD
+    PyObject *owner;            /* the LRU, a strong reference while exports isn't 0 */
+    Arena *arena;
+    ArenaBlock *block;          /* NULL once the block is freed */
+    Py_ssize_t exports;         /* buffers of the memoryviews alive */
+} ArenaValue;
+
+static ArenaBlock *
+arena_alloc(Arena *a, size_t len)
+{
+    size_t size = ARENA_BLOCK_SIZE(len);
+    ArenaBlock *b;
+
+    if (size > ARENA_MAX_BLOCK) {
+        if (!(b = PyMem_Malloc(size))) {
+            PyErr_NoMemory();
+            return NULL;
         }
+        a->reserved += size;
+    } else if ((b = a->free[size / ARENA_ALIGN - 1])) {
+        a->free[size / ARENA_ALIGN - 1] = b->u.next;
     } else {
-        res = PUT_NODE(self->dict, key, NULL);
-        if (res == 0) {
-            assert(node && PyObject_TypeCheck(node, &NodeType));
-            lru_remove_node(self, node);
+        if (!a->slab || a->slab_used + size > ARENA_SLAB) {
+            char *slab = PyMem_Malloc(ARENA_SLAB);
+            if (!slab) {
+                PyErr_NoMemory();
+                return NULL;
+            }
+            *(char **)slab = a->slab;
+            a->slab = slab;
+            a->slab_used = ARENA_ALIGN;
+            a->reserved += ARENA_SLAB;
         }
+        b = (ArenaBlock *)(a->slab + a->slab_used);
+        a->slab_used += size;
     }
-
-    Py_XDECREF(node);
-    return res;
+    b->u.arena = a;
+    b->len = (uint32_t)len;
+    b->flags = 0;
+    a->used += size;
+    return b;
 }
 
-static PyMappingMethods LRU_as_mapping = {
-    (lenfunc)lru_length,        /*mp_length*/
-    (binaryfunc)lru_subscript,  /*mp_subscript*/
-    (objobjargproc)lru_ass_sub, /*mp_ass_subscript*/
-};
-
-static PyObject *
-collect(LRU *self, PyObject * (*getterfunc)(Node *))
+static void
+arena_free_block(Arena *a, ArenaBlock *b)
 {
-    register PyObject *v;
-    Node *curr;
-    int i;
-    v = PyList_New(lru_length(self));
-    if (v == NULL)
-        return NULL;
-    curr = self->first;
-    i = 0;
+    size_t size = ARENA_BLOCK_SIZE(b->len);
 
-    while (curr) {
-        PyList_SET_ITEM(v, i++, getterfunc(curr));
-        curr = curr->next;
+    a->used -= size;
+    if (size > ARENA_MAX_BLOCK) {
+        a->reserved -= size;
+        PyMem_Free(b);
+        return;
     }
-    assert(i == lru_length(self));
-    return v;
+    b->u.next = a->free[size / ARENA_ALIGN - 1];
+    a->free[size / ARENA_ALIGN - 1] = b;
 }
 
-static PyObject *
-get_key(Node *node)
+/* The entry of b is gone. */
+static void
+arena_drop(ArenaBlock *b)
 {
-    Py_INCREF(node->key);
-    return node->key;
+    ArenaValue *exporter;
+
+    if (!(b->flags & ARENA_EXPORTED)) {
+        arena_free_block(b->u.arena, b);
+        return;
+    }
+    exporter = b->u.exporter;
+    if (exporter->exports) {
+        b->flags |= ARENA_DEAD;
+    } else {
+        exporter->block = NULL;
+        arena_free_block(exporter->arena, b);
+    }
+    Py_DECREF(exporter);
 }
 
-static PyObject *
-LRU_update(LRU *self, PyObject *args, PyObject *kwargs)
+/* Frees the slabs. The LRU has no entries left and no views of them are alive. */
+static void
+arena_free(Arena *a)
 {
-	PyObject *key, *value;
-	PyObject *arg = NULL;
-	Py_ssize_t pos = 0;
-
-	if ((PyArg_ParseTuple(args, "|O", &arg))) {
-		if (arg && PyDict_Check(arg)) {
-			while (PyDict_Next(arg, &pos, &key, &value))
-				lru_ass_sub(self, key, value);
-		}
-	}
-
-	if (kwargs != NULL && PyDict_Check(kwargs)) {
-		while (PyDict_Next(kwargs, &pos, &key, &value))
-			lru_ass_sub(self, key, value);
-	}
-
-	Py_RETURN_NONE;
+    while (a->slab) {
+        char *slab = a->slab;
+        a->slab = *(char **)slab;
+        PyMem_Free(slab);
+    }
+    PyMem_Free(a);
 }
 
-static PyObject *
-LRU_setdefault(LRU *self, PyObject *args)
+/* Copies the bytes of value into a new block. */
+static ArenaBlock *
+lru_arena_store(LRU *self, PyObject *value)
 {
-    PyObject *key;
-    PyObject *default_obj = NULL;
-    PyObject *result;
+    Py_buffer view;
+    ArenaBlock *b = NULL;
 
-    if (!PyArg_ParseTuple(args, "O|O", &key, &default_obj))
+    if (PyObject_GetBuffer(value, &view, PyBUF_SIMPLE) < 0)
         return NULL;
+    if ((size_t)view.len > ARENA_MAX_LEN)
+        PyErr_SetString(PyExc_OverflowError, "value is too large for value_store='arena'");
+    else if ((b = arena_alloc(self->arena, (size_t)view.len)))
+        memcpy(b->data, view.buf, (size_t)view.len);
+    PyBuffer_Release(&view);
+    return b;
+}
 
-    result = lru_subscript(self, key);
-    PyErr_Clear();
-    if (result)
-        return result;
+/* The first view of the exporter takes a reference to the LRU, the last one drops it. */
+static int
+arena_value_getbuffer(ArenaValue *self, Py_buffer *view, int flags)
+{
+    int res;
 
-    if (!default_obj)
-        default_obj = Py_None;
+    /* Only reachable through memoryview.obj once the LRU is gone. */
+    if (!self->block) {
+        PyErr_SetString(PyExc_BufferError, "the value is no longer in the LRU");
+        return -1;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self->owner);
+    res = PyBuffer_FillInfo(view, (PyObject *)self, self->block->data,
+                            (Py_ssize_t)self->block->len, 1, flags);
+    if (res == 0 && self->exports++ == 0)
+        Py_INCREF(self->owner);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
 
-    if (lru_ass_sub(self, key, default_obj) != 0)
-        return NULL;
+static void
+arena_value_releasebuffer(ArenaValue *self, Py_buffer *view)
+{
+    PyObject *owner = NULL;
 
-    Py_INCREF(default_obj);
-    return default_obj;
+    Py_BEGIN_CRITICAL_SECTION(self->owner);
+    if (--self->exports == 0) {
+        owner = self->owner;
+        if (self->block->flags & ARENA_DEAD) {
+            arena_free_block(self->arena, self->block);
+            self->block = NULL;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    Py_XDECREF(owner);
 }
 
-static PyObject *
-LRU_pop(LRU *self, PyObject *args, PyObject *keywds)
+static void
+arena_value_dealloc(ArenaValue *self)
 {
-    PyObject *key;
-    PyObject *default_obj = NULL;
-    PyObject *result;
-
-    static char *kwlist[] = {"key", "default", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|O", kwlist, &key, &default_obj))
-        return NULL;
+    PyTypeObject *tp = Py_TYPE(self);
 
-    /* Trying to access the item by key. */
-    result = lru_subscript(self, key);
+    assert(self->exports == 0);
+    PyObject_Del(self);
+    Py_DECREF(tp);
+}
 
-    if (result)
-        /* result != NULL, delete it from dict by key */
-        lru_ass_sub(self, key, NULL);
-    else if (default_obj) {
-        /* result == NULL, i.e. key missing, and default_obj given */
-        PyErr_Clear();
-        Py_INCREF(default_obj);
-        result = default_obj;
-    }
-    /* Otherwise (key missing, and default_obj not given [i.e. == NULL]), the
-     * call to lru_subscript (at the location marked by "Trying to access the
-     * item by key" in the comments) has already generated the appropriate
-     * exception. */
+static PyType_Slot arena_value_slots[] = {
+    {Py_tp_dealloc, arena_value_dealloc},
+#if PY_VERSION_HEX >= 0x03090000
+    {Py_bf_getbuffer, arena_value_getbuffer},
+    {Py_bf_releasebuffer, arena_value_releasebuffer},
+#endif
+    {0, NULL},
+};
 
-    return result;
-}
+static PyType_Spec arena_value_spec = {
+    "_lru.ArenaValue", sizeof(ArenaValue), 0, LRU_TPFLAGS_INTERNAL, arena_value_slots,
+};
 
+/* Returns a read only memoryview of b, or a copy of its bytes with copy_values. */
 static PyObject *
-LRU_peek_first_item(LRU *self)
+lru_block_value(LRU *self, ArenaBlock *b)
 {
-    if (self->first) {
-        PyObject *tuple = PyTuple_New(2);
-        Py_INCREF(self->first->key);
-        PyTuple_SET_ITEM(tuple, 0, self->first->key);
-        Py_INCREF(self->first->value);
-        PyTuple_SET_ITEM(tuple, 1, self->first->value);
-        return tuple;
+    ArenaValue *exporter;
+
+    if (self->copy_values)
+        return PyBytes_FromStringAndSize(b->data, (Py_ssize_t)b->len);
+    if (!(b->flags & ARENA_EXPORTED)) {
+        exporter = PyObject_New(ArenaValue, lru_state_of((PyObject *)self)->ArenaValueType);
+        if (!exporter)
+            return NULL;
+        exporter->owner = (PyObject *)self;
+        exporter->arena = b->u.arena;
+        exporter->block = b;
+        exporter->exports = 0;
+        b->u.exporter = exporter;
+        b->flags |= ARENA_EXPORTED;
     }
-    else Py_RETURN_NONE;
+    return PyMemoryView_FromObject((PyObject *)b->u.exporter);
 }
 
+/* Returns a new reference to the value of node. */
 static PyObject *
-LRU_peek_last_item(LRU *self)
+lru_node_value(LRU *self, Node *node)
 {
-    if (self->last) {
-        PyObject *tuple = PyTuple_New(2);
-        Py_INCREF(self->last->key);
-        PyTuple_SET_ITEM(tuple, 0, self->last->key);
-        Py_INCREF(self->last->value);
-        PyTuple_SET_ITEM(tuple, 1, self->last->value);
-        return tuple;
-    }
-    else Py_RETURN_NONE;
+    if (node->block)
+        return lru_block_value(self, node->block);
+    Py_INCREF(node->value);
+    return node->value;
 }
 
-static PyObject *
-LRU_popitem(LRU *self, PyObject *args, PyObject *kwds)
+/*
+ * Nodes released by evictions and deletes are kept in a per LRU free list, so that at
+ * capacity the node of the evicted entry is reused by the insert which caused the eviction
+ * instead of going back to the allocator. The pool holds at most min(size, LRU_NODE_POOL_MAX)
+ * nodes.
+ */
+#define LRU_NODE_POOL_MAX 4096
+
+/*
+ * Eviction policies.
+ *
+ * LRU_POLICY_CLOCK approximates LRU with a second chance list: a hit only sets
+ * NODE_REFERENCED on the node instead of moving it, and the tail of the list works as the
+ * clock hand. Eviction moves referenced nodes back to the head, clearing the bit, until it
+ * finds an unreferenced one. The list order is then insertion order, with nodes that got a
+ * second chance moved to the front, so keys() and friends are only approximately MRU first.
+ */
+enum {
+    LRU_POLICY_LRU,
+    LRU_POLICY_CLOCK,
+    LRU_POLICY_SLRU,
+    LRU_POLICY_2Q,
+    LRU_POLICY_TINYLFU,
+};
+
+static Node *
+lru_node_new(LRU *self, PyObject *key, PyObject *value)
 {
-    static char *kwlist[] = {"least_recent", NULL};
-    int pop_least_recent = 1;
-    PyObject *result;
+    Node *node = self->pool;
+    ArenaBlock *block = NULL;
 
-#if PY_MAJOR_VERSION >= 3
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &pop_least_recent))
+    if (self->arena && !(block = lru_arena_store(self, value)))
         return NULL;
-#else
-    {
-        PyObject *arg_ob = Py_True;
-        if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &arg_ob))
-            return NULL;
-        pop_least_recent = PyObject_IsTrue(arg_ob);
-        if (pop_least_recent == -1)
+    if (node) {
+        self->pool = node->next;
+        self->pool_len--;
+    } else {
+        node = PyObject_NEW(Node, lru_state_of((PyObject *)self)->NodeType);
+        if (!node) {
+            if (block)
+                arena_drop(block);
             return NULL;
+        }
     }
-#endif
-    if (pop_least_recent)
-        result = LRU_peek_last_item(self);
-    else
-        result = LRU_peek_first_item(self);
-    if (result == Py_None) {
-        PyErr_SetString(PyExc_KeyError, "popitem(): LRU dict is empty");
-        return NULL;
-    }
-    lru_ass_sub(self, PyTuple_GET_ITEM(result, 0), NULL);
-    Py_INCREF(result);
-    return result;
-}
-
-static PyObject *
-LRU_keys(LRU *self) {
-    return collect(self, get_key);
+    if (block)
+        value = NULL;
+    Py_INCREF(key);
+    Py_XINCREF(value);
+    node->key = key;
+    node->value = value;
+    node->block = block;
+    node->next = node->prev = NULL;
+    node->flags = 0;
+    node->generation = self->generation;
+    node->hash = -1;
+    node->timer = NULL;
+    node->weight = 0;
+    node->tags = NULL;
+    return node;
 }
 
-static PyObject *
-get_value(Node *node)
+/* Drops a reference to a node, recycling it if that was the last one. */
+static void
+lru_node_release(LRU *self, Node *node)
 {
-    Py_INCREF(node->value);
-    return node->value;
+    PyObject *key, *value;
+
+    if (Py_REFCNT(node) != 1 || self->pool_len >= self->pool_max) {
+        Py_DECREF(node);
+        return;
+    }
+    assert(node->prev == NULL && node->next == NULL);
+    key = node->key;
+    value = node->value;
+    if (node->block) {
+        arena_drop(node->block);
+        node->block = NULL;
+    }
+    node->key = node->value = NULL;
+    node->next = self->pool;
+    self->pool = node;
+    self->pool_len++;
+    Py_DECREF(key);
+    Py_XDECREF(value);
 }
 
-static PyObject *
-LRU_values(LRU *self)
+static Py_ssize_t
+lru_pool_limit(LRU *self)
 {
-    return collect(self, get_value);
+#ifdef Py_GIL_DISABLED
+    /* Lock free readers (read_buffer mode) hold node references we can't account for. */
+    if (self->rbuf)
+        return 0;
+#endif
+    return Py_MIN(self->size, LRU_NODE_POOL_MAX);
 }
 
-static PyObject *
-LRU_set_callback(LRU *self, PyObject *args)
+static void
+lru_pool_trim(LRU *self, Py_ssize_t max)
 {
-    return set_callback(self, args);
+    while (self->pool_len > max) {
+        Node *node = self->pool;
+        self->pool = node->next;
+        self->pool_len--;
+        node->next = NULL;
+        Py_DECREF(node);
+    }
 }
 
-static PyObject *
-get_item(Node *node)
+
+/*
+ * Argument parsing for METH_FASTCALL | METH_KEYWORDS methods, in the spirit of what argument
+ * clinic generates: positional arguments are copied into out[], keywords are matched against
+ * kwlist. Unset optional arguments are left NULL. Returns 0 on success, -1 with TypeError set.
+ */
+static int
+lru_parse_args(const char *fname, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+               const char * const *kwlist, Py_ssize_t minargs, Py_ssize_t maxargs, PyObject **out)
 {
-    PyObject *tuple = PyTuple_New(2);
-    Py_INCREF(node->key);
-    PyTuple_SET_ITEM(tuple, 0, node->key);
-    Py_INCREF(node->value);
-    PyTuple_SET_ITEM(tuple, 1, node->value);
-    return tuple;
+    Py_ssize_t i, j, nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+
+    if (nkw == 0 && nargs >= minargs && nargs <= maxargs) {
+        for (i = 0; i < nargs; i++)
+            out[i] = args[i];
+        return 0;
+    }
+    if (nargs > maxargs) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd argument%s (%zd given)",
+                     fname, maxargs, maxargs == 1 ? "" : "s", nargs + nkw);
+        return -1;
+    }
+    for (i = 0; i < nargs; i++)
+        out[i] = args[i];
+    for (i = 0; i < nkw; i++) {
+        PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+        for (j = 0; j < maxargs; j++) {
+            if (PyUnicode_CompareWithASCIIString(name, kwlist[j]) == 0)
+                break;
+        }
+        if (j == maxargs) {
+            PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'",
+                         fname, name);
+            return -1;
+        }
+        if (out[j]) {
+            PyErr_Format(PyExc_TypeError, "argument for %s() given by name ('%U') and position (%zd)",
+                         fname, name, j + 1);
+            return -1;
+        }
+        out[j] = args[nargs + i];
+    }
+    for (i = 0; i < minargs; i++) {
+        if (!out[i]) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s' (pos %zd)",
+                         fname, kwlist[i], i + 1);
+            return -1;
+        }
+    }
+    return 0;
 }
 
-static PyObject *
-LRU_items(LRU *self)
+/* Positional only variant, for METH_FASTCALL methods. */
+static int
+lru_check_positional(const char *fname, Py_ssize_t nargs, Py_ssize_t minargs, Py_ssize_t maxargs)
 {
-    return collect(self, get_item);
+    if (nargs < minargs) {
+        PyErr_Format(PyExc_TypeError, "%s expected at least %zd argument%s, got %zd",
+                     fname, minargs, minargs == 1 ? "" : "s", nargs);
+        return -1;
+    }
+    if (nargs > maxargs) {
+        PyErr_Format(PyExc_TypeError, "%s expected at most %zd argument%s, got %zd",
+                     fname, maxargs, maxargs == 1 ? "" : "s", nargs);
+        return -1;
+    }
+    return 0;
 }
 
 static PyObject *
-LRU_set_size(LRU *self, PyObject *args, PyObject *kwds)
+set_callback(LRU *self, PyObject *temp)
 {
-    Py_ssize_t newSize;
-    if (!PyArg_ParseTuple(args, "n", &newSize)) {
-        return NULL;
-    }
-    if (newSize <= 0) {
-        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
+    if (temp == Py_None) {
+        Py_XDECREF(self->callback);
+        self->callback = NULL;
+    } else if (!PyCallable_Check(temp)) {
+        PyErr_SetString(PyExc_TypeError, "parameter must be callable");
         return NULL;
+    } else {
+        Py_XINCREF(temp);         /* Add a reference to new callback */
+        Py_XDECREF(self->callback);  /* Dispose of previous callback */
+        self->callback = temp;       /* Remember new callback */
     }
-    while (lru_length(self) > newSize) {
-        lru_delete_last(self);
-    }
-    self->size = newSize;
     Py_RETURN_NONE;
 }
 
-static PyObject *
-LRU_clear(LRU *self)
-{
-    Node *c = self->first;
+/*
+ * Scan resistant policies: policy="slru", "2q" and "tinylfu".
+ *
+ * These split the entries into segments, which stay contiguous runs of the one linked list
+ * so that everything walking self->first..self->last keeps working. The list holds the
+ * window segment, then the protected one, then probation, each in MRU to LRU order, and
+ * eviction takes its victim from the back.
+ *
+ * - slru: new entries start in probation and move to protected when hit again. Protected is
+ *   limited to 80% of the size and overflows back into the head of probation, so a scan
+ *   only ever replaces what is in probation.
+ * - 2q: probation is the A1in FIFO (25% of the size, hits don't move it) and protected is
+ *   Am. Keys evicted from A1in are remembered by hash in a small ghost table, and a key
+ *   coming back while it is still remembered goes straight to Am.
+ * - tinylfu: W-TinyLFU. New entries enter a 1% LRU window in front of an SLRU. A count-min
+ *   sketch estimates how often every key was accessed recently, and the window's LRU entry
+ *   only gets into the SLRU if it was used more often than the SLRU's victim.
+ */
 
-    while (c) {
-        Node* n = c;
-        c = c->next;
-        lru_remove_node(self, n);
-    }
-    PyDict_Clear(self->dict);
+enum {
+    SEG_WINDOW,
+    SEG_PROTECTED,
+    SEG_PROBATION,
+    LRU_SEGMENTS,
+};
 
-    self->hits = 0;
-    self->misses = 0;
-    Py_RETURN_NONE;
-}
+/*
+ * Count-min sketch with 4 bit counters, 16 per 64 bit word. Each key increments one
+ * counter in each of 4 words, all at the same offset group within a word, and its
+ * frequency is the minimum of the four. After 10 * size increments all counters are halved,
+ * so old popularity fades.
+ */
+typedef struct {
+    uint64_t *table;
+    size_t mask;
+    Py_ssize_t additions;
+    Py_ssize_t sample;
+} Sketch;
 
+typedef struct _Segments {
+    Node *first[LRU_SEGMENTS];      /* first node of every segment, NULL if it's empty */
+    Py_ssize_t len[LRU_SEGMENTS];
+    Py_ssize_t max[LRU_SEGMENTS];   /* window, protected and (2q) A1in capacities */
+    Sketch sketch;                  /* tinylfu frequencies */
+    Py_hash_t *ghosts;              /* 2q: direct mapped hashes of keys evicted from A1in */
+    size_t ghost_mask;
+} Segments;
 
-static PyObject *
-LRU_get_size(LRU *self)
+static const uint64_t sketch_seeds[4] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL,
+};
+
+/* Mixes a Python hash, which is the identity for small ints. */
+static uint64_t
+seg_spread(Py_hash_t hash)
 {
-    return Py_BuildValue("i", self->size);
+    uint64_t x = (uint64_t)hash;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
 }
 
-static PyObject *
-LRU_get_stats(LRU *self)
+static size_t
+sketch_index(const Sketch *s, uint64_t h, int i)
 {
-    return Py_BuildValue("nn", self->hits, self->misses);
+    h = (h + sketch_seeds[i]) * sketch_seeds[i];
+    h += h >> 32;
+    return (size_t)h & s->mask;
 }
 
-
-/* Hack to implement "key in lru" */
-static PySequenceMethods lru_as_sequence = {
-    0,                             /* sq_length */
-    0,                             /* sq_concat */
-    0,                             /* sq_repeat */
-    0,                             /* sq_item */
-    0,                             /* sq_slice */
-    0,                             /* sq_ass_item */
-    0,                             /* sq_ass_slice */
-    (objobjproc) LRU_seq_contains, /* sq_contains */
-    0,                             /* sq_inplace_concat */
-    0,                             /* sq_inplace_repeat */
-};
-
-static PyMethodDef LRU_methods[] = {
-    {"__contains__", (PyCFunction)LRU_contains_key, METH_O | METH_COEXIST,
-                    PyDoc_STR("L.__contains__(key) -> Check if key is there in L")},
-    {"keys", (PyCFunction)LRU_keys, METH_NOARGS,
-                    PyDoc_STR("L.keys() -> list of L's keys in MRU order")},
-    {"values", (PyCFunction)LRU_values, METH_NOARGS,
-                    PyDoc_STR("L.values() -> list of L's values in MRU order")},
-    {"items", (PyCFunction)LRU_items, METH_NOARGS,
-                    PyDoc_STR("L.items() -> list of L's items (key,value) in MRU order")},
-    {"has_key",	(PyCFunction)LRU_contains, METH_VARARGS,
-                    PyDoc_STR("L.has_key(key) -> Check if key is there in L")},
-    {"get",	(PyCFunction)LRU_get, METH_VARARGS | METH_KEYWORDS,
-                    PyDoc_STR("L.get(key, default=None) -> If L has key return its value, otherwise default")},
-    {"setdefault", (PyCFunction)LRU_setdefault, METH_VARARGS,
-                    PyDoc_STR("L.setdefault(key, default=None) -> If L has key return its value, otherwise insert key with a value of default and return default")},
-    {"pop", (PyCFunction)LRU_pop, METH_VARARGS | METH_KEYWORDS,
-                    PyDoc_STR("L.pop(key[, default]) -> If L has key return its value and remove it from L, otherwise return default. If default is not given and key is not in L, a KeyError is raised.")},
-    {"popitem", (PyCFunction)LRU_popitem, METH_VARARGS | METH_KEYWORDS,
-                    PyDoc_STR("L.popitem([least_recent=True]) -> Returns and removes a (key, value) pair. The pair returned is the least-recently used if least_recent is true, or the most-recently used if false.")},
-    {"set_size", (PyCFunction)LRU_set_size, METH_VARARGS,
-                    PyDoc_STR("L.set_size() -> set size of LRU")},
-    {"get_size", (PyCFunction)LRU_get_size, METH_NOARGS,
-                    PyDoc_STR("L.get_size() -> get size of LRU")},
-    {"clear", (PyCFunction)LRU_clear, METH_NOARGS,
-                    PyDoc_STR("L.clear() -> clear LRU")},
-    {"get_stats", (PyCFunction)LRU_get_stats, METH_NOARGS,
-                    PyDoc_STR("L.get_stats() -> returns a tuple with cache hits and misses")},
-    {"peek_first_item", (PyCFunction)LRU_peek_first_item, METH_NOARGS,
-                    PyDoc_STR("L.peek_first_item() -> returns the MRU item (key,value) without changing key order")},
-    {"peek_last_item", (PyCFunction)LRU_peek_last_item, METH_NOARGS,
-                    PyDoc_STR("L.peek_last_item() -> returns the LRU item (key,value) without changing key order")},
-    {"update", (PyCFunction)LRU_update, METH_VARARGS | METH_KEYWORDS,
-                    PyDoc_STR("L.update() -> update value for key in LRU")},
-    {"set_callback", (PyCFunction)LRU_set_callback, METH_VARARGS,
-                    PyDoc_STR("L.set_callback(callback) -> set a callback to call when an item is evicted.")},
-    {NULL,	NULL},
-};
-
-static PyObject*
-LRU_repr(LRU* self)
+static void
+sketch_reset(Sketch *s)
 {
-    return PyObject_Repr(self->dict);
+    size_t i;
+    for (i = 0; i <= s->mask; i++)
+        s->table[i] = (s->table[i] >> 1) & 0x7777777777777777ULL;
+    s->additions /= 2;
 }
 
-static int
-LRU_init(LRU *self, PyObject *args, PyObject *kwds)
+static void
+sketch_increment(Sketch *s, Py_hash_t hash)
 {
-    static char *kwlist[] = {"size", "callback", NULL};
-    PyObject *callback = NULL;
-    self->callback = NULL;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|O", kwlist, &self->size, &callback)) {
-        return -1;
-    }
+    uint64_t h = seg_spread(hash), mask;
+    int i, start = (int)(h & 3) << 2, added = 0, offset;
+    size_t index;
 
-    if (callback && callback != Py_None) {
-        if (!PyCallable_Check(callback)) {
-            PyErr_SetString(PyExc_TypeError, "parameter must be callable");
-            return -1;
+    for (i = 0; i < 4; i++) {
+        index = sketch_index(s, h, i);
+        offset = (start + i) << 2;
+        mask = (uint64_t)0xF << offset;
+        if ((s->table[index] & mask) != mask) {
+            s->table[index] += (uint64_t)1 << offset;
+            added = 1;
         }
-        Py_XINCREF(callback);
-        self->callback = callback;
-    }
-
-    if ((Py_ssize_t)self->size <= 0) {
-        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
-        return -1;
     }
-    self->dict = PyDict_New();
-    self->first = self->last = NULL;
-    self->hits = 0;
-    self->misses = 0;
-    return 0;
+    if (added && ++s->additions >= s->sample)
+        sketch_reset(s);
 }
 
-static void
-LRU_dealloc(LRU *self)
+static int
+sketch_frequency(const Sketch *s, Py_hash_t hash)
 {
-    if (self->dict) {
-        LRU_clear(self);
-        Py_DECREF(self->dict);
-        Py_XDECREF(self->callback);
+    uint64_t h = seg_spread(hash);
+    int i, start = (int)(h & 3) << 2, freq = 15, count;
+
+    for (i = 0; i < 4; i++) {
+        count = (int)((s->table[sketch_index(s, h, i)] >> ((start + i) << 2)) & 0xF);
+        if (count < freq)
+            freq = count;
     }
-    PyObject_Del((PyObject*)self);
+    return freq;
 }
 
-PyDoc_STRVAR(lru_doc,
-"LRU(size, callback=None) -> new LRU dict that can store up to size elements\n"
-"An LRU dict behaves like a standard dict, except that it stores only fixed\n"
-"set of elements. Once the size overflows, it evicts least recently used\n"
-"items.  If a callback is set it will call the callback with the evicted key\n"
-" and item.\n\n"
-"Eg:\n"
-">>> l = LRU(3)\n"
-">>> for i in range(5):\n"
-">>>   l[i] = str(i)\n"
-">>> l.keys()\n"
-"[2,3,4]\n\n"
-"Note: An LRU(n) can be thought of as a dict that will have the most\n"
-"recently accessed n items.\n");
-
-static PyTypeObject LRUType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "_lru.LRU",               /* tp_name */
-    sizeof(LRU),             /* tp_basicsize */
-    0,                       /* tp_itemsize */
-    (destructor)LRU_dealloc, /* tp_dealloc */
-    0,                       /* tp_print */
-    0,                       /* tp_getattr */
-    0,                       /* tp_setattr */
-    0,                       /* tp_compare */
-    (reprfunc)LRU_repr,      /* tp_repr */
-    0,                       /* tp_as_number */
-    &lru_as_sequence,        /* tp_as_sequence */
-    &LRU_as_mapping,         /* tp_as_mapping */
-    0,                       /* tp_hash */
-    0,                       /* tp_call */
-    0,                       /* tp_str */
-    0,                       /* tp_getattro */
-    0,                       /* tp_setattro */
-    0,                       /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,      /* tp_flags */
-    lru_doc,                 /* tp_doc */
-    0,                       /* tp_traverse */
-    0,                       /* tp_clear */
-    0,                       /* tp_richcompare */
-    0,                       /* tp_weaklistoffset */
-    0,                       /* tp_iter */
-    0,                       /* tp_iternext */
-    LRU_methods,             /* tp_methods */
-    0,                       /* tp_members */
-    0,                       /* tp_getset */
-    0,                       /* tp_base */
-    0,                       /* tp_dict */
-    0,                       /* tp_descr_get */
-    0,                       /* tp_descr_set */
-    0,                       /* tp_dictoffset */
-    (initproc)LRU_init,      /* tp_init */
-    0,                       /* tp_alloc */
-    0,                       /* tp_new */
-};
-
-#if PY_MAJOR_VERSION >= 3
-  static struct PyModuleDef moduledef = {
-    PyModuleDef_HEAD_INIT,
-    "_lru",            /* m_name */
-    lru_doc,          /* m_doc */
-    -1,               /* m_size */
-    NULL,             /* m_methods */
-    NULL,             /* m_reload */
-    NULL,             /* m_traverse */
-    NULL,             /* m_clear */
-    NULL,             /* m_free */
-  };
-#endif
+static int
+node_segment(Node *node)
+{
+    return (int)((node->flags & NODE_SEGMENT_MASK) >> NODE_SEGMENT_SHIFT);
+}
 
-static PyObject *
-moduleinit(void)
+/* Segment bookkeeping for a node about to be unlinked from the list. */
+static void
+seg_unlink(Segments *sg, Node *node)
 {
-    PyObject *m;
+    int seg = node_segment(node);
+    if (sg->first[seg] == node)
+        sg->first[seg] = node->next && node_segment(node->next) == seg ? node->next : NULL;
+    sg->len[seg]--;
+}
 
-    NodeType.tp_new = PyType_GenericNew;
-    if (PyType_Ready(&NodeType) < 0)
-        return NULL;
+/*
+ * Expiry, enabled by LRU(size, ttl=seconds) or set(key, value, ttl=seconds).
+ *
+ * Entries with a TTL get a Timer, which sits in a hierarchical timing wheel: 5 levels of
+ * 64, 64, 16, 16 and 1 buckets spanning about 1.07s, 1.14m, 1.22h, 0.81d and 13d each. The
+ * buckets of a level cover one bucket of the level above, up to 2^50 ns (13d) for the first
+ * four. A timer goes to the lowest level whose range covers its expiry, and as the wheel's
+ * time advances past a bucket, its timers are either expired or moved down a level. Advancing is
+ * amortized O(1) per timer. Expired entries are also dropped when they are looked up, so
+ * the wheel only has to run from expire() and when a full LRU needs room.
+ *
+ * Times are nanoseconds since the wheel was created, on the monotonic clock or the timer
+ * passed to the constructor.
+ */
 
-    LRUType.tp_new = PyType_GenericNew;
-    if (PyType_Ready(&LRUType) < 0)
-        return NULL;
+#define WHEEL_LEVELS 5
+#define WHEEL_BUCKETS_0 64
+#define WHEEL_BUCKETS_1 64
+#define WHEEL_BUCKETS_2 16
+#define WHEEL_BUCKETS_3 16
+#define WHEEL_BUCKETS_4 1
+#define WHEEL_SLOTS (WHEEL_BUCKETS_0 + WHEEL_BUCKETS_1 + WHEEL_BUCKETS_2 + WHEEL_BUCKETS_3 + \
+                     WHEEL_BUCKETS_4)
+#define WHEEL_NO_TTL 0
+#define WHEEL_DEFAULT_TTL (-1)
+#define WHEEL_MAX_TTL ((int64_t)1 << 62)
 
-    #if PY_MAJOR_VERSION >= 3
-        m = PyModule_Create(&moduledef);
-    #else
-        m = Py_InitModule3("_lru", NULL, lru_doc);
-    #endif
+static const int wheel_buckets[WHEEL_LEVELS] = {WHEEL_BUCKETS_0, WHEEL_BUCKETS_1,
+                                                WHEEL_BUCKETS_2, WHEEL_BUCKETS_3,
+                                                WHEEL_BUCKETS_4};
+static const int wheel_shift[WHEEL_LEVELS] = {30, 36, 42, 46, 50};
 
-    if (m == NULL)
-        return NULL;
+typedef struct _Timer {
+    struct _Timer *prev;
+    struct _Timer *next;
+    Node *node;
+    int64_t expires;
+} Timer;
 
-    Py_INCREF(&NodeType);
-    Py_INCREF(&LRUType);
-    PyModule_AddObject(m, "LRU", (PyObject *) &LRUType);
+typedef struct _Wheel {
+    Timer *buckets[WHEEL_LEVELS];
+    Timer slots[WHEEL_SLOTS];   /* bucket sentinels */
+    int64_t now;                /* time the wheel was last advanced to */
+    int64_t origin;             /* clock reading at time 0 */
+    int64_t ttl;                /* default TTL, WHEEL_NO_TTL for none */
+    PyObject *timer;            /* clock returning seconds, NULL for the monotonic clock */
+    Py_ssize_t expired;         /* entries expired by the current wheel_advance */
+} Wheel;
 
-    return m;
+static void
+timer_unlink(Timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = t;
 }
 
-#if PY_MAJOR_VERSION < 3
-    PyMODINIT_FUNC
-    init_lru(void)
-    {
-        moduleinit();
-    }
-#else
-    PyMODINIT_FUNC
-    PyInit__lru(void)
+static void
+wheel_schedule(Wheel *w, Timer *t)
+{
+    int64_t duration = t->expires - w->now;
+    Timer *bucket = &w->buckets[WHEEL_LEVELS - 1][0];
+    int i;
+
+    for (i = 0; i < WHEEL_LEVELS - 1; i++) {
+        if (duration < ((int64_t)1 << wheel_shift[i + 1])) {
+            bucket = &w->buckets[i][(t->expires >> wheel_shift[i]) & (wheel_buckets[i] - 1)];
+            break;
+        }
+    }
+    t->next = bucket;
+    t->prev = bucket->prev;
+    bucket->prev->next = t;
+    bucket->prev = t;
+}
+
+static void
+lru_cancel_timer(Node *node)
+{
+    timer_unlink(node->timer);
+    PyMem_Free(node->timer);
+    node->timer = NULL;
+}
+
+/* Unlinks a node from the list, to be linked again somewhere else. */
+static void
+lru_unlink_node(LRU *self, Node* node)
+{
+    self->version++;
+    if (self->seg)
+        seg_unlink(self->seg, node);
+    if (self->sweep == node)
+        self->sweep = node->prev;
+    if (self->first == node) {
+        self->first = node->next;
+    }
+    if (self->last == node) {
+        self->last = node->prev;
+    }
+    if (node->prev) {
+        node->prev->next = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    }
+    node->next = node->prev = NULL;
+}
+
+#define NODE_STALE(self, node) ((node)->generation != (self)->generation)
+
+/*
+ * Tags, set with set(key, value, tags=...) on the dict engine without read_buffer. self->tags
+ * maps every tag in use to a TagList capsule, the head of an intrusive list with a TagLink
+ * per tagged node. A node's links are chained through sibling from node->tags, so removing
+ * a node unlinks it from its tags in O(its tags), and invalidate_tag() costs O(entries with
+ * the tag). A tag goes away with its last entry, once the call that removed it is done:
+ * deleting it from self->tags can run __eq__ of a colliding tag and __del__ of the tag.
+ */
+typedef struct _TagLink {
+    Node *node;
+    struct _TagList *list;
+    struct _TagLink *prev;      /* in list */
+    struct _TagLink *next;
+    struct _TagLink *sibling;   /* next link of node */
+} TagLink;
+
+typedef struct _TagList {
+    PyObject *tag;
+    Py_hash_t hash;
+    TagLink *head;
+    struct _TagList *empty;     /* next list of self->empty_tags */
+    int queued;                 /* in self->empty_tags */
+} TagList;
+
+#define TAG_CAPSULE "lru._tag"
+
+static void
+tag_list_free(PyObject *capsule)
+{
+    TagList *list = PyCapsule_GetPointer(capsule, TAG_CAPSULE);
+    Py_DECREF(list->tag);
+    PyMem_Free(list);
+}
+
+/* Returns the list of tag, creating it if needed, or NULL with an exception set. */
+static TagList *
+lru_tag_list(LRU *self, PyObject *tag, Py_hash_t hash)
+{
+    PyObject *capsule;
+    TagList *list;
+
+    if (!self->tags && !(self->tags = PyDict_New()))
+        return NULL;
+    capsule = _PyDict_GetItem_KnownHash(self->tags, tag, hash);
+    if (capsule)
+        return PyCapsule_GetPointer(capsule, TAG_CAPSULE);
+    if (PyErr_Occurred())
+        return NULL;
+    list = PyMem_Malloc(sizeof(TagList));
+    if (!list) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    Py_INCREF(tag);
+    list->tag = tag;
+    list->hash = hash;
+    list->head = NULL;
+    list->queued = 0;
+    capsule = PyCapsule_New(list, TAG_CAPSULE, tag_list_free);
+    if (!capsule) {
+        Py_DECREF(tag);
+        PyMem_Free(list);
+        return NULL;
+    }
+    if (PUT_NODE_HASH(self->tags, tag, capsule, hash) < 0)
+        list = NULL;
+    Py_DECREF(capsule);
+    return list;
+}
+
+/* Unlinks node from all its tags, queueing the tags left without entries to be dropped. */
+static void
+lru_untag(LRU *self, Node *node)
+{
+    TagLink *link;
+
+    while ((link = node->tags)) {
+        TagList *list = link->list;
+        node->tags = link->sibling;
+        if (link->prev)
+            link->prev->next = link->next;
+        else
+            list->head = link->next;
+        if (link->next)
+            link->next->prev = link->prev;
+        PyMem_Free(link);
+        if (!list->head && !list->queued) {
+            list->queued = 1;
+            list->empty = self->empty_tags;
+            self->empty_tags = list;
+        }
+    }
+}
+
+/*
+ * Drops the queued tags still without entries from self->tags. Runs once a call is done with
+ * the LRU, as the deletion can run Python code. A list set again since it was queued stays.
+ */
+static void
+lru_drop_empty_tags(LRU *self)
+{
+    PyObject *exc_type, *exc_value, *exc_tb, *tag;
+    TagList *list;
+    Py_hash_t hash;
+
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    while ((list = self->empty_tags)) {
+        self->empty_tags = list->empty;
+        list->queued = 0;
+        if (list->head)
+            continue;
+        /* Deleting frees the list, and the tag with it unless held */
+        tag = list->tag;
+        hash = list->hash;
+        Py_INCREF(tag);
+        if (DEL_NODE_HASH(self->tags, tag, hash) < 0) {
+            /* A call made by the deletion may have dropped it already */
+            if (PyErr_ExceptionMatches(PyExc_KeyError))
+                PyErr_Clear();
+            else
+                PyErr_WriteUnraisable((PyObject *)self);
+        }
+        Py_DECREF(tag);
+    }
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+/* Replaces the tags of a linked node with the (hashed already) items of seq. */
+static int
+lru_set_tags(LRU *self, Node *node, PyObject *seq)
+{
+    Py_ssize_t i, n = PySequence_Fast_GET_SIZE(seq);
+
+    lru_untag(self, node);
+    for (i = 0; i < n; i++) {
+        PyObject *tag = PySequence_Fast_GET_ITEM(seq, i);
+        Py_hash_t hash = PyObject_Hash(tag);
+        TagList *list;
+        TagLink *link;
+
+        if (hash == -1 || !(list = lru_tag_list(self, tag, hash)))
+            return -1;
+        for (link = node->tags; link && link->list != list; link = link->sibling)
+            ;
+        if (link)
+            continue;
+        if (!(link = PyMem_Malloc(sizeof(TagLink)))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        link->node = node;
+        link->list = list;
+        link->prev = NULL;
+        link->next = list->head;
+        if (list->head)
+            list->head->prev = link;
+        list->head = link;
+        link->sibling = node->tags;
+        node->tags = link;
+    }
+    return 0;
+}
+
+/* Unlinks a node that leaves the LRU. */
+static void
+lru_remove_node(LRU *self, Node* node)
+{
+    lru_unlink_node(self, node);
+    if (node->timer)
+        lru_cancel_timer(node);
+    if (NODE_STALE(self, node))
+        self->stale--;
+    if (node->tags)
+        lru_untag(self, node);
+    self->weight -= node->weight;
+}
+
+static void
+lru_add_node_at_head(LRU *self, Node* node)
+{
+    self->version++;
+    node->prev = NULL;
+    if (!self->first) {
+        self->first = self->last = node;
+        node->next = NULL;
+    } else {
+        node->next = self->first;
+        if (node->next) {
+            node->next->prev = node;
+        }
+        self->first = node;
+    }
+}
+
+/* Links node in front of at, or at the tail if at is NULL. */
+static void
+lru_add_node_before(LRU *self, Node *node, Node *at)
+{
+    self->version++;
+    node->next = at;
+    node->prev = at ? at->prev : self->last;
+    if (node->prev)
+        node->prev->next = node;
+    else
+        self->first = node;
+    if (at)
+        at->prev = node;
+    else
+        self->last = node;
+}
+
+/* First node after segment seg, NULL if the later segments are empty. */
+static Node *
+seg_next_head(Segments *sg, int seg)
+{
+    for (seg++; seg < LRU_SEGMENTS; seg++) {
+        if (sg->first[seg])
+            return sg->first[seg];
+    }
+    return NULL;
+}
+
+/* Links an unlinked node at the head of segment seg. */
+static void
+seg_link(LRU *self, Node *node, int seg)
+{
+    Segments *sg = self->seg;
+    lru_add_node_before(self, node, sg->first[seg] ? sg->first[seg] : seg_next_head(sg, seg));
+    node->flags = (node->flags & ~NODE_SEGMENT_MASK) | ((unsigned int)seg << NODE_SEGMENT_SHIFT);
+    sg->first[seg] = node;
+    sg->len[seg]++;
+}
+
+static void
+seg_move(LRU *self, Node *node, int seg)
+{
+    lru_unlink_node(self, node);
+    seg_link(self, node, seg);
+}
+
+/* LRU node of segment seg, NULL if it's empty. */
+static Node *
+seg_last(LRU *self, int seg)
+{
+    Node *next;
+    if (!self->seg->len[seg])
+        return NULL;
+    next = seg_next_head(self->seg, seg);
+    return next ? next->prev : self->last;
+}
+
+/* A hit on node. */
+static void
+seg_touch(LRU *self, Node *node)
+{
+    Segments *sg = self->seg;
+    Node *demoted;
+
+    if (self->policy == LRU_POLICY_TINYLFU)
+        sketch_increment(&sg->sketch, node->hash);
+
+    switch (node_segment(node)) {
+    case SEG_PROBATION:
+        if (self->policy == LRU_POLICY_2Q)
+            break;              /* A1in is a FIFO */
+        seg_move(self, node, SEG_PROTECTED);
+        if (sg->len[SEG_PROTECTED] > sg->max[SEG_PROTECTED]) {
+            demoted = seg_last(self, SEG_PROTECTED);
+            seg_move(self, demoted, SEG_PROBATION);
+        }
+        break;
+    default:
+        if (sg->first[node_segment(node)] != node)
+            seg_move(self, node, node_segment(node));
+        break;
+    }
+}
+
+/* A miss on a key. Only tinylfu counts those, it returns -1 if the key can't be hashed. */
+static int
+seg_miss(LRU *self, PyObject *key)
+{
+    Py_hash_t hash;
+    if (self->policy != LRU_POLICY_TINYLFU)
+        return 0;
+    hash = lru_hash(key);
+    if (hash == -1)
+        return -1;
+    sketch_increment(&self->seg->sketch, hash);
+    return 0;
+}
+
+/* Links a new node, with node->hash set. */
+static void
+seg_add(LRU *self, Node *node)
+{
+    Segments *sg = self->seg;
+    size_t slot;
+
+    switch (self->policy) {
+    case LRU_POLICY_SLRU:
+        seg_link(self, node, SEG_PROBATION);
+        break;
+    case LRU_POLICY_2Q:
+        slot = (size_t)seg_spread(node->hash) & sg->ghost_mask;
+        if (sg->ghosts[slot] == node->hash) {
+            sg->ghosts[slot] = -1;
+            seg_link(self, node, SEG_PROTECTED);
+        } else {
+            seg_link(self, node, SEG_PROBATION);
+        }
+        break;
+    default:
+        sketch_increment(&sg->sketch, node->hash);
+        seg_link(self, node, SEG_WINDOW);
+        if (sg->len[SEG_WINDOW] > sg->max[SEG_WINDOW])
+            seg_move(self, seg_last(self, SEG_WINDOW), SEG_PROBATION);
+        break;
+    }
+}
+
+/* Picks the node to evict from a non empty LRU. */
+static Node *
+seg_victim(LRU *self)
+{
+    Segments *sg = self->seg;
+    Node *candidate, *victim;
+
+    switch (self->policy) {
+    case LRU_POLICY_SLRU:
+        victim = seg_last(self, SEG_PROBATION);
+        return victim ? victim : seg_last(self, SEG_PROTECTED);
+    case LRU_POLICY_2Q:
+        if (sg->len[SEG_PROBATION] > sg->max[SEG_PROBATION] || !sg->len[SEG_PROTECTED]) {
+            victim = seg_last(self, SEG_PROBATION);
+            sg->ghosts[(size_t)seg_spread(victim->hash) & sg->ghost_mask] = victim->hash;
+            return victim;
+        }
+        return seg_last(self, SEG_PROTECTED);
+    default:
+        victim = seg_last(self, SEG_PROBATION);
+        if (!victim)
+            victim = seg_last(self, SEG_PROTECTED);
+        candidate = NULL;
+        if (sg->len[SEG_WINDOW] >= sg->max[SEG_WINDOW])
+            candidate = seg_last(self, SEG_WINDOW);
+        if (!candidate)
+            return victim ? victim : seg_last(self, SEG_WINDOW);
+        if (!victim)
+            return candidate;
+        /* The admission filter: the window's oldest entry replaces the main victim only if
+         * it is more popular. */
+        if (sketch_frequency(&sg->sketch, candidate->hash) >
+            sketch_frequency(&sg->sketch, victim->hash)) {
+            seg_move(self, candidate, SEG_PROBATION);
+            return victim;
+        }
+        return candidate;
+    }
+}
+
+static size_t
+seg_table_size(Py_ssize_t n)
+{
+    size_t size = 8;
+    while (size < (size_t)n)
+        size <<= 1;
+    return size;
+}
+
+/* Sets the segment capacities for an LRU of the given size, resizing the sketch and the
+ * ghost table. Counts and ghosts are lost when those are resized. */
+static int
+seg_resize(LRU *self, Py_ssize_t size)
+{
+    Segments *sg = self->seg;
+    Py_ssize_t main;
+    size_t n, i;
+
+    switch (self->policy) {
+    case LRU_POLICY_SLRU:
+        sg->max[SEG_PROTECTED] = size - size / 5;
+        break;
+    case LRU_POLICY_2Q:
+        sg->max[SEG_PROTECTED] = PY_SSIZE_T_MAX;
+        sg->max[SEG_PROBATION] = size / 4 > 0 ? size / 4 : 1;
+        n = seg_table_size(size / 2);
+        if (!sg->ghosts || n != sg->ghost_mask + 1) {
+            Py_hash_t *ghosts = PyMem_New(Py_hash_t, n);
+            if (!ghosts) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            for (i = 0; i < n; i++)
+                ghosts[i] = -1;
+            PyMem_Free(sg->ghosts);
+            sg->ghosts = ghosts;
+            sg->ghost_mask = n - 1;
+        }
+        break;
+    default:
+        sg->max[SEG_WINDOW] = size / 100 > 0 ? size / 100 : 1;
+        main = size - sg->max[SEG_WINDOW];
+        sg->max[SEG_PROTECTED] = main - main / 5;
+        n = seg_table_size(size);
+        if (!sg->sketch.table || n != sg->sketch.mask + 1) {
+            uint64_t *table = PyMem_New(uint64_t, n);
+            if (!table) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            memset(table, 0, n * sizeof(uint64_t));
+            PyMem_Free(sg->sketch.table);
+            sg->sketch.table = table;
+            sg->sketch.mask = n - 1;
+            sg->sketch.additions = 0;
+        }
+        sg->sketch.sample = size < PY_SSIZE_T_MAX / 10 ? size * 10 : PY_SSIZE_T_MAX;
+        break;
+    }
+    return 0;
+}
+
+static int
+seg_new(LRU *self)
+{
+    self->seg = PyMem_New(Segments, 1);
+    if (!self->seg) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(self->seg, 0, sizeof(Segments));
+    return seg_resize(self, self->size);
+}
+
+static void
+seg_free(LRU *self)
+{
+    if (!self->seg)
+        return;
+    PyMem_Free(self->seg->sketch.table);
+    PyMem_Free(self->seg->ghosts);
+    PyMem_Free(self->seg);
+    self->seg = NULL;
+}
+
+/*
+ * Buffered reads, enabled with LRU(size, read_buffer=n).
+ *
+ * A hit normally moves its node to the head of the list, so every read writes to the list
+ * like an insert does. In read_buffer mode a hit only records its node in a ring of n slots
+ * and the recorded moves are applied in one batch, under the LRU lock, when a ring fills up
+ * or before the next operation that depends on the order (writes, keys(), peek_*...).
+ *
+ * On free-threaded builds hits don't take the LRU lock at all: the node is looked up in the
+ * (thread safe) dict and recorded in one of several rings picked by thread id, each with its
+ * own mutex. If a ring is still full when a hit wants to record into it, the move is dropped,
+ * trading a little recency accuracy for never waiting on the writers. To make the lock free
+ * read safe, nodes never change their value in this mode; an update replaces the node.
+ */
+
+#ifdef Py_GIL_DISABLED
+#define READ_STRIPES 16
+#define STRIPE_LOCK(s) PyMutex_Lock(&(s)->mutex)
+#define STRIPE_UNLOCK(s) PyMutex_Unlock(&(s)->mutex)
+#else
+#define READ_STRIPES 1
+#define STRIPE_LOCK(s)
+#define STRIPE_UNLOCK(s)
+#endif
+
+typedef struct {
+#ifdef Py_GIL_DISABLED
+    PyMutex mutex;
+#endif
+    Py_ssize_t len;
+    Py_ssize_t hits;
+    Py_ssize_t misses;
+    Py_ssize_t dropped;
+    Node **nodes;           /* strong references to the recorded nodes */
+} ReadStripe;
+
+typedef struct _ReadBuffer {
+    Py_ssize_t capacity;    /* slots per stripe */
+    Py_ssize_t batched;     /* moves applied by lru_drain_reads */
+    Node **scratch;         /* used by the drainer, which holds the LRU lock */
+    ReadStripe stripes[READ_STRIPES];
+} ReadBuffer;
+
+static int
+rbuf_new(LRU *self, Py_ssize_t capacity)
+{
+    ReadBuffer *rbuf;
+    int i;
+
+    if (capacity > PY_SSIZE_T_MAX / (Py_ssize_t)sizeof(Node *) / (READ_STRIPES + 1)) {
+        PyErr_SetString(PyExc_ValueError, "read_buffer is too large");
+        return -1;
+    }
+    rbuf = PyMem_Calloc(1, sizeof(ReadBuffer));
+    if (!rbuf) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    rbuf->capacity = capacity;
+    rbuf->scratch = PyMem_New(Node *, capacity);
+    for (i = 0; i < READ_STRIPES; i++)
+        rbuf->stripes[i].nodes = PyMem_New(Node *, capacity);
+    self->rbuf = rbuf;
+    for (i = 0; i < READ_STRIPES; i++) {
+        if (!rbuf->stripes[i].nodes)
+            break;
+    }
+    if (!rbuf->scratch || i < READ_STRIPES) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+static int
+lru_node_linked(LRU *self, Node *node)
+{
+    return node->prev || node->next || self->first == node;
+}
+
+/* Applies the recorded moves of all stripes. Must hold the LRU lock. */
+static void
+lru_drain_reads(LRU *self)
+{
+    ReadBuffer *rbuf = self->rbuf;
+    ReadStripe *stripe;
+    Py_ssize_t i, n;
+    int s;
+
+    for (s = 0; s < READ_STRIPES; s++) {
+        stripe = &rbuf->stripes[s];
+        if (stripe->len == 0)
+            continue;
+        STRIPE_LOCK(stripe);
+        n = stripe->len;
+        memcpy(rbuf->scratch, stripe->nodes, n * sizeof(Node *));
+        stripe->len = 0;
+        STRIPE_UNLOCK(stripe);
+
+        for (i = 0; i < n; i++) {
+            Node *node = rbuf->scratch[i];
+            /* The node may have been deleted or replaced since the read. */
+            if (lru_node_linked(self, node) && node != self->first) {
+                lru_unlink_node(self, node);
+                lru_add_node_at_head(self, node);
+            }
+            rbuf->batched++;
+        }
+        for (i = 0; i < n; i++)
+            Py_DECREF(rbuf->scratch[i]);
+    }
+}
+
+static void
+lru_sync(LRU *self)
+{
+    if (self->rbuf)
+        lru_drain_reads(self);
+}
+
+static ReadStripe *
+rbuf_stripe(ReadBuffer *rbuf)
+{
+#ifdef Py_GIL_DISABLED
+    return &rbuf->stripes[(PyThread_get_thread_ident() >> 4) % READ_STRIPES];
+#else
+    return &rbuf->stripes[0];
+#endif
+}
+
+/*
+ * Read path of read_buffer mode. Returns a new reference to the value, or NULL on a miss
+ * (without an exception set) or error. Does not need the LRU lock.
+ */
+static PyObject *
+lru_buffered_find(LRU *self, PyObject *key)
+{
+    ReadBuffer *rbuf = self->rbuf;
+    ReadStripe *stripe = rbuf_stripe(rbuf);
+    PyObject *value;
+    Node *node;
+    int full = 0;
+
+#ifdef Py_GIL_DISABLED
+    if (PyDict_GetItemRef(self->dict, key, (PyObject **)&node) < 0)
+        return NULL;
+#else
+    node = (Node *)PyDict_GetItemWithError(self->dict, key);
+    Py_XINCREF(node);
+#endif
+    if (!node) {
+        if (PyErr_Occurred())
+            return NULL;
+        STRIPE_LOCK(stripe);
+        stripe->misses++;
+        STRIPE_UNLOCK(stripe);
+        return NULL;
+    }
+
+    value = node->value;
+    Py_INCREF(value);
+
+    STRIPE_LOCK(stripe);
+    stripe->hits++;
+    if (stripe->len < rbuf->capacity) {
+        stripe->nodes[stripe->len++] = node;
+        full = stripe->len == rbuf->capacity;
+        node = NULL;
+    } else {
+        stripe->dropped++;
+    }
+    STRIPE_UNLOCK(stripe);
+
+    Py_XDECREF(node);
+    if (full) {
+        Py_BEGIN_CRITICAL_SECTION(self);
+        lru_drain_reads(self);
+        Py_END_CRITICAL_SECTION();
+    }
+    return value;
+}
+
+static void
+rbuf_free(LRU *self)
+{
+    ReadBuffer *rbuf = self->rbuf;
+    int i;
+
+    if (!rbuf)
+        return;
+    self->rbuf = NULL;
+    for (i = 0; i < READ_STRIPES; i++) {
+        Py_ssize_t j;
+        for (j = 0; j < rbuf->stripes[i].len; j++)
+            Py_DECREF(rbuf->stripes[i].nodes[j]);
+        PyMem_Free(rbuf->stripes[i].nodes);
+    }
+    PyMem_Free(rbuf->scratch);
+    PyMem_Free(rbuf);
+}
+
+/*
+ * Instrumentation, enabled by LRU(size, metrics=True). Without it self->metrics is NULL and
+ * each hook is a test of that pointer, so the uninstrumented paths cost what they did.
+ *
+ * The counters are updated under the lock, where the event happens. One in METRICS_SAMPLE
+ * calls of each operation is timed, around its work inside the critical section, into a
+ * histogram of fixed log2 buckets: bucket i counts latencies in [2^i, 2^(i+1)) ns. Nothing is
+ * allocated until get_metrics() exports them.
+ */
+#define METRICS_SAMPLE 64
+#define METRICS_BUCKETS 32
+
+enum {
+    METRIC_GET,
+    METRIC_SET,
+    METRIC_DELETE,
+    METRIC_OPS,
+};
+
+static const char * const metric_op_names[METRIC_OPS] = {
+    "get", "set", "delete",
+};
+
+typedef struct _Metrics {
+    Py_ssize_t inserts;
+    Py_ssize_t updates;
+    Py_ssize_t removals[EVICT_REASONS];     /* evictions by reason, EVICT_EXPLICIT are deletes */
+    Py_ssize_t get_misses;      /* misses of get(), answered with the default */
+    Py_ssize_t callback_calls;
+    int64_t callback_ns;
+    uint32_t ticks[METRIC_OPS];
+    uint64_t latency[METRIC_OPS][METRICS_BUCKETS];
+} Metrics;
+
+#define METRIC_INC(self, field)             \
+    do {                                    \
+        if ((self)->metrics)                \
+            (self)->metrics->field++;       \
+    } while (0)
+
+/* Returns the start time if this call of op is sampled, 0 otherwise. */
+static inline int64_t
+metrics_begin(Metrics *m, int op)
+{
+    if (++m->ticks[op] % METRICS_SAMPLE)
+        return 0;
+    return lru_monotonic_ns();
+}
+
+static void
+metrics_end(Metrics *m, int op, int64_t start)
+{
+    int64_t elapsed = lru_monotonic_ns() - start;
+    int bucket = 0;
+
+    while (elapsed > 1 && bucket < METRICS_BUCKETS - 1) {
+        elapsed >>= 1;
+        bucket++;
+    }
+    m->latency[op][bucket]++;
+}
+
+static void
+metrics_callback(Metrics *m, int64_t start)
+{
+    m->callback_calls++;
+    m->callback_ns += lru_monotonic_ns() - start;
+}
+
+static void
+metrics_add(Metrics *sum, const Metrics *m)
+{
+    int i, j;
+
+    sum->inserts += m->inserts;
+    sum->updates += m->updates;
+    for (i = 0; i < EVICT_REASONS; i++)
+        sum->removals[i] += m->removals[i];
+    sum->get_misses += m->get_misses;
+    sum->callback_calls += m->callback_calls;
+    sum->callback_ns += m->callback_ns;
+    for (i = 0; i < METRIC_OPS; i++)
+        for (j = 0; j < METRICS_BUCKETS; j++)
+            sum->latency[i][j] += m->latency[i][j];
+}
+
+static PyObject *
+metrics_export(const Metrics *m, Py_ssize_t hits, Py_ssize_t misses)
+{
+    PyObject *evictions, *latency = NULL, *histogram;
+    int i, j;
+
+    evictions = Py_BuildValue("{snsnsn}", evict_reason_names[EVICT_CAPACITY],
+                              m->removals[EVICT_CAPACITY], evict_reason_names[EVICT_RESIZE],
+                              m->removals[EVICT_RESIZE], evict_reason_names[EVICT_EXPIRED],
+                              m->removals[EVICT_EXPIRED]);
+    if (!evictions || !(latency = PyDict_New()))
+        goto error;
+    for (i = 0; i < METRIC_OPS; i++) {
+        histogram = PyTuple_New(METRICS_BUCKETS);
+        if (!histogram)
+            goto error;
+        for (j = 0; j < METRICS_BUCKETS; j++) {
+            PyObject *count = PyLong_FromUnsignedLongLong(m->latency[i][j]);
+            if (!count) {
+                Py_DECREF(histogram);
+                goto error;
+            }
+            PyTuple_SET_ITEM(histogram, j, count);
+        }
+        if (PyDict_SetItemString(latency, metric_op_names[i], histogram) < 0) {
+            Py_DECREF(histogram);
+            goto error;
+        }
+        Py_DECREF(histogram);
+    }
+    return Py_BuildValue("{snsnsnsnsnsnsNsnsdsNsi}", "hits", hits, "misses", misses,
+                         "get_misses", m->get_misses, "inserts", m->inserts,
+                         "updates", m->updates, "deletes", m->removals[EVICT_EXPLICIT],
+                         "evictions", evictions, "callback_calls", m->callback_calls,
+                         "callback_time", m->callback_ns / 1e9, "latency", latency,
+                         "latency_sample", METRICS_SAMPLE);
+
+error:
+    Py_XDECREF(evictions);
+    Py_XDECREF(latency);
+    return NULL;
+}
+
+/*
+ * Miss ratio curve estimation, enabled by LRU(size, mrc=n), following SHARDS (Waldspurger et
+ * al., FAST '15). Keys are sampled by hash at the rate R = MRC_KEYS / n and the sampled hashes,
+ * without their values, are kept in LRU stack order whether or not the LRU still holds them.
+ * A lookup at distance d from the top of that stack would hit in any LRU with more than about
+ * d / R entries, so the histogram of those distances gives the hit ratio of every size up to n.
+ *
+ * The stack order is kept as the time of the last access of every hash, with a Fenwick tree
+ * over the MRC_SLOTS times counting the hashes accessed since, which is the distance. Times
+ * are renumbered when they run out. At most MRC_KEYS hashes are tracked, the oldest beyond
+ * that is forgotten, so the memory used doesn't depend on n.
+ */
+#define MRC_KEYS 2048
+#define MRC_SLOTS (2 * MRC_KEYS)
+#define MRC_INDEX (2 * MRC_KEYS)            /* hash -> time, open addressing, a power of 2 */
+#define MRC_MODULUS (UINT64_C(1) << 24)     /* a key is sampled if hash % MRC_MODULUS < threshold */
+#define MRC_POINTS 16                       /* sizes of miss_ratio_curve() by default */
+
+typedef struct _Mrc {
+    Py_ssize_t max_size;        /* mrc=n */
+    uint64_t threshold;
+    uint64_t lookups;           /* all lookups, sampled or not */
+    uint64_t sampled;           /* sampled lookups */
+    uint64_t distances[MRC_KEYS];   /* sampled lookups by distance, the rest were cold */
+    uint32_t now;
+    uint32_t live;
+    uint64_t slots[MRC_SLOTS];      /* the hash last accessed at each time, 0 once it moved on */
+    uint32_t tree[MRC_SLOTS + 1];   /* Fenwick tree over the used slots */
+    uint64_t index_hashes[MRC_INDEX];   /* 0 for free entries */
+    uint32_t index_times[MRC_INDEX];
+} Mrc;
+
+static Mrc *
+mrc_new(Py_ssize_t max_size)
+{
+    Mrc *m = PyMem_Calloc(1, sizeof(Mrc));
+    if (!m) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    m->max_size = max_size;
+    if ((uint64_t)max_size <= MRC_KEYS)
+        m->threshold = MRC_MODULUS;
+    else if (!(m->threshold = MRC_MODULUS * MRC_KEYS / (uint64_t)max_size))
+        m->threshold = 1;
+    return m;
+}
+
+/* splitmix64's finalizer, unrelated to the mixes which choose shards and sketch counters. */
+static inline uint64_t
+mrc_spread(Py_hash_t hash)
+{
+    uint64_t x = (uint64_t)hash;
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+static void
+mrc_tree_add(Mrc *m, uint32_t t, uint32_t delta)
+{
+    for (t++; t <= MRC_SLOTS; t += t & (0u - t))
+        m->tree[t] += delta;
+}
+
+/* Number of used slots up to t included. */
+static uint32_t
+mrc_tree_count(const Mrc *m, uint32_t t)
+{
+    uint32_t n = 0;
+    for (t++; t; t -= t & (0u - t))
+        n += m->tree[t];
+    return n;
+}
+
+/* The first used slot, the oldest hash. */
+static uint32_t
+mrc_tree_first(const Mrc *m)
+{
+    uint32_t t = 0, step;
+    for (step = MRC_SLOTS; step; step >>= 1) {
+        if (t + step <= MRC_SLOTS && !m->tree[t + step])
+            t += step;
+    }
+    return t;
+}
+
+/* Position of h in the index, or of the free entry where it goes. The low bits sampled it. */
+static size_t
+mrc_find(const Mrc *m, uint64_t h)
+{
+    size_t i = (size_t)(h >> 24) & (MRC_INDEX - 1);
+    while (m->index_hashes[i] && m->index_hashes[i] != h)
+        i = (i + 1) & (MRC_INDEX - 1);
+    return i;
+}
+
+/* Removes index entry i, moving back the entries of its probe run. */
+static void
+mrc_unindex(Mrc *m, size_t i)
+{
+    size_t j = i, home;
+    for (;;) {
+        j = (j + 1) & (MRC_INDEX - 1);
+        if (!m->index_hashes[j])
+            break;
+        home = (size_t)(m->index_hashes[j] >> 24) & (MRC_INDEX - 1);
+        if (j > i ? (home <= i || home > j) : (home <= i && home > j)) {
+            m->index_hashes[i] = m->index_hashes[j];
+            m->index_times[i] = m->index_times[j];
+            i = j;
+        }
+    }
+    m->index_hashes[i] = 0;
+}
+
+static void
+mrc_release(Mrc *m, uint32_t t)
+{
+    m->slots[t] = 0;
+    mrc_tree_add(m, t, (uint32_t)-1);
+    m->live--;
+}
+
+/* Packs the used slots at the start, in the same order. */
+static void
+mrc_renumber(Mrc *m)
+{
+    uint32_t t, n = 0;
+
+    memset(m->tree, 0, sizeof(m->tree));
+    for (t = 0; t < m->now; t++) {
+        if (!m->slots[t])
+            continue;
+        m->slots[n] = m->slots[t];
+        m->index_times[mrc_find(m, m->slots[n])] = n;
+        mrc_tree_add(m, n, 1);
+        n++;
+    }
+    memset(&m->slots[n], 0, (MRC_SLOTS - n) * sizeof(m->slots[0]));
+    m->now = n;
+}
+
+/* Returns the sampled hash for hash, 0 if the key isn't sampled. */
+static inline uint64_t
+mrc_sample(const Mrc *m, Py_hash_t hash)
+{
+    uint64_t h = mrc_spread(hash);
+    if ((h & (MRC_MODULUS - 1)) >= m->threshold)
+        return 0;
+    return h ? h : 1;
+}
+
+/*
+ * An access of the key with this hash: a lookup, counted at its distance, or a store
+ * (lookup == 0), which only moves the key to the top of the stack.
+ */
+static void
+mrc_access(Mrc *m, Py_hash_t hash, int lookup)
+{
+    uint64_t h;
+    size_t i;
+    uint32_t t;
+
+    m->lookups += lookup;
+    if (!(h = mrc_sample(m, hash)))
+        return;
+    m->sampled += lookup;
+    i = mrc_find(m, h);
+    if (m->index_hashes[i]) {
+        t = m->index_times[i];
+        if (lookup)
+            m->distances[m->live - mrc_tree_count(m, t)]++;
+        mrc_release(m, t);
+    } else if (m->live == MRC_KEYS) {
+        t = mrc_tree_first(m);
+        mrc_unindex(m, mrc_find(m, m->slots[t]));
+        mrc_release(m, t);
+        i = mrc_find(m, h);
+    }
+    if (m->now == MRC_SLOTS)
+        mrc_renumber(m);
+    m->index_hashes[i] = h;
+    m->index_times[i] = m->now;
+    m->slots[m->now] = h;
+    mrc_tree_add(m, m->now, 1);
+    m->now++;
+    m->live++;
+}
+
+/* The key was deleted or expired, a lookup (lookup == 1) which found it expired missed. */
+static void
+mrc_forget(Mrc *m, Py_hash_t hash, int lookup)
+{
+    uint64_t h;
+    size_t i;
+
+    m->lookups += lookup;
+    if (!(h = mrc_sample(m, hash)))
+        return;
+    m->sampled += lookup;
+    i = mrc_find(m, h);
+    if (m->index_hashes[i]) {
+        mrc_release(m, m->index_times[i]);
+        mrc_unindex(m, i);
+    }
+}
+
+/*
+ * Estimated hits of an LRU of size entries, in the lookups counted so far. Like SHARDS_adj
+ * the difference between the sampled lookups and R times all of them is added to the hits at
+ * distance 0, which every size gets.
+ */
+static double
+mrc_hits(const Mrc *m, double size)
+{
+    double rate = (double)m->threshold / MRC_MODULUS, hits;
+    uint64_t sampled = 0;
+    Py_ssize_t d;
+
+    for (d = 0; d < MRC_KEYS && d < size * rate; d++)
+        sampled += m->distances[d];
+    hits = ((double)sampled + (double)m->lookups * rate - (double)m->sampled) / rate;
+    if (hits < 0)
+        return 0;
+    return hits < (double)m->lookups ? hits : (double)m->lookups;
+}
+
+/*
+ * Access traces, enabled by LRU(size, trace=n), to replay traffic offline with simulate().
+ * Lookups, sets, deletes, evictions and clears are appended to a ring of n preallocated
+ * events, the oldest being overwritten once it is full, until flush_trace() writes them out.
+ * An event is two 64 bit words, little endian in files: the hash of the key, then the ns
+ * since the module was imported shifted left by 8 bits and or'ed with the op. The shards of
+ * a ShardedLRU share that clock, so their events can be merged.
+ */
+enum {
+    TRACE_HIT,
+    TRACE_MISS,
+    TRACE_SET,
+    TRACE_DELETE,
+    TRACE_EVICT,
+    TRACE_CLEAR,
+};
+
+#define TRACE_EVENT_SIZE 16
+
+typedef struct {
+    uint64_t hash;
+    uint64_t stamp;
+} TraceEvent;
+
+typedef struct _Trace {
+    Py_ssize_t capacity;
+    Py_ssize_t head;        /* where the next event goes */
+    Py_ssize_t count;       /* events kept since the last flush */
+    Py_ssize_t dropped;     /* events overwritten since the last flush */
+    size_t flushes;         /* flushes written out, see trace_consume */
+    TraceEvent events[1];
+} Trace;
+
+static int64_t trace_epoch;
+
+static Trace *
+trace_new(Py_ssize_t capacity)
+{
+    Trace *tr = NULL;
+    if ((size_t)capacity < ((size_t)PY_SSIZE_T_MAX - sizeof(Trace)) / sizeof(TraceEvent))
+        tr = PyMem_Malloc(sizeof(Trace) + (size_t)(capacity - 1) * sizeof(TraceEvent));
+    if (!tr) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    tr->capacity = capacity;
+    tr->head = tr->count = tr->dropped = 0;
+    tr->flushes = 0;
+    return tr;
+}
+
+static void
+trace_record(Trace *tr, Py_hash_t hash, int op)
+{
+    TraceEvent *e = &tr->events[tr->head];
+    e->hash = (uint64_t)hash;
+    e->stamp = (uint64_t)(lru_monotonic_ns() - trace_epoch) << 8 | (uint64_t)op;
+    if (++tr->head == tr->capacity)
+        tr->head = 0;
+    if (tr->count < tr->capacity)
+        tr->count++;
+    else
+        tr->dropped++;
+}
+
+/* Records op on a key whose hash isn't at hand. The key was hashed before, so it can't fail. */
+static void
+trace_key(Trace *tr, PyObject *key, int op)
+{
+    Py_hash_t hash = lru_hash(key);
+    if (hash == -1) {
+        PyErr_Clear();
+        return;
+    }
+    trace_record(tr, hash, op);
+}
+
+static void
+trace_put64(unsigned char *p, uint64_t v)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t
+trace_get64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < 8; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+/* What trace_copy took from a trace, for trace_consume. */
+typedef struct {
+    LRU *lru;               /* held during the write, which may replace ShardedLRU shards */
+    Py_ssize_t count;
+    Py_ssize_t dropped;
+    size_t flushes;
+} TraceMark;
+
+/* Copies the events since the last flush to out, oldest first. They stay in the trace until
+ * trace_consume, once they are written out. */
+static Py_ssize_t
+trace_copy(Trace *tr, TraceEvent *out, TraceMark *mark)
+{
+    Py_ssize_t i, index = tr->head - tr->count, count = tr->count;
+
+    if (index < 0)
+        index += tr->capacity;
+    for (i = 0; i < count; i++) {
+        out[i] = tr->events[index];
+        if (++index == tr->capacity)
+            index = 0;
+    }
+    mark->count = count;
+    mark->dropped = tr->dropped;
+    mark->flushes = tr->flushes;
+    return count;
+}
+
+/*
+ * Forgets the events copied by trace_copy, now written out. The events overwritten since
+ * were the oldest ones, so the copied ones come first and aren't dropped. Nothing is
+ * forgotten if another flush wrote them out meanwhile.
+ */
+static void
+trace_consume(Trace *tr, const TraceMark *mark)
+{
+    Py_ssize_t overwritten = tr->dropped - mark->dropped;
+
+    if (tr->flushes != mark->flushes)
+        return;
+    tr->flushes++;
+    if (overwritten < mark->count) {
+        tr->count -= mark->count - overwritten;
+        tr->dropped = 0;
+    } else {
+        tr->dropped = overwritten - mark->count;
+    }
+}
+
+static int
+trace_compare(const void *a, const void *b)
+{
+    uint64_t x = ((const TraceEvent *)a)->stamp, y = ((const TraceEvent *)b)->stamp;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * flush_trace(file) of the LRUs in shards: copies their events under their locks, merges
+ * them by time and writes them out. The events are only taken out of the traces once the
+ * write succeeded. Returns (events, dropped).
+ */
+static PyObject *
+trace_flush(LRU **shards, Py_ssize_t nshards, PyObject *file)
+{
+    Py_ssize_t i, n = 0, count = 0, dropped = 0;
+    TraceEvent *events;
+    TraceMark *marks;
+    PyObject *data, *result;
+    unsigned char *p;
+
+    for (i = 0; i < nshards; i++) {
+        if (!shards[i]->trace) {
+            PyErr_SetString(PyExc_ValueError, "tracing is not enabled, see LRU(size, trace=n)");
+            return NULL;
+        }
+        n += shards[i]->trace->capacity;
+    }
+    events = PyMem_New(TraceEvent, n ? n : 1);
+    marks = PyMem_New(TraceMark, nshards);
+    if (!events || !marks) {
+        PyMem_Free(events);
+        PyMem_Free(marks);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < nshards; i++) {
+        LRU *shard = shards[i];
+        Py_BEGIN_CRITICAL_SECTION(shard);
+        count += trace_copy(shard->trace, events + count, &marks[i]);
+        Py_END_CRITICAL_SECTION();
+        dropped += marks[i].dropped;
+        Py_INCREF(shard);
+        marks[i].lru = shard;
+    }
+    if (nshards > 1)
+        qsort(events, (size_t)count, sizeof(TraceEvent), trace_compare);
+
+    data = PyBytes_FromStringAndSize(NULL, count * TRACE_EVENT_SIZE);
+    result = NULL;
+    if (data) {
+        p = (unsigned char *)PyBytes_AS_STRING(data);
+        for (i = 0; i < count; i++, p += TRACE_EVENT_SIZE) {
+            trace_put64(p, events[i].hash);
+            trace_put64(p + 8, events[i].stamp);
+        }
+        result = PyObject_CallMethod(file, "write", "O", data);
+        Py_DECREF(data);
+    }
+    PyMem_Free(events);
+    for (i = 0; i < nshards; i++) {
+        LRU *shard = marks[i].lru;
+        if (result) {
+            Py_BEGIN_CRITICAL_SECTION(shard);
+            trace_consume(shard->trace, &marks[i]);
+            Py_END_CRITICAL_SECTION();
+        }
+        Py_DECREF(shard);
+    }
+    PyMem_Free(marks);
+    if (!result)
+        return NULL;
+    Py_DECREF(result);
+    return Py_BuildValue("nn", count, dropped);
+}
+
+/*
+ * Called with the exception of a failed callback set. The first one is kept to be raised
+ * by lru_finish once the call is done, later ones are reported as unraisable.
+ */
+static void
+lru_callback_failed(LRU *self)
+{
+    if (self->callback_error[0]) {
+        PyErr_WriteUnraisable(self->callback);
+        return;
+    }
+    PyErr_Fetch(&self->callback_error[0], &self->callback_error[1], &self->callback_error[2]);
+}
+
+/*
+ * Reports an evicted entry to the callback. Inside a batch operation the entry is queued
+ * instead and the callback runs from lru_end_batch, once the whole batch has been applied.
+ * With callback_batch the entries are always queued, for lru_finish.
+ */
+static void
+lru_notify(LRU *self, PyObject *key, PyObject *value, int reason)
+{
+    PyObject *arglist;
+    PyObject *result;
+    int64_t start;
+
+    METRIC_INC(self, removals[reason]);
+    if (self->trace)
+        trace_key(self->trace, key, reason == EVICT_EXPLICIT ? TRACE_DELETE : TRACE_EVICT);
+    if (self->trimmed) {
+        arglist = PyTuple_Pack(2, key, value);
+        if (!arglist || PyList_Append(self->trimmed, arglist) < 0)
+            lru_callback_failed(self);
+        Py_XDECREF(arglist);
+        return;
+    }
+    if (!self->callback)
+        return;
+    if (reason == EVICT_EXPLICIT && !self->callback_reason)
+        return;
+
+    if (self->callback_reason)
+        arglist = PyTuple_Pack(3, key, value, lru_state_of((PyObject *)self)->evict_reasons[reason]);
+    else
+        arglist = PyTuple_Pack(2, key, value);
+    if (!arglist)
+        return;
+    if (self->batch_depth || self->callback_batch) {
+        if (!self->pending)
+            self->pending = PyList_New(0);
+        if (!self->pending || PyList_Append(self->pending, arglist) < 0)
+            lru_callback_failed(self);
+    } else {
+        start = self->metrics ? lru_monotonic_ns() : 0;
+        result = PyObject_CallObject(self->callback, arglist);
+        if (self->metrics)
+            metrics_callback(self->metrics, start);
+        if (!result)
+            lru_callback_failed(self);
+        Py_XDECREF(result);
+    }
+    Py_DECREF(arglist);
+}
+
+/* lru_notify for node, whose value is only read from the arena if the callback or trim()
+ * gets it. */
+static void
+lru_notify_node(LRU *self, Node *node, int reason)
+{
+    PyObject *value;
+
+    if (!node->block || (!self->trimmed && (!self->callback ||
+                                            (reason == EVICT_EXPLICIT && !self->callback_reason)))) {
+        lru_notify(self, node->key, node->block ? Py_None : node->value, reason);
+        return;
+    }
+    value = lru_block_value(self, node->block);
+    if (!value) {
+        lru_callback_failed(self);
+        return;
+    }
+    lru_notify(self, node->key, value, reason);
+    Py_DECREF(value);
+}
+
+static void
+lru_begin_batch(LRU *self)
+{
+    self->batch_depth++;
+}
+
+/* Ends a batch started by lru_begin_batch and runs the deferred callbacks. Returns status. */
+static int
+lru_end_batch(LRU *self, int status)
+{
+    PyObject *pending, *exc_type, *exc_value, *exc_tb, *result;
+    Py_ssize_t i;
+
+    if (--self->batch_depth > 0 || !self->pending || self->callback_batch)
+        return status;
+
+    pending = self->pending;
+    self->pending = NULL;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    for (i = 0; i < PyList_GET_SIZE(pending) && self->callback; i++) {
+        int64_t start = self->metrics ? lru_monotonic_ns() : 0;
+        result = PyObject_CallObject(self->callback, PyList_GET_ITEM(pending, i));
+        if (self->metrics)
+            metrics_callback(self->metrics, start);
+        if (!result)
+            lru_callback_failed(self);
+        Py_XDECREF(result);
+    }
+    Py_DECREF(pending);
+    if (exc_type)
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+    return status;
+}
+
+/* Evicts a linked node. The node is unlinked before calling back, so the callback sees a
+ * consistent LRU. */
+static void
+lru_evict_node(LRU *self, Node *n, int reason)
+{
+    lru_remove_node(self, n);
+    Py_INCREF(n);
+    DEL_NODE_HASH(self->dict, n->key, n->hash);
+    if (self->l2 && (reason == EVICT_CAPACITY || reason == EVICT_RESIZE))
+        l2_spill(self, n);
+    lru_notify_node(self, n, reason);
+    lru_node_release(self, n);
+}
+
+static void
+lru_delete_last(LRU *self, int reason)
+{
+    Node* n;
+
+    lru_sync(self);
+    n = self->last;
+
+    if (self->table) {
+        PyObject *key, *value;
+        if (self->table->last == TABLE_NIL)
+            return;
+        table_delete(self->table, self->table->last, &key, &value);
+        lru_notify(self, key, value, reason);
+        Py_DECREF(key);
+        Py_DECREF(value);
+        return;
+    }
+
+    if (!self->last)
+        return;
+
+    if (self->policy == LRU_POLICY_CLOCK) {
+        /* Advance the hand, giving referenced nodes a second chance. This ends within one
+         * pass, as every node passed over loses its bit. */
+        while ((self->last->flags & NODE_REFERENCED) && !NODE_STALE(self, self->last)) {
+            n = self->last;
+            n->flags &= ~NODE_REFERENCED;
+            lru_unlink_node(self, n);
+            lru_add_node_at_head(self, n);
+        }
+        n = self->last;
+    } else if (self->seg) {
+        n = seg_victim(self);
+    }
+    /* Invalidated entries leave as deleted, like on clear(). */
+    lru_evict_node(self, n, NODE_STALE(self, n) ? EVICT_EXPLICIT : reason);
+}
+
+/*
+ * Invalidation, for the dict engine without read_buffer. invalidate_all() bumps the
+ * generation of the LRU, which makes every node of an older generation stale. Lookups treat
+ * a stale node like an expired one, as a miss that drops it. The others are reclaimed a few
+ * at a time by inserts, or in chunks by clear(budget=n), walking self->sweep from the LRU
+ * end towards the MRU one. With policy="lru" every node used since the invalidation is in
+ * front of the stale ones, so the walk only meets stale nodes; with the other policies it
+ * may also pass over live ones. Stale nodes leave with EVICT_EXPLICIT, as on clear().
+ */
+#define LRU_RECLAIM_STEP 2
+
+static int
+lru_check_invalidate(LRU *self, const char *fname)
+{
+    if (self->table) {
+        PyErr_Format(PyExc_ValueError, "%s is not supported with engine='compact'", fname);
+        return -1;
+    }
+    if (self->rbuf) {
+        PyErr_Format(PyExc_ValueError, "%s can't be combined with read_buffer", fname);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+lru_invalidate(LRU *self)
+{
+    self->generation++;
+    self->stale = PyDict_GET_SIZE(self->dict);
+    if (self->l2)
+        l2_clear(self->l2);
+    if (self->trace)
+        trace_record(self->trace, 0, TRACE_CLEAR);
+}
+
+/* Looks at up to budget nodes for stale ones to drop. Returns the number of stale nodes left. */
+static Py_ssize_t
+lru_reclaim(LRU *self, Py_ssize_t budget)
+{
+    Node *node;
+
+    lru_begin_batch(self);
+    while (budget-- > 0 && self->stale > 0) {
+        node = self->sweep ? self->sweep : self->last;
+        self->sweep = node->prev;
+        if (NODE_STALE(self, node))
+            lru_evict_node(self, node, EVICT_EXPLICIT);
+    }
+    lru_end_batch(self, 0);
+    return self->stale;
+}
+
+/* Returns the current wheel time, or -1 with an exception set if the timer failed. */
+static int64_t
+wheel_now(Wheel *w)
+{
+    int64_t now;
+
+    if (w->timer) {
+        PyObject *result = PyObject_CallObject(w->timer, NULL);
+        double seconds;
+        if (!result)
+            return -1;
+        seconds = PyFloat_AsDouble(result);
+        Py_DECREF(result);
+        if (seconds == -1.0 && PyErr_Occurred())
+            return -1;
+        now = (int64_t)(seconds * 1e9);
+    } else {
+        now = lru_monotonic_ns();
+    }
+    now -= w->origin;
+    /* Never go back in time, the schedule depends on it. */
+    return now > w->now ? now : w->now;
+}
+
+/*
+ * Returns the time to check expiry against, 0 without a wheel and -1 on error. An operation
+ * reads it before looking nodes up, as a timer= callable may change the LRU.
+ */
+static int64_t
+lru_now(LRU *self)
+{
+    return self->wheel ? wheel_now(self->wheel) : 0;
+}
+
+/*
+ * Whether node has expired at now, from lru_now. Expired nodes stay in the LRU until they
+ * are looked up or the wheel gets to them.
+ */
+static int
+lru_expired(Node *node, int64_t now)
+{
+    return node->timer && node->timer->expires <= now;
+}
+
+/* Expires or reschedules the timers of a bucket. */
+static void
+wheel_expire_bucket(LRU *self, Timer *bucket)
+{
+    Wheel *w = self->wheel;
+    Timer pending, *t;
+
+    if (bucket->next == bucket)
+        return;
+    /* Move the timers to a local list first, as rescheduled ones may land in the same bucket. */
+    pending.next = bucket->next;
+    pending.prev = bucket->prev;
+    pending.next->prev = pending.prev->next = &pending;
+    bucket->next = bucket->prev = bucket;
+
+    while (pending.next != &pending) {
+        t = pending.next;
+        timer_unlink(t);
+        if (t->expires <= w->now) {
+            w->expired++;
+            lru_evict_node(self, t->node, EVICT_EXPIRED);
+        } else {
+            wheel_schedule(w, t);
+        }
+    }
+}
+
+/*
+ * Advances the wheel to the current time and evicts the expired entries. Returns the
+ * number of expired entries, or -1 on error. Callbacks run once the wheel is consistent.
+ *
+ * Entries expiring within the current tick of the first level are only found if exact is
+ * set, as that has to go over all of them every time.
+ */
+static Py_ssize_t
+wheel_advance(LRU *self, int exact)
+{
+    Wheel *w = self->wheel;
+    int64_t now = wheel_now(w), previous = w->now, ticks, delta, i;
+    int level, n;
+
+    if (now < 0)
+        return -1;
+    w->now = now;
+    w->expired = 0;
+    lru_begin_batch(self);
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        n = wheel_buckets[level];
+        ticks = previous >> wheel_shift[level];
+        delta = (now >> wheel_shift[level]) - ticks;
+        if (delta == 0) {
+            /* Entries can also expire within the current bucket of the first level. */
+            if (level == 0 && exact)
+                wheel_expire_bucket(self, &w->buckets[0][ticks & (n - 1)]);
+            break;
+        }
+        for (i = 0; i <= delta && i < n; i++)
+            wheel_expire_bucket(self, &w->buckets[level][(ticks + i) & (n - 1)]);
+    }
+    return lru_end_batch(self, 0) < 0 ? -1 : w->expired;
+}
+
+/*
+ * Sets the expiry of a linked node to ttl nanoseconds from now, read by lru_now, with
+ * WHEEL_DEFAULT_TTL for the default TTL or WHEEL_NO_TTL for none. Returns -1 on error.
+ */
+static int
+lru_set_ttl(LRU *self, Node *node, int64_t ttl, int64_t now)
+{
+    Wheel *w = self->wheel;
+
+    if (ttl == WHEEL_DEFAULT_TTL)
+        ttl = w ? w->ttl : WHEEL_NO_TTL;
+    if (ttl == WHEEL_NO_TTL) {
+        if (node->timer)
+            lru_cancel_timer(node);
+        return 0;
+    }
+    /* The wheel may have advanced past now since. */
+    if (now < w->now)
+        now = w->now;
+    if (node->timer) {
+        timer_unlink(node->timer);
+    } else {
+        node->timer = PyMem_New(Timer, 1);
+        if (!node->timer) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        node->timer->node = node;
+    }
+    node->timer->expires = now + ttl;
+    wheel_schedule(w, node->timer);
+    return 0;
+}
+
+static int
+wheel_new(LRU *self, PyObject *timer, int64_t ttl)
+{
+    Wheel *w;
+    int level, i, slot = 0;
+
+    w = self->wheel = PyMem_New(Wheel, 1);
+    if (!w) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        assert(level == WHEEL_LEVELS - 1 || ((int64_t)wheel_buckets[level] << wheel_shift[level]) ==
+               ((int64_t)1 << wheel_shift[level + 1]));
+        w->buckets[level] = &w->slots[slot];
+        for (i = 0; i < wheel_buckets[level]; i++, slot++)
+            w->slots[slot].next = w->slots[slot].prev = &w->slots[slot];
+    }
+    Py_XINCREF(timer);
+    w->timer = timer;
+    w->ttl = ttl;
+    w->now = w->origin = 0;
+    w->expired = 0;
+    w->origin = wheel_now(w);
+    if (w->origin < 0) {
+        Py_CLEAR(w->timer);
+        PyMem_Free(w);
+        self->wheel = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+wheel_free(LRU *self)
+{
+    if (!self->wheel)
+        return;
+    Py_XDECREF(self->wheel->timer);
+    PyMem_Free(self->wheel);
+    self->wheel = NULL;
+}
+
+/* Converts a ttl argument in seconds, None meaning the default, to nanoseconds. */
+static int
+lru_parse_ttl(PyObject *arg, int64_t *ttl)
+{
+    double seconds;
+
+    if (!arg || arg == Py_None) {
+        *ttl = WHEEL_DEFAULT_TTL;
+        return 0;
+    }
+    seconds = PyFloat_AsDouble(arg);
+    if (seconds == -1.0 && PyErr_Occurred())
+        return -1;
+    if (!(seconds > 0)) {
+        PyErr_SetString(PyExc_ValueError, "ttl should be a positive number");
+        return -1;
+    }
+    *ttl = seconds * 1e9 < (double)WHEEL_MAX_TTL ? (int64_t)(seconds * 1e9) : WHEEL_MAX_TTL;
+    if (*ttl == 0)
+        *ttl = 1;
+    return 0;
+}
+
+static Py_ssize_t
+lru_length(LRU *self)
+{
+    if (self->table)
+        return self->table->used;
+    return PyDict_Size(self->dict);
+}
+
+/*
+ * Shrinking in steps. set_size(n, incremental=True) only moves the capacity, and every
+ * insert then evicts up to LRU_TRIM_STEP of the entries over it, on top of the one it
+ * makes room for, so that no single call holds the LRU for the whole excess. trim()
+ * evicts in one batch, as much as the caller allows.
+ */
+#define LRU_TRIM_STEP 64
+
+/* Evicts up to n entries from the LRU end. Returns the number evicted. */
+static Py_ssize_t
+lru_trim(LRU *self, Py_ssize_t n, int reason)
+{
+    Py_ssize_t evicted = 0;
+
+    lru_begin_batch(self);
+    while (evicted < n && lru_length(self) > 0) {
+        lru_delete_last(self, reason);
+        evicted++;
+    }
+    lru_end_batch(self, 0);
+    return evicted;
+}
+
+/* Evicts the next step of the entries over the size left by an incremental set_size. */
+static void
+lru_trim_step(LRU *self)
+{
+    Py_ssize_t excess = lru_length(self) - self->size;
+
+    if (excess > 0)
+        lru_trim(self, excess < LRU_TRIM_STEP ? excess : LRU_TRIM_STEP, EVICT_RESIZE);
+}
+
+static int
+table_contains(Table *t, PyObject *key)
+{
+    uint32_t index;
+    Py_hash_t hash = lru_hash(key);
+    if (hash == -1)
+        return -1;
+    return table_lookup(t, key, hash, &index, NULL);
+}
+
+static int
+lru_contains(LRU *self, PyObject *key)
+{
+    Node *node;
+    int64_t now;
+    if (self->table)
+        return table_contains(self->table, key);
+    if (!self->wheel && !self->stale && !self->l2)
+        return PyDict_Contains(self->dict, key);
+
+    if ((now = lru_now(self)) < 0)
+        return -1;
+    node = (Node *)PyDict_GetItemWithError(self->dict, key);
+    if (!node) {
+        if (PyErr_Occurred())
+            return -1;
+        return self->l2 ? l2_find(self, key, -1, 0, NULL, NULL) : 0;
+    }
+    if (NODE_STALE(self, node)) {
+        lru_evict_node(self, node, EVICT_EXPLICIT);
+        return 0;
+    }
+    if (lru_expired(node, now)) {
+        lru_evict_node(self, node, EVICT_EXPIRED);
+        return 0;
+    }
+    return 1;
+}
+
+static PyObject *
+LRU_contains_key_impl(LRU *self, PyObject *key)
+{
+    int res = lru_contains(self, key);
+    if (res < 0)
+        return NULL;
+    if (res) {
+        Py_RETURN_TRUE;
+    } else {
+        Py_RETURN_FALSE;
+    }
+}
+
+static int
+LRU_seq_contains_impl(LRU *self, PyObject *key)
+{
+    return lru_contains(self, key);
+}
+
+/* A lookup of key missed, for mrc and trace. The dict engine hashes key again. */
+static int
+lru_record_miss(LRU *self, PyObject *key)
+{
+    Py_hash_t hash = lru_hash(key);
+    if (hash == -1)
+        return -1;
+    if (self->mrc)
+        mrc_access(self->mrc, hash, 1);
+    if (self->trace)
+        trace_record(self->trace, hash, TRACE_MISS);
+    return 0;
+}
+
+/*
+ * Looks up key and promotes it to MRU. Returns a borrowed reference to the value, or NULL
+ * on a miss (without an exception set) or error. Hits and misses are counted.
+ */
+static PyObject *
+table_find(LRU *self, PyObject *key)
+{
+    Table *t = self->table;
+    uint32_t index;
+    int found;
+    Py_hash_t hash = lru_hash(key);
+    if (hash == -1)
+        return NULL;
+
+    found = table_lookup(t, key, hash, &index, NULL);
+    if (found == 0 && self->mrc)
+        mrc_access(self->mrc, hash, 1);
+    if (found == 0 && self->trace)
+        trace_record(self->trace, hash, TRACE_MISS);
+    if (found <= 0) {
+        if (found == 0)
+            self->misses++;
+        return NULL;
+    }
+
+    if (index != t->first) {
+        table_unlink(t, index);
+        table_link_at_head(t, index);
+    }
+
+    if (self->mrc)
+        mrc_access(self->mrc, hash, 1);
+    if (self->trace)
+        trace_record(self->trace, hash, TRACE_HIT);
+    self->hits++;
+    return t->entries[index].value;
+}
+
+/* lru_find found node expired or invalidated: drops it and counts a miss. */
+static void
+lru_find_dead(LRU *self, Node *node, int reason)
+{
+    if (self->mrc)
+        mrc_forget(self->mrc, node->hash, 1);
+    if (self->trace)
+        trace_record(self->trace, node->hash, TRACE_MISS);
+    lru_evict_node(self, node, reason);
+    self->misses++;
+}
+
+/* Returns a new reference to the value of key and promotes it, NULL on a miss. */
+static PyObject *
+lru_find(LRU *self, PyObject *key)
+{
+    Node *node;
+    int64_t now;
+    if (self->table) {
+        PyObject *value = table_find(self, key);
+        Py_XINCREF(value);
+        return value;
+    }
+
+    if ((now = lru_now(self)) < 0)
+        return NULL;
+    node = (Node *)PyDict_GetItemWithError(self->dict, key);
+    if (!node) {
+        if (!PyErr_Occurred()) {
+            self->misses++;
+            if (self->seg && seg_miss(self, key) < 0)
+                return NULL;
+            if ((self->mrc || self->trace) && lru_record_miss(self, key) < 0)
+                return NULL;
+            if (self->l2)
+                return l2_promote(self, key);
+        }
+        return NULL;
+    }
+
+    assert(Py_TYPE(node) == lru_state_of((PyObject *)self)->NodeType);
+
+    if (NODE_STALE(self, node)) {
+        lru_find_dead(self, node, EVICT_EXPLICIT);
+        return NULL;
+    }
+    if (lru_expired(node, now)) {
+        lru_find_dead(self, node, EVICT_EXPIRED);
+        return NULL;
+    }
+
+    if (self->policy == LRU_POLICY_CLOCK) {
+        node->flags |= NODE_REFERENCED;
+    } else if (self->seg) {
+        seg_touch(self, node);
+    } else if (node != self->first) {
+        /* We don't need to move the node when it's already self->first. */
+        lru_unlink_node(self, node);
+        lru_add_node_at_head(self, node);
+    }
+
+    if (self->mrc)
+        mrc_access(self->mrc, node->hash, 1);
+    if (self->trace)
+        trace_record(self->trace, node->hash, TRACE_HIT);
+    self->hits++;
+    return lru_node_value(self, node);
+}
+
+static void
+lru_set_key_error(PyObject *key)
+{
+    /* Same as dict: wrap tuples so that KeyError.args[0] is the key itself. */
+    PyObject *tup = PyTuple_Pack(1, key);
+    if (!tup)
+        return;
+    PyErr_SetObject(PyExc_KeyError, tup);
+    Py_DECREF(tup);
+}
+
+static PyObject *
+lru_subscript(LRU *self, register PyObject *key)
+{
+    PyObject *value = lru_find(self, key);
+    if (!value) {
+        if (!PyErr_Occurred())
+            lru_set_key_error(key);
+        return NULL;
+    }
+    return value;
+}
+
+static const char * const key_default_kwlist[] = {"key", "default", NULL};
+static const char * const get_kwlist[] = {"key", "default", "promote", NULL};
+
+static int lru_peek(LRU *self, PyObject *key, PyObject **pvalue);
+
+/* get(key, default, promote=False) and peek(key, default): no promotion, hit or miss. */
+static PyObject *
+lru_peek_default(LRU *self, PyObject *key, PyObject *default_obj)
+{
+    PyObject *result;
+    switch (lru_peek(self, key, &result)) {
+    case -1:
+        return NULL;
+    case 0:
+        result = default_obj ? default_obj : Py_None;
+        Py_INCREF(result);
+    }
+    return result;
+}
+
+/*
+ * Parses get(key, default=None, *, promote=True) into argv[3]. Returns 1 to promote, 0 not
+ * to and -1 on error.
+ */
+static int
+lru_parse_get(PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames, PyObject **argv)
+{
+    if (nargs > 2) {
+        PyErr_Format(PyExc_TypeError, "get() takes at most 2 positional arguments (%zd given)",
+                     nargs);
+        return -1;
+    }
+    if (lru_parse_args("get", args, nargs, kwnames, get_kwlist, 1, 3, argv) < 0)
+        return -1;
+    return argv[2] ? PyObject_IsTrue(argv[2]) : 1;
+}
+
+static PyObject *
+lru_get(LRU *self, PyObject *key, PyObject *default_obj)
+{
+    PyObject *result = lru_find(self, key);
+    if (result)
+        return result;
+    if (PyErr_Occurred())
+        return NULL;
+
+    METRIC_INC(self, get_misses);
+    if (!default_obj) {
+        Py_RETURN_NONE;
+    }
+
+    Py_INCREF(default_obj);
+    return default_obj;
+}
+
+static int
+table_ass_sub(LRU *self, PyObject *key, PyObject *value)
+{
+    Table *t = self->table;
+    uint32_t index;
+    size_t slot;
+    int found;
+    PyObject *old_key, *old_value;
+    Py_hash_t hash = lru_hash(key);
+    if (hash == -1)
+        return -1;
+
+    found = table_lookup(t, key, hash, &index, &slot);
+    if (found < 0)
+        return -1;
+
+    if (!value) {
+        if (!found) {
+            lru_set_key_error(key);
+            return -1;
+        }
+        if (self->mrc)
+            mrc_forget(self->mrc, hash, 0);
+        table_delete(t, index, &old_key, &old_value);
+        lru_notify(self, old_key, old_value, EVICT_EXPLICIT);
+        Py_DECREF(old_key);
+        Py_DECREF(old_value);
+        return 0;
+    }
+
+    if (self->mrc)
+        mrc_access(self->mrc, hash, 0);
+    if (self->trace)
+        trace_record(self->trace, hash, TRACE_SET);
+    if (found) {
+        METRIC_INC(self, updates);
+        old_value = t->entries[index].value;
+        Py_INCREF(value);
+        t->entries[index].value = value;
+        if (index != t->first) {
+            table_unlink(t, index);
+            table_link_at_head(t, index);
+        }
+        Py_DECREF(old_value);
+        return 0;
+    }
+
+    Py_INCREF(key);
+    Py_INCREF(value);
+    if (table_insert(t, key, hash, value, slot, self->size + 1) == TABLE_NIL) {
+        Py_DECREF(key);
+        Py_DECREF(value);
+        return -1;
+    }
+    METRIC_INC(self, inserts);
+    if (lru_length(self) > self->size)
+        lru_delete_last(self, EVICT_CAPACITY);
+    lru_trim_step(self);
+    return 0;
+}
+
+/*
+ * Weighted capacity, enabled by LRU(size, max_weight=n).
+ *
+ * Every entry then has a weight, given to set() or computed by weigher(key, value) (1
+ * without a weigher), and the LRU evicts until both the number of entries fits size and the
+ * total weight fits max_weight.
+ */
+static Py_ssize_t
+lru_weigh(LRU *self, PyObject *key, PyObject *value)
+{
+    PyObject *result;
+    Py_ssize_t weight;
+
+    if (!self->weigher)
+        return 1;
+    result = PyObject_CallFunctionObjArgs(self->weigher, key, value, NULL);
+    if (!result)
+        return -1;
+    weight = PyLong_AsSsize_t(result);
+    Py_DECREF(result);
+    if (weight < 0 && !PyErr_Occurred())
+        PyErr_SetString(PyExc_ValueError, "weigher returned a negative weight");
+    return weight;
+}
+
+/* Whether an entry of the given weight only fits after evicting. */
+static int
+lru_full(LRU *self, Py_ssize_t weight)
+{
+    return lru_length(self) >= self->size ||
+           (self->max_weight && self->weight > self->max_weight - weight);
+}
+
+/* Evicts until the total weight fits max_weight again, keeping at least one entry. */
+static void
+lru_trim_weight(LRU *self, Py_ssize_t max_weight, int reason)
+{
+    while (self->weight > max_weight && lru_length(self) > 1)
+        lru_delete_last(self, reason);
+}
+
+/*
+ * Removes key from the dict in a single probe, returning a new reference to its node or NULL
+ * with KeyError or another error set. The node is still linked.
+ */
+static Node *
+lru_pop_node(LRU *self, PyObject *key)
+{
+#if PY_VERSION_HEX >= 0x030D0000
+    PyObject *node;
+#endif
+    /* An empty dict doesn't hash the key, have unhashable keys raise TypeError still. */
+    if (PyDict_GET_SIZE(self->dict) == 0 && PyObject_Hash(key) == -1)
+        return NULL;
+#if PY_VERSION_HEX >= 0x030D0000
+    if (PyDict_Pop(self->dict, key, &node) == 0)
+        lru_set_key_error(key);
+    return (Node *)node;
+#else
+    return (Node *)_PyDict_Pop(self->dict, key, NULL);
+#endif
+}
+
+static int
+lru_delete(LRU *self, PyObject *key)
+{
+    Node *node = lru_pop_node(self, key);
+    if (!node) {
+        if (self->l2 && PyErr_ExceptionMatches(PyExc_KeyError)) {
+            PyErr_Clear();
+            switch (l2_find(self, key, -1, 1, NULL, NULL)) {
+            case 0:
+                lru_set_key_error(key);
+                return -1;
+            case 1:
+                return 0;
+            }
+        }
+        return -1;
+    }
+    assert(Py_TYPE(node) == lru_state_of((PyObject *)self)->NodeType);
+    if (self->mrc)
+        mrc_forget(self->mrc, node->hash, 0);
+    lru_remove_node(self, node);
+    lru_notify_node(self, node, EVICT_EXPLICIT);
+    lru_node_release(self, node);
+    return 0;
+}
+
+/*
+ * Sets or deletes (value == NULL) key. ttl is passed on to lru_set_ttl and weight is the
+ * weight of the entry with max_weight, -1 to have it computed by lru_weigh. The key is hashed
+ * once, setting a new key takes two probes with that hash and deleting one.
+ */
+static int
+lru_store(LRU *self, PyObject *key, PyObject *value, int64_t ttl, Py_ssize_t weight)
+{
+    int res = 0;
+    Node *node;
+    Py_hash_t hash;
+    int64_t now;
+    if (self->table)
+        return table_ass_sub(self, key, value);
+    if (!value) {
+        lru_sync(self);
+        return lru_delete(self, key);
+    }
+    if (ttl != WHEEL_DEFAULT_TTL && ttl != WHEEL_NO_TTL && !self->wheel &&
+        wheel_new(self, NULL, WHEEL_NO_TTL) < 0)
+        return -1;
+    if (self->max_weight) {
+        if (weight < 0 && (weight = lru_weigh(self, key, value)) < 0)
+            return -1;
+        if (weight > self->max_weight) {
+            PyErr_Format(PyExc_ValueError, "weight %zd is larger than max_weight %zd", weight,
+                         self->max_weight);
+            return -1;
+        }
+    } else {
+        weight = 0;
+    }
+
+    lru_sync(self);
+    hash = lru_hash(key);
+    if (hash == -1)
+        return -1;
+    if (self->stale)
+        lru_reclaim(self, LRU_RECLAIM_STEP);
+    lru_trim_step(self);
+    if (self->mrc)
+        mrc_access(self->mrc, hash, 0);
+    if (self->trace)
+        trace_record(self->trace, hash, TRACE_SET);
+    /* The new value replaces the one spilled to the disk tier. */
+    if (self->l2 && l2_find(self, key, hash, 1, NULL, NULL) < 0)
+        return -1;
+    if ((now = lru_now(self)) < 0)
+        return -1;
+    node = GET_NODE_HASH(self->dict, key, hash);
+    if (!node && PyErr_Occurred())
+        return -1;
+    Py_XINCREF(node);
+
+    if (!node && lru_full(self, weight)) {
+        /* Drop the expired entries first. Then evict, so that the freed node is recycled
+         * for this insert. */
+        if (self->wheel && wheel_advance(self, 0) < 0)
+            return -1;
+        if (lru_length(self) >= self->size)
+            lru_delete_last(self, EVICT_CAPACITY);
+        while (self->max_weight && lru_length(self) &&
+               self->weight > self->max_weight - weight)
+            lru_delete_last(self, EVICT_CAPACITY);
+        if (self->callback || self->wheel) {
+            /* The callback or a timer= callable may have inserted key itself. */
+            node = GET_NODE_HASH(self->dict, key, hash);
+            if (!node && PyErr_Occurred())
+                return -1;
+            Py_XINCREF(node);
+        }
+    }
+    if (node && self->rbuf) {
+        /* Lock free readers may be reading node->value, replace the whole node. */
+        Node *old = node;
+        node = lru_node_new(self, key, value);
+        if (!node) {
+            lru_node_release(self, old);
+            return -1;
+        }
+        node->hash = hash;
+        res = PUT_NODE_HASH(self->dict, key, node, hash);
+        if (res == 0) {
+            METRIC_INC(self, updates);
+            lru_remove_node(self, old);
+            lru_add_node_at_head(self, node);
+        } else {
+            lru_node_release(self, node);
+            node = NULL;
+        }
+        lru_node_release(self, old);
+    } else if (node) {
+        if (node->block) {
+            ArenaBlock *block = lru_arena_store(self, value);
+            if (!block) {
+                lru_node_release(self, node);
+                return -1;
+            }
+            arena_drop(node->block);
+            node->block = block;
+        } else {
+            Py_INCREF(value);
+            Py_DECREF(node->value);
+            node->value = value;
+        }
+        METRIC_INC(self, updates);
+        if (NODE_STALE(self, node)) {
+            node->generation = self->generation;
+            self->stale--;
+        }
+        self->weight += weight - node->weight;
+        node->weight = weight;
+
+        if (self->policy == LRU_POLICY_CLOCK) {
+            node->flags |= NODE_REFERENCED;
+        } else if (self->seg) {
+            seg_touch(self, node);
+        } else {
+            lru_unlink_node(self, node);
+            lru_add_node_at_head(self, node);
+        }
+
+        res = 0;
+    } else {
+        node = lru_node_new(self, key, value);
+        if (!node)
+            return -1;
+        node->hash = hash;
+        res = PUT_NODE_HASH(self->dict, key, node, hash);
+        if (res == 0) {
+            METRIC_INC(self, inserts);
+            if (self->seg)
+                seg_add(self, node);
+            else
+                lru_add_node_at_head(self, node);
+            node->weight = weight;
+            self->weight += weight;
+        }
+    }
+
+    if (res == 0 && self->wheel)
+        res = lru_set_ttl(self, node, ttl, now);
+    if (node)
+        lru_node_release(self, node);
+    /* An update may have made the entry heavier. */
+    if (res == 0 && self->max_weight)
+        lru_trim_weight(self, self->max_weight, EVICT_CAPACITY);
+    return res;
+}
+
+static int
+lru_ass_sub(LRU *self, PyObject *key, PyObject *value)
+{
+    return lru_store(self, key, value, WHEEL_DEFAULT_TTL, -1);
+}
+
+static PyObject *get_key(PyObject *key, PyObject *value);
+
+static PyObject *
+collect(LRU *self, PyObject * (*getterfunc)(PyObject *, PyObject *))
+{
+    register PyObject *v;
+    Node *curr;
+    Py_ssize_t i;
+    lru_sync(self);
+    v = PyList_New(lru_length(self));
+    if (v == NULL)
+        return NULL;
+    i = 0;
+
+    if (self->table) {
+        Table *t = self->table;
+        uint32_t index;
+        for (index = t->first; index != TABLE_NIL; index = t->entries[index].next)
+            PyList_SET_ITEM(v, i++, getterfunc(t->entries[index].key, t->entries[index].value));
+        assert(i == lru_length(self));
+        return v;
+    }
+
+    curr = self->first;
+    while (curr) {
+        /* Invalidated entries only wait to be reclaimed, lookups already miss them. */
+        if (NODE_STALE(self, curr)) {
+            curr = curr->next;
+            continue;
+        }
+        if (curr->block && getterfunc != get_key) {
+            PyObject *value = lru_block_value(self, curr->block);
+            if (!value) {
+                Py_DECREF(v);
+                return NULL;
+            }
+            PyList_SET_ITEM(v, i++, getterfunc(curr->key, value));
+            Py_DECREF(value);
+        } else {
+            PyList_SET_ITEM(v, i++, getterfunc(curr->key, curr->value));
+        }
+        curr = curr->next;
+    }
+    if (i < lru_length(self) && PyList_SetSlice(v, i, lru_length(self), NULL) < 0) {
+        Py_DECREF(v);
+        return NULL;
+    }
+    return v;
+}
+
+static PyObject *
+get_key(PyObject *key, PyObject *value)
+{
+    Py_INCREF(key);
+    return key;
+}
+
+/*
+ * Inserts every (key, value) pair of an iterable with setitem. Used by update() and
+ * set_many() of LRU and ShardedLRU.
+ */
+static int
+lru_update_from_pairs(PyObject *self, objobjargproc setitem, PyObject *pairs)
+{
+    PyObject *it, *item, *fast;
+    Py_ssize_t i;
+    int res = 0;
+
+    it = PyObject_GetIter(pairs);
+    if (!it)
+        return -1;
+
+    for (i = 0; res == 0 && (item = PyIter_Next(it)); i++) {
+        if (PyTuple_CheckExact(item) && PyTuple_GET_SIZE(item) == 2) {
+            res = setitem(self, PyTuple_GET_ITEM(item, 0), PyTuple_GET_ITEM(item, 1));
+        } else {
+            fast = PySequence_Fast(item, "");
+            if (!fast) {
+                if (PyErr_ExceptionMatches(PyExc_TypeError))
+                    PyErr_Format(PyExc_TypeError,
+                                 "cannot convert LRU update sequence element #%zd to a sequence", i);
+                res = -1;
+            } else if (PySequence_Fast_GET_SIZE(fast) != 2) {
+                PyErr_Format(PyExc_ValueError,
+                             "LRU update sequence element #%zd has length %zd; 2 is required",
+                             i, PySequence_Fast_GET_SIZE(fast));
+                res = -1;
+            } else {
+                res = setitem(self, PySequence_Fast_GET_ITEM(fast, 0),
+                              PySequence_Fast_GET_ITEM(fast, 1));
+            }
+            Py_XDECREF(fast);
+        }
+        Py_DECREF(item);
+    }
+    Py_DECREF(it);
+    if (res == 0 && PyErr_Occurred())
+        res = -1;
+    return res;
+}
+
+/* Inserts the items of a dict or of any object with keys() and __getitem__. */
+static int
+lru_update_from_mapping(PyObject *self, objobjargproc setitem, PyObject *mapping)
+{
+    PyObject *key, *value, *keys, *it;
+    Py_ssize_t pos = 0;
+    int res = 0;
+
+    if (PyDict_CheckExact(mapping)) {
+        while (res == 0 && PyDict_Next(mapping, &pos, &key, &value)) {
+            Py_INCREF(key);
+            Py_INCREF(value);
+            res = setitem(self, key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+        }
+        return res;
+    }
+
+    keys = PyMapping_Keys(mapping);
+    if (!keys)
+        return -1;
+    it = PyObject_GetIter(keys);
+    Py_DECREF(keys);
+    if (!it)
+        return -1;
+    while (res == 0 && (key = PyIter_Next(it))) {
+        value = PyObject_GetItem(mapping, key);
+        res = value ? setitem(self, key, value) : -1;
+        Py_XDECREF(value);
+        Py_DECREF(key);
+    }
+    Py_DECREF(it);
+    if (res == 0 && PyErr_Occurred())
+        res = -1;
+    return res;
+}
+
+static PyObject *
+LRU_update_impl(LRU *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *arg = NULL;
+    int res = 0;
+    int has_keys;
+
+    if (!PyArg_UnpackTuple(args, "update", 0, 1, &arg))
+        return NULL;
+
+    lru_begin_batch(self);
+    if (arg) {
+        has_keys = PyDict_CheckExact(arg) ? 1 : PyObject_HasAttrString(arg, "keys");
+        if (has_keys)
+            res = lru_update_from_mapping((PyObject *)self, (objobjargproc)lru_ass_sub, arg);
+        else
+            res = lru_update_from_pairs((PyObject *)self, (objobjargproc)lru_ass_sub, arg);
+    }
+    if (res == 0 && kwargs != NULL)
+        res = lru_update_from_mapping((PyObject *)self, (objobjargproc)lru_ass_sub, kwargs);
+    if (lru_end_batch(self, res) < 0)
+        return NULL;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_set_many_impl(LRU *self, PyObject *pairs)
+{
+    lru_begin_batch(self);
+    if (lru_end_batch(self, lru_update_from_pairs((PyObject *)self, (objobjargproc)lru_ass_sub, pairs)) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_get_many_impl(LRU *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *keys, *seq, *result, *value;
+    PyObject *default_obj = Py_None;
+    Py_ssize_t i, n;
+
+    static char *kwlist[] = {"keys", "default", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|O:get_many", kwlist, &keys, &default_obj))
+        return NULL;
+
+    seq = PySequence_Fast(keys, "get_many() argument must be iterable");
+    if (!seq)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    result = PyList_New(n);
+    if (!result) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        value = lru_find(self, PySequence_Fast_GET_ITEM(seq, i));
+        if (!value) {
+            if (PyErr_Occurred()) {
+                Py_DECREF(result);
+                Py_DECREF(seq);
+                return NULL;
+            }
+            METRIC_INC(self, get_misses);
+            value = default_obj;
+            Py_INCREF(value);
+        }
+        PyList_SET_ITEM(result, i, value);
+    }
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject *
+LRU_delete_many_impl(LRU *self, PyObject *keys)
+{
+    PyObject *seq, *key;
+    Py_ssize_t i, n, deleted = 0;
+
+    seq = PySequence_Fast(keys, "delete_many() argument must be iterable");
+    if (!seq)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    for (i = 0; i < n; i++) {
+        key = PySequence_Fast_GET_ITEM(seq, i);
+        if (lru_ass_sub(self, key, NULL) == 0) {
+            deleted++;
+        } else if (PyErr_ExceptionMatches(PyExc_KeyError)) {
+            PyErr_Clear();
+        } else {
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+    return PyLong_FromSsize_t(deleted);
+}
+
+static const char * const set_kwlist[] = {"key", "value", "ttl", "weight", "tags", NULL};
+
+/* Checks the tags argument of set(), returning a new reference to them as a sequence. */
+static PyObject *
+lru_parse_tags(LRU *self, PyObject *tags)
+{
+    PyObject *seq;
+    Py_ssize_t i;
+
+    if (self->table) {
+        PyErr_SetString(PyExc_ValueError, "tags are not supported with engine='compact'");
+        return NULL;
+    }
+    if (self->rbuf) {
+        PyErr_SetString(PyExc_ValueError, "tags can't be combined with read_buffer");
+        return NULL;
+    }
+    if (PyUnicode_Check(tags) || PyBytes_Check(tags)) {
+        PyErr_SetString(PyExc_TypeError, "tags should be an iterable of tags, not a string");
+        return NULL;
+    }
+    seq = PySequence_Fast(tags, "tags should be an iterable");
+    if (!seq)
+        return NULL;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        if (PyObject_Hash(PySequence_Fast_GET_ITEM(seq, i)) == -1) {
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+    return seq;
+}
+
+static PyObject *
+LRU_set_impl(LRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *argv[5] = {NULL, NULL, NULL, NULL, NULL};
+    PyObject *tags = NULL;
+    Node *node;
+    int64_t ttl;
+    Py_ssize_t weight = -1;
+    int res;
+
+    if (lru_parse_args("set", args, nargs, kwnames, set_kwlist, 2, 5, argv) < 0)
+        return NULL;
+    if (lru_parse_ttl(argv[2], &ttl) < 0)
+        return NULL;
+    if (argv[3] && argv[3] != Py_None) {
+        weight = PyLong_AsSsize_t(argv[3]);
+        if (weight == -1 && PyErr_Occurred())
+            return NULL;
+        if (weight < 0) {
+            PyErr_SetString(PyExc_ValueError, "weight should not be negative");
+            return NULL;
+        }
+        if (!self->max_weight) {
+            PyErr_SetString(PyExc_ValueError, "weight needs an LRU with max_weight");
+            return NULL;
+        }
+    }
+    if (self->table && ttl != WHEEL_DEFAULT_TTL) {
+        PyErr_SetString(PyExc_ValueError, "ttl is not supported with engine='compact'");
+        return NULL;
+    }
+    if (self->rbuf && ttl != WHEEL_DEFAULT_TTL) {
+        PyErr_SetString(PyExc_ValueError, "ttl can't be combined with read_buffer");
+        return NULL;
+    }
+    if (argv[4] && argv[4] != Py_None && !(tags = lru_parse_tags(self, argv[4])))
+        return NULL;
+    res = lru_store(self, argv[0], argv[1], ttl, weight);
+    if (res == 0 && tags) {
+        /* Unless a callback removed it already. */
+        node = (Node *)PyDict_GetItemWithError(self->dict, argv[0]);
+        if (node)
+            res = lru_set_tags(self, node, tags);
+        else if (PyErr_Occurred())
+            res = -1;
+    }
+    Py_XDECREF(tags);
+    if (res < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_invalidate_tag_impl(LRU *self, PyObject *tag)
+{
+    PyObject *capsule;
+    TagList *list;
+    Py_ssize_t removed = 0;
+
+    if (PyObject_Hash(tag) == -1)
+        return NULL;
+    capsule = self->tags ? PyDict_GetItemWithError(self->tags, tag) : NULL;
+    if (!capsule)
+        return PyErr_Occurred() ? NULL : PyLong_FromLong(0);
+    /* The list goes away with its last entry. */
+    Py_INCREF(capsule);
+    list = PyCapsule_GetPointer(capsule, TAG_CAPSULE);
+    lru_begin_batch(self);
+    while (list->head) {
+        Node *node = list->head->node;
+        if (!NODE_STALE(self, node))
+            removed++;
+        if (self->mrc)
+            mrc_forget(self->mrc, node->hash, 0);
+        lru_evict_node(self, node, EVICT_EXPLICIT);
+    }
+    Py_DECREF(capsule);
+    lru_end_batch(self, 0);
+    return PyLong_FromSsize_t(removed);
+}
+
+static PyObject *
+LRU_get_current_weight_impl(LRU *self)
+{
+    return PyLong_FromSsize_t(self->weight);
+}
+
+static PyObject *
+LRU_get_max_weight_impl(LRU *self)
+{
+    if (!self->max_weight)
+        Py_RETURN_NONE;
+    return PyLong_FromSsize_t(self->max_weight);
+}
+
+static PyObject *
+LRU_set_max_weight_impl(LRU *self, PyObject *arg)
+{
+    Py_ssize_t max_weight = PyLong_AsSsize_t(arg);
+    if (max_weight == -1 && PyErr_Occurred())
+        return NULL;
+    if (max_weight <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_weight should be a positive number");
+        return NULL;
+    }
+    if (!self->max_weight) {
+        PyErr_SetString(PyExc_ValueError, "the LRU was created without max_weight");
+        return NULL;
+    }
+    /* Unlike set_size this may leave one entry heavier than max_weight around. */
+    lru_trim_weight(self, max_weight, EVICT_RESIZE);
+    self->max_weight = max_weight;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_expire_impl(LRU *self)
+{
+    Py_ssize_t expired = 0;
+    if (self->wheel && (expired = wheel_advance(self, 1)) < 0)
+        return NULL;
+    return PyLong_FromSsize_t(expired);
+}
+
+static PyObject *
+LRU_setdefault_impl(LRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key;
+    PyObject *default_obj;
+    PyObject *result;
+
+    if (lru_check_positional("setdefault", nargs, 1, 2) < 0)
+        return NULL;
+    key = args[0];
+    default_obj = nargs > 1 ? args[1] : NULL;
+
+    result = lru_find(self, key);
+    if (result)
+        return result;
+    if (PyErr_Occurred())
+        return NULL;
+
+    if (!default_obj)
+        default_obj = Py_None;
+
+    if (lru_ass_sub(self, key, default_obj) != 0)
+        return NULL;
+
+    Py_INCREF(default_obj);
+    return default_obj;
+}
+
+/*
+ * pop() on the dict engine, in one probe. Counts as a hit followed by a delete, like the get
+ * and del it replaces.
+ */
+static PyObject *
+lru_pop(LRU *self, PyObject *key, PyObject *default_obj)
+{
+    PyObject *result;
+    Node *node;
+    int64_t now;
+
+    lru_sync(self);
+    if ((now = lru_now(self)) < 0)
+        return NULL;
+    node = lru_pop_node(self, key);
+    if (!node) {
+        if (!PyErr_ExceptionMatches(PyExc_KeyError))
+            return NULL;
+        PyErr_Clear();
+        self->misses++;
+        if (self->seg && seg_miss(self, key) < 0)
+            return NULL;
+        if ((self->mrc || self->trace) && lru_record_miss(self, key) < 0)
+            return NULL;
+        if (self->l2) {
+            switch (l2_find(self, key, -1, 1, &result, NULL)) {
+            case -1:
+                return NULL;
+            case 1:
+                return result;
+            }
+        }
+        if (!default_obj) {
+            lru_set_key_error(key);
+            return NULL;
+        }
+        Py_INCREF(default_obj);
+        return default_obj;
+    }
+    assert(Py_TYPE(node) == lru_state_of((PyObject *)self)->NodeType);
+
+    if (node->timer || NODE_STALE(self, node)) {
+        int stale = NODE_STALE(self, node);
+        if (stale || lru_expired(node, now)) {
+            if (self->mrc)
+                mrc_forget(self->mrc, node->hash, 1);
+            if (self->trace)
+                trace_record(self->trace, node->hash, TRACE_MISS);
+            lru_remove_node(self, node);
+            lru_notify_node(self, node, stale ? EVICT_EXPLICIT : EVICT_EXPIRED);
+            lru_node_release(self, node);
+            self->misses++;
+            if (!default_obj) {
+                lru_set_key_error(key);
+                return NULL;
+            }
+            Py_INCREF(default_obj);
+            return default_obj;
+        }
+    }
+
+    if (self->seg)
+        seg_touch(self, node);
+    if (self->mrc) {
+        mrc_access(self->mrc, node->hash, 1);
+        mrc_forget(self->mrc, node->hash, 0);
+    }
+    if (self->trace)
+        trace_record(self->trace, node->hash, TRACE_HIT);
+    self->hits++;
+    result = lru_node_value(self, node);
+    lru_remove_node(self, node);
+    if (result)
+        lru_notify_node(self, node, EVICT_EXPLICIT);
+    lru_node_release(self, node);
+    return result;
+}
+
+/* pop() on the compact engine, hashing key once and deleting the entry found by index. */
+static PyObject *
+table_pop(LRU *self, PyObject *key, PyObject *default_obj)
+{
+    Table *t = self->table;
+    uint32_t index;
+    int found;
+    PyObject *old_key, *value;
+    Py_hash_t hash = lru_hash(key);
+    if (hash == -1)
+        return NULL;
+
+    found = table_lookup(t, key, hash, &index, NULL);
+    if (found < 0)
+        return NULL;
+    if (self->mrc)
+        mrc_access(self->mrc, hash, 1);
+    if (self->trace)
+        trace_record(self->trace, hash, found ? TRACE_HIT : TRACE_MISS);
+    if (!found) {
+        self->misses++;
+        if (!default_obj) {
+            lru_set_key_error(key);
+            return NULL;
+        }
+        Py_INCREF(default_obj);
+        return default_obj;
+    }
+
+    self->hits++;
+    if (self->mrc)
+        mrc_forget(self->mrc, hash, 0);
+    table_delete(t, index, &old_key, &value);
+    lru_notify(self, old_key, value, EVICT_EXPLICIT);
+    Py_DECREF(old_key);
+    return value;
+}
+
+static PyObject *
+LRU_pop_impl(LRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *argv[2] = {NULL, NULL};
+    PyObject *key;
+    PyObject *default_obj;
+
+    if (lru_parse_args("pop", args, nargs, kwnames, key_default_kwlist, 1, 2, argv) < 0)
+        return NULL;
+    key = argv[0];
+    default_obj = argv[1];
+
+    if (self->table)
+        return table_pop(self, key, default_obj);
+    return lru_pop(self, key, default_obj);
+}
+
+static PyObject *
+get_item(PyObject *key, PyObject *value)
+{
+    PyObject *tuple = PyTuple_New(2);
+    Py_INCREF(key);
+    PyTuple_SET_ITEM(tuple, 0, key);
+    Py_INCREF(value);
+    PyTuple_SET_ITEM(tuple, 1, value);
+    return tuple;
+}
+
+static PyObject *
+table_peek(Table *t, uint32_t index)
+{
+    if (index == TABLE_NIL)
+        Py_RETURN_NONE;
+    return get_item(t->entries[index].key, t->entries[index].value);
+}
+
+static PyObject *
+node_item(LRU *self, Node *node)
+{
+    PyObject *value = lru_node_value(self, node), *tuple;
+    if (!value)
+        return NULL;
+    tuple = get_item(node->key, value);
+    Py_DECREF(value);
+    return tuple;
+}
+
+/*
+ * Sets *pnode to a borrowed reference to the node at the MRU end with first, else at the
+ * LRU end, dropping the invalidated and expired nodes found there on the way, or to NULL if
+ * there is none left. Returns -1 on error.
+ */
+static int
+lru_live_end(LRU *self, int first, Node **pnode)
+{
+    Node *node;
+    int64_t now;
+
+    lru_sync(self);
+    if ((now = lru_now(self)) < 0)
+        return -1;
+    while ((node = first ? self->first : self->last)) {
+        if (NODE_STALE(self, node))
+            lru_evict_node(self, node, EVICT_EXPLICIT);
+        else if (lru_expired(node, now))
+            lru_evict_node(self, node, EVICT_EXPIRED);
+        else
+            break;
+    }
+    *pnode = node;
+    return 0;
+}
+
+static PyObject *
+LRU_peek_first_item_impl(LRU *self)
+{
+    Node *node;
+    if (self->table)
+        return table_peek(self->table, self->table->first);
+    if (lru_live_end(self, 1, &node) < 0)
+        return NULL;
+    if (node)
+        return node_item(self, node);
+    else Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_peek_last_item_impl(LRU *self)
+{
+    Node *node;
+    if (self->table)
+        return table_peek(self->table, self->table->last);
+    if (lru_live_end(self, 0, &node) < 0)
+        return NULL;
+    if (node)
+        return node_item(self, node);
+    else Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_popitem_impl(LRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"least_recent", NULL};
+    PyObject *argv[1] = {NULL};
+    int pop_least_recent = 1;
+    PyObject *result;
+
+    if (lru_parse_args("popitem", args, nargs, kwnames, kwlist, 0, 1, argv) < 0)
+        return NULL;
+    if (argv[0]) {
+        pop_least_recent = PyObject_IsTrue(argv[0]);
+        if (pop_least_recent == -1)
+            return NULL;
+    }
+
+    if (pop_least_recent)
+        result = LRU_peek_last_item_impl(self);
+    else
+        result = LRU_peek_first_item_impl(self);
+    if (!result)
+        return NULL;
+    if (result == Py_None) {
+        Py_DECREF(result);
+        PyErr_SetString(PyExc_KeyError, "popitem(): LRU dict is empty");
+        return NULL;
+    }
+    if (lru_ass_sub(self, PyTuple_GET_ITEM(result, 0), NULL) < 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *
+LRU_keys_impl(LRU *self) {
+    return collect(self, get_key);
+}
+
+static PyObject *
+get_value(PyObject *key, PyObject *value)
+{
+    Py_INCREF(value);
+    return value;
+}
+
+static PyObject *
+LRU_values_impl(LRU *self)
+{
+    return collect(self, get_value);
+}
+
+static PyObject *
+LRU_set_callback_impl(LRU *self, PyObject *callback)
+{
+    return set_callback(self, callback);
+}
+
+static PyObject *
+LRU_items_impl(LRU *self)
+{
+    return collect(self, get_item);
+}
+
+static PyObject *
+LRU_set_size_impl(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"size", "incremental", NULL};
+    Py_ssize_t newSize;
+    int incremental = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|p:set_size", kwlist, &newSize,
+                                     &incremental)) {
+        return NULL;
+    }
+    if (newSize <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
+        return NULL;
+    }
+    if (self->table && newSize >= TABLE_MAX_ENTRIES) {
+        PyErr_SetString(PyExc_ValueError, "Size is too large for the compact engine");
+        return NULL;
+    }
+    if (self->seg && seg_resize(self, newSize) < 0)
+        return NULL;
+    while (!incremental && lru_length(self) > newSize) {
+        lru_delete_last(self, EVICT_RESIZE);
+    }
+    self->size = newSize;
+    if (!self->table) {
+        self->pool_max = lru_pool_limit(self);
+        lru_pool_trim(self, self->pool_max);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_clear_impl(LRU *self)
+{
+    Node *c = self->first;
+    /* Removed entries are reported to the callback only when it asked for reasons. */
+    int notify = self->callback && self->callback_reason;
+
+    if (self->metrics && !notify)
+        self->metrics->removals[EVICT_EXPLICIT] += lru_length(self);
+    if (self->trace)
+        trace_record(self->trace, 0, TRACE_CLEAR);
+    if (self->l2)
+        l2_clear(self->l2);
+
+    if (notify)
+        lru_begin_batch(self);
+    if (self->table) {
+        while (notify && self->table->last != TABLE_NIL) {
+            PyObject *key, *value;
+            table_delete(self->table, self->table->last, &key, &value);
+            lru_notify(self, key, value, EVICT_EXPLICIT);
+            Py_DECREF(key);
+            Py_DECREF(value);
+        }
+        if (notify && lru_end_batch(self, 0) < 0)
+            return NULL;
+        if (table_clear(self->table) < 0)
+            return NULL;
+        self->hits = 0;
+        self->misses = 0;
+        Py_RETURN_NONE;
+    }
+
+    if (self->rbuf) {
+        int i;
+        lru_drain_reads(self);
+        c = self->first;
+        for (i = 0; i < READ_STRIPES; i++) {
+            ReadStripe *stripe = &self->rbuf->stripes[i];
+            STRIPE_LOCK(stripe);
+            stripe->hits = stripe->misses = stripe->dropped = 0;
+            STRIPE_UNLOCK(stripe);
+        }
+        self->rbuf->batched = 0;
+    }
+
+    while (c) {
+        Node* n = c;
+        c = c->next;
+        lru_remove_node(self, n);
+        if (notify)
+            lru_notify_node(self, n, EVICT_EXPLICIT);
+    }
+    PyDict_Clear(self->dict);
+    if (notify && lru_end_batch(self, 0) < 0)
+        return NULL;
+
+    self->hits = 0;
+    self->misses = 0;
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+LRU_invalidate_all_impl(LRU *self)
+{
+    if (lru_check_invalidate(self, "invalidate_all()") < 0)
+        return NULL;
+    lru_invalidate(self);
+    Py_RETURN_NONE;
+}
+
+/* clear(budget=n): invalidates everything and drops at most n of the stale entries now. */
+static PyObject *
+lru_clear_budget(LRU *self, Py_ssize_t budget)
+{
+    lru_invalidate(self);
+    self->hits = 0;
+    self->misses = 0;
+    return PyLong_FromSsize_t(lru_reclaim(self, budget));
+}
+
+/*
+ * trim(n=None, budget_items=None): evicts up to n entries from the LRU end, by default the
+ * ones over the size, and at most budget_items of them. Without a callback the evicted
+ * (key, value) pairs are returned, otherwise they go to the callback and their number is.
+ */
+static PyObject *
+LRU_trim_impl(LRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"n", "budget_items", NULL};
+    PyObject *argv[2] = {NULL, NULL};
+    Py_ssize_t limits[2] = {-1, -1}, n;
+    PyObject *saved, *result;
+    int i;
+
+    if (lru_parse_args("trim", args, nargs, kwnames, kwlist, 0, 2, argv) < 0)
+        return NULL;
+    for (i = 0; i < 2; i++) {
+        if (!argv[i] || argv[i] == Py_None)
+            continue;
+        limits[i] = PyLong_AsSsize_t(argv[i]);
+        if (limits[i] == -1 && PyErr_Occurred())
+            return NULL;
+        if (limits[i] < 0) {
+            PyErr_Format(PyExc_ValueError, "%s should not be negative", kwlist[i]);
+            return NULL;
+        }
+    }
+
+    lru_sync(self);
+    n = limits[0] >= 0 ? limits[0] : lru_length(self) - self->size;
+    if (limits[1] >= 0 && n > limits[1])
+        n = limits[1];
+    if (n < 0)
+        n = 0;
+    if (self->callback)
+        return PyLong_FromSsize_t(lru_trim(self, n, EVICT_RESIZE));
+
+    saved = self->trimmed;
+    if (!(self->trimmed = PyList_New(0))) {
+        self->trimmed = saved;
+        return NULL;
+    }
+    lru_trim(self, n, EVICT_RESIZE);
+    result = self->trimmed;
+    self->trimmed = saved;
+    return result;
+}
+
+static PyObject *
+LRU_get_size_impl(LRU *self)
+{
+    return Py_BuildValue("i", self->size);
+}
+
+static void
+lru_stats(LRU *self, Py_ssize_t *phits, Py_ssize_t *pmisses)
+{
+    Py_ssize_t hits = self->hits, misses = self->misses;
+    int i;
+
+    if (self->rbuf) {
+        for (i = 0; i < READ_STRIPES; i++) {
+            ReadStripe *stripe = &self->rbuf->stripes[i];
+            STRIPE_LOCK(stripe);
+            hits += stripe->hits;
+            misses += stripe->misses;
+            STRIPE_UNLOCK(stripe);
+        }
+    }
+    *phits = hits;
+    *pmisses = misses;
+}
+
+static PyObject *
+LRU_get_stats_impl(LRU *self)
+{
+    Py_ssize_t hits, misses;
+    lru_stats(self, &hits, &misses);
+    return Py_BuildValue("nn", hits, misses);
+}
+
+static int
+lru_check_metrics(Metrics *m)
+{
+    if (!m) {
+        PyErr_SetString(PyExc_ValueError, "metrics are not enabled, see LRU(size, metrics=True)");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+LRU_get_metrics_impl(LRU *self)
+{
+    Py_ssize_t hits, misses;
+
+    if (lru_check_metrics(self->metrics) < 0)
+        return NULL;
+    lru_stats(self, &hits, &misses);
+    return metrics_export(self->metrics, hits, misses);
+}
+
+/*
+ * miss_ratio_curve() of the LRUs in shards, between which the keys are spread. Each one
+ * estimates its share of every size, in proportion to its mrc.
+ */
+static PyObject *
+mrc_curve(LRU **shards, Py_ssize_t nshards, PyObject *sizes)
+{
+    Py_ssize_t max_size = 0, n, i, j, *points = NULL;
+    double *hits = NULL, lookups = 0;
+    PyObject *seq = NULL, *result = NULL, *item;
+
+    for (i = 0; i < nshards; i++) {
+        if (!shards[i]->mrc) {
+            PyErr_SetString(PyExc_ValueError,
+                            "miss ratio curves are not enabled, see LRU(size, mrc=n)");
+            return NULL;
+        }
+        max_size += shards[i]->mrc->max_size;
+    }
+    if (!sizes || sizes == Py_None) {
+        n = max_size < MRC_POINTS ? max_size : MRC_POINTS;
+        if (!(points = PyMem_New(Py_ssize_t, n)))
+            goto nomemory;
+        for (j = 0; j < n; j++)
+            points[j] = (Py_ssize_t)((double)max_size * (j + 1) / n);
+    } else {
+        seq = PySequence_Fast(sizes, "sizes must be an iterable of sizes");
+        if (!seq)
+            return NULL;
+        n = PySequence_Fast_GET_SIZE(seq);
+        if (!(points = PyMem_New(Py_ssize_t, n ? n : 1)))
+            goto nomemory;
+        for (j = 0; j < n; j++) {
+            points[j] = PyLong_AsSsize_t(PySequence_Fast_GET_ITEM(seq, j));
+            if (points[j] == -1 && PyErr_Occurred())
+                goto done;
+            if (points[j] <= 0 || points[j] > max_size) {
+                PyErr_Format(PyExc_ValueError, "sizes should be between 1 and mrc (%zd)",
+                             max_size);
+                goto done;
+            }
+        }
+    }
+    if (!(hits = PyMem_Calloc(n ? n : 1, sizeof(double))))
+        goto nomemory;
+
+    for (i = 0; i < nshards; i++) {
+        LRU *shard = shards[i];
+        Py_BEGIN_CRITICAL_SECTION(shard);
+        lookups += (double)shard->mrc->lookups;
+        for (j = 0; j < n; j++)
+            hits[j] += mrc_hits(shard->mrc,
+                                (double)points[j] * shard->mrc->max_size / max_size);
+        Py_END_CRITICAL_SECTION();
+    }
+
+    if (!(result = PyList_New(n)))
+        goto done;
+    for (j = 0; j < n; j++) {
+        item = Py_BuildValue("nd", points[j], lookups ? 1 - hits[j] / lookups : 0.0);
+        if (!item) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, j, item);
+    }
+    goto done;
+
+nomemory:
+    PyErr_NoMemory();
+done:
+    Py_XDECREF(seq);
+    PyMem_Free(points);
+    PyMem_Free(hits);
+    return result;
+}
+
+static PyObject *
+LRU_miss_ratio_curve(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"sizes", NULL};
+    PyObject *sizes = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:miss_ratio_curve", kwlist, &sizes))
+        return NULL;
+    return mrc_curve(&self, 1, sizes);
+}
+
+static PyObject *
+LRU_flush_trace(LRU *self, PyObject *file)
+{
+    return trace_flush(&self, 1, file);
+}
+
+static PyObject *
+LRU_get_read_buffer_stats_impl(LRU *self)
+{
+    Py_ssize_t dropped = 0;
+    int i;
+
+    if (!self->rbuf)
+        return Py_BuildValue("nn", (Py_ssize_t)0, (Py_ssize_t)0);
+    for (i = 0; i < READ_STRIPES; i++) {
+        ReadStripe *stripe = &self->rbuf->stripes[i];
+        STRIPE_LOCK(stripe);
+        dropped += stripe->dropped;
+        STRIPE_UNLOCK(stripe);
+    }
+    return Py_BuildValue("nn", self->rbuf->batched, dropped);
+}
+
+static PyObject *
+LRU_get_arena_stats_impl(LRU *self)
+{
+    if (!self->arena)
+        return Py_BuildValue("nn", (Py_ssize_t)0, (Py_ssize_t)0);
+    return Py_BuildValue("nn", self->arena->reserved, self->arena->used);
+}
+
+
+/*
+ * Callback work left over by a call: the evictions queued with callback_batch and the first
+ * callback exception. It is detached from the LRU inside the critical section and run by
+ * lru_finish once the lock is released, so callbacks never see the LRU half updated.
+ */
+typedef struct {
+    PyObject *callback;
+    PyObject *pending;
+    PyObject *error[3];
+    LRU *metrics_owner;     /* the LRU to account the callback to with metrics=True */
+} Deferred;
+
+static inline void
+lru_take_deferred(LRU *self, Deferred *d)
+{
+    if (self->empty_tags)
+        lru_drop_empty_tags(self);
+    d->pending = NULL;
+    d->error[0] = self->callback_error[0];
+    if (self->callback_batch && self->pending && self->callback) {
+        d->pending = self->pending;
+        self->pending = NULL;
+    }
+    if (!d->pending && !d->error[0])
+        return;
+    d->callback = self->callback;
+    Py_XINCREF(d->callback);
+    d->metrics_owner = self->metrics ? self : NULL;
+    d->error[1] = self->callback_error[1];
+    d->error[2] = self->callback_error[2];
+    self->callback_error[0] = self->callback_error[1] = self->callback_error[2] = NULL;
+}
+
+/*
+ * Hands the queued evictions to the callback as one list. Returns -1 with the first callback
+ * exception set if the call itself succeeded (failed == 0), otherwise the error of the call
+ * wins and callback exceptions are reported as unraisable.
+ */
+static int
+lru_run_deferred(Deferred *d, int failed)
+{
+    PyObject *exc_type = NULL, *exc_value = NULL, *exc_tb = NULL, *result;
+    int status = 0;
+
+    if (failed)
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    if (d->pending) {
+        int64_t start = d->metrics_owner ? lru_monotonic_ns() : 0;
+        result = PyObject_CallFunctionObjArgs(d->callback, d->pending, NULL);
+        if (d->metrics_owner) {
+            /* The caller holds a reference to the LRU. */
+            Py_BEGIN_CRITICAL_SECTION(d->metrics_owner);
+            metrics_callback(d->metrics_owner->metrics, start);
+            Py_END_CRITICAL_SECTION();
+        }
+        if (result)
+            Py_DECREF(result);
+        else if (d->error[0])
+            PyErr_WriteUnraisable(d->callback);
+        else
+            PyErr_Fetch(&d->error[0], &d->error[1], &d->error[2]);
+        Py_DECREF(d->pending);
+    }
+    if (d->error[0]) {
+        PyErr_Restore(d->error[0], d->error[1], d->error[2]);
+        if (failed)
+            PyErr_WriteUnraisable(d->callback);
+        else
+            status = -1;
+    }
+    if (failed)
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+    Py_XDECREF(d->callback);
+    return status;
+}
+
+static inline PyObject *
+lru_finish(Deferred *d, PyObject *result)
+{
+    if ((d->pending || d->error[0]) && lru_run_deferred(d, result == NULL) < 0)
+        Py_CLEAR(result);
+    return result;
+}
+
+static inline int
+lru_finish_status(Deferred *d, int status)
+{
+    if ((d->pending || d->error[0]) && lru_run_deferred(d, status < 0) < 0)
+        return -1;
+    return status;
+}
+
+/*
+ * Every entry point runs inside a critical section on the LRU. On free-threaded builds this
+ * is a per object lock, elsewhere the GIL already serialises access and it compiles to nothing.
+ * The *_impl functions above expect the lock to be held. LRU_LOCKED_CALL also collects the
+ * deferred callback work, to be run with lru_finish after the lock is released.
+ */
+#define LRU_LOCKED(ret, call)                   \
+    do {                                        \
+        Py_BEGIN_CRITICAL_SECTION(self);        \
+        ret = call;                             \
+        Py_END_CRITICAL_SECTION();              \
+    } while (0)
+
+#define LRU_LOCKED_CALL(ret, call, deferred)    \
+    do {                                        \
+        Py_BEGIN_CRITICAL_SECTION(self);        \
+        ret = call;                             \
+        lru_take_deferred(self, &deferred);     \
+        Py_END_CRITICAL_SECTION();              \
+    } while (0)
+
+/* LRU_LOCKED_CALL for the operations sampled into the op latency histogram with metrics. */
+#define LRU_TIMED_CALL(ret, call, deferred, op)                 \
+    do {                                                        \
+        int64_t start_ = 0;                                     \
+        Py_BEGIN_CRITICAL_SECTION(self);                        \
+        if (self->metrics)                                      \
+            start_ = metrics_begin(self->metrics, op);          \
+        ret = call;                                             \
+        if (start_)                                             \
+            metrics_end(self->metrics, op, start_);             \
+        lru_take_deferred(self, &deferred);                     \
+        Py_END_CRITICAL_SECTION();                              \
+    } while (0)
+
+#define LRU_LOCKED_NOARGS(name)                                             \
+    static PyObject *                                                       \
+    name(LRU *self, PyObject *Py_UNUSED(ignored))                           \
+    {                                                                       \
+        PyObject *result;                                                   \
+        Deferred deferred;                                                  \
+        LRU_LOCKED_CALL(result, name##_impl(self), deferred);               \
+        return lru_finish(&deferred, result);                               \
+    }
+
+#define LRU_LOCKED_O(name)                                                  \
+    static PyObject *                                                       \
+    name(LRU *self, PyObject *arg)                                          \
+    {                                                                       \
+        PyObject *result;                                                   \
+        Deferred deferred;                                                  \
+        LRU_LOCKED_CALL(result, name##_impl(self, arg), deferred);          \
+        return lru_finish(&deferred, result);                               \
+    }
+
+#define LRU_LOCKED_KEYWORDS(name)                                           \
+    static PyObject *                                                       \
+    name(LRU *self, PyObject *args, PyObject *kwds)                         \
+    {                                                                       \
+        PyObject *result;                                                   \
+        Deferred deferred;                                                  \
+        LRU_LOCKED_CALL(result, name##_impl(self, args, kwds), deferred);   \
+        return lru_finish(&deferred, result);                               \
+    }
+
+#define LRU_LOCKED_FASTCALL(name)                                           \
+    static PyObject *                                                       \
+    name(LRU *self, PyObject *const *args, Py_ssize_t nargs)                \
+    {                                                                       \
+        PyObject *result;                                                   \
+        Deferred deferred;                                                  \
+        LRU_LOCKED_CALL(result, name##_impl(self, args, nargs), deferred);  \
+        return lru_finish(&deferred, result);                               \
+    }
+
+#define LRU_LOCKED_FASTCALL_KEYWORDS(name)                                  \
+    static PyObject *                                                       \
+    name(LRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) \
+    {                                                                       \
+        PyObject *result;                                                   \
+        Deferred deferred;                                                  \
+        LRU_LOCKED_CALL(result, name##_impl(self, args, nargs, kwnames), deferred); \
+        return lru_finish(&deferred, result);                               \
+    }
+
+#define LRU_TIMED_FASTCALL_KEYWORDS(name, op)                               \
+    static PyObject *                                                       \
+    name(LRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames) \
+    {                                                                       \
+        PyObject *result;                                                   \
+        Deferred deferred;                                                  \
+        LRU_TIMED_CALL(result, name##_impl(self, args, nargs, kwnames), deferred, op); \
+        return lru_finish(&deferred, result);                               \
+    }
+
+LRU_LOCKED_O(LRU_contains_key)
+LRU_LOCKED_NOARGS(LRU_keys)
+LRU_LOCKED_NOARGS(LRU_values)
+LRU_LOCKED_NOARGS(LRU_items)
+LRU_LOCKED_NOARGS(LRU_get_read_buffer_stats)
+LRU_LOCKED_NOARGS(LRU_get_arena_stats)
+LRU_LOCKED_FASTCALL(LRU_setdefault)
+LRU_TIMED_FASTCALL_KEYWORDS(LRU_set, METRIC_SET)
+LRU_LOCKED_NOARGS(LRU_expire)
+LRU_LOCKED_NOARGS(LRU_get_current_weight)
+LRU_LOCKED_NOARGS(LRU_get_max_weight)
+LRU_LOCKED_O(LRU_set_max_weight)
+LRU_TIMED_FASTCALL_KEYWORDS(LRU_pop, METRIC_DELETE)
+LRU_LOCKED_FASTCALL_KEYWORDS(LRU_popitem)
+LRU_LOCKED_FASTCALL_KEYWORDS(LRU_trim)
+LRU_LOCKED_KEYWORDS(LRU_set_size)
+LRU_LOCKED_NOARGS(LRU_get_size)
+LRU_LOCKED_NOARGS(LRU_invalidate_all)
+LRU_LOCKED_O(LRU_invalidate_tag)
+LRU_LOCKED_NOARGS(LRU_get_stats)
+LRU_LOCKED_NOARGS(LRU_get_metrics)
+LRU_LOCKED_NOARGS(LRU_peek_first_item)
+LRU_LOCKED_NOARGS(LRU_peek_last_item)
+LRU_LOCKED_KEYWORDS(LRU_update)
+LRU_LOCKED_KEYWORDS(LRU_get_many)
+LRU_LOCKED_O(LRU_set_many)
+LRU_LOCKED_O(LRU_delete_many)
+LRU_LOCKED_O(LRU_set_callback)
+
+static PyObject *
+LRU_clear(LRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"budget", NULL};
+    PyObject *argv[1] = {NULL};
+    PyObject *result;
+    Py_ssize_t budget = -1;
+    Deferred deferred;
+
+    if (lru_parse_args("clear", args, nargs, kwnames, kwlist, 0, 1, argv) < 0)
+        return NULL;
+    if (argv[0] && argv[0] != Py_None) {
+        budget = PyLong_AsSsize_t(argv[0]);
+        if (budget == -1 && PyErr_Occurred())
+            return NULL;
+        if (budget < 0) {
+            PyErr_SetString(PyExc_ValueError, "budget should not be negative");
+            return NULL;
+        }
+        if (lru_check_invalidate(self, "clear(budget=...)") < 0)
+            return NULL;
+    }
+    if (budget < 0)
+        LRU_LOCKED_CALL(result, LRU_clear_impl(self), deferred);
+    else
+        LRU_LOCKED_CALL(result, lru_clear_budget(self, budget), deferred);
+    return lru_finish(&deferred, result);
+}
+
+static Py_ssize_t
+LRU_length(LRU *self)
+{
+    Py_ssize_t result;
+    LRU_LOCKED(result, lru_length(self));
+    return result;
+}
+
+static PyObject *
+LRU_subscript(LRU *self, PyObject *key)
+{
+    PyObject *result;
+    Deferred deferred;
+
+    if (self->rbuf) {
+        result = lru_buffered_find(self, key);
+        if (!result && !PyErr_Occurred())
+            lru_set_key_error(key);
+        return result;
+    }
+    LRU_TIMED_CALL(result, lru_subscript(self, key), deferred, METRIC_GET);
+    return lru_finish(&deferred, result);
+}
+
+/* get() with its arguments parsed, for LRU and ShardedLRU. */
+static PyObject *
+lru_get_call(LRU *self, PyObject *key, PyObject *default_obj, int promote)
+{
+    PyObject *result;
+    Deferred deferred;
+
+    if (!promote) {
+        LRU_LOCKED(result, lru_peek_default(self, key, default_obj));
+        return result;
+    }
+    if (!self->rbuf) {
+        LRU_TIMED_CALL(result, lru_get(self, key, default_obj), deferred, METRIC_GET);
+        return lru_finish(&deferred, result);
+    }
+    result = lru_buffered_find(self, key);
+    if (result || PyErr_Occurred())
+        return result;
+    result = default_obj ? default_obj : Py_None;
+    Py_INCREF(result);
+    return result;
+}
+
+static PyObject *
+LRU_get(LRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *argv[3] = {NULL, NULL, NULL};
+    int promote;
+
+    if ((promote = lru_parse_get(args, nargs, kwnames, argv)) < 0)
+        return NULL;
+    return lru_get_call(self, argv[0], argv[1], promote);
+}
+
+static PyObject *
+LRU_peek(LRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *argv[2] = {NULL, NULL};
+    PyObject *result;
+
+    if (lru_parse_args("peek", args, nargs, kwnames, key_default_kwlist, 1, 2, argv) < 0)
+        return NULL;
+    LRU_LOCKED(result, lru_peek_default(self, argv[0], argv[1]));
+    return result;
+}
+
+/* Whether key is in the LRU, like peek(). Takes the lock. */
+static int
+lru_has(LRU *self, PyObject *key)
+{
+    int found;
+    LRU_LOCKED(found, lru_peek(self, key, NULL));
+    return found;
+}
+
+static PyObject *
+LRU_contains_many_impl(LRU *self, PyObject *keys)
+{
+    PyObject *seq, *result, *value;
+    Py_ssize_t i, n;
+    int found;
+
+    seq = PySequence_Fast(keys, "contains_many() argument must be iterable");
+    if (!seq)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    result = PyList_New(n);
+    if (!result) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        found = lru_peek(self, PySequence_Fast_GET_ITEM(seq, i), NULL);
+        if (found < 0) {
+            Py_DECREF(result);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        value = found ? Py_True : Py_False;
+        Py_INCREF(value);
+        PyList_SET_ITEM(result, i, value);
+    }
+    Py_DECREF(seq);
+    return result;
+}
+
+LRU_LOCKED_O(LRU_contains_many)
+
+static int
+LRU_ass_sub(LRU *self, PyObject *key, PyObject *value)
+{
+    int result;
+    Deferred deferred;
+    LRU_TIMED_CALL(result, lru_ass_sub(self, key, value), deferred,
+                   value ? METRIC_SET : METRIC_DELETE);
+    return lru_finish_status(&deferred, result);
+}
+
+static int
+LRU_seq_contains(LRU *self, PyObject *key)
+{
+    int result;
+    Deferred deferred;
+    LRU_LOCKED_CALL(result, LRU_seq_contains_impl(self, key), deferred);
+    return lru_finish_status(&deferred, result);
+}
+
+/*
+ * get_or_load(key, loader) is single flight: the first caller missing key registers a
+ * Flight in self->inflight and calls loader(key) without the lock. Callers missing the same
+ * key meanwhile wait on the flight's lock, which the loader holds until its result is in,
+ * and return that result or raise the same exception. The loaded value is set through
+ * lru_ass_sub and the flight removed under the lock before it completes, so later callers
+ * find the value or start a new load.
+ */
+typedef struct {
+    PyThread_type_lock lock;    /* held until the result is in */
+    unsigned long owner;        /* thread of the loader */
+    PyObject *value;            /* the loaded value, NULL if it failed */
+    PyObject *exc[3];           /* why it failed, PyErr_Fetch style */
+} Flight;
+
+#define FLIGHT_CAPSULE "lru._flight"
+
+static void
+flight_free(PyObject *capsule)
+{
+    Flight *f = PyCapsule_GetPointer(capsule, FLIGHT_CAPSULE);
+    PyThread_free_lock(f->lock);
+    Py_XDECREF(f->value);
+    Py_XDECREF(f->exc[0]);
+    Py_XDECREF(f->exc[1]);
+    Py_XDECREF(f->exc[2]);
+    PyMem_Free(f);
+}
+
+static PyObject *
+flight_new(void)
+{
+    PyObject *capsule;
+    Flight *f = PyMem_Calloc(1, sizeof(Flight));
+
+    if (!f || !(f->lock = PyThread_allocate_lock())) {
+        PyMem_Free(f);
+        return PyErr_NoMemory();
+    }
+    PyThread_acquire_lock(f->lock, WAIT_LOCK);
+    f->owner = PyThread_get_thread_ident();
+    capsule = PyCapsule_New(f, FLIGHT_CAPSULE, flight_free);
+    if (!capsule) {
+        PyThread_release_lock(f->lock);
+        PyThread_free_lock(f->lock);
+        PyMem_Free(f);
+    }
+    return capsule;
+}
+
+/*
+ * Returns a new reference to the value of key, or NULL with *pflight set to a new reference
+ * to the flight of key and *powner telling whether this caller is to load it.
+ */
+static PyObject *
+lru_load_begin(LRU *self, PyObject *key, PyObject **pflight, int *powner)
+{
+    PyObject *value, *flight;
+
+    lru_sync(self);
+    value = lru_find(self, key);
+    if (value)
+        return value;
+    if (PyErr_Occurred())
+        return NULL;
+    if (!self->inflight && !(self->inflight = PyDict_New()))
+        return NULL;
+    flight = PyDict_GetItemWithError(self->inflight, key);
+    if (flight) {
+        Py_INCREF(flight);
+        *powner = 0;
+    } else if (PyErr_Occurred() || !(flight = flight_new())) {
+        return NULL;
+    } else if (PyDict_SetItem(self->inflight, key, flight) < 0) {
+        PyThread_release_lock(((Flight *)PyCapsule_GetPointer(flight, FLIGHT_CAPSULE))->lock);
+        Py_DECREF(flight);
+        return NULL;
+    } else {
+        *powner = 1;
+    }
+    *pflight = flight;
+    return NULL;
+}
+
+/* Sets the loaded value, NULL if the loader failed, and retires the flight. */
+static int
+lru_load_end(LRU *self, PyObject *key, PyObject *flight, PyObject *value)
+{
+    int status = value ? lru_ass_sub(self, key, value) : -1;
+    PyObject *exc[3];
+
+    PyErr_Fetch(&exc[0], &exc[1], &exc[2]);
+    if (PyDict_GetItemWithError(self->inflight, key) == flight) {
+        if (PyDict_DelItem(self->inflight, key) < 0)
+            PyErr_WriteUnraisable((PyObject *)self);
+    } else if (PyErr_Occurred()) {
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+    PyErr_Restore(exc[0], exc[1], exc[2]);
+    return status;
+}
+
+/* Waits for the loader of flight, then returns its value or raises its exception. */
+static PyObject *
+flight_wait(Flight *f)
+{
+    PyLockStatus r;
+
+    if (f->owner == PyThread_get_thread_ident()) {
+        PyErr_SetString(PyExc_RuntimeError, "get_or_load() called by the loader of the same key");
+        return NULL;
+    }
+    for (;;) {
+        Py_BEGIN_ALLOW_THREADS
+        r = PyThread_acquire_lock_timed(f->lock, -1, 1);
+        Py_END_ALLOW_THREADS
+        if (r == PY_LOCK_ACQUIRED)
+            break;
+        if (PyErr_CheckSignals() < 0)
+            return NULL;
+    }
+    /* Pass the lock on to the next waiter. */
+    PyThread_release_lock(f->lock);
+    if (f->value) {
+        Py_INCREF(f->value);
+        return f->value;
+    }
+    Py_XINCREF(f->exc[0]);
+    Py_XINCREF(f->exc[1]);
+    Py_XINCREF(f->exc[2]);
+    PyErr_Restore(f->exc[0], f->exc[1], f->exc[2]);
+    return NULL;
+}
+
+static PyObject *
+LRU_get_or_load(LRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key, *loader, *value, *flight = NULL;
+    Flight *f;
+    Deferred deferred;
+    int owner = 0, status;
+
+    if (lru_check_positional("get_or_load", nargs, 2, 2) < 0)
+        return NULL;
+    key = args[0];
+    loader = args[1];
+    if (!PyCallable_Check(loader)) {
+        PyErr_SetString(PyExc_TypeError, "loader must be callable");
+        return NULL;
+    }
+
+    LRU_TIMED_CALL(value, lru_load_begin(self, key, &flight, &owner), deferred, METRIC_GET);
+    value = lru_finish(&deferred, value);
+    if (value || !flight) {
+        if (value && flight) {
+            Py_DECREF(flight);
+        }
+        return value;
+    }
+    f = PyCapsule_GetPointer(flight, FLIGHT_CAPSULE);
+    if (!owner) {
+        value = flight_wait(f);
+        Py_DECREF(flight);
+        return value;
+    }
+
+    value = PyObject_CallFunctionObjArgs(loader, key, NULL);
+    LRU_TIMED_CALL(status, lru_load_end(self, key, flight, value), deferred, METRIC_SET);
+    status = lru_finish_status(&deferred, status);
+    if (status < 0) {
+        Py_CLEAR(value);
+        PyErr_Fetch(&f->exc[0], &f->exc[1], &f->exc[2]);
+        PyErr_NormalizeException(&f->exc[0], &f->exc[1], &f->exc[2]);
+        Py_XINCREF(f->exc[0]);
+        Py_XINCREF(f->exc[1]);
+        Py_XINCREF(f->exc[2]);
+        PyErr_Restore(f->exc[0], f->exc[1], f->exc[2]);
+    } else {
+        Py_INCREF(value);
+        f->value = value;
+    }
+    PyThread_release_lock(f->lock);
+    Py_DECREF(flight);
+    return value;
+}
+
+/*
+ * Iterators and views walk the LRU list in place instead of copying it like keys() does.
+ * The LRU list is reordered by lookups as well as by writes, so any change of the list
+ * while iterating raises a RuntimeError, caught through the version counter of the LRU or
+ * of its table. A ShardedLRU is walked one segment after the other.
+ */
+
+enum {
+    ITER_KEYS,
+    ITER_VALUES,
+    ITER_ITEMS,
+};
+
+static const char * const iter_kind_names[] = {"keys", "values", "items"};
+
+/* What an iterator or view walks: the segments of an LRU (one) or a ShardedLRU. */
+typedef struct {
+    Py_ssize_t (*count)(PyObject *owner);
+    LRU *(*shard)(PyObject *owner, Py_ssize_t i);
+    LRU *(*shard_of)(PyObject *owner, PyObject *key);   /* segment holding key, NULL on error */
+} IterSource;
+
+static Py_ssize_t
+lru_source_count(PyObject *owner)
+{
+    return 1;
+}
+
+static LRU *
+lru_source_shard(PyObject *owner, Py_ssize_t i)
+{
+    return (LRU *)owner;
+}
+
+static LRU *
+lru_source_shard_of(PyObject *owner, PyObject *key)
+{
+    return (LRU *)owner;
+}
+
+static const IterSource lru_source = {lru_source_count, lru_source_shard, lru_source_shard_of};
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *owner;            /* LRU or ShardedLRU, NULL once exhausted */
+    const IterSource *source;
+    LRU *lru;                   /* segment being walked, borrowed from owner */
+    Py_ssize_t shard;           /* index of lru in owner */
+    Py_ssize_t nshards;
+    Node *node;                 /* next node of the dict engine, a strong reference */
+    uint32_t index;             /* next entry of the compact engine */
+    size_t version;             /* version of lru when the walk started */
+    int kind;                   /* ITER_* */
+    int reverse;
+} LRUIter;
+
+static size_t
+lru_version(LRU *self)
+{
+    return self->table ? self->table->version : self->version;
+}
+
+/* Positions the iterator on the first entry of segment it->shard. Expects its lock held. */
+static void
+lru_iter_start(LRUIter *it)
+{
+    LRU *self = it->lru;
+
+    lru_sync(self);
+    it->version = lru_version(self);
+    if (self->table) {
+        it->index = it->reverse ? self->table->last : self->table->first;
+    } else {
+        it->node = it->reverse ? self->last : self->first;
+        Py_XINCREF(it->node);
+    }
+}
+
+static int
+lru_iter_at_end(LRUIter *it)
+{
+    return it->lru->table ? it->index == TABLE_NIL : it->node == NULL;
+}
+
+/* Returns the next item of the current segment, NULL at its end or on error. */
+static PyObject *
+lru_iter_step(LRUIter *it)
+{
+    LRU *self = it->lru;
+    PyObject *key, *value;
+    Node *node;
+
+    if (lru_version(self) != it->version) {
+        PyErr_SetString(PyExc_RuntimeError, "LRU changed during iteration");
+        return NULL;
+    }
+    if (self->table) {
+        Entry *e = &self->table->entries[it->index];
+        key = e->key;
+        value = e->value;
+        it->index = it->reverse ? e->prev : e->next;
+        node = NULL;
+    } else {
+        /* Invalidated nodes are skipped, as by keys() and items(). */
+        while (NODE_STALE(self, it->node)) {
+            node = it->node;
+            it->node = it->reverse ? node->prev : node->next;
+            Py_XINCREF(it->node);
+            Py_DECREF(node);
+            if (!it->node)
+                return NULL;
+        }
+        node = it->node;
+        key = node->key;
+        value = node->value;
+        it->node = it->reverse ? node->prev : node->next;
+        Py_XINCREF(it->node);
+        if (node->block && it->kind != ITER_KEYS) {
+            value = lru_block_value(self, node->block);
+            if (value && it->kind != ITER_VALUES) {
+                key = get_item(key, value);
+                Py_DECREF(value);
+                value = key;
+            }
+            Py_DECREF(node);
+            return value;
+        }
+    }
+    switch (it->kind) {
+    case ITER_KEYS:
+        Py_INCREF(key);
+        break;
+    case ITER_VALUES:
+        Py_INCREF(value);
+        key = value;
+        break;
+    default:
+        key = get_item(key, value);
+    }
+    Py_XDECREF(node);
+    return key;
+}
+
+static PyObject *
+lru_iter_next(LRUIter *it)
+{
+    PyObject *result = NULL;
+
+    while (it->owner) {
+        Py_BEGIN_CRITICAL_SECTION(it->lru);
+        if (!lru_iter_at_end(it))
+            result = lru_iter_step(it);
+        Py_END_CRITICAL_SECTION();
+        if (result || PyErr_Occurred())
+            return result;
+
+        /* This segment is done, move on to the next one. */
+        if (++it->shard >= it->nshards) {
+            Py_CLEAR(it->owner);
+            return NULL;
+        }
+        it->lru = it->source->shard(it->owner, it->reverse ? it->nshards - 1 - it->shard : it->shard);
+        Py_BEGIN_CRITICAL_SECTION(it->lru);
+        lru_iter_start(it);
+        Py_END_CRITICAL_SECTION();
+    }
+    return NULL;
+}
+
+static PyObject *
+lru_iter_new(PyObject *owner, const IterSource *source, int kind, int reverse)
+{
+    LRUIter *it = PyObject_New(LRUIter, lru_state_of(owner)->LRUIterType);
+
+    if (!it)
+        return NULL;
+    Py_INCREF(owner);
+    it->owner = owner;
+    it->source = source;
+    it->nshards = source->count(owner);
+    it->shard = 0;
+    it->kind = kind;
+    it->reverse = reverse;
+    it->node = NULL;
+    it->index = TABLE_NIL;
+    it->lru = source->shard(owner, reverse ? it->nshards - 1 : 0);
+    Py_BEGIN_CRITICAL_SECTION(it->lru);
+    lru_iter_start(it);
+    Py_END_CRITICAL_SECTION();
+    return (PyObject *)it;
+}
+
+static void
+lru_iter_dealloc(LRUIter *it)
+{
+    PyTypeObject *tp = Py_TYPE(it);
+
+    /* The node may be the last reference to an arena block, freed with the LRU locked. */
+    if (it->node && it->node->block) {
+        Py_BEGIN_CRITICAL_SECTION(it->lru);
+        Py_CLEAR(it->node);
+        Py_END_CRITICAL_SECTION();
+    }
+    Py_XDECREF(it->node);
+    Py_XDECREF(it->owner);
+    PyObject_Del(it);
+    Py_DECREF(tp);
+}
+
+static PyType_Slot lru_iter_slots[] = {
+    {Py_tp_dealloc, lru_iter_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, lru_iter_next},
+    {0, NULL},
+};
+
+static PyType_Spec lru_iter_spec = {
+    "_lru.LRUIterator", sizeof(LRUIter), 0, LRU_TPFLAGS_INTERNAL, lru_iter_slots,
+};
+
+/*
+ * View objects of keys, values or items. They hold no copy of the entries, len() and
+ * iteration always reflect the current content.
+ */
+typedef struct {
+    PyObject_HEAD
+    PyObject *owner;
+    const IterSource *source;
+    int kind;
+} LRUView;
+
+static PyObject *
+lru_view_new(PyObject *owner, const IterSource *source, int kind)
+{
+    LRUView *view = PyObject_New(LRUView, lru_state_of(owner)->LRUViewType);
+
+    if (!view)
+        return NULL;
+    Py_INCREF(owner);
+    view->owner = owner;
+    view->source = source;
+    view->kind = kind;
+    return (PyObject *)view;
+}
+
+static void
+lru_view_dealloc(LRUView *view)
+{
+    PyTypeObject *tp = Py_TYPE(view);
+
+    Py_DECREF(view->owner);
+    PyObject_Del(view);
+    Py_DECREF(tp);
+}
+
+/* The length of the owner, without the invalidated entries the iterators skip. */
+static Py_ssize_t
+lru_view_len(LRUView *view)
+{
+    Py_ssize_t i, n, len = PyObject_Size(view->owner);
+
+    if (len < 0)
+        return -1;
+    n = view->source->count(view->owner);
+    for (i = 0; i < n; i++) {
+        LRU *lru = view->source->shard(view->owner, i);
+        Py_BEGIN_CRITICAL_SECTION(lru);
+        len -= lru->stale;
+        Py_END_CRITICAL_SECTION();
+    }
+    return len;
+}
+
+static PyObject *
+lru_view_iter(LRUView *view)
+{
+    return lru_iter_new(view->owner, view->source, view->kind, 0);
+}
+
+static PyObject *
+lru_view_reversed(LRUView *view, PyObject *Py_UNUSED(ignored))
+{
+    return lru_iter_new(view->owner, view->source, view->kind, 1);
+}
+
+/*
+ * Looks key up without promoting it or counting a hit. Returns 1 if found, with a new
+ * reference to its value in *pvalue unless pvalue is NULL, 0 if missing and -1 on error.
+ */
+static int
+lru_peek(LRU *self, PyObject *key, PyObject **pvalue)
+{
+    Node *node;
+    int64_t now;
+
+    if (self->table) {
+        uint32_t index;
+        Py_hash_t hash = lru_hash(key);
+        int found;
+        if (hash == -1)
+            return -1;
+        found = table_lookup(self->table, key, hash, &index, NULL);
+        if (found > 0 && pvalue) {
+            *pvalue = self->table->entries[index].value;
+            Py_INCREF(*pvalue);
+        }
+        return found;
+    }
+    if ((now = lru_now(self)) < 0)
+        return -1;
+    node = (Node *)PyDict_GetItemWithError(self->dict, key);
+    if (!node) {
+        if (PyErr_Occurred())
+            return -1;
+        return self->l2 ? l2_find(self, key, -1, 0, pvalue, NULL) : 0;
+    }
+    if (NODE_STALE(self, node) || lru_expired(node, now))
+        return 0;
+    if (pvalue && !(*pvalue = lru_node_value(self, node)))
+        return -1;
+    return 1;
+}
+
+static int
+lru_view_contains(LRUView *view, PyObject *obj)
+{
+    PyObject *value, *iter, *item;
+    LRU *lru;
+    int res = 0, found;
+
+    switch (view->kind) {
+    case ITER_KEYS:
+        return PySequence_Contains(view->owner, obj);
+    case ITER_ITEMS:
+        if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != 2)
+            return 0;
+        lru = view->source->shard_of(view->owner, PyTuple_GET_ITEM(obj, 0));
+        if (!lru)
+            return -1;
+        Py_BEGIN_CRITICAL_SECTION(lru);
+        found = lru_peek(lru, PyTuple_GET_ITEM(obj, 0), &value);
+        Py_END_CRITICAL_SECTION();
+        if (found <= 0)
+            return found;
+        res = PyObject_RichCompareBool(value, PyTuple_GET_ITEM(obj, 1), Py_EQ);
+        Py_DECREF(value);
+        return res;
+    default:
+        iter = lru_view_iter(view);
+        if (!iter)
+            return -1;
+        while (!res && (item = PyIter_Next(iter))) {
+            res = PyObject_RichCompareBool(item, obj, Py_EQ);
+            Py_DECREF(item);
+        }
+        Py_DECREF(iter);
+        return res < 0 || PyErr_Occurred() ? -1 : res;
+    }
+}
+
+static PyObject *
+lru_view_repr(LRUView *view)
+{
+    PyObject *list, *result;
+
+    if (Py_ReprEnter((PyObject *)view) != 0)
+        return PyUnicode_FromString("...");
+    list = PySequence_List((PyObject *)view);
+    result = list ? PyUnicode_FromFormat("%s_%s(%R)", _PyType_Name(Py_TYPE(view->owner)),
+                                         iter_kind_names[view->kind], list) : NULL;
+    Py_XDECREF(list);
+    Py_ReprLeave((PyObject *)view);
+    return result;
+}
+
+static PyMethodDef lru_view_methods[] = {
+    {"__reversed__", (PyCFunction)lru_view_reversed, METH_NOARGS,
+                    PyDoc_STR("Return a reverse iterator, from the LRU to the MRU end")},
+    {NULL,	NULL},
+};
+
+static PyType_Slot lru_view_slots[] = {
+    {Py_tp_dealloc, lru_view_dealloc},
+    {Py_tp_repr, lru_view_repr},
+    {Py_sq_length, lru_view_len},
+    {Py_sq_contains, lru_view_contains},
+    {Py_tp_iter, lru_view_iter},
+    {Py_tp_methods, lru_view_methods},
+    {0, NULL},
+};
+
+static PyType_Spec lru_view_spec = {
+    "_lru.LRUView", sizeof(LRUView), 0, LRU_TPFLAGS_INTERNAL, lru_view_slots,
+};
+
+static PyObject *
+LRU_iter(LRU *self)
+{
+    return lru_iter_new((PyObject *)self, &lru_source, ITER_KEYS, 0);
+}
+
+static PyObject *
+LRU_reversed(LRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return lru_iter_new((PyObject *)self, &lru_source, ITER_KEYS, 1);
+}
+
+static PyObject *
+LRU_iterkeys(LRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return lru_iter_new((PyObject *)self, &lru_source, ITER_KEYS, 0);
+}
+
+static PyObject *
+LRU_itervalues(LRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return lru_iter_new((PyObject *)self, &lru_source, ITER_VALUES, 0);
+}
+
+static PyObject *
+LRU_iteritems(LRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return lru_iter_new((PyObject *)self, &lru_source, ITER_ITEMS, 0);
+}
+
+static PyObject *
+LRU_viewkeys(LRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return lru_view_new((PyObject *)self, &lru_source, ITER_KEYS);
+}
+
+static PyObject *
+LRU_viewvalues(LRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return lru_view_new((PyObject *)self, &lru_source, ITER_VALUES);
+}
+
+static PyObject *
+LRU_viewitems(LRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return lru_view_new((PyObject *)self, &lru_source, ITER_ITEMS);
+}
+
+/*
+ * Snapshots. dump() writes the entries from the LRU to the MRU end, so that load() inserting
+ * them in order ends up with the same recency order:
+ *
+ *   "LRUDUMP\x01" flags:u8 count:varint
+ *   count * (key:object value:object [weight:varint] [ttl:varint])
+ *
+ * An object is a tag byte followed by the varint length and content of a str (UTF-8) or
+ * bytes, by the zigzag varint of an int, or by the length and pickle of anything else.
+ * The weights and the remaining TTLs, in ns with 0 for none, are there with DUMP_WEIGHTS and
+ * DUMP_TTLS.
+ */
+#define DUMP_MAGIC "LRUDUMP\x01"
+#define DUMP_MAGIC_LEN 8
+#define DUMP_WEIGHTS 0x1
+#define DUMP_TTLS 0x2
+#define DUMP_CHUNK 65536
+
+enum {
+    DUMP_BYTES = 1,
+    DUMP_STR,
+    DUMP_INT,
+    DUMP_PICKLE,
+};
+
+typedef struct {
+    PyObject *key;
+    PyObject *value;
+    Py_ssize_t weight;
+    int64_t ttl;
+} DumpEntry;
+
+typedef struct {
+    DumpEntry *entries;
+    Py_ssize_t count;
+    int flags;
+} Snapshot;
+
+static void
+snapshot_free(Snapshot *snap)
+{
+    Py_ssize_t i;
+    for (i = 0; i < snap->count; i++) {
+        Py_DECREF(snap->entries[i].key);
+        Py_DECREF(snap->entries[i].value);
+    }
+    PyMem_Free(snap->entries);
+    snap->entries = NULL;
+    snap->count = 0;
+}
+
+/*
+ * Appends new references to the entries of self to snap, LRU end first, skipping the
+ * expired ones. Expects the lock held. Only references are taken here, the encoding runs
+ * later without the lock.
+ */
+static int
+lru_snapshot(LRU *self, Snapshot *snap)
+{
+    Py_ssize_t n = snap->count, total;
+    int64_t now = 0;
+    DumpEntry *entries, *e;
+
+    lru_sync(self);
+    /* Before sizing entries, a timer= callable may change the LRU. */
+    if ((now = lru_now(self)) < 0)
+        return -1;
+    total = n + lru_length(self);
+    entries = PyMem_Resize(snap->entries, DumpEntry, total ? (size_t)total : 1);
+    if (!entries) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    snap->entries = entries;
+    if (self->max_weight)
+        snap->flags |= DUMP_WEIGHTS;
+    if (self->wheel)
+        snap->flags |= DUMP_TTLS;
+
+    if (self->table) {
+        Table *t = self->table;
+        uint32_t i;
+        for (i = t->last; i != TABLE_NIL; i = t->entries[i].prev) {
+            e = &entries[n++];
+            e->key = t->entries[i].key;
+            e->value = t->entries[i].value;
+            e->weight = 0;
+            e->ttl = 0;
+            Py_INCREF(e->key);
+            Py_INCREF(e->value);
+        }
+    } else {
+        Node *node;
+        for (node = self->last; node; node = node->prev) {
+            if ((node->timer && node->timer->expires <= now) || NODE_STALE(self, node))
+                continue;
+            /* Arena values are copied, the snapshot outlives the lock. */
+            if (node->block) {
+                PyObject *value = PyBytes_FromStringAndSize(node->block->data,
+                                                            (Py_ssize_t)node->block->len);
+                if (!value) {
+                    snap->count = n;
+                    return -1;
+                }
+                entries[n].value = value;
+            } else {
+                entries[n].value = node->value;
+                Py_INCREF(node->value);
+            }
+            e = &entries[n++];
+            e->key = node->key;
+            e->weight = node->weight;
+            e->ttl = node->timer ? node->timer->expires - now : 0;
+            Py_INCREF(e->key);
+        }
+    }
+    snap->count = n;
+    return 0;
+}
+
+typedef struct {
+    PyObject *write;            /* file.write, NULL to write to out */
+    PyObject *pickle;           /* pickle.dumps, imported on first use */
+    char *out;                  /* what was written without a file */
+    Py_ssize_t out_len, out_allocated;
+    Py_ssize_t len;
+    char buf[DUMP_CHUNK];
+} DumpWriter;
+
+static int
+dump_call_write(DumpWriter *w, const char *data, Py_ssize_t n)
+{
+    PyObject *chunk, *result;
+
+    if (!w->write) {
+        if (w->out_len + n > w->out_allocated) {
+            Py_ssize_t allocated = Py_MAX(w->out_len + n, 2 * w->out_allocated);
+            char *out = PyMem_Realloc(w->out, (size_t)allocated);
+            if (!out) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            w->out = out;
+            w->out_allocated = allocated;
+        }
+        memcpy(w->out + w->out_len, data, (size_t)n);
+        w->out_len += n;
+        return 0;
+    }
+    chunk = PyBytes_FromStringAndSize(data, n);
+    if (!chunk)
+        return -1;
+    result = PyObject_CallFunctionObjArgs(w->write, chunk, NULL);
+    Py_DECREF(chunk);
+    Py_XDECREF(result);
+    return result ? 0 : -1;
+}
+
+static int
+dump_flush(DumpWriter *w)
+{
+    Py_ssize_t n = w->len;
+    w->len = 0;
+    return n ? dump_call_write(w, w->buf, n) : 0;
+}
+
+static int
+dump_write(DumpWriter *w, const char *data, Py_ssize_t n)
+{
+    if (w->len + n > DUMP_CHUNK && dump_flush(w) < 0)
+        return -1;
+    if (n > DUMP_CHUNK)
+        return dump_call_write(w, data, n);
+    memcpy(w->buf + w->len, data, (size_t)n);
+    w->len += n;
+    return 0;
+}
+
+static int
+dump_varint(DumpWriter *w, uint64_t v)
+{
+    char b[10];
+    Py_ssize_t n = 0;
+    while (v >= 0x80) {
+        b[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    b[n++] = (char)v;
+    return dump_write(w, b, n);
+}
+
+static int
+dump_tagged(DumpWriter *w, int tag, const char *data, Py_ssize_t n)
+{
+    char t = (char)tag;
+    if (dump_write(w, &t, 1) < 0 || dump_varint(w, (uint64_t)n) < 0)
+        return -1;
+    return dump_write(w, data, n);
+}
+
+static int
+dump_object(DumpWriter *w, PyObject *obj)
+{
+    PyObject *data;
+    int res;
+
+    if (PyBytes_CheckExact(obj))
+        return dump_tagged(w, DUMP_BYTES, PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj));
+    if (PyUnicode_CheckExact(obj)) {
+        if (PyUnicode_IS_ASCII(obj))
+            return dump_tagged(w, DUMP_STR, (const char *)PyUnicode_DATA(obj),
+                               PyUnicode_GET_LENGTH(obj));
+        /* Not PyUnicode_AsUTF8AndSize, which would keep a UTF-8 copy in every str. */
+        data = PyUnicode_AsUTF8String(obj);
+        if (data) {
+            res = dump_tagged(w, DUMP_STR, PyBytes_AS_STRING(data), PyBytes_GET_SIZE(data));
+            Py_DECREF(data);
+            return res;
+        }
+        PyErr_Clear();  /* lone surrogates, left to pickle */
+    } else if (PyLong_CheckExact(obj)) {
+        int overflow;
+        long long v = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        if (!overflow) {
+            char t = DUMP_INT;
+            uint64_t zigzag = v < 0 ? ~((uint64_t)v << 1) : (uint64_t)v << 1;
+            if (v == -1 && PyErr_Occurred())
+                return -1;
+            if (dump_write(w, &t, 1) < 0)
+                return -1;
+            return dump_varint(w, zigzag);
+        }
+    }
+
+    if (!w->pickle) {
+        PyObject *module = PyImport_ImportModule("pickle");
+        if (!module)
+            return -1;
+        w->pickle = PyObject_GetAttrString(module, "dumps");
+        Py_DECREF(module);
+        if (!w->pickle)
+            return -1;
+    }
+    data = PyObject_CallFunction(w->pickle, "Oi", obj, -1);
+    if (!data)
+        return -1;
+    if (!PyBytes_Check(data)) {
+        Py_DECREF(data);
+        PyErr_SetString(PyExc_TypeError, "pickle.dumps() didn't return bytes");
+        return -1;
+    }
+    res = dump_tagged(w, DUMP_PICKLE, PyBytes_AS_STRING(data), PyBytes_GET_SIZE(data));
+    Py_DECREF(data);
+    return res;
+}
+
+/* Writes snap to file and releases it. */
+static PyObject *
+snapshot_dump(Snapshot *snap, PyObject *file)
+{
+    DumpWriter *w = PyMem_New(DumpWriter, 1);
+    Py_ssize_t i;
+    char flags = (char)snap->flags;
+    int res = -1;
+
+    if (!w) {
+        snapshot_free(snap);
+        return PyErr_NoMemory();
+    }
+    w->len = 0;
+    w->pickle = NULL;
+    w->out = NULL;
+    w->write = PyObject_GetAttrString(file, "write");
+    if (!w->write)
+        goto done;
+    if (dump_write(w, DUMP_MAGIC, DUMP_MAGIC_LEN) < 0 || dump_write(w, &flags, 1) < 0 ||
+        dump_varint(w, (uint64_t)snap->count) < 0)
+        goto done;
+    for (i = 0; i < snap->count; i++) {
+        DumpEntry *e = &snap->entries[i];
+        if (dump_object(w, e->key) < 0 || dump_object(w, e->value) < 0)
+            goto done;
+        if ((snap->flags & DUMP_WEIGHTS) && dump_varint(w, (uint64_t)e->weight) < 0)
+            goto done;
+        if ((snap->flags & DUMP_TTLS) && dump_varint(w, (uint64_t)e->ttl) < 0)
+            goto done;
+    }
+    res = dump_flush(w);
+done:
+    Py_XDECREF(w->write);
+    Py_XDECREF(w->pickle);
+    PyMem_Free(w);
+    snapshot_free(snap);
+    if (res < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+typedef struct {
+    PyObject *read;             /* file.read, NULL if buf holds everything */
+    PyObject *pickle;           /* pickle.loads, imported on first use */
+    char *buf;
+    Py_ssize_t pos, len, allocated;
+} DumpReader;
+
+/* Makes sure the next n bytes are buffered, reading more from the file as needed. */
+static int
+load_need(DumpReader *r, Py_ssize_t n)
+{
+    PyObject *chunk;
+    Py_ssize_t size;
+
+    if (r->len - r->pos >= n)
+        return 0;
+    if (!r->read) {
+        PyErr_SetString(PyExc_ValueError, "invalid LRU dump");
+        return -1;
+    }
+    memmove(r->buf, r->buf + r->pos, (size_t)(r->len - r->pos));
+    r->len -= r->pos;
+    r->pos = 0;
+    if (n > r->allocated) {
+        char *buf = PyMem_Realloc(r->buf, (size_t)n);
+        if (!buf) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        r->buf = buf;
+        r->allocated = n;
+    }
+    while (r->len < n) {
+        chunk = PyObject_CallFunction(r->read, "n", Py_MAX(n - r->len, (Py_ssize_t)DUMP_CHUNK));
+        if (!chunk)
+            return -1;
+        if (!PyBytes_Check(chunk)) {
+            Py_DECREF(chunk);
+            PyErr_SetString(PyExc_TypeError, "read() should return bytes");
+            return -1;
+        }
+        size = PyBytes_GET_SIZE(chunk);
+        if (size == 0) {
+            Py_DECREF(chunk);
+            PyErr_SetString(PyExc_ValueError, "truncated LRU dump");
+            return -1;
+        }
+        if (r->len + size > r->allocated) {
+            char *buf = PyMem_Realloc(r->buf, (size_t)(r->len + size));
+            if (!buf) {
+                Py_DECREF(chunk);
+                PyErr_NoMemory();
+                return -1;
+            }
+            r->buf = buf;
+            r->allocated = r->len + size;
+        }
+        memcpy(r->buf + r->len, PyBytes_AS_STRING(chunk), (size_t)size);
+        r->len += size;
+        Py_DECREF(chunk);
+    }
+    return 0;
+}
+
+static int
+load_varint(DumpReader *r, uint64_t *pv)
+{
+    uint64_t v = 0;
+    int shift;
+    unsigned char b;
+
+    for (shift = 0; shift < 64; shift += 7) {
+        if (load_need(r, 1) < 0)
+            return -1;
+        b = (unsigned char)r->buf[r->pos++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *pv = v;
+            return 0;
+        }
+    }
+    PyErr_SetString(PyExc_ValueError, "invalid LRU dump");
+    return -1;
+}
+
+/* Reads the varint length of a str, bytes or pickle and buffers its content. */
+static const char *
+load_data(DumpReader *r, Py_ssize_t *pn)
+{
+    uint64_t n;
+    const char *data;
+
+    if (load_varint(r, &n) < 0)
+        return NULL;
+    if (n > (uint64_t)PY_SSIZE_T_MAX) {
+        PyErr_SetString(PyExc_ValueError, "invalid LRU dump");
+        return NULL;
+    }
+    if (load_need(r, (Py_ssize_t)n) < 0)
+        return NULL;
+    data = r->buf + r->pos;
+    r->pos += (Py_ssize_t)n;
+    *pn = (Py_ssize_t)n;
+    return data;
+}
+
+static PyObject *
+load_object(DumpReader *r)
+{
+    PyObject *view, *result;
+    const char *data;
+    Py_ssize_t n;
+    uint64_t v;
+    int tag;
+
+    if (load_need(r, 1) < 0)
+        return NULL;
+    tag = (unsigned char)r->buf[r->pos++];
+    switch (tag) {
+    case DUMP_BYTES:
+        data = load_data(r, &n);
+        return data ? PyBytes_FromStringAndSize(data, n) : NULL;
+    case DUMP_STR:
+        data = load_data(r, &n);
+        return data ? PyUnicode_DecodeUTF8(data, n, NULL) : NULL;
+    case DUMP_INT:
+        if (load_varint(r, &v) < 0)
+            return NULL;
+        return PyLong_FromLongLong((long long)(v >> 1) ^ -(long long)(v & 1));
+    case DUMP_PICKLE:
+        if (!r->pickle) {
+            PyObject *module = PyImport_ImportModule("pickle");
+            if (!module)
+                return NULL;
+            r->pickle = PyObject_GetAttrString(module, "loads");
+            Py_DECREF(module);
+            if (!r->pickle)
+                return NULL;
+        }
+        data = load_data(r, &n);
+        if (!data)
+            return NULL;
+        /* pickle.loads() reads the buffer in place, before anything else can touch it. */
+        view = PyMemoryView_FromMemory((char *)data, n, PyBUF_READ);
+        if (!view)
+            return NULL;
+        result = PyObject_CallFunctionObjArgs(r->pickle, view, NULL);
+        Py_DECREF(view);
+        return result;
+    default:
+        PyErr_SetString(PyExc_ValueError, "invalid LRU dump");
+        return NULL;
+    }
+}
+
+/*
+ * Where load() puts the entries: store inserts one entry and reserve, which may be NULL,
+ * prepares room for count entries.
+ */
+typedef struct {
+    int (*store)(PyObject *owner, PyObject *key, PyObject *value, int64_t ttl,
+                 Py_ssize_t weight);
+    int (*reserve)(PyObject *owner, Py_ssize_t count);
+    Py_ssize_t (*size)(PyObject *owner);
+} LoadTarget;
+
+/* Reads a dump from file into owner. Returns the number of entries read. */
+static PyObject *
+snapshot_load(PyObject *owner, const LoadTarget *target, PyObject *file)
+{
+    DumpReader r = {NULL, NULL, NULL, 0, 0, 0};
+    PyObject *key = NULL, *value = NULL;
+    uint64_t count, i, skip = 0, weight, ttl;
+    int flags, res = -1;
+
+    r.read = PyObject_GetAttrString(file, "read");
+    if (!r.read)
+        goto done;
+    if (load_need(&r, DUMP_MAGIC_LEN + 1) < 0)
+        goto done;
+    if (memcmp(r.buf, DUMP_MAGIC, DUMP_MAGIC_LEN) != 0) {
+        PyErr_SetString(PyExc_ValueError, "not an LRU dump");
+        goto done;
+    }
+    flags = (unsigned char)r.buf[DUMP_MAGIC_LEN];
+    r.pos = DUMP_MAGIC_LEN + 1;
+    if (load_varint(&r, &count) < 0)
+        goto done;
+    /* The oldest entries beyond the size would be evicted right away. */
+    if (target->size && count > (uint64_t)target->size(owner))
+        skip = count - (uint64_t)target->size(owner);
+    if (target->reserve && target->reserve(owner, (Py_ssize_t)Py_MIN(count - skip, (uint64_t)PY_SSIZE_T_MAX)) < 0)
+        goto done;
+
+    for (i = 0; i < count; i++) {
+        weight = 0;
+        ttl = 0;
+        if (!(key = load_object(&r)) || !(value = load_object(&r)))
+            goto done;
+        if ((flags & DUMP_WEIGHTS) && load_varint(&r, &weight) < 0)
+            goto done;
+        if ((flags & DUMP_TTLS) && load_varint(&r, &ttl) < 0)
+            goto done;
+        if (i >= skip) {
+            int64_t entry_ttl = WHEEL_DEFAULT_TTL;
+            if (flags & DUMP_TTLS)
+                entry_ttl = ttl ? (int64_t)Py_MIN(ttl, (uint64_t)WHEEL_MAX_TTL) : WHEEL_NO_TTL;
+            if (target->store(owner, key, value, entry_ttl,
+                              (flags & DUMP_WEIGHTS) ? (Py_ssize_t)Py_MIN(weight, (uint64_t)PY_SSIZE_T_MAX) : -1) < 0)
+                goto done;
+        }
+        Py_CLEAR(key);
+        Py_CLEAR(value);
+    }
+    res = 0;
+done:
+    Py_XDECREF(key);
+    Py_XDECREF(value);
+    Py_XDECREF(r.read);
+    Py_XDECREF(r.pickle);
+    PyMem_Free(r.buf);
+    if (res < 0)
+        return NULL;
+    return PyLong_FromUnsignedLongLong(count - skip);
+}
+
+/*
+ * Disk tier of LRU(size, l2_path=path, l2_size=n). Entries evicted from memory for capacity
+ * are encoded like the entries of a dump and appended to a log in a memory mapped file of n
+ * bytes, used as a ring:
+ *
+ *   L2Record(hash, weight, len, live) | key:object value:object | padding to 8 bytes
+ *
+ * When the log reaches the end of the file it goes on from the start, dropping the oldest
+ * records in its way, so the tier evicts first in, first out. The index in memory is an
+ * open addressing table of the hash and offset of each live record, with linear probing.
+ * A lookup decodes the key of the records with the same hash to compare it. A hit removes
+ * the record from the index, promoted entries move back to memory. Removed records stay
+ * in the log until it overwrites them. A key is in at most one of the tiers.
+ *
+ * The file only holds the entries of this LRU while it exists: it is truncated when the LRU
+ * is created and isn't read back.
+ */
+#define L2_EMPTY UINT64_MAX
+#define L2_MIN_SLOTS 64
+#define L2_RECORD_SIZE(len) ((sizeof(L2Record) + (size_t)(len) + 7) & ~(size_t)7)
+
+typedef struct {
+    uint64_t hash;
+    int64_t weight;
+    uint32_t len;               /* bytes of the key and value */
+    uint32_t live;              /* in the index */
+} L2Record;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;            /* of the record, L2_EMPTY for a free slot */
+} L2Slot;
+
+typedef struct _L2 {
+    PyObject *map;              /* mmap.mmap of the file */
+    Py_buffer view;             /* exported from map, which keeps it from moving */
+    char *base;
+    size_t capacity;
+    size_t head;                /* where the next record goes */
+    size_t tail;                /* oldest record */
+    size_t end;                 /* end of the records before head, once it wrapped */
+    int wrapped;
+    Py_ssize_t records;         /* in the log, live or not */
+    L2Slot *slots;
+    size_t mask;
+    Py_ssize_t count;           /* live records */
+    Py_ssize_t used;            /* bytes of the live records */
+    uint64_t version;           /* changes with the index, see l2_find */
+    Py_ssize_t hits, misses;
+    int spilling;               /* a spill is encoding its entry, which may run Python code */
+    DumpWriter *writer;         /* encodes the records, allocated by the first spill */
+    PyObject *loads;            /* pickle.loads, imported on first use */
+} L2;
+
+#define L2_RECORD(l2, offset) ((L2Record *)((l2)->base + (offset)))
+
+static L2 *
+l2_new(PyObject *path, Py_ssize_t capacity)
+{
+    PyObject *io = NULL, *mmap = NULL, *file = NULL, *result;
+    L2 *l2 = PyMem_Calloc(1, sizeof(L2));
+
+    if (!l2) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    l2->capacity = (size_t)capacity;
+    l2->mask = L2_MIN_SLOTS - 1;
+    l2->slots = PyMem_New(L2Slot, L2_MIN_SLOTS);
+    if (!l2->slots) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    memset(l2->slots, 0xff, L2_MIN_SLOTS * sizeof(L2Slot));
+
+    if (!(io = PyImport_ImportModule("io")) || !(mmap = PyImport_ImportModule("mmap")))
+        goto error;
+    file = PyObject_CallMethod(io, "open", "Os", path, "w+b");
+    if (!file)
+        goto error;
+    result = PyObject_CallMethod(file, "truncate", "n", capacity);
+    if (!result)
+        goto error;
+    Py_DECREF(result);
+    result = PyObject_CallMethod(file, "fileno", NULL);
+    if (!result)
+        goto error;
+    l2->map = PyObject_CallMethod(mmap, "mmap", "On", result, capacity);
+    Py_DECREF(result);
+    if (!l2->map || PyObject_GetBuffer(l2->map, &l2->view, PyBUF_WRITABLE) < 0)
+        goto error;
+    l2->base = l2->view.buf;
+    /* The mapping stays valid once the file is closed. */
+    result = PyObject_CallMethod(file, "close", NULL);
+    if (!result)
+        goto error;
+    Py_DECREF(result);
+    Py_DECREF(file);
+    Py_DECREF(mmap);
+    Py_DECREF(io);
+    return l2;
+
+error:
+    if (file) {
+        PyObject *exc_type, *exc_value, *exc_tb;
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        result = PyObject_CallMethod(file, "close", NULL);
+        Py_XDECREF(result);
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+        Py_DECREF(file);
+    }
+    if (l2->base)
+        PyBuffer_Release(&l2->view);
+    Py_XDECREF(l2->map);
+    Py_XDECREF(mmap);
+    Py_XDECREF(io);
+    PyMem_Free(l2->slots);
+    PyMem_Free(l2);
+    return NULL;
+}
+
+static void
+l2_free(L2 *l2)
+{
+    PyObject *result;
+
+    PyBuffer_Release(&l2->view);
+    result = PyObject_CallMethod(l2->map, "close", NULL);
+    if (!result)
+        PyErr_WriteUnraisable(l2->map);
+    Py_XDECREF(result);
+    Py_DECREF(l2->map);
+    if (l2->writer) {
+        Py_XDECREF(l2->writer->pickle);
+        PyMem_Free(l2->writer->out);
+        PyMem_Free(l2->writer);
+    }
+    Py_XDECREF(l2->loads);
+    PyMem_Free(l2->slots);
+    PyMem_Free(l2);
+}
+
+/* Empties the index and the log. */
+static void
+l2_clear(L2 *l2)
+{
+    if (!l2->records)
+        return;
+    memset(l2->slots, 0xff, (l2->mask + 1) * sizeof(L2Slot));
+    l2->head = l2->tail = l2->end = 0;
+    l2->wrapped = 0;
+    l2->records = l2->count = l2->used = 0;
+    l2->version++;
+}
+
+/* Frees slot i of the index, shifting back the slots probed past it. */
+static void
+l2_index_remove(L2 *l2, size_t i)
+{
+    L2Record *rec = L2_RECORD(l2, l2->slots[i].offset);
+    size_t j = i, home;
+
+    rec->live = 0;
+    l2->count--;
+    l2->used -= L2_RECORD_SIZE(rec->len);
+    l2->version++;
+    for (;;) {
+        l2->slots[i].offset = L2_EMPTY;
+        for (;;) {
+            j = (j + 1) & l2->mask;
+            if (l2->slots[j].offset == L2_EMPTY)
+                return;
+            home = table_home(l2->mask, (Py_hash_t)l2->slots[j].hash);
+            /* Slot j can move to i unless its home lies cyclically in (i, j]. */
+            if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
+                break;
+        }
+        l2->slots[i] = l2->slots[j];
+        i = j;
+    }
+}
+
+static void
+l2_index_put(L2Slot *slots, size_t mask, uint64_t hash, uint64_t offset)
+{
+    size_t i = table_home(mask, (Py_hash_t)hash);
+    while (slots[i].offset != L2_EMPTY)
+        i = (i + 1) & mask;
+    slots[i].hash = hash;
+    slots[i].offset = offset;
+}
+
+static int
+l2_index_add(L2 *l2, uint64_t hash, uint64_t offset)
+{
+    if ((size_t)(l2->count + 1) * 3 > (l2->mask + 1) * 2) {
+        size_t nslots = (l2->mask + 1) * 2, i;
+        L2Slot *slots = PyMem_New(L2Slot, nslots);
+        if (!slots) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memset(slots, 0xff, nslots * sizeof(L2Slot));
+        for (i = 0; i <= l2->mask; i++) {
+            if (l2->slots[i].offset != L2_EMPTY)
+                l2_index_put(slots, nslots - 1, l2->slots[i].hash, l2->slots[i].offset);
+        }
+        PyMem_Free(l2->slots);
+        l2->slots = slots;
+        l2->mask = nslots - 1;
+    }
+    l2_index_put(l2->slots, l2->mask, hash, offset);
+    l2->count++;
+    l2->version++;
+    return 0;
+}
+
+/* Drops the oldest record of the log, removing it from the index if it is live. */
+static void
+l2_drop_oldest(L2 *l2)
+{
+    L2Record *rec = L2_RECORD(l2, l2->tail);
+    size_t i;
+
+    if (rec->live) {
+        for (i = table_home(l2->mask, (Py_hash_t)rec->hash); l2->slots[i].offset != l2->tail;
+             i = (i + 1) & l2->mask)
+            ;
+        l2_index_remove(l2, i);
+    }
+    l2->tail += L2_RECORD_SIZE(rec->len);
+    l2->records--;
+    if (l2->wrapped && l2->tail == l2->end) {
+        l2->tail = 0;
+        l2->wrapped = 0;
+    }
+}
+
+/* Makes room for size bytes at the head of the log and returns their offset. */
+static size_t
+l2_reserve(L2 *l2, size_t size)
+{
+    size_t offset;
+
+    for (;;) {
+        if (!l2->records) {
+            l2->head = l2->tail = l2->end = 0;
+            l2->wrapped = 0;
+        }
+        if (!l2->wrapped) {
+            if (l2->head + size <= l2->capacity)
+                break;
+            l2->end = l2->head;
+            l2->head = 0;
+            l2->wrapped = 1;
+        }
+        /* Wrapped, the free space is between head and the oldest record. */
+        if (l2->head + size <= l2->tail)
+            break;
+        l2_drop_oldest(l2);
+    }
+    offset = l2->head;
+    l2->head += size;
+    l2->records++;
+    return offset;
+}
+
+/*
+ * Appends an entry evicted from memory to the log. Entries that can't be encoded or don't
+ * fit are only evicted, as are the ones with a ttl and the ones with tags, which
+ * invalidate_tag() couldn't reach there.
+ */
+static void
+l2_spill(LRU *self, Node *node)
+{
+    L2 *l2 = self->l2;
+    DumpWriter *w = l2->writer;
+    PyObject *exc_type, *exc_value, *exc_tb;
+    L2Record *rec;
+    size_t offset;
+    int res;
+
+    if (node->tags || node->timer || l2->spilling)
+        return;
+    if (!w) {
+        if (!(w = PyMem_New(DumpWriter, 1)))
+            return;
+        w->write = NULL;
+        w->pickle = NULL;
+        w->out = NULL;
+        w->out_allocated = 0;
+        l2->writer = w;
+    }
+    w->len = w->out_len = 0;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    l2->spilling = 1;
+    res = dump_object(w, node->key);
+    if (res == 0)
+        res = node->block ? dump_tagged(w, DUMP_BYTES, node->block->data, node->block->len)
+                          : dump_object(w, node->value);
+    if (res == 0)
+        res = dump_flush(w);
+    l2->spilling = 0;
+    if (res < 0)
+        PyErr_Clear();
+    else if ((size_t)w->out_len <= UINT32_MAX && L2_RECORD_SIZE(w->out_len) <= l2->capacity) {
+        offset = l2_reserve(l2, L2_RECORD_SIZE(w->out_len));
+        rec = L2_RECORD(l2, offset);
+        rec->hash = (uint64_t)node->hash;
+        rec->weight = node->weight;
+        rec->len = (uint32_t)w->out_len;
+        rec->live = 0;
+        memcpy(rec + 1, w->out, (size_t)w->out_len);
+        if (l2_index_add(l2, rec->hash, offset) < 0) {
+            PyErr_Clear();
+        } else {
+            rec->live = 1;
+            l2->used += L2_RECORD_SIZE(rec->len);
+        }
+    }
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+/*
+ * Looks key up in the disk tier, hashing it if hash is -1. Returns 1 if found, setting
+ * *pvalue to a new reference to its value and *pweight to its weight when they aren't NULL
+ * and removing it with remove, 0 if missing and -1 on error. The keys are decoded from a
+ * copy of the record, as their __eq__ may change the LRU.
+ */
+static int
+l2_find(LRU *self, PyObject *key, Py_hash_t hash, int remove, PyObject **pvalue,
+        Py_ssize_t *pweight)
+{
+    L2 *l2 = self->l2;
+    DumpReader r = {NULL, NULL, NULL, 0, 0, 0};
+    PyObject *found, *value = NULL;
+    L2Record *rec;
+    uint64_t version;
+    size_t i;
+    int cmp;
+
+    if (!l2->count)
+        return 0;
+    if (hash == -1 && (hash = lru_hash(key)) == -1)
+        return -1;
+restart:
+    for (i = table_home(l2->mask, hash); l2->slots[i].offset != L2_EMPTY; i = (i + 1) & l2->mask) {
+        if (l2->slots[i].hash != (uint64_t)hash)
+            continue;
+        rec = L2_RECORD(l2, l2->slots[i].offset);
+        if (!(r.buf = PyMem_Malloc(rec->len ? rec->len : 1))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(r.buf, rec + 1, rec->len);
+        r.pos = 0;
+        r.len = r.allocated = rec->len;
+        r.pickle = l2->loads;
+        version = l2->version;
+        found = load_object(&r);
+        if (found) {
+            cmp = PyObject_RichCompareBool(found, key, Py_EQ);
+            Py_DECREF(found);
+            if (cmp > 0 && pvalue && !(value = load_object(&r)))
+                cmp = -1;
+        } else {
+            cmp = -1;
+        }
+        l2->loads = r.pickle;
+        PyMem_Free(r.buf);
+        if (cmp < 0)
+            return -1;
+        if (l2->version != version) {
+            Py_XDECREF(value);
+            value = NULL;
+            goto restart;
+        }
+        if (!cmp)
+            continue;
+        if (pweight)
+            *pweight = (Py_ssize_t)rec->weight;
+        if (remove)
+            l2_index_remove(l2, i);
+        if (pvalue) {
+            /* Like the values of value_store='arena' still in memory. */
+            if (self->arena && !self->copy_values) {
+                Py_SETREF(value, PyMemoryView_FromObject(value));
+                if (!value)
+                    return -1;
+            }
+            *pvalue = value;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* lru_find missed key in memory: moves it back from the disk tier, if it is there. */
+static PyObject *
+l2_promote(LRU *self, PyObject *key)
+{
+    PyObject *value;
+    Py_ssize_t weight;
+
+    switch (l2_find(self, key, -1, 1, &value, &weight)) {
+    case -1:
+        return NULL;
+    case 0:
+        self->l2->misses++;
+        return NULL;
+    }
+    self->l2->hits++;
+    if (lru_store(self, key, value, WHEEL_DEFAULT_TTL, self->max_weight ? weight : -1) < 0) {
+        Py_DECREF(value);
+        return NULL;
+    }
+    return value;
+}
+
+static PyObject *
+LRU_get_l2_stats_impl(LRU *self)
+{
+    L2 *l2 = self->l2;
+    if (!l2)
+        return Py_BuildValue("nnnn", (Py_ssize_t)0, (Py_ssize_t)0, (Py_ssize_t)0, (Py_ssize_t)0);
+    return Py_BuildValue("nnnn", l2->hits, l2->misses, l2->count, l2->used);
+}
+
+LRU_LOCKED_NOARGS(LRU_get_l2_stats)
+
+/* lru_store for a loaded entry, leaving out what this LRU can't keep. */
+static int
+lru_load_entry(LRU *self, PyObject *key, PyObject *value, int64_t ttl, Py_ssize_t weight)
+{
+    if (self->table || self->rbuf)
+        ttl = WHEEL_DEFAULT_TTL;
+    if (!self->max_weight)
+        weight = -1;
+    return lru_store(self, key, value, ttl, weight);
+}
+
+static int
+lru_load_store(PyObject *owner, PyObject *key, PyObject *value, int64_t ttl, Py_ssize_t weight)
+{
+    LRU *self = (LRU *)owner;
+    Deferred deferred;
+    int result;
+
+    LRU_LOCKED_CALL(result, lru_load_entry(self, key, value, ttl, weight), deferred);
+    return lru_finish_status(&deferred, result);
+}
+
+/* Grows the dict or the table of an empty LRU for count more entries. */
+static int
+lru_reserve_impl(LRU *self, Py_ssize_t count)
+{
+    if (count > self->size)
+        count = self->size;
+    if (self->table) {
+        Table *t = self->table;
+        size_t nslots = t->mask + 1;
+        Py_ssize_t n = t->used + count;
+        Entry *entries;
+
+        while ((size_t)n * 3 > nslots * 2)
+            nslots *= 2;
+        if (nslots > t->mask + 1 && table_resize(t, nslots) < 0)
+            return -1;
+        if (n > (Py_ssize_t)t->allocated) {
+            entries = PyMem_Resize(t->entries, Entry, (size_t)n);
+            if (!entries) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            t->entries = entries;
+            t->allocated = (uint32_t)n;
+        }
+        return 0;
+    }
+    /* Lock free readers of read_buffer mode may be looking at the dict. */
+    if (self->dict && !self->rbuf && PyDict_GET_SIZE(self->dict) == 0) {
+        PyObject *dict = _PyDict_NewPresized(count);
+        if (!dict)
+            return -1;
+        Py_SETREF(self->dict, dict);
+    }
+    return 0;
+}
+
+static int
+lru_load_reserve(PyObject *owner, Py_ssize_t count)
+{
+    LRU *self = (LRU *)owner;
+    int result;
+    LRU_LOCKED(result, lru_reserve_impl(self, count));
+    return result;
+}
+
+static Py_ssize_t
+lru_load_size(PyObject *owner)
+{
+    return ((LRU *)owner)->size;
+}
+
+static const LoadTarget lru_load_target = {lru_load_store, lru_load_reserve, lru_load_size};
+
+static PyObject *
+LRU_dump(LRU *self, PyObject *file)
+{
+    Snapshot snap = {NULL, 0, 0};
+    int result;
+
+    LRU_LOCKED(result, lru_snapshot(self, &snap));
+    if (result < 0) {
+        snapshot_free(&snap);
+        return NULL;
+    }
+    return snapshot_dump(&snap, file);
+}
+
+static PyObject *
+LRU_load(LRU *self, PyObject *file)
+{
+    return snapshot_load((PyObject *)self, &lru_load_target, file);
+}
+
+static const char * const policy_names[] = {"lru", "clock", "slru", "2q", "tinylfu"};
+
+/* Pickles as the constructor arguments and a dump of the entries. */
+static PyObject *
+LRU_reduce(LRU *self, PyObject *Py_UNUSED(ignored))
+{
+    PyObject *io, *buffer, *state, *result = NULL, *ttl = Py_None, *timer = Py_None;
+    PyObject *max_weight = Py_None;
+
+    if (self->wheel) {
+        if (self->wheel->ttl != WHEEL_NO_TTL && !(ttl = PyFloat_FromDouble(self->wheel->ttl / 1e9)))
+            return NULL;
+        if (self->wheel->timer)
+            timer = self->wheel->timer;
+    }
+    if (self->max_weight && !(max_weight = PyLong_FromSsize_t(self->max_weight)))
+        goto done;
+
+    io = PyImport_ImportModule("io");
+    if (!io)
+        goto done;
+    buffer = PyObject_CallMethod(io, "BytesIO", NULL);
+    Py_DECREF(io);
+    if (!buffer)
+        goto done;
+    state = LRU_dump(self, buffer);
+    if (state) {
+        Py_DECREF(state);
+        state = PyObject_CallMethod(buffer, "getvalue", NULL);
+    }
+    Py_DECREF(buffer);
+    if (!state)
+        goto done;
+    result = Py_BuildValue("O(nOsnsOOiOOiinnsi)N", (PyObject *)Py_TYPE(self), self->size,
+                           self->callback ? self->callback : Py_None,
+                           self->table ? "compact" : "dict",
+                           self->rbuf ? self->rbuf->capacity : (Py_ssize_t)0,
+                           policy_names[self->policy], ttl, timer, self->callback_reason,
+                           max_weight, self->weigher ? self->weigher : Py_None,
+                           self->callback_batch, self->metrics != NULL,
+                           self->mrc ? self->mrc->max_size : (Py_ssize_t)0,
+                           self->trace ? self->trace->capacity : (Py_ssize_t)0,
+                           self->arena ? "arena" : "object", self->copy_values, state);
+done:
+    if (ttl != Py_None)
+        Py_DECREF(ttl);
+    if (max_weight != Py_None)
+        Py_DECREF(max_weight);
+    return result;
+}
+
+static PyObject *
+LRU_setstate(LRU *self, PyObject *state)
+{
+    PyObject *io, *buffer, *result;
+
+    io = PyImport_ImportModule("io");
+    if (!io)
+        return NULL;
+    buffer = PyObject_CallMethod(io, "BytesIO", "O", state);
+    Py_DECREF(io);
+    if (!buffer)
+        return NULL;
+    result = LRU_load(self, buffer);
+    Py_DECREF(buffer);
+    if (!result)
+        return NULL;
+    Py_DECREF(result);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef LRU_methods[] = {
+    {"__contains__", (PyCFunction)LRU_contains_key, METH_O | METH_COEXIST,
+                    PyDoc_STR("L.__contains__(key) -> Check if key is there in L")},
+    {"keys", (PyCFunction)LRU_keys, METH_NOARGS,
+                    PyDoc_STR("L.keys() -> list of L's keys in MRU order")},
+    {"values", (PyCFunction)LRU_values, METH_NOARGS,
+                    PyDoc_STR("L.values() -> list of L's values in MRU order")},
+    {"items", (PyCFunction)LRU_items, METH_NOARGS,
+                    PyDoc_STR("L.items() -> list of L's items (key,value) in MRU order")},
+    {"iterkeys", (PyCFunction)LRU_iterkeys, METH_NOARGS,
+                    PyDoc_STR("L.iterkeys() -> iterator over L's keys in MRU order")},
+    {"itervalues", (PyCFunction)LRU_itervalues, METH_NOARGS,
+                    PyDoc_STR("L.itervalues() -> iterator over L's values in MRU order")},
+    {"iteritems", (PyCFunction)LRU_iteritems, METH_NOARGS,
+                    PyDoc_STR("L.iteritems() -> iterator over L's items (key,value) in MRU order")},
+    {"viewkeys", (PyCFunction)LRU_viewkeys, METH_NOARGS,
+                    PyDoc_STR("L.viewkeys() -> a live view of L's keys in MRU order")},
+    {"viewvalues", (PyCFunction)LRU_viewvalues, METH_NOARGS,
+                    PyDoc_STR("L.viewvalues() -> a live view of L's values in MRU order")},
+    {"viewitems", (PyCFunction)LRU_viewitems, METH_NOARGS,
+                    PyDoc_STR("L.viewitems() -> a live view of L's items (key,value) in MRU order")},
+    {"__reversed__", (PyCFunction)LRU_reversed, METH_NOARGS,
+                    PyDoc_STR("L.__reversed__() -> iterator over L's keys from the LRU end")},
+    {"dump", (PyCFunction)LRU_dump, METH_O,
+                    PyDoc_STR("L.dump(file) -> write L's entries to a binary file, LRU first")},
+    {"load", (PyCFunction)LRU_load, METH_O,
+                    PyDoc_STR("L.load(file) -> insert the entries of a dump, returns their number")},
+    {"__reduce__", (PyCFunction)LRU_reduce, METH_NOARGS,
+                    PyDoc_STR("Pickle support")},
+    {"__setstate__", (PyCFunction)LRU_setstate, METH_O,
+                    PyDoc_STR("Pickle support")},
+    {"has_key",	(PyCFunction)LRU_contains_key, METH_O,
+                    PyDoc_STR("L.has_key(key) -> Check if key is there in L")},
+    {"get",	(PyCFunction)(void(*)(void))LRU_get, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.get(key, default=None, promote=True) -> If L has key return its value, otherwise default. With promote=False the lookup neither moves key nor counts as a hit or miss")},
+    {"peek", (PyCFunction)(void(*)(void))LRU_peek, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.peek(key, default=None) -> L.get(key, default, promote=False)")},
+    {"contains_many", (PyCFunction)LRU_contains_many, METH_O,
+                    PyDoc_STR("L.contains_many(keys) -> list of whether each key in keys is in L, without promoting them or counting hits")},
+    {"get_or_load", (PyCFunction)(void(*)(void))LRU_get_or_load, METH_FASTCALL,
+                    PyDoc_STR("L.get_or_load(key, loader) -> If L has key return its value, otherwise set it to loader(key) and return that. Concurrent callers missing the same key wait for the first one's loader")},
+    {"setdefault", (PyCFunction)(void(*)(void))LRU_setdefault, METH_FASTCALL,
+                    PyDoc_STR("L.setdefault(key, default=None) -> If L has key return its value, otherwise insert key with a value of default and return default")},
+    {"set", (PyCFunction)(void(*)(void))LRU_set, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.set(key, value, ttl=None, weight=None, tags=None) -> set key to value, expiring after ttl seconds. ttl=None uses the default TTL of L and weight=None the weigher. tags replaces the tags of key, tags=None keeps them")},
+    {"expire", (PyCFunction)LRU_expire, METH_NOARGS,
+                    PyDoc_STR("L.expire() -> remove the expired items, returns how many were removed")},
+    {"pop", (PyCFunction)(void(*)(void))LRU_pop, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.pop(key[, default]) -> If L has key return its value and remove it from L, otherwise return default. If default is not given and key is not in L, a KeyError is raised.")},
+    {"popitem", (PyCFunction)(void(*)(void))LRU_popitem, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.popitem([least_recent=True]) -> Returns and removes a (key, value) pair. The pair returned is the least-recently used if least_recent is true, or the most-recently used if false.")},
+    {"set_size", (PyCFunction)LRU_set_size, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.set_size(size, incremental=False) -> set size of LRU. With incremental, the items over it are evicted by later inserts, a few at a time")},
+    {"trim", (PyCFunction)(void(*)(void))LRU_trim, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.trim(n=None, budget_items=None) -> evict up to n items, by default the ones over the size, and at most budget_items of them. Returns the evicted (key, value) pairs, or their number with a callback")},
+    {"get_size", (PyCFunction)LRU_get_size, METH_NOARGS,
+                    PyDoc_STR("L.get_size() -> get size of LRU")},
+    {"get_current_weight", (PyCFunction)LRU_get_current_weight, METH_NOARGS,
+                    PyDoc_STR("L.get_current_weight() -> total weight of the items in L, 0 without max_weight")},
+    {"get_max_weight", (PyCFunction)LRU_get_max_weight, METH_NOARGS,
+                    PyDoc_STR("L.get_max_weight() -> get max_weight of LRU, None without it")},
+    {"set_max_weight", (PyCFunction)LRU_set_max_weight, METH_O,
+                    PyDoc_STR("L.set_max_weight(max_weight) -> set max_weight of LRU, evicting items if needed")},
+    {"clear", (PyCFunction)(void(*)(void))LRU_clear, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.clear(budget=None) -> clear LRU. With a budget, invalidate everything and free at most budget entries now, returns the number of invalidated entries still held")},
+    {"invalidate_tag", (PyCFunction)LRU_invalidate_tag, METH_O,
+                    PyDoc_STR("L.invalidate_tag(tag) -> delete the items set with tag among their tags, returns how many were deleted")},
+    {"invalidate_all", (PyCFunction)LRU_invalidate_all, METH_NOARGS,
+                    PyDoc_STR("L.invalidate_all() -> make every entry of L a miss in constant time, their memory is reclaimed by later inserts")},
+    {"get_stats", (PyCFunction)LRU_get_stats, METH_NOARGS,
+                    PyDoc_STR("L.get_stats() -> returns a tuple with cache hits and misses")},
+    {"get_metrics", (PyCFunction)LRU_get_metrics, METH_NOARGS,
+                    PyDoc_STR("L.get_metrics() -> dict of the counters and latency histograms of L, with metrics=True")},
+    {"miss_ratio_curve", (PyCFunction)LRU_miss_ratio_curve, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.miss_ratio_curve(sizes=None) -> list of (size, miss ratio) estimated for an LRU of each size, with mrc=n")},
+    {"flush_trace", (PyCFunction)LRU_flush_trace, METH_O,
+                    PyDoc_STR("L.flush_trace(file) -> write the events recorded since the last flush with trace=n, returns (events, dropped)")},
+    {"get_read_buffer_stats", (PyCFunction)LRU_get_read_buffer_stats, METH_NOARGS,
+                    PyDoc_STR("L.get_read_buffer_stats() -> returns a tuple with the number of buffered MRU moves applied in batches and dropped")},
+    {"get_l2_stats", (PyCFunction)LRU_get_l2_stats, METH_NOARGS,
+                    PyDoc_STR("L.get_l2_stats() -> returns a tuple with the hits, misses, entries and bytes in use of the disk tier, with l2_path")},
+    {"get_arena_stats", (PyCFunction)LRU_get_arena_stats, METH_NOARGS,
+                    PyDoc_STR("L.get_arena_stats() -> returns a tuple with the bytes reserved by the value arena and the bytes in use, with value_store='arena'")},
+    {"peek_first_item", (PyCFunction)LRU_peek_first_item, METH_NOARGS,
+                    PyDoc_STR("L.peek_first_item() -> returns the MRU item (key,value) without changing key order")},
+    {"peek_last_item", (PyCFunction)LRU_peek_last_item, METH_NOARGS,
+                    PyDoc_STR("L.peek_last_item() -> returns the LRU item (key,value) without changing key order")},
+    {"update", (PyCFunction)LRU_update, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.update([E, ]**F) -> update value for key in LRU from a mapping or an iterable of (key, value) pairs, and F")},
+    {"get_many", (PyCFunction)LRU_get_many, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.get_many(keys, default=None) -> list with the value of each key in keys, or default if it is missing")},
+    {"set_many", (PyCFunction)LRU_set_many, METH_O,
+                    PyDoc_STR("L.set_many(pairs) -> set each (key, value) in pairs. Eviction callbacks run once all pairs are set")},
+    {"delete_many", (PyCFunction)LRU_delete_many, METH_O,
+                    PyDoc_STR("L.delete_many(keys) -> delete each key in keys that is in L, returns the number of deleted keys")},
+    {"set_callback", (PyCFunction)LRU_set_callback, METH_O,
+                    PyDoc_STR("L.set_callback(callback) -> set a callback to call when an item is evicted.")},
+    {NULL,	NULL},
+};
+
+static PyObject*
+LRU_repr_impl(LRU* self)
+{
+    PyObject *d, *result;
+    Table *t = self->table;
+    uint32_t index;
+
+    if (!t)
+        return PyObject_Repr(self->dict);
+
+    /* Render the compact engine like a dict, oldest entry first as the dict engine does. */
+    d = PyDict_New();
+    if (!d)
+        return NULL;
+    for (index = t->last; index != TABLE_NIL; index = t->entries[index].prev) {
+        if (PyDict_SetItem(d, t->entries[index].key, t->entries[index].value) < 0) {
+            Py_DECREF(d);
+            return NULL;
+        }
+    }
+    result = PyObject_Repr(d);
+    Py_DECREF(d);
+    return result;
+}
+
+static PyObject *
+LRU_repr(LRU *self)
+{
+    PyObject *result;
+    LRU_LOCKED(result, LRU_repr_impl(self));
+    return result;
+}
+
+static int
+LRU_init(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"size", "callback", "engine", "read_buffer", "policy", "ttl", "timer",
+                             "callback_reason", "max_weight", "weigher", "callback_batch",
+                             "metrics", "mrc", "trace", "value_store", "copy_values", "l2_path",
+                             "l2_size", NULL};
+    PyObject *callback = NULL, *ttl_arg = NULL, *timer = NULL, *max_weight = NULL;
+    PyObject *weigher = NULL, *l2_path = NULL;
+    const char *engine = NULL;
+    const char *policy = NULL;
+    const char *value_store = NULL;
+    Py_ssize_t read_buffer = 0, mrc = 0, trace = 0, l2_size = 0;
+    int64_t ttl;
+    int metrics = 0;
+    self->callback = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|OznzOOpOOppnnzpOn", kwlist, &self->size,
+                                     &callback, &engine, &read_buffer, &policy, &ttl_arg, &timer,
+                                     &self->callback_reason, &max_weight, &weigher,
+                                     &self->callback_batch, &metrics, &mrc, &trace,
+                                     &value_store, &self->copy_values, &l2_path, &l2_size)) {
+        return -1;
+    }
+    if (value_store && strcmp(value_store, "object") != 0) {
+        if (strcmp(value_store, "arena") != 0) {
+            PyErr_Format(PyExc_ValueError, "value_store must be 'object' or 'arena', not '%s'",
+                         value_store);
+            return -1;
+        }
+        if (engine && strcmp(engine, "compact") == 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "value_store='arena' is not supported with engine='compact'");
+            return -1;
+        }
+        if (read_buffer) {
+            PyErr_SetString(PyExc_ValueError,
+                            "value_store='arena' can't be combined with read_buffer");
+            return -1;
+        }
+        if (!self->arena && !(self->arena = PyMem_Calloc(1, sizeof(Arena)))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    if (self->copy_values && !self->arena) {
+        PyErr_SetString(PyExc_ValueError, "copy_values needs value_store='arena'");
+        return -1;
+    }
+    if (l2_path == Py_None)
+        l2_path = NULL;
+    if (l2_path || l2_size) {
+        if (!l2_path || l2_size <= 0) {
+            PyErr_SetString(PyExc_ValueError, "l2_path needs a positive l2_size");
+            return -1;
+        }
+        if ((engine && strcmp(engine, "compact") == 0) || read_buffer) {
+            PyErr_SetString(PyExc_ValueError,
+                            "l2_path can't be combined with engine='compact' or read_buffer");
+            return -1;
+        }
+        if ((ttl_arg && ttl_arg != Py_None) || (timer && timer != Py_None)) {
+            PyErr_SetString(PyExc_ValueError, "l2_path can't be combined with ttl");
+            return -1;
+        }
+    }
+    if (mrc < 0) {
+        PyErr_SetString(PyExc_ValueError, "mrc should not be negative");
+        return -1;
+    }
+    if (mrc && read_buffer) {
+        PyErr_SetString(PyExc_ValueError, "mrc can't be combined with read_buffer");
+        return -1;
+    }
+    if (mrc && !self->mrc && !(self->mrc = mrc_new(mrc)))
+        return -1;
+    if (trace < 0) {
+        PyErr_SetString(PyExc_ValueError, "trace should not be negative");
+        return -1;
+    }
+    if (trace && read_buffer) {
+        PyErr_SetString(PyExc_ValueError, "trace can't be combined with read_buffer");
+        return -1;
+    }
+    if (trace && !self->trace && !(self->trace = trace_new(trace)))
+        return -1;
+    /* Buffered hits don't take the lock the counters and histograms are updated under. */
+    if (metrics && read_buffer) {
+        PyErr_SetString(PyExc_ValueError, "metrics can't be combined with read_buffer");
+        return -1;
+    }
+    if (metrics && !self->metrics) {
+        self->metrics = PyMem_Calloc(1, sizeof(Metrics));
+        if (!self->metrics) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    if (max_weight && max_weight != Py_None) {
+        self->max_weight = PyLong_AsSsize_t(max_weight);
+        if (self->max_weight == -1 && PyErr_Occurred())
+            return -1;
+        if (self->max_weight <= 0) {
+            PyErr_SetString(PyExc_ValueError, "max_weight should be a positive number");
+            return -1;
+        }
+        if (engine && strcmp(engine, "compact") == 0) {
+            PyErr_SetString(PyExc_ValueError, "max_weight is not supported with engine='compact'");
+            return -1;
+        }
+        if (read_buffer) {
+            PyErr_SetString(PyExc_ValueError, "max_weight can't be combined with read_buffer");
+            return -1;
+        }
+    }
+    if (weigher && weigher != Py_None) {
+        if (!self->max_weight) {
+            PyErr_SetString(PyExc_ValueError, "weigher needs max_weight");
+            return -1;
+        }
+        if (!PyCallable_Check(weigher)) {
+            PyErr_SetString(PyExc_TypeError, "weigher must be callable");
+            return -1;
+        }
+        Py_INCREF(weigher);
+        Py_XSETREF(self->weigher, weigher);
+    }
+    if (lru_parse_ttl(ttl_arg, &ttl) < 0)
+        return -1;
+    if (ttl == WHEEL_DEFAULT_TTL)
+        ttl = WHEEL_NO_TTL;
+    if (timer == Py_None)
+        timer = NULL;
+    if (timer && !PyCallable_Check(timer)) {
+        PyErr_SetString(PyExc_TypeError, "timer must be callable");
+        return -1;
+    }
+    if (ttl != WHEEL_NO_TTL || timer) {
+        if (engine && strcmp(engine, "compact") == 0) {
+            PyErr_SetString(PyExc_ValueError, "ttl is not supported with engine='compact'");
+            return -1;
+        }
+        if (read_buffer) {
+            PyErr_SetString(PyExc_ValueError, "ttl can't be combined with read_buffer");
+            return -1;
+        }
+    }
+    if (!policy || strcmp(policy, "lru") == 0) {
+        self->policy = LRU_POLICY_LRU;
+    } else if (strcmp(policy, "clock") == 0) {
+        self->policy = LRU_POLICY_CLOCK;
+    } else if (strcmp(policy, "slru") == 0) {
+        self->policy = LRU_POLICY_SLRU;
+    } else if (strcmp(policy, "2q") == 0) {
+        self->policy = LRU_POLICY_2Q;
+    } else if (strcmp(policy, "tinylfu") == 0) {
+        self->policy = LRU_POLICY_TINYLFU;
+    } else {
+        PyErr_Format(PyExc_ValueError,
+                     "policy must be 'lru', 'clock', 'slru', '2q' or 'tinylfu', not '%s'", policy);
+        return -1;
+    }
+    if (self->policy != LRU_POLICY_LRU) {
+        if (engine && strcmp(engine, "compact") == 0) {
+            PyErr_Format(PyExc_ValueError, "policy '%s' is not supported by engine='compact'",
+                         policy);
+            return -1;
+        }
+        if (read_buffer) {
+            PyErr_Format(PyExc_ValueError, "policy '%s' can't be combined with read_buffer",
+                         policy);
+            return -1;
+        }
+    }
+    if (read_buffer < 0) {
+        PyErr_SetString(PyExc_ValueError, "read_buffer should not be negative");
+        return -1;
+    }
+    if (read_buffer && engine && strcmp(engine, "compact") == 0) {
+        PyErr_SetString(PyExc_ValueError, "read_buffer is not supported with engine='compact'");
+        return -1;
+    }
+
+    if (engine && strcmp(engine, "dict") != 0 && strcmp(engine, "compact") != 0) {
+        PyErr_Format(PyExc_ValueError, "engine must be 'dict' or 'compact', not '%s'", engine);
+        return -1;
+    }
+
+    if (callback && callback != Py_None) {
+        if (!PyCallable_Check(callback)) {
+            PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+            return -1;
+        }
+        Py_XINCREF(callback);
+        self->callback = callback;
+    }
+
+    if ((Py_ssize_t)self->size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
+        return -1;
+    }
+    if (engine && strcmp(engine, "compact") == 0) {
+        if (self->size >= TABLE_MAX_ENTRIES) {
+            PyErr_SetString(PyExc_ValueError, "Size is too large for the compact engine");
+            return -1;
+        }
+        self->table = PyMem_New(Table, 1);
+        if (!self->table || table_init(self->table) < 0) {
+            PyMem_Free(self->table);
+            self->table = NULL;
+            if (!PyErr_Occurred())
+                PyErr_NoMemory();
+            return -1;
+        }
+    } else {
+        self->dict = PyDict_New();
+        if (read_buffer && rbuf_new(self, read_buffer) < 0)
+            return -1;
+        if (self->policy >= LRU_POLICY_SLRU && seg_new(self) < 0)
+            return -1;
+        if ((ttl != WHEEL_NO_TTL || timer) && wheel_new(self, timer, ttl) < 0)
+            return -1;
+        self->pool_max = lru_pool_limit(self);
+        if (l2_path && !self->l2 && !(self->l2 = l2_new(l2_path, l2_size)))
+            return -1;
+    }
+    self->first = self->last = NULL;
+    self->hits = 0;
+    self->misses = 0;
+    return 0;
+}
+
+static void
+LRU_dealloc(LRU *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    if (self->table) {
+        table_free(self->table);
+        PyMem_Free(self->table);
+        Py_XDECREF(self->callback);
+    }
+    if (self->dict) {
+        /* A dying LRU does not report its entries. */
+        Py_CLEAR(self->callback);
+        rbuf_free(self);
+        LRU_clear_impl(self);
+        seg_free(self);
+        wheel_free(self);
+        Py_XDECREF(self->weigher);
+        lru_pool_trim(self, 0);
+        Py_DECREF(self->dict);
+    }
+    if (self->arena)
+        arena_free(self->arena);
+    if (self->l2)
+        l2_free(self->l2);
+    Py_XDECREF(self->tags);
+    Py_XDECREF(self->pending);
+    Py_XDECREF(self->callback_error[0]);
+    Py_XDECREF(self->callback_error[1]);
+    Py_XDECREF(self->callback_error[2]);
+    PyMem_Free(self->metrics);
+    PyMem_Free(self->mrc);
+    PyMem_Free(self->trace);
+    Py_XDECREF(self->inflight);
+    PyObject_Del((PyObject*)self);
+    Py_DECREF(tp);
+}
+
+PyDoc_STRVAR(lru_doc,
+"LRU(size, callback=None, engine='dict', read_buffer=0, policy='lru', ttl=None,\n"
+"    timer=None, callback_reason=False, max_weight=None, weigher=None,\n"
+"    callback_batch=False, metrics=False, mrc=0, trace=0, value_store='object',\n"
+"    copy_values=False, l2_path=None, l2_size=0) -> new LRU dict\n"
+"that can store up to size elements\n"
+"An LRU dict behaves like a standard dict, except that it stores only fixed\n"
+"set of elements. Once the size overflows, it evicts least recently used\n"
+"items.  If a callback is set it will call the callback with the evicted key\n"
+" and item.\n\n"
+"read_buffer=n records hits in buffers of n slots and applies the MRU moves\n"
+"in batches. On free-threaded Python hits then don't take the LRU lock.\n\n"
+"engine='compact' keeps entries in one contiguous array behind an open\n"
+"addressing index instead of a dict of linked list nodes. It behaves the\n"
+"same and uses much less memory per entry.\n\n"
+"policy='clock' approximates LRU order: a hit only marks the entry, and\n"
+"eviction gives marked entries a second chance before evicting.\n"
+"policy='slru', '2q' or 'tinylfu' select scan resistant policies, which keep\n"
+"entries that are used repeatedly when many keys are only used once.\n\n"
+"ttl=seconds makes entries expire that long after they were set, set() takes\n"
+"a per key ttl. Expired entries are dropped when they are looked up, by\n"
+"expire() and when room is needed. timer replaces the monotonic clock, and\n"
+"with callback_reason=True the callback also gets the reason of the eviction,\n"
+"'capacity', 'resize', 'expired' or 'explicit' for del, pop and clear.\n\n"
+"callback_batch=True collects the evictions of a call and passes them to the\n"
+"callback as one list of tuples once the call is done. Callback exceptions\n"
+"are raised by the call after the LRU is updated.\n\n"
+"max_weight also bounds the total weight of the entries. The weight of an\n"
+"entry is given to set() or computed by weigher(key, value), 1 without one.\n\n"
+"dump(file) and load(file) save and restore the entries in a binary format,\n"
+"keeping their order.\n\n"
+"metrics=True counts inserts, updates, deletes, evictions and callback time\n"
+"and samples operation latencies, see get_metrics().\n\n"
+"mrc=n samples the key stream to estimate the miss ratio an LRU of any size\n"
+"up to n would have, see miss_ratio_curve().\n\n"
+"trace=n records the last n lookups, sets, deletes and evictions in a ring\n"
+"buffer, see flush_trace() and simulate().\n\n"
+"value_store='arena' copies values, which must be bytes-like, into memory\n"
+"owned by the LRU and returns them as read only memoryviews, or as bytes with\n"
+"copy_values=True. A view keeps its bytes alive after the entry is evicted.\n\n"
+"l2_path and l2_size add a disk tier: entries evicted for capacity are\n"
+"written to a log of l2_size bytes in a memory mapped file, and lookups\n"
+"missing in memory move them back. See get_l2_stats().\n\n"
+"Eg:\n"
+">>> l = LRU(3)\n"
+">>> for i in range(5):\n"
+">>>   l[i] = str(i)\n"
+">>> l.keys()\n"
+"[2,3,4]\n\n"
+"Note: An LRU(n) can be thought of as a dict that will have the most\n"
+"recently accessed n items.\n");
+
+static PyType_Slot lru_slots[] = {
+    {Py_tp_dealloc, LRU_dealloc},
+    {Py_tp_repr, LRU_repr},
+    {Py_sq_contains, LRU_seq_contains},
+    {Py_mp_length, LRU_length},
+    {Py_mp_subscript, LRU_subscript},
+    {Py_mp_ass_subscript, LRU_ass_sub},
+    {Py_tp_doc, (void *)lru_doc},
+    {Py_tp_iter, LRU_iter},
+    {Py_tp_methods, LRU_methods},
+    {Py_tp_init, LRU_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL},
+};
+
+static PyType_Spec lru_spec = {
+    "lru.LRU", sizeof(LRU), 0, LRU_TPFLAGS, lru_slots,
+};
+
+/*
+ * ShardedLRU splits its capacity over a fixed number of independent LRU segments and sends
+ * every key to one of them by hash. Each segment has its own lock on free-threaded builds, so
+ * threads working on different keys rarely contend on the same lock or list. Recency is only
+ * tracked within a segment: eviction picks the LRU item of the segment the new key goes to.
+ */
+
+#define SHARDED_DEFAULT_SHARDS 16
+
+typedef struct {
+    PyObject_HEAD
+    LRU **shards;
+    Py_ssize_t nshards;
+    Py_ssize_t size;
+} ShardedLRU;
+
+static LRU *
+sharded_shard(ShardedLRU *self, PyObject *key)
+{
+    uint64_t h;
+    Py_hash_t hash = lru_hash(key);
+    if (hash == -1)
+        return NULL;
+    /* The segments hash the key again with the same bits, so select by the high bits of a
+     * multiplicative mix instead of hash % nshards. */
+    h = (uint64_t)(Py_uhash_t)hash * UINT64_C(0x9E3779B97F4A7C15);
+    return self->shards[(h >> 32) % (uint64_t)self->nshards];
+}
+
+/* Size of segment i when size is spread over nshards segments. */
+static Py_ssize_t
+sharded_shard_size(Py_ssize_t size, Py_ssize_t nshards, Py_ssize_t i)
+{
+    return size / nshards + (i < size % nshards ? 1 : 0);
+}
+
+static int
+sharded_check(ShardedLRU *self)
+{
+    if (!self->shards) {
+        PyErr_SetString(PyExc_RuntimeError, "ShardedLRU is not initialized");
+        return -1;
+    }
+    return 0;
+}
+
+static Py_ssize_t
+sharded_length(ShardedLRU *self)
+{
+    Py_ssize_t i, n = 0;
+    if (sharded_check(self) < 0)
+        return -1;
+    for (i = 0; i < self->nshards; i++)
+        n += LRU_length(self->shards[i]);
+    return n;
+}
+
+static PyObject *
+sharded_subscript(ShardedLRU *self, PyObject *key)
+{
+    LRU *shard;
+    if (sharded_check(self) < 0 || !(shard = sharded_shard(self, key)))
+        return NULL;
+    return LRU_subscript(shard, key);
+}
+
+static int
+sharded_ass_sub(ShardedLRU *self, PyObject *key, PyObject *value)
+{
+    LRU *shard;
+    if (sharded_check(self) < 0 || !(shard = sharded_shard(self, key)))
+        return -1;
+    return LRU_ass_sub(shard, key, value);
+}
+
+static int
+sharded_contains(ShardedLRU *self, PyObject *key)
+{
+    LRU *shard;
+    if (sharded_check(self) < 0 || !(shard = sharded_shard(self, key)))
+        return -1;
+    return LRU_seq_contains(shard, key);
+}
+
+static PyObject *
+ShardedLRU_contains_key(ShardedLRU *self, PyObject *key)
+{
+    int res = sharded_contains(self, key);
+    if (res < 0)
+        return NULL;
+    return PyBool_FromLong(res);
+}
+
+/* Calls a key, default=... method of the segment owning the key. */
+static PyObject *
+sharded_call_key_default(ShardedLRU *self, const char *fname,
+                         PyObject *(*method)(LRU *, PyObject *const *, Py_ssize_t, PyObject *),
+                         PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *argv[2] = {NULL, NULL};
+    LRU *shard;
+
+    if (lru_parse_args(fname, args, nargs, kwnames, key_default_kwlist, 1, 2, argv) < 0)
+        return NULL;
+    if (sharded_check(self) < 0 || !(shard = sharded_shard(self, argv[0])))
+        return NULL;
+    return method(shard, argv, argv[1] ? 2 : 1, NULL);
+}
+
+static PyObject *
+ShardedLRU_get(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *argv[3] = {NULL, NULL, NULL};
+    LRU *shard;
+    int promote;
+
+    if ((promote = lru_parse_get(args, nargs, kwnames, argv)) < 0)
+        return NULL;
+    if (sharded_check(self) < 0 || !(shard = sharded_shard(self, argv[0])))
+        return NULL;
+    return lru_get_call(shard, argv[0], argv[1], promote);
+}
+
+static PyObject *
+ShardedLRU_peek(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return sharded_call_key_default(self, "peek", LRU_peek, args, nargs, kwnames);
+}
+
+static PyObject *
+ShardedLRU_contains_many(ShardedLRU *self, PyObject *keys)
+{
+    PyObject *seq, *result, *key;
+    Py_ssize_t i, n;
+    LRU *shard;
+    int res;
+
+    if (sharded_check(self) < 0)
+        return NULL;
+    seq = PySequence_Fast(keys, "contains_many() argument must be iterable");
+    if (!seq)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    result = PyList_New(n);
+    if (!result) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        key = PySequence_Fast_GET_ITEM(seq, i);
+        if (!(shard = sharded_shard(self, key)) || (res = lru_has(shard, key)) < 0) {
+            Py_DECREF(result);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, PyBool_FromLong(res));
+    }
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject *
+ShardedLRU_pop(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    return sharded_call_key_default(self, "pop", LRU_pop, args, nargs, kwnames);
+}
+
+static PyObject *
+ShardedLRU_get_or_load(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    LRU *shard;
+    if (lru_check_positional("get_or_load", nargs, 2, 2) < 0)
+        return NULL;
+    if (sharded_check(self) < 0 || !(shard = sharded_shard(self, args[0])))
+        return NULL;
+    return LRU_get_or_load(shard, args, nargs);
+}
+
+static PyObject *
+ShardedLRU_setdefault(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    LRU *shard;
+    if (lru_check_positional("setdefault", nargs, 1, 2) < 0)
+        return NULL;
+    if (sharded_check(self) < 0 || !(shard = sharded_shard(self, args[0])))
+        return NULL;
+    return LRU_setdefault(shard, args, nargs);
+}
+
+static PyObject *
+ShardedLRU_set(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *argv[5] = {NULL, NULL, NULL, NULL, NULL};
+    LRU *shard;
+
+    if (lru_parse_args("set", args, nargs, kwnames, set_kwlist, 2, 5, argv) < 0)
+        return NULL;
+    if (sharded_check(self) < 0 || !(shard = sharded_shard(self, argv[0])))
+        return NULL;
+    if (!argv[2])
+        argv[2] = Py_None;
+    if (argv[4] && !argv[3])
+        argv[3] = Py_None;
+    return LRU_set(shard, argv, argv[4] ? 5 : argv[3] ? 4 : 3, NULL);
+}
+
+static PyObject *
+ShardedLRU_expire(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    Py_ssize_t i, expired = 0;
+    PyObject *res;
+    if (sharded_check(self) < 0)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        if (!(res = LRU_expire(self->shards[i], NULL)))
+            return NULL;
+        expired += PyLong_AsSsize_t(res);
+        Py_DECREF(res);
+    }
+    return PyLong_FromSsize_t(expired);
+}
+
+static PyObject *
+ShardedLRU_popitem(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    Py_ssize_t i;
+    PyObject *result;
+
+    if (sharded_check(self) < 0)
+        return NULL;
+    /* There is no global recency order, pop from the first non empty segment. */
+    for (i = 0; i < self->nshards; i++) {
+        result = LRU_popitem(self->shards[i], args, nargs, kwnames);
+        if (result || !PyErr_ExceptionMatches(PyExc_KeyError))
+            return result;
+        PyErr_Clear();
+    }
+    PyErr_SetString(PyExc_KeyError, "popitem(): ShardedLRU is empty");
+    return NULL;
+}
+
+/* Concatenates the keys(), values() or items() lists of all segments. */
+static PyObject *
+sharded_collect(ShardedLRU *self, PyObject *(*method)(LRU *, PyObject *))
+{
+    PyObject *result, *part;
+    Py_ssize_t i;
+
+    if (sharded_check(self) < 0)
+        return NULL;
+    result = PyList_New(0);
+    if (!result)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        part = method(self->shards[i], NULL);
+        if (!part || PyList_SetSlice(result, PY_SSIZE_T_MAX, PY_SSIZE_T_MAX, part) < 0) {
+            Py_XDECREF(part);
+            Py_DECREF(result);
+            return NULL;
+        }
+        Py_DECREF(part);
+    }
+    return result;
+}
+
+static PyObject *
+ShardedLRU_keys(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return sharded_collect(self, LRU_keys);
+}
+
+static PyObject *
+ShardedLRU_values(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return sharded_collect(self, LRU_values);
+}
+
+static PyObject *
+ShardedLRU_items(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return sharded_collect(self, LRU_items);
+}
+
+static Py_ssize_t
+sharded_source_count(PyObject *owner)
+{
+    return ((ShardedLRU *)owner)->nshards;
+}
+
+static LRU *
+sharded_source_shard(PyObject *owner, Py_ssize_t i)
+{
+    return ((ShardedLRU *)owner)->shards[i];
+}
+
+static LRU *
+sharded_source_shard_of(PyObject *owner, PyObject *key)
+{
+    return sharded_shard((ShardedLRU *)owner, key);
+}
+
+static const IterSource sharded_source = {
+    sharded_source_count, sharded_source_shard, sharded_source_shard_of,
+};
+
+static PyObject *
+sharded_iter(ShardedLRU *self, int kind, int reverse)
+{
+    if (sharded_check(self) < 0)
+        return NULL;
+    return lru_iter_new((PyObject *)self, &sharded_source, kind, reverse);
+}
+
+static PyObject *
+sharded_view(ShardedLRU *self, int kind)
+{
+    if (sharded_check(self) < 0)
+        return NULL;
+    return lru_view_new((PyObject *)self, &sharded_source, kind);
+}
+
+static PyObject *
+ShardedLRU_iter(ShardedLRU *self)
+{
+    return sharded_iter(self, ITER_KEYS, 0);
+}
+
+static PyObject *
+ShardedLRU_reversed(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return sharded_iter(self, ITER_KEYS, 1);
+}
+
+static PyObject *
+ShardedLRU_iterkeys(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return sharded_iter(self, ITER_KEYS, 0);
+}
+
+static PyObject *
+ShardedLRU_itervalues(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return sharded_iter(self, ITER_VALUES, 0);
+}
+
+static PyObject *
+ShardedLRU_iteritems(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return sharded_iter(self, ITER_ITEMS, 0);
+}
+
+static PyObject *
+ShardedLRU_viewkeys(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return sharded_view(self, ITER_KEYS);
+}
+
+static PyObject *
+ShardedLRU_viewvalues(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return sharded_view(self, ITER_VALUES);
+}
+
+static PyObject *
+ShardedLRU_viewitems(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return sharded_view(self, ITER_ITEMS);
+}
+
+static PyObject *
+ShardedLRU_update(ShardedLRU *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *arg = NULL;
+    int res = 0;
+
+    if (!PyArg_UnpackTuple(args, "update", 0, 1, &arg) || sharded_check(self) < 0)
+        return NULL;
+    if (arg) {
+        if (PyDict_CheckExact(arg) || PyObject_HasAttrString(arg, "keys"))
+            res = lru_update_from_mapping((PyObject *)self, (objobjargproc)sharded_ass_sub, arg);
+        else
+            res = lru_update_from_pairs((PyObject *)self, (objobjargproc)sharded_ass_sub, arg);
+    }
+    if (res == 0 && kwargs != NULL)
+        res = lru_update_from_mapping((PyObject *)self, (objobjargproc)sharded_ass_sub, kwargs);
+    if (res < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ShardedLRU_set_many(ShardedLRU *self, PyObject *pairs)
+{
+    if (sharded_check(self) < 0 ||
+        lru_update_from_pairs((PyObject *)self, (objobjargproc)sharded_ass_sub, pairs) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ShardedLRU_get_many(ShardedLRU *self, PyObject *args, PyObject *keywds)
+{
+    PyObject *keys, *seq, *result, *value, *argv[2];
+    PyObject *default_obj = Py_None;
+    Py_ssize_t i, n;
+    LRU *shard;
+
+    static char *kwlist[] = {"keys", "default", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|O:get_many", kwlist, &keys, &default_obj))
+        return NULL;
+    if (sharded_check(self) < 0)
+        return NULL;
+
+    seq = PySequence_Fast(keys, "get_many() argument must be iterable");
+    if (!seq)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    result = PyList_New(n);
+    if (!result) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+    argv[1] = default_obj;
+    for (i = 0; i < n; i++) {
+        argv[0] = PySequence_Fast_GET_ITEM(seq, i);
+        shard = sharded_shard(self, argv[0]);
+        value = shard ? LRU_get(shard, argv, 2, NULL) : NULL;
+        if (!value) {
+            Py_DECREF(result);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, value);
+    }
+    Py_DECREF(seq);
+    return result;
+}
+
+static PyObject *
+ShardedLRU_delete_many(ShardedLRU *self, PyObject *keys)
+{
+    PyObject *seq, *key;
+    Py_ssize_t i, n, deleted = 0;
+
+    if (sharded_check(self) < 0)
+        return NULL;
+    seq = PySequence_Fast(keys, "delete_many() argument must be iterable");
+    if (!seq)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    for (i = 0; i < n; i++) {
+        key = PySequence_Fast_GET_ITEM(seq, i);
+        if (sharded_ass_sub(self, key, NULL) == 0) {
+            deleted++;
+        } else if (PyErr_ExceptionMatches(PyExc_KeyError)) {
+            PyErr_Clear();
+        } else {
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+    return PyLong_FromSsize_t(deleted);
+}
+
+/* With a budget, each shard gets its share of it, see sharded_shard_size. */
+static PyObject *
+ShardedLRU_clear(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char * const kwlist[] = {"budget", NULL};
+    PyObject *argv[1] = {NULL};
+    PyObject *res, *share;
+    Py_ssize_t i, budget = -1, left = 0;
+
+    if (lru_parse_args("clear", args, nargs, kwnames, kwlist, 0, 1, argv) < 0)
+        return NULL;
+    if (sharded_check(self) < 0)
+        return NULL;
+    if (argv[0] && argv[0] != Py_None) {
+        budget = PyLong_AsSsize_t(argv[0]);
+        if (budget == -1 && PyErr_Occurred())
+            return NULL;
+        if (budget < 0) {
+            PyErr_SetString(PyExc_ValueError, "budget should not be negative");
+            return NULL;
+        }
+    }
+    for (i = 0; i < self->nshards; i++) {
+        if (budget < 0) {
+            res = LRU_clear(self->shards[i], NULL, 0, NULL);
+        } else {
+            if (!(share = PyLong_FromSsize_t(sharded_shard_size(budget, self->nshards, i))))
+                return NULL;
+            res = LRU_clear(self->shards[i], &share, 1, NULL);
+            Py_DECREF(share);
+        }
+        if (!res)
+            return NULL;
+        if (budget >= 0)
+            left += PyLong_AsSsize_t(res);
+        Py_DECREF(res);
+    }
+    if (budget < 0)
+        Py_RETURN_NONE;
+    return PyLong_FromSsize_t(left);
+}
+
+static PyObject *
+ShardedLRU_invalidate_tag(ShardedLRU *self, PyObject *tag)
+{
+    Py_ssize_t i, removed = 0;
+    PyObject *res;
+    if (sharded_check(self) < 0)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        if (!(res = LRU_invalidate_tag(self->shards[i], tag)))
+            return NULL;
+        removed += PyLong_AsSsize_t(res);
+        Py_DECREF(res);
+    }
+    return PyLong_FromSsize_t(removed);
+}
+
+static PyObject *
+ShardedLRU_invalidate_all(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    Py_ssize_t i;
+    PyObject *res;
+    if (sharded_check(self) < 0)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        if (!(res = LRU_invalidate_all(self->shards[i], NULL)))
+            return NULL;
+        Py_DECREF(res);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ShardedLRU_set_callback(ShardedLRU *self, PyObject *callback)
+{
+    Py_ssize_t i;
+    PyObject *res;
+    if (sharded_check(self) < 0)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        if (!(res = LRU_set_callback(self->shards[i], callback)))
+            return NULL;
+        Py_DECREF(res);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ShardedLRU_set_size(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"size", "incremental", NULL};
+    Py_ssize_t i, size;
+    int incremental = 0;
+    PyObject *res, *shard_args;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|p:set_size", kwlist, &size, &incremental) ||
+        sharded_check(self) < 0)
+        return NULL;
+    if (size < self->nshards) {
+        PyErr_Format(PyExc_ValueError, "Size should be at least the number of shards (%zd)",
+                     self->nshards);
+        return NULL;
+    }
+    for (i = 0; i < self->nshards; i++) {
+        shard_args = Py_BuildValue("(ni)", sharded_shard_size(size, self->nshards, i),
+                                   incremental);
+        if (!shard_args)
+            return NULL;
+        res = LRU_set_size(self->shards[i], shard_args, NULL);
+        Py_DECREF(shard_args);
+        if (!res)
+            return NULL;
+        Py_DECREF(res);
+    }
+    self->size = size;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ShardedLRU_get_current_weight(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    Py_ssize_t i, weight = 0;
+    PyObject *res;
+    if (sharded_check(self) < 0)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        if (!(res = LRU_get_current_weight(self->shards[i], NULL)))
+            return NULL;
+        weight += PyLong_AsSsize_t(res);
+        Py_DECREF(res);
+    }
+    return PyLong_FromSsize_t(weight);
+}
+
+static PyObject *
+ShardedLRU_get_max_weight(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    Py_ssize_t i, weight = 0;
+    PyObject *res;
+    if (sharded_check(self) < 0)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        if (!(res = LRU_get_max_weight(self->shards[i], NULL)))
+            return NULL;
+        if (res == Py_None)
+            return res;
+        weight += PyLong_AsSsize_t(res);
+        Py_DECREF(res);
+    }
+    return PyLong_FromSsize_t(weight);
+}
+
+static PyObject *
+ShardedLRU_set_max_weight(ShardedLRU *self, PyObject *arg)
+{
+    Py_ssize_t i, max_weight;
+    PyObject *res, *shard_weight;
+
+    if (sharded_check(self) < 0)
+        return NULL;
+    max_weight = PyLong_AsSsize_t(arg);
+    if (max_weight == -1 && PyErr_Occurred())
+        return NULL;
+    if (max_weight < self->nshards) {
+        PyErr_Format(PyExc_ValueError,
+                     "max_weight should be at least the number of shards (%zd)", self->nshards);
+        return NULL;
+    }
+    for (i = 0; i < self->nshards; i++) {
+        shard_weight = PyLong_FromSsize_t(sharded_shard_size(max_weight, self->nshards, i));
+        if (!shard_weight)
+            return NULL;
+        res = LRU_set_max_weight(self->shards[i], shard_weight);
+        Py_DECREF(shard_weight);
+        if (!res)
+            return NULL;
+        Py_DECREF(res);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ShardedLRU_get_size(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return PyLong_FromSsize_t(self->size);
+}
+
+static PyObject *
+ShardedLRU_get_shards(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    return PyLong_FromSsize_t(self->nshards);
+}
+
+static PyObject *
+ShardedLRU_get_stats(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    Py_ssize_t i, hits = 0, misses = 0;
+    LRU *shard;
+
+    if (sharded_check(self) < 0)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        shard = self->shards[i];
+        Py_BEGIN_CRITICAL_SECTION(shard);
+        hits += shard->hits;
+        misses += shard->misses;
+        Py_END_CRITICAL_SECTION();
+    }
+    return Py_BuildValue("nn", hits, misses);
+}
+
+static PyObject *
+ShardedLRU_get_metrics(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    Py_ssize_t i, hits = 0, misses = 0, shard_hits, shard_misses;
+    Metrics *sum;
+    PyObject *result;
+    LRU *shard;
+    int ok = 1;
+
+    if (sharded_check(self) < 0 || lru_check_metrics(self->shards[0]->metrics) < 0)
+        return NULL;
+    sum = PyMem_Calloc(1, sizeof(Metrics));
+    if (!sum)
+        return PyErr_NoMemory();
+    for (i = 0; i < self->nshards; i++) {
+        shard = self->shards[i];
+        Py_BEGIN_CRITICAL_SECTION(shard);
+        if (shard->metrics) {
+            lru_stats(shard, &shard_hits, &shard_misses);
+            hits += shard_hits;
+            misses += shard_misses;
+            metrics_add(sum, shard->metrics);
+        } else {
+            ok = 0;
+        }
+        Py_END_CRITICAL_SECTION();
+    }
+    result = ok ? metrics_export(sum, hits, misses) : NULL;
+    if (!ok)
+        lru_check_metrics(NULL);
+    PyMem_Free(sum);
+    return result;
+}
+
+static PyObject *
+ShardedLRU_miss_ratio_curve(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"sizes", NULL};
+    PyObject *sizes = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:miss_ratio_curve", kwlist, &sizes))
+        return NULL;
+    if (sharded_check(self) < 0)
+        return NULL;
+    return mrc_curve(self->shards, self->nshards, sizes);
+}
+
+static PyObject *
+ShardedLRU_flush_trace(ShardedLRU *self, PyObject *file)
+{
+    if (sharded_check(self) < 0)
+        return NULL;
+    return trace_flush(self->shards, self->nshards, file);
+}
+
+static PyObject *
+ShardedLRU_repr(ShardedLRU *self)
+{
+    PyObject *items, *result;
+    if (!self->shards)
+        return PyUnicode_FromString("ShardedLRU()");
+    items = sharded_collect(self, LRU_items);
+    if (!items)
+        return NULL;
+    result = PyUnicode_FromFormat("ShardedLRU(%zd, %R)", self->size, items);
+    Py_DECREF(items);
+    return result;
+}
+
+static void
+sharded_free_shards(ShardedLRU *self)
+{
+    Py_ssize_t i;
+    if (!self->shards)
+        return;
+    for (i = 0; i < self->nshards; i++)
+        Py_XDECREF(self->shards[i]);
+    PyMem_Free(self->shards);
+    self->shards = NULL;
+}
+
+static int
+ShardedLRU_init(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"size", "shards", NULL};
+    Py_ssize_t size, nshards = SHARDED_DEFAULT_SHARDS, max_weight = 0, mrc = 0, trace = 0, i;
+    PyObject *own = NULL, *options = NULL, *item, *shard_args, *shard_weight;
+    int ok;
+
+    /* size and shards are ours, every other keyword is passed on to the LRU segments. */
+    own = PyDict_New();
+    options = kwds ? PyDict_Copy(kwds) : PyDict_New();
+    if (!own || !options)
+        goto error;
+    for (i = 0; kwlist[i]; i++) {
+        item = PyDict_GetItemString(options, kwlist[i]);
+        if (!item)
+            continue;
+        if (PyDict_SetItemString(own, kwlist[i], item) < 0 ||
+            PyDict_DelItemString(options, kwlist[i]) < 0)
+            goto error;
+    }
+    ok = PyArg_ParseTupleAndKeywords(args, own, "n|n", kwlist, &size, &nshards);
+    Py_CLEAR(own);
+    if (!ok)
+        goto error;
+    if (size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
+        goto error;
+    }
+    if (nshards <= 0) {
+        PyErr_SetString(PyExc_ValueError, "shards should be a positive number");
+        goto error;
+    }
+    if (nshards > size)
+        nshards = size;
+    if (PyDict_GetItemString(options, "l2_path")) {
+        PyErr_SetString(PyExc_ValueError, "l2_path is not supported by ShardedLRU");
+        goto error;
+    }
+    /* max_weight, mrc and trace are split over the segments like size. */
+    item = PyDict_GetItemString(options, "max_weight");
+    if (item && item != Py_None) {
+        max_weight = PyLong_AsSsize_t(item);
+        if (max_weight == -1 && PyErr_Occurred())
+            goto error;
+        if (max_weight < nshards) {
+            PyErr_Format(PyExc_ValueError,
+                         "max_weight should be at least the number of shards (%zd)", nshards);
+            goto error;
+        }
+    }
+    item = PyDict_GetItemString(options, "mrc");
+    if (item) {
+        mrc = PyLong_AsSsize_t(item);
+        if (mrc == -1 && PyErr_Occurred())
+            goto error;
+        if (mrc > 0 && mrc < nshards) {
+            PyErr_Format(PyExc_ValueError,
+                         "mrc should be at least the number of shards (%zd)", nshards);
+            goto error;
+        }
+    }
+    item = PyDict_GetItemString(options, "trace");
+    if (item) {
+        trace = PyLong_AsSsize_t(item);
+        if (trace == -1 && PyErr_Occurred())
+            goto error;
+        if (trace > 0 && trace < nshards) {
+            PyErr_Format(PyExc_ValueError,
+                         "trace should be at least the number of shards (%zd)", nshards);
+            goto error;
+        }
+    }
+
+    sharded_free_shards(self);
+    self->shards = PyMem_New(LRU *, nshards);
+    if (!self->shards) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    self->nshards = nshards;
+    self->size = size;
+    for (i = 0; i < nshards; i++)
+        self->shards[i] = NULL;
+    for (i = 0; i < nshards; i++) {
+        if (max_weight) {
+            shard_weight = PyLong_FromSsize_t(sharded_shard_size(max_weight, nshards, i));
+            ok = shard_weight && PyDict_SetItemString(options, "max_weight", shard_weight) == 0;
+            Py_XDECREF(shard_weight);
+            if (!ok)
+                break;
+        }
+        if (mrc > 0) {
+            shard_weight = PyLong_FromSsize_t(sharded_shard_size(mrc, nshards, i));
+            ok = shard_weight && PyDict_SetItemString(options, "mrc", shard_weight) == 0;
+            Py_XDECREF(shard_weight);
+            if (!ok)
+                break;
+        }
+        if (trace > 0) {
+            shard_weight = PyLong_FromSsize_t(sharded_shard_size(trace, nshards, i));
+            ok = shard_weight && PyDict_SetItemString(options, "trace", shard_weight) == 0;
+            Py_XDECREF(shard_weight);
+            if (!ok)
+                break;
+        }
+        shard_args = Py_BuildValue("(n)", sharded_shard_size(size, nshards, i));
+        if (!shard_args)
+            break;
+        self->shards[i] = (LRU *)PyObject_Call((PyObject *)lru_state_of((PyObject *)self)->LRUType,
+                                                shard_args, options);
+        Py_DECREF(shard_args);
+        if (!self->shards[i])
+            break;
+    }
+    if (i < nshards) {
+        sharded_free_shards(self);
+        goto error;
+    }
+    Py_DECREF(options);
+    return 0;
+
+error:
+    Py_XDECREF(own);
+    Py_XDECREF(options);
+    return -1;
+}
+
+static void
+ShardedLRU_dealloc(ShardedLRU *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    sharded_free_shards(self);
+    PyObject_Del((PyObject*)self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+ShardedLRU_dump(ShardedLRU *self, PyObject *file)
+{
+    Snapshot snap = {NULL, 0, 0};
+    Py_ssize_t i;
+    int result = 0;
+
+    if (sharded_check(self) < 0)
+        return NULL;
+    for (i = 0; i < self->nshards && result == 0; i++) {
+        LRU *shard = self->shards[i];
+        Py_BEGIN_CRITICAL_SECTION(shard);
+        result = lru_snapshot(shard, &snap);
+        Py_END_CRITICAL_SECTION();
+    }
+    if (result < 0) {
+        snapshot_free(&snap);
+        return NULL;
+    }
+    return snapshot_dump(&snap, file);
+}
+
+static int
+sharded_load_store(PyObject *owner, PyObject *key, PyObject *value, int64_t ttl,
+                   Py_ssize_t weight)
+{
+    LRU *shard = sharded_shard((ShardedLRU *)owner, key);
+    if (!shard)
+        return -1;
+    return lru_load_store((PyObject *)shard, key, value, ttl, weight);
+}
+
+static Py_ssize_t
+sharded_load_size(PyObject *owner)
+{
+    return ((ShardedLRU *)owner)->size;
+}
+
+static const LoadTarget sharded_load_target = {sharded_load_store, NULL, sharded_load_size};
+
+static PyObject *
+ShardedLRU_load(ShardedLRU *self, PyObject *file)
+{
+    if (sharded_check(self) < 0)
+        return NULL;
+    return snapshot_load((PyObject *)self, &sharded_load_target, file);
+}
+
+/*
+ * Pickles as functools.partial(ShardedLRU, **options)(size, shards) and a dump of the
+ * entries. The options are the constructor arguments of the segments, with their max_weight
+ * added up again.
+ */
+static PyObject *
+ShardedLRU_reduce(ShardedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    static const char * const names[] = {"callback", "engine", "read_buffer", "policy", "ttl",
+                                         "timer", "callback_reason", "max_weight", "weigher",
+                                         "callback_batch", "metrics", "mrc", "trace",
+                                         "value_store", "copy_values", NULL};
+    PyObject *reduced, *args, *options = NULL, *functools = NULL, *factory = NULL;
+    PyObject *max_weight = NULL, *mrc_size = NULL, *trace_size = NULL, *io, *buffer;
+    PyObject *state = NULL, *result = NULL;
+    Py_ssize_t i;
+
+    if (sharded_check(self) < 0)
+        return NULL;
+    reduced = LRU_reduce(self->shards[0], NULL);
+    if (!reduced)
+        return NULL;
+    args = PyTuple_GET_ITEM(reduced, 1);
+    options = PyDict_New();
+    if (!options)
+        goto done;
+    for (i = 0; names[i]; i++) {
+        if (PyDict_SetItemString(options, names[i], PyTuple_GET_ITEM(args, i + 1)) < 0)
+            goto done;
+    }
+    if (PyTuple_GET_ITEM(args, 8) != Py_None) {
+        if (!(max_weight = ShardedLRU_get_max_weight(self, NULL)) ||
+            PyDict_SetItemString(options, "max_weight", max_weight) < 0)
+            goto done;
+    }
+    if (self->shards[0]->mrc) {
+        Py_ssize_t mrc = 0;
+        for (i = 0; i < self->nshards; i++)
+            mrc += self->shards[i]->mrc->max_size;
+        if (!(mrc_size = PyLong_FromSsize_t(mrc)) ||
+            PyDict_SetItemString(options, "mrc", mrc_size) < 0)
+            goto done;
+    }
+    if (self->shards[0]->trace) {
+        Py_ssize_t trace = 0;
+        for (i = 0; i < self->nshards; i++)
+            trace += self->shards[i]->trace->capacity;
+        if (!(trace_size = PyLong_FromSsize_t(trace)) ||
+            PyDict_SetItemString(options, "trace", trace_size) < 0)
+            goto done;
+    }
+    functools = PyImport_ImportModule("functools");
+    if (!functools)
+        goto done;
+    factory = PyObject_GetAttrString(functools, "partial");
+    if (!factory)
+        goto done;
+    args = PyTuple_Pack(1, (PyObject *)Py_TYPE(self));
+    if (!args)
+        goto done;
+    Py_SETREF(factory, PyObject_Call(factory, args, options));
+    Py_DECREF(args);
+    if (!factory)
+        goto done;
+
+    io = PyImport_ImportModule("io");
+    if (!io)
+        goto done;
+    buffer = PyObject_CallMethod(io, "BytesIO", NULL);
+    Py_DECREF(io);
+    if (!buffer)
+        goto done;
+    state = ShardedLRU_dump(self, buffer);
+    if (state) {
+        Py_DECREF(state);
+        state = PyObject_CallMethod(buffer, "getvalue", NULL);
+    }
+    Py_DECREF(buffer);
+    if (!state)
+        goto done;
+    result = Py_BuildValue("O(nn)N", factory, self->size, self->nshards, state);
+done:
+    Py_DECREF(reduced);
+    Py_XDECREF(options);
+    Py_XDECREF(functools);
+    Py_XDECREF(factory);
+    Py_XDECREF(max_weight);
+    Py_XDECREF(mrc_size);
+    Py_XDECREF(trace_size);
+    return result;
+}
+
+static PyObject *
+ShardedLRU_setstate(ShardedLRU *self, PyObject *state)
+{
+    PyObject *io, *buffer, *result;
+
+    io = PyImport_ImportModule("io");
+    if (!io)
+        return NULL;
+    buffer = PyObject_CallMethod(io, "BytesIO", "O", state);
+    Py_DECREF(io);
+    if (!buffer)
+        return NULL;
+    result = ShardedLRU_load(self, buffer);
+    Py_DECREF(buffer);
+    if (!result)
+        return NULL;
+    Py_DECREF(result);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef ShardedLRU_methods[] = {
+    {"__contains__", (PyCFunction)ShardedLRU_contains_key, METH_O | METH_COEXIST,
+                    PyDoc_STR("L.__contains__(key) -> Check if key is there in L")},
+    {"has_key", (PyCFunction)ShardedLRU_contains_key, METH_O,
+                    PyDoc_STR("L.has_key(key) -> Check if key is there in L")},
+    {"keys", (PyCFunction)ShardedLRU_keys, METH_NOARGS,
+                    PyDoc_STR("L.keys() -> list of L's keys, in MRU order within each shard")},
+    {"values", (PyCFunction)ShardedLRU_values, METH_NOARGS,
+                    PyDoc_STR("L.values() -> list of L's values, in MRU order within each shard")},
+    {"items", (PyCFunction)ShardedLRU_items, METH_NOARGS,
+                    PyDoc_STR("L.items() -> list of L's items (key,value), in MRU order within each shard")},
+    {"iterkeys", (PyCFunction)ShardedLRU_iterkeys, METH_NOARGS,
+                    PyDoc_STR("L.iterkeys() -> iterator over L's keys, in MRU order within each shard")},
+    {"itervalues", (PyCFunction)ShardedLRU_itervalues, METH_NOARGS,
+                    PyDoc_STR("L.itervalues() -> iterator over L's values, in MRU order within each shard")},
+    {"iteritems", (PyCFunction)ShardedLRU_iteritems, METH_NOARGS,
+                    PyDoc_STR("L.iteritems() -> iterator over L's items (key,value), in MRU order within each shard")},
+    {"viewkeys", (PyCFunction)ShardedLRU_viewkeys, METH_NOARGS,
+                    PyDoc_STR("L.viewkeys() -> a live view of L's keys")},
+    {"viewvalues", (PyCFunction)ShardedLRU_viewvalues, METH_NOARGS,
+                    PyDoc_STR("L.viewvalues() -> a live view of L's values")},
+    {"viewitems", (PyCFunction)ShardedLRU_viewitems, METH_NOARGS,
+                    PyDoc_STR("L.viewitems() -> a live view of L's items (key,value)")},
+    {"__reversed__", (PyCFunction)ShardedLRU_reversed, METH_NOARGS,
+                    PyDoc_STR("L.__reversed__() -> iterator over L's keys in the reverse order of keys()")},
+    {"dump", (PyCFunction)ShardedLRU_dump, METH_O,
+                    PyDoc_STR("L.dump(file) -> write L's entries to a binary file, LRU first within each shard")},
+    {"load", (PyCFunction)ShardedLRU_load, METH_O,
+                    PyDoc_STR("L.load(file) -> insert the entries of a dump, returns their number")},
+    {"__reduce__", (PyCFunction)ShardedLRU_reduce, METH_NOARGS,
+                    PyDoc_STR("Pickle support")},
+    {"__setstate__", (PyCFunction)ShardedLRU_setstate, METH_O,
+                    PyDoc_STR("Pickle support")},
+    {"get", (PyCFunction)(void(*)(void))ShardedLRU_get, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.get(key, default=None, promote=True) -> If L has key return its value, otherwise default. With promote=False the lookup neither moves key nor counts as a hit or miss")},
+    {"peek", (PyCFunction)(void(*)(void))ShardedLRU_peek, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.peek(key, default=None) -> L.get(key, default, promote=False)")},
+    {"contains_many", (PyCFunction)ShardedLRU_contains_many, METH_O,
+                    PyDoc_STR("L.contains_many(keys) -> list of whether each key in keys is in L, without promoting them or counting hits")},
+    {"get_or_load", (PyCFunction)(void(*)(void))ShardedLRU_get_or_load, METH_FASTCALL,
+                    PyDoc_STR("L.get_or_load(key, loader) -> If L has key return its value, otherwise set it to loader(key) and return that. Concurrent callers missing the same key wait for the first one's loader")},
+    {"setdefault", (PyCFunction)(void(*)(void))ShardedLRU_setdefault, METH_FASTCALL,
+                    PyDoc_STR("L.setdefault(key, default=None) -> If L has key return its value, otherwise insert key with a value of default and return default")},
+    {"set", (PyCFunction)(void(*)(void))ShardedLRU_set, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.set(key, value, ttl=None, weight=None, tags=None) -> set key to value, expiring after ttl seconds. ttl=None uses the default TTL of L and weight=None the weigher. tags replaces the tags of key, tags=None keeps them")},
+    {"expire", (PyCFunction)ShardedLRU_expire, METH_NOARGS,
+                    PyDoc_STR("L.expire() -> remove the expired items, returns how many were removed")},
+    {"pop", (PyCFunction)(void(*)(void))ShardedLRU_pop, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.pop(key[, default]) -> If L has key return its value and remove it from L, otherwise return default. If default is not given and key is not in L, a KeyError is raised.")},
+    {"popitem", (PyCFunction)(void(*)(void))ShardedLRU_popitem, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.popitem([least_recent=True]) -> Returns and removes a (key, value) pair from the first non empty shard.")},
+    {"update", (PyCFunction)ShardedLRU_update, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.update([E, ]**F) -> update value for key in L from a mapping or an iterable of (key, value) pairs, and F")},
+    {"get_many", (PyCFunction)ShardedLRU_get_many, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.get_many(keys, default=None) -> list with the value of each key in keys, or default if it is missing")},
+    {"set_many", (PyCFunction)ShardedLRU_set_many, METH_O,
+                    PyDoc_STR("L.set_many(pairs) -> set each (key, value) in pairs")},
+    {"delete_many", (PyCFunction)ShardedLRU_delete_many, METH_O,
+                    PyDoc_STR("L.delete_many(keys) -> delete each key in keys that is in L, returns the number of deleted keys")},
+    {"clear", (PyCFunction)(void(*)(void))ShardedLRU_clear, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.clear(budget=None) -> clear all shards. With a budget, invalidate everything and free at most budget entries now, returns the number of invalidated entries still held")},
+    {"invalidate_tag", (PyCFunction)ShardedLRU_invalidate_tag, METH_O,
+                    PyDoc_STR("L.invalidate_tag(tag) -> delete the items set with tag among their tags, returns how many were deleted")},
+    {"invalidate_all", (PyCFunction)ShardedLRU_invalidate_all, METH_NOARGS,
+                    PyDoc_STR("L.invalidate_all() -> make every entry of L a miss, their memory is reclaimed by later inserts")},
+    {"set_size", (PyCFunction)ShardedLRU_set_size, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.set_size(size, incremental=False) -> set the total size, spread over the shards")},
+    {"get_current_weight", (PyCFunction)ShardedLRU_get_current_weight, METH_NOARGS,
+                    PyDoc_STR("L.get_current_weight() -> total weight of the items in L, 0 without max_weight")},
+    {"get_max_weight", (PyCFunction)ShardedLRU_get_max_weight, METH_NOARGS,
+                    PyDoc_STR("L.get_max_weight() -> get max_weight of L, None without it")},
+    {"set_max_weight", (PyCFunction)ShardedLRU_set_max_weight, METH_O,
+                    PyDoc_STR("L.set_max_weight(max_weight) -> set max_weight of L, evicting items if needed")},
+    {"get_size", (PyCFunction)ShardedLRU_get_size, METH_NOARGS,
+                    PyDoc_STR("L.get_size() -> get the total size of L")},
+    {"get_shards", (PyCFunction)ShardedLRU_get_shards, METH_NOARGS,
+                    PyDoc_STR("L.get_shards() -> get the number of shards of L")},
+    {"get_stats", (PyCFunction)ShardedLRU_get_stats, METH_NOARGS,
+                    PyDoc_STR("L.get_stats() -> returns a tuple with cache hits and misses of all shards")},
+    {"get_metrics", (PyCFunction)ShardedLRU_get_metrics, METH_NOARGS,
+                    PyDoc_STR("L.get_metrics() -> dict of the counters and latency histograms of all shards, with metrics=True")},
+    {"miss_ratio_curve", (PyCFunction)ShardedLRU_miss_ratio_curve, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.miss_ratio_curve(sizes=None) -> list of (size, miss ratio) estimated for an LRU of each total size, with mrc=n")},
+    {"flush_trace", (PyCFunction)ShardedLRU_flush_trace, METH_O,
+                    PyDoc_STR("L.flush_trace(file) -> write the events of all shards recorded since the last flush, merged by time, returns (events, dropped)")},
+    {"set_callback", (PyCFunction)ShardedLRU_set_callback, METH_O,
+                    PyDoc_STR("L.set_callback(callback) -> set a callback to call when an item is evicted.")},
+    {NULL,	NULL},
+};
+
+PyDoc_STRVAR(sharded_doc,
+"ShardedLRU(size, shards=16, **kwargs) -> new LRU dict split\n"
+"into shards independent LRU segments which together hold up to size elements.\n"
+"Keys are assigned to a segment by hash and each segment evicts its own least\n"
+"recently used items, so recency is tracked per segment rather than globally.\n"
+"On free-threaded Python every segment has its own lock, which lets threads\n"
+"working on different keys run in parallel. Other keyword arguments are\n"
+"passed on to every LRU segment.\n");
+
+static PyType_Slot sharded_slots[] = {
+    {Py_tp_dealloc, ShardedLRU_dealloc},
+    {Py_tp_repr, ShardedLRU_repr},
+    {Py_sq_contains, sharded_contains},
+    {Py_mp_length, sharded_length},
+    {Py_mp_subscript, sharded_subscript},
+    {Py_mp_ass_subscript, sharded_ass_sub},
+    {Py_tp_doc, (void *)sharded_doc},
+    {Py_tp_iter, ShardedLRU_iter},
+    {Py_tp_methods, ShardedLRU_methods},
+    {Py_tp_init, ShardedLRU_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL},
+};
+
+static PyType_Spec sharded_spec = {
+    "lru.ShardedLRU", sizeof(ShardedLRU), 0, LRU_TPFLAGS, sharded_slots,
+};
+
+/*
+ * lru.cache(), a memoizing wrapper around a function with an LRU of its results, in the
+ * spirit of functools.lru_cache. It is called through vectorcall. A single str, int or bytes
+ * argument is its own key, other calls get a tuple of the arguments as key. The key is hashed
+ * once: a hit costs one dict probe and a miss one more, to insert the result with
+ * PyDict_SetDefault after the call, so a recursive call which cached the key meanwhile wins.
+ * Entries are evicted after the insert, their node is recycled by the next miss.
+ */
+#if PY_VERSION_HEX < 0x03090000
+ #define PyObject_Vectorcall _PyObject_Vectorcall
+ #define Py_TPFLAGS_HAVE_VECTORCALL _Py_TPFLAGS_HAVE_VECTORCALL
+#endif
+
+typedef struct {
+    PyObject_HEAD
+    vectorcallfunc vectorcall;
+    PyObject *func;
+    LRU *lru;                   /* the results, only used for its hits with maxsize=0 */
+    Py_ssize_t maxsize;         /* -1 for an unbounded cache */
+    int typed;                  /* calls with arguments of different types are cached apart */
+    PyObject *cache_info_type;
+    PyObject *dict;
+    PyObject *weakreflist;
+} CacheWrapper;
+
+static PyObject *
+cache_make_key(CacheWrapper *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    Py_ssize_t nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0, n, i, j = 0;
+    PyObject *key;
+
+    if (nargs == 1 && !nkw) {
+        /* These can't be equal to the tuple key of another call. 1.0 == 1 though, so floats
+         * have to keep their type in a tuple when typed. */
+        PyObject *arg = args[0];
+        if (PyUnicode_CheckExact(arg) || PyLong_CheckExact(arg) || PyBytes_CheckExact(arg) ||
+            (PyFloat_CheckExact(arg) && !self->typed)) {
+            Py_INCREF(arg);
+            return arg;
+        }
+    }
+    n = nargs + (nkw ? 1 + 2 * nkw : 0) + (self->typed ? nargs + nkw : 0);
+    key = PyTuple_New(n);
+    if (!key)
+        return NULL;
+    for (i = 0; i < nargs; i++) {
+        Py_INCREF(args[i]);
+        PyTuple_SET_ITEM(key, j++, args[i]);
+    }
+    if (nkw) {
+        PyObject *mark = lru_state_of((PyObject *)self)->cache_kwd_mark;
+        Py_INCREF(mark);
+        PyTuple_SET_ITEM(key, j++, mark);
+        for (i = 0; i < nkw; i++) {
+            PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+            Py_INCREF(name);
+            PyTuple_SET_ITEM(key, j++, name);
+            Py_INCREF(args[nargs + i]);
+            PyTuple_SET_ITEM(key, j++, args[nargs + i]);
+        }
+    }
+    if (self->typed) {
+        for (i = 0; i < nargs + nkw; i++) {
+            PyObject *type = (PyObject *)Py_TYPE(args[i]);
+            Py_INCREF(type);
+            PyTuple_SET_ITEM(key, j++, type);
+        }
+    }
+    return key;
+}
+
+/* Returns a new reference to the cached result, NULL on a miss or with an error set. */
+static PyObject *
+cache_lookup(LRU *lru, PyObject *key, Py_hash_t hash)
+{
+    Node *node = (Node *)_PyDict_GetItem_KnownHash(lru->dict, key, hash);
+
+    if (!node) {
+        if (!PyErr_Occurred())
+            lru->misses++;
+        return NULL;
+    }
+    if (node != lru->first) {
+        lru_unlink_node(lru, node);
+        lru_add_node_at_head(lru, node);
+    }
+    lru->hits++;
+    Py_INCREF(node->value);
+    return node->value;
+}
+
+static int
+cache_store(LRU *lru, PyObject *key, Py_hash_t hash, PyObject *value)
+{
+    Node *node, *cached;
+
+    node = lru_node_new(lru, key, value);
+    if (!node)
+        return -1;
+    node->hash = hash;
+    cached = (Node *)PyDict_SetDefault(lru->dict, key, (PyObject *)node);
+    if (cached == node) {
+        lru_add_node_at_head(lru, node);
+        if (lru_length(lru) > lru->size)
+            lru_delete_last(lru, EVICT_CAPACITY);
+    }
+    lru_node_release(lru, node);
+    return cached ? 0 : -1;
+}
+
+static PyObject *
+cache_vectorcall(CacheWrapper *self, PyObject *const *args, size_t nargsf, PyObject *kwnames)
+{
+    LRU *lru = self->lru;
+    PyObject *key, *result;
+    Py_hash_t hash;
+    int status;
+
+    if (self->maxsize == 0) {
+        Py_BEGIN_CRITICAL_SECTION(lru);
+        lru->misses++;
+        Py_END_CRITICAL_SECTION();
+        return PyObject_Vectorcall(self->func, args, nargsf, kwnames);
+    }
+    key = cache_make_key(self, args, PyVectorcall_NARGS(nargsf), kwnames);
+    if (!key)
+        return NULL;
+    hash = lru_hash(key);
+    if (hash == -1) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(lru);
+    result = cache_lookup(lru, key, hash);
+    Py_END_CRITICAL_SECTION();
+    if (result || PyErr_Occurred()) {
+        Py_DECREF(key);
+        return result;
+    }
+
+    result = PyObject_Vectorcall(self->func, args, nargsf, kwnames);
+    if (result) {
+        Py_BEGIN_CRITICAL_SECTION(lru);
+        status = cache_store(lru, key, hash, result);
+        Py_END_CRITICAL_SECTION();
+        if (status < 0)
+            Py_CLEAR(result);
+    }
+    Py_DECREF(key);
+    return result;
+}
+
+static PyObject *
+cache_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"user_function", "maxsize", "typed", "cache_info_type", NULL};
+    PyObject *func, *maxsize_arg, *cache_info_type;
+    CacheWrapper *self;
+    Py_ssize_t maxsize = -1;
+    int typed;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOpO:_cache_wrapper", kwlist, &func,
+                                     &maxsize_arg, &typed, &cache_info_type))
+        return NULL;
+    if (!PyCallable_Check(func)) {
+        PyErr_SetString(PyExc_TypeError, "the first argument must be callable");
+        return NULL;
+    }
+    if (maxsize_arg != Py_None) {
+        maxsize = PyNumber_AsSsize_t(maxsize_arg, PyExc_OverflowError);
+        if (maxsize == -1 && PyErr_Occurred())
+            return NULL;
+        if (maxsize < 0)
+            maxsize = 0;
+    }
+
+    self = (CacheWrapper *)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    self->vectorcall = (vectorcallfunc)cache_vectorcall;
+    self->lru = (LRU *)PyObject_CallFunction((PyObject *)lru_state_of((PyObject *)self)->LRUType,
+                                             "n", maxsize > 0 ? maxsize :
+                                             maxsize == 0 ? 1 : PY_SSIZE_T_MAX);
+    if (!self->lru) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    Py_INCREF(func);
+    self->func = func;
+    self->maxsize = maxsize;
+    self->typed = typed;
+    Py_INCREF(cache_info_type);
+    self->cache_info_type = cache_info_type;
+    return (PyObject *)self;
+}
+
+static int
+cache_traverse(CacheWrapper *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->func);
+    Py_VISIT(self->lru);
+    Py_VISIT(self->cache_info_type);
+    Py_VISIT(self->dict);
+#if PY_VERSION_HEX >= 0x03090000
+    Py_VISIT(Py_TYPE(self));
+#endif
+    return 0;
+}
+
+static int
+cache_tp_clear(CacheWrapper *self)
+{
+    Py_CLEAR(self->func);
+    Py_CLEAR(self->lru);
+    Py_CLEAR(self->cache_info_type);
+    Py_CLEAR(self->dict);
+    return 0;
+}
+
+static void
+cache_dealloc(CacheWrapper *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+    if (self->weakreflist)
+        PyObject_ClearWeakRefs((PyObject *)self);
+    cache_tp_clear(self);
+    tp->tp_free((PyObject *)self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+cache_descr_get(PyObject *self, PyObject *obj, PyObject *type)
+{
+    if (obj == Py_None || obj == NULL) {
+        Py_INCREF(self);
+        return self;
+    }
+    return PyMethod_New(self, obj);
+}
+
+static PyObject *
+cache_maxsize(CacheWrapper *self)
+{
+    if (self->maxsize < 0)
+        Py_RETURN_NONE;
+    return PyLong_FromSsize_t(self->maxsize);
+}
+
+static PyObject *
+cache_info(CacheWrapper *self, PyObject *Py_UNUSED(ignored))
+{
+    Py_ssize_t hits, misses, currsize;
+    PyObject *maxsize = cache_maxsize(self), *result;
+
+    if (!maxsize)
+        return NULL;
+    Py_BEGIN_CRITICAL_SECTION(self->lru);
+    hits = self->lru->hits;
+    misses = self->lru->misses;
+    currsize = lru_length(self->lru);
+    Py_END_CRITICAL_SECTION();
+    result = PyObject_CallFunction(self->cache_info_type, "nnOn", hits, misses, maxsize,
+                                   currsize);
+    Py_DECREF(maxsize);
+    return result;
+}
+
+static PyObject *
+cache_clear(CacheWrapper *self, PyObject *Py_UNUSED(ignored))
+{
+    PyObject *result;
+    Py_BEGIN_CRITICAL_SECTION(self->lru);
+    result = LRU_clear_impl(self->lru);
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+static PyObject *
+cache_parameters(CacheWrapper *self, PyObject *Py_UNUSED(ignored))
+{
+    PyObject *maxsize = cache_maxsize(self), *result;
+
+    if (!maxsize)
+        return NULL;
+    result = Py_BuildValue("{sOsO}", "maxsize", maxsize, "typed",
+                           self->typed ? Py_True : Py_False);
+    Py_DECREF(maxsize);
+    return result;
+}
+
+static PyObject *
+cache_reduce(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    /* Pickled by name, like a function. */
+    return PyObject_GetAttrString(self, "__qualname__");
+}
+
+static PyObject *
+cache_copy(PyObject *self, PyObject *Py_UNUSED(args))
+{
+    Py_INCREF(self);
+    return self;
+}
+
+static PyMethodDef cache_methods[] = {
+    {"cache_info", (PyCFunction)cache_info, METH_NOARGS,
+                    PyDoc_STR("f.cache_info() -> CacheInfo(hits, misses, maxsize, currsize)")},
+    {"cache_clear", (PyCFunction)cache_clear, METH_NOARGS,
+                    PyDoc_STR("f.cache_clear() -> drop the cached results and reset the statistics")},
+    {"cache_parameters", (PyCFunction)cache_parameters, METH_NOARGS,
+                    PyDoc_STR("f.cache_parameters() -> dict with the maxsize and typed arguments")},
+    {"__reduce__", (PyCFunction)cache_reduce, METH_NOARGS, NULL},
+    {"__copy__", (PyCFunction)cache_copy, METH_NOARGS, NULL},
+    {"__deepcopy__", (PyCFunction)cache_copy, METH_O, NULL},
+    {NULL,	NULL},
+};
+
+static PyGetSetDef cache_getset[] = {
+    {"__dict__", PyObject_GenericGetDict, PyObject_GenericSetDict},
+    {NULL}
+};
+
+PyDoc_STRVAR(cache_doc,
+"_cache_wrapper(user_function, maxsize, typed, cache_info_type)\n"
+"Calls user_function through an LRU of its results, see lru.cache.\n");
+
+static PyMemberDef cache_members[] = {
+    {"__vectorcalloffset__", T_PYSSIZET, offsetof(CacheWrapper, vectorcall), READONLY},
+    {"__weaklistoffset__", T_PYSSIZET, offsetof(CacheWrapper, weakreflist), READONLY},
+    {"__dictoffset__", T_PYSSIZET, offsetof(CacheWrapper, dict), READONLY},
+    {NULL}
+};
+
+static PyType_Slot cache_slots[] = {
+    {Py_tp_dealloc, cache_dealloc},
+    {Py_tp_call, PyVectorcall_Call},
+    {Py_tp_doc, (void *)cache_doc},
+    {Py_tp_traverse, cache_traverse},
+    {Py_tp_clear, cache_tp_clear},
+    {Py_tp_methods, cache_methods},
+    {Py_tp_members, cache_members},
+    {Py_tp_getset, cache_getset},
+    {Py_tp_descr_get, cache_descr_get},
+    {Py_tp_new, cache_new},
+    {0, NULL},
+};
+
+static PyType_Spec cache_spec = {
+    "lru._cache_wrapper", sizeof(CacheWrapper), 0,
+    LRU_TPFLAGS | Py_TPFLAGS_HAVE_GC | Py_TPFLAGS_HAVE_VECTORCALL | Py_TPFLAGS_METHOD_DESCRIPTOR,
+    cache_slots,
+};
+
+/*
+ * SharedLRU keeps bytes keys and values in a memory mapped segment shared by processes.
+ * Everything in the segment is addressed by offsets, as every process maps it elsewhere:
+ *
+ *   ShmHeader | ShmEntry[max_entries] | uint32_t buckets[nbuckets] | data
+ *
+ * Entries are chained from the hash buckets and linked in LRU order by index. The key and
+ * value of an entry live in one block of the data area, handed out by a boundary tag
+ * allocator with free lists per power of two size class. When there is no room the least
+ * recently used entries are evicted until the block fits.
+ *
+ * A process shared mutex in the header protects the segment. A hit returns a memoryview of
+ * the value in place and pins the entry: an entry removed while pinned is unlinked at once,
+ * but its block is only freed once the last view of it, in any process, is released. No
+ * Python object is created while the mutex is held, so garbage collection can't run into it.
+ */
+#ifndef MS_WINDOWS
+#define HAVE_SHARED_LRU
+#endif
+
+#ifdef HAVE_SHARED_LRU
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x4552414853555254ULL     /* "TRUSHARE" */
+#define SHM_VERSION 2
+#define SHM_NIL UINT32_MAX
+#define SHM_NONE UINT64_MAX
+#define SHM_BINS 48
+#define SHM_MIN_BLOCK 32            /* header, free list links and footer */
+#define SHM_USED 1
+#define SHM_MAX_ENTRIES ((uint64_t)1 << 31)
+
+enum {
+    SHM_FREE_ENTRY,
+    SHM_LIVE,
+    SHM_DEAD,       /* removed while pinned, freed by the last unpin */
+};
+
+typedef struct {
+    uint64_t hash;
+    uint64_t block;         /* offset of the data block in the data area */
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t prev;          /* LRU list, MRU first */
+    uint32_t next;
+    uint32_t chain;         /* next entry of the bucket, or of the free entry list */
+    uint32_t pins;          /* memoryviews of the value alive in any process */
+    uint32_t state;         /* SHM_FREE_ENTRY, SHM_LIVE or SHM_DEAD */
+    uint32_t unused;
+} ShmEntry;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t max_entries;
+    uint32_t nbuckets;
+    uint32_t first;
+    uint32_t last;
+    uint32_t free_entry;
+    uint64_t map_size;
+    uint64_t entries_off;
+    uint64_t buckets_off;
+    uint64_t data_off;
+    uint64_t data_size;
+    uint64_t used;          /* live entries */
+    uint64_t used_bytes;    /* bytes of the data area in allocated blocks */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t epoch;         /* number of resets, the pins of older views are gone */
+    uint64_t bins[SHM_BINS];    /* free blocks by size class */
+    pthread_mutex_t mutex;
+} ShmHeader;
+
+typedef struct {
+    PyObject_HEAD
+    char *base;             /* the mapping, NULL before init */
+    size_t map_size;
+    PyObject *path;
+} SharedLRU;
+
+#define SHM_HEADER(self) ((ShmHeader *)(self)->base)
+#define SHM_ENTRIES(self) ((ShmEntry *)((self)->base + SHM_HEADER(self)->entries_off))
+#define SHM_BUCKETS(self) ((uint32_t *)((self)->base + SHM_HEADER(self)->buckets_off))
+#define SHM_DATA(self) ((self)->base + SHM_HEADER(self)->data_off)
+#define SHM_WORD(self, off) (*(uint64_t *)(SHM_DATA(self) + (off)))
+
+/* A hash that is the same in every process, unlike the randomized hash() of bytes. */
+static uint64_t
+shm_hash(const unsigned char *p, size_t n)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (n * 0xff51afd7ed558ccdULL), w;
+
+    while (n >= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ (w * 0x87c37b91114253d5ULL)) * 0x4cf5ad432745937fULL;
+        h ^= h >> 31;
+        p += 8;
+        n -= 8;
+    }
+    w = 0;
+    memcpy(&w, p, n);
+    h = (h ^ (w * 0x87c37b91114253d5ULL)) * 0x4cf5ad432745937fULL;
+    h ^= h >> 29;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static int
+shm_bin(uint64_t size)
+{
+    int bin = 0;
+    while (size >>= 1)
+        bin++;
+    return bin < SHM_BINS ? bin : SHM_BINS - 1;
+}
+
+/* Block layout: size|flags word, payload (free list next and prev when free), footer word. */
+static void
+shm_block_mark(SharedLRU *self, uint64_t off, uint64_t size, uint64_t flags)
+{
+    SHM_WORD(self, off) = size | flags;
+    SHM_WORD(self, off + size - 8) = size | flags;
+}
+
+static void
+shm_bin_insert(SharedLRU *self, uint64_t off, uint64_t size)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    int bin = shm_bin(size);
+    uint64_t head = h->bins[bin];
+
+    shm_block_mark(self, off, size, 0);
+    SHM_WORD(self, off + 8) = head;
+    SHM_WORD(self, off + 16) = SHM_NONE;
+    if (head != SHM_NONE)
+        SHM_WORD(self, head + 16) = off;
+    h->bins[bin] = off;
+}
+
+static void
+shm_bin_remove(SharedLRU *self, uint64_t off, uint64_t size)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    uint64_t next = SHM_WORD(self, off + 8), prev = SHM_WORD(self, off + 16);
+
+    if (prev != SHM_NONE)
+        SHM_WORD(self, prev + 8) = next;
+    else
+        h->bins[shm_bin(size)] = next;
+    if (next != SHM_NONE)
+        SHM_WORD(self, next + 16) = prev;
+}
+
+static uint64_t
+shm_block_size(uint64_t payload)
+{
+    uint64_t size = (payload + 16 + 7) & ~(uint64_t)7;
+    return size < SHM_MIN_BLOCK ? SHM_MIN_BLOCK : size;
+}
+
+/* Returns the offset of a block with room for payload bytes, SHM_NONE if none is free. */
+static uint64_t
+shm_alloc(SharedLRU *self, uint64_t payload)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    uint64_t need = shm_block_size(payload), off, size;
+    int bin;
+
+    for (bin = shm_bin(need); bin < SHM_BINS; bin++) {
+        for (off = h->bins[bin]; off != SHM_NONE; off = SHM_WORD(self, off + 8)) {
+            size = SHM_WORD(self, off);
+            if (size >= need)
+                break;
+        }
+        if (off == SHM_NONE)
+            continue;
+        shm_bin_remove(self, off, size);
+        if (size - need >= SHM_MIN_BLOCK) {
+            shm_bin_insert(self, off + need, size - need);
+            size = need;
+        }
+        shm_block_mark(self, off, size, SHM_USED);
+        h->used_bytes += size;
+        return off;
+    }
+    return SHM_NONE;
+}
+
+/* Frees a block, merging it with free neighbours. */
+static void
+shm_free(SharedLRU *self, uint64_t off)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    uint64_t size = SHM_WORD(self, off) & ~(uint64_t)SHM_USED, word;
+
+    h->used_bytes -= size;
+    if (off + size < h->data_size) {
+        word = SHM_WORD(self, off + size);
+        if (!(word & SHM_USED)) {
+            shm_bin_remove(self, off + size, word);
+            size += word;
+        }
+    }
+    if (off > 0) {
+        word = SHM_WORD(self, off - 8);
+        if (!(word & SHM_USED)) {
+            shm_bin_remove(self, off - word, word);
+            off -= word;
+            size += word;
+        }
+    }
+    shm_bin_insert(self, off, size);
+}
+
+/*
+ * Empties the segment. Used on creation and after a process died holding the mutex. The
+ * pins are dropped with the entries, bumping the epoch tells the views taken before not to
+ * unpin their old entry.
+ */
+static void
+shm_reset(SharedLRU *self)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    ShmEntry *entries = SHM_ENTRIES(self);
+    uint32_t *buckets = SHM_BUCKETS(self);
+    uint32_t i;
+
+    for (i = 0; i < h->max_entries; i++) {
+        entries[i].state = SHM_FREE_ENTRY;
+        entries[i].chain = i + 1 < h->max_entries ? i + 1 : SHM_NIL;
+    }
+    for (i = 0; i < h->nbuckets; i++)
+        buckets[i] = SHM_NIL;
+    for (i = 0; i < SHM_BINS; i++)
+        h->bins[i] = SHM_NONE;
+    h->first = h->last = SHM_NIL;
+    h->free_entry = 0;
+    h->used = 0;
+    h->used_bytes = 0;
+    h->epoch++;
+    shm_bin_insert(self, 0, h->data_size);
+}
+
+static int
+shm_lock(SharedLRU *self)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    int err = pthread_mutex_trylock(&h->mutex);
+
+    if (err == EBUSY) {
+        Py_BEGIN_ALLOW_THREADS
+        err = pthread_mutex_lock(&h->mutex);
+        Py_END_ALLOW_THREADS
+    }
+#ifdef __linux__
+    if (err == EOWNERDEAD) {
+        /* The owner died in the middle of an update, the segment can't be trusted. */
+        shm_reset(self);
+        pthread_mutex_consistent(&h->mutex);
+        err = 0;
+    }
+#endif
+    if (err) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+shm_unlock(SharedLRU *self)
+{
+    pthread_mutex_unlock(&SHM_HEADER(self)->mutex);
+}
+
+static const char *
+shm_key(SharedLRU *self, ShmEntry *e)
+{
+    return SHM_DATA(self) + e->block + 8;
+}
+
+static uint32_t
+shm_lookup(SharedLRU *self, const char *key, uint32_t klen, uint64_t hash)
+{
+    ShmEntry *entries = SHM_ENTRIES(self);
+    uint32_t i = SHM_BUCKETS(self)[hash & (SHM_HEADER(self)->nbuckets - 1)];
+
+    for (; i != SHM_NIL; i = entries[i].chain) {
+        ShmEntry *e = &entries[i];
+        if (e->hash == hash && e->klen == klen && memcmp(shm_key(self, e), key, klen) == 0)
+            return i;
+    }
+    return SHM_NIL;
+}
+
+static void
+shm_list_unlink(SharedLRU *self, uint32_t i)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    ShmEntry *entries = SHM_ENTRIES(self), *e = &entries[i];
+
+    if (e->prev != SHM_NIL)
+        entries[e->prev].next = e->next;
+    else
+        h->first = e->next;
+    if (e->next != SHM_NIL)
+        entries[e->next].prev = e->prev;
+    else
+        h->last = e->prev;
+}
+
+static void
+shm_list_push(SharedLRU *self, uint32_t i)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    ShmEntry *entries = SHM_ENTRIES(self), *e = &entries[i];
+
+    e->prev = SHM_NIL;
+    e->next = h->first;
+    if (h->first != SHM_NIL)
+        entries[h->first].prev = i;
+    else
+        h->last = i;
+    h->first = i;
+}
+
+/* Gives back the block and the slot of an entry nobody looks at anymore. */
+static void
+shm_release(SharedLRU *self, uint32_t i)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    ShmEntry *e = &SHM_ENTRIES(self)[i];
+
+    shm_free(self, e->block);
+    e->state = SHM_FREE_ENTRY;
+    e->chain = h->free_entry;
+    h->free_entry = i;
+}
+
+/* Removes a live entry from the index and the list. Pinned entries are released later. */
+static void
+shm_remove(SharedLRU *self, uint32_t i)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    ShmEntry *entries = SHM_ENTRIES(self), *e = &entries[i];
+    uint32_t *link = &SHM_BUCKETS(self)[e->hash & (h->nbuckets - 1)];
+
+    while (*link != i)
+        link = &entries[*link].chain;
+    *link = e->chain;
+    shm_list_unlink(self, i);
+    h->used--;
+    if (e->pins) {
+        e->state = SHM_DEAD;
+    } else {
+        shm_release(self, i);
+    }
+}
+
+/*
+ * Inserts a new key, evicting from the LRU end until a slot and a block are free. Returns
+ * the entry, or SHM_NIL if even an empty segment has no room for it. Callers reject items
+ * larger than the data area first, so that only room held by pinned values gets here.
+ */
+static uint32_t
+shm_insert(SharedLRU *self, const char *key, uint32_t klen, const char *value, uint32_t vlen,
+           uint64_t hash)
+{
+    ShmHeader *h = SHM_HEADER(self);
+    ShmEntry *e;
+    uint32_t i, *bucket;
+    uint64_t block;
+
+    for (;;) {
+        if (h->free_entry != SHM_NIL &&
+            (block = shm_alloc(self, (uint64_t)klen + vlen)) != SHM_NONE)
+            break;
+        if (h->last == SHM_NIL)
+            return SHM_NIL;
+        shm_remove(self, h->last);
+    }
+    i = h->free_entry;
+    e = &SHM_ENTRIES(self)[i];
+    h->free_entry = e->chain;
+    e->hash = hash;
+    e->block = block;
+    e->klen = klen;
+    e->vlen = vlen;
+    e->pins = 0;
+    e->state = SHM_LIVE;
+    memcpy(SHM_DATA(self) + block + 8, key, klen);
+    memcpy(SHM_DATA(self) + block + 8 + klen, value, vlen);
+    bucket = &SHM_BUCKETS(self)[hash & (h->nbuckets - 1)];
+    e->chain = *bucket;
+    *bucket = i;
+    shm_list_push(self, i);
+    h->used++;
+    return i;
+}
+
+static int
+shared_check(SharedLRU *self)
+{
+    if (!self->base) {
+        PyErr_SetString(PyExc_RuntimeError, "SharedLRU is not initialized");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+shared_get_key(SharedLRU *self, PyObject *key, Py_buffer *view)
+{
+    if (shared_check(self) < 0 || PyObject_GetBuffer(key, view, PyBUF_SIMPLE) < 0)
+        return -1;
+    if ((uint64_t)view->len >= SHM_NIL) {
+        PyBuffer_Release(view);
+        PyErr_SetString(PyExc_ValueError, "key is too large");
+        return -1;
+    }
+    return 0;
+}
+
+/* Exports the value of a pinned entry as a buffer, unpinning it when released. */
+typedef struct {
+    PyObject_HEAD
+    SharedLRU *owner;
+    uint32_t index;
+    uint64_t epoch;         /* of the segment when the entry was pinned */
+    char *data;
+    Py_ssize_t len;
+} SharedValue;
+
+static int
+shared_value_getbuffer(SharedValue *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->data, self->len, 1, flags);
+}
+
+static void
+shared_value_dealloc(SharedValue *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    if (self->index != SHM_NIL && shm_lock(self->owner) == 0) {
+        ShmEntry *e = &SHM_ENTRIES(self->owner)[self->index];
+        /* After a reset the entry isn't ours anymore. */
+        if (self->epoch == SHM_HEADER(self->owner)->epoch && --e->pins == 0 &&
+            e->state == SHM_DEAD)
+            shm_release(self->owner, self->index);
+        shm_unlock(self->owner);
+    } else if (PyErr_Occurred()) {
+        PyErr_WriteUnraisable((PyObject *)self);
+    }
+    Py_XDECREF(self->owner);
+    PyObject_Del(self);
+    Py_DECREF(tp);
+}
+
+static PyType_Slot shared_value_slots[] = {
+    {Py_tp_dealloc, shared_value_dealloc},
+#if PY_VERSION_HEX >= 0x03090000
+    {Py_bf_getbuffer, shared_value_getbuffer},
+#endif
+    {0, NULL},
+};
+
+static PyType_Spec shared_value_spec = {
+    "_lru.SharedValue", sizeof(SharedValue), 0, LRU_TPFLAGS_INTERNAL, shared_value_slots,
+};
+
+/*
+ * Looks key up and returns a memoryview of its value, NULL without an exception set on a
+ * miss. A hit makes the entry the MRU one.
+ */
+static PyObject *
+shared_find(SharedLRU *self, PyObject *key)
+{
+    Py_buffer k;
+    SharedValue *value;
+    PyObject *view;
+    uint32_t i;
+
+    if (shared_get_key(self, key, &k) < 0)
+        return NULL;
+    /* Allocated up front, nothing is allocated with the mutex held. */
+    value = PyObject_New(SharedValue, lru_state_of((PyObject *)self)->SharedValueType);
+    if (!value) {
+        PyBuffer_Release(&k);
+        return NULL;
+    }
+    value->owner = NULL;
+    value->index = SHM_NIL;
+    if (shm_lock(self) < 0) {
+        PyBuffer_Release(&k);
+        Py_DECREF(value);
+        return NULL;
+    }
+    i = shm_lookup(self, k.buf, (uint32_t)k.len, shm_hash(k.buf, (size_t)k.len));
+    if (i != SHM_NIL) {
+        ShmEntry *e = &SHM_ENTRIES(self)[i];
+        e->pins++;
+        if (SHM_HEADER(self)->first != i) {
+            shm_list_unlink(self, i);
+            shm_list_push(self, i);
+        }
+        SHM_HEADER(self)->hits++;
+        value->index = i;
+        value->epoch = SHM_HEADER(self)->epoch;
+        value->data = SHM_DATA(self) + e->block + 8 + e->klen;
+        value->len = e->vlen;
+    } else {
+        SHM_HEADER(self)->misses++;
+    }
+    shm_unlock(self);
+    PyBuffer_Release(&k);
+
+    if (i == SHM_NIL) {
+        Py_DECREF(value);
+        return NULL;
+    }
+    Py_INCREF(self);
+    value->owner = self;
+    view = PyMemoryView_FromObject((PyObject *)value);
+    Py_DECREF(value);
+    return view;
+}
+
+static PyObject *
+shared_subscript(SharedLRU *self, PyObject *key)
+{
+    PyObject *result = shared_find(self, key);
+    if (!result && !PyErr_Occurred())
+        lru_set_key_error(key);
+    return result;
+}
+
+static PyObject *
+SharedLRU_get(SharedLRU *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *argv[2] = {NULL, NULL};
+    PyObject *result;
+
+    if (lru_parse_args("get", args, nargs, kwnames, key_default_kwlist, 1, 2, argv) < 0)
+        return NULL;
+    result = shared_find(self, argv[0]);
+    if (result || PyErr_Occurred())
+        return result;
+    result = argv[1] ? argv[1] : Py_None;
+    Py_INCREF(result);
+    return result;
+}
+
+static int
+shared_ass_sub(SharedLRU *self, PyObject *key, PyObject *value)
+{
+    Py_buffer k, v;
+    uint64_t hash;
+    uint32_t i;
+    int res = 0;
+
+    if (shared_get_key(self, key, &k) < 0)
+        return -1;
+    if (value && PyObject_GetBuffer(value, &v, PyBUF_SIMPLE) < 0) {
+        PyBuffer_Release(&k);
+        return -1;
+    }
+    if (value && (uint64_t)v.len >= SHM_NIL) {
+        PyErr_SetString(PyExc_ValueError, "value is too large");
+        res = -1;
+        goto done;
+    }
+    hash = shm_hash(k.buf, (size_t)k.len);
+    if (shm_lock(self) < 0) {
+        res = -1;
+        goto done;
+    }
+    /* Checked before anything is removed, an item that can never fit leaves the cache alone */
+    if (value && shm_block_size((uint64_t)k.len + (uint64_t)v.len) > SHM_HEADER(self)->data_size) {
+        shm_unlock(self);
+        res = -2;
+        goto done;
+    }
+    i = shm_lookup(self, k.buf, (uint32_t)k.len, hash);
+    if (i != SHM_NIL)
+        shm_remove(self, i);
+    if (value)
+        res = shm_insert(self, k.buf, (uint32_t)k.len, v.buf, (uint32_t)v.len, hash) == SHM_NIL ? -2 : 0;
+    else if (i == SHM_NIL)
+        res = -3;
+    shm_unlock(self);
+
+done:
+    if (res == -2)
+        PyErr_SetString(PyExc_ValueError, "item is larger than the SharedLRU");
+    else if (res == -3)
+        lru_set_key_error(key);
+    if (value)
+        PyBuffer_Release(&v);
+    PyBuffer_Release(&k);
+    return res < 0 ? -1 : 0;
+}
+
+static int
+shared_contains(SharedLRU *self, PyObject *key)
+{
+    Py_buffer k;
+    uint32_t i;
+
+    if (shared_get_key(self, key, &k) < 0)
+        return -1;
+    if (shm_lock(self) < 0) {
+        PyBuffer_Release(&k);
+        return -1;
+    }
+    i = shm_lookup(self, k.buf, (uint32_t)k.len, shm_hash(k.buf, (size_t)k.len));
+    shm_unlock(self);
+    PyBuffer_Release(&k);
+    return i != SHM_NIL;
+}
+
+static Py_ssize_t
+shared_length(SharedLRU *self)
+{
+    uint64_t used;
+    if (shared_check(self) < 0 || shm_lock(self) < 0)
+        return -1;
+    used = SHM_HEADER(self)->used;
+    shm_unlock(self);
+    return (Py_ssize_t)used;
+}
+
+static PyObject *
+SharedLRU_keys(SharedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    ShmEntry *entries;
+    PyObject *list;
+    Py_ssize_t n = 0, total = 0, count, j;
+    char *copy = NULL;
+    uint32_t *lens = NULL, i;
+
+    if (shared_check(self) < 0)
+        return NULL;
+    /* Sized without the lock, then copied with it held and built after. */
+    for (;;) {
+        char *p;
+        uint64_t need = 0;
+        if (shm_lock(self) < 0)
+            goto error;
+        entries = SHM_ENTRIES(self);
+        count = (Py_ssize_t)SHM_HEADER(self)->used;
+        for (i = SHM_HEADER(self)->first; i != SHM_NIL; i = entries[i].next)
+            need += entries[i].klen;
+        if (copy && count <= n && (Py_ssize_t)need <= total) {
+            for (p = copy, j = 0, i = SHM_HEADER(self)->first; i != SHM_NIL; i = entries[i].next) {
+                memcpy(p, shm_key(self, &entries[i]), entries[i].klen);
+                p += entries[i].klen;
+                lens[j++] = entries[i].klen;
+            }
+            shm_unlock(self);
+            n = count;
+            break;
+        }
+        shm_unlock(self);
+        PyMem_Free(copy);
+        PyMem_Free(lens);
+        n = count;
+        total = (Py_ssize_t)need;
+        copy = PyMem_Malloc((size_t)total + 1);
+        lens = PyMem_New(uint32_t, (size_t)n + 1);
+        if (!copy || !lens) {
+            PyErr_NoMemory();
+            goto error;
+        }
+    }
+
+    list = PyList_New(n);
+    if (list) {
+        char *p = copy;
+        for (j = 0; j < n; j++) {
+            PyObject *key = PyBytes_FromStringAndSize(p, lens[j]);
+            if (!key) {
+                Py_CLEAR(list);
+                break;
+            }
+            PyList_SET_ITEM(list, j, key);
+            p += lens[j];
+        }
+    }
+    PyMem_Free(copy);
+    PyMem_Free(lens);
+    return list;
+
+error:
+    PyMem_Free(copy);
+    PyMem_Free(lens);
+    return NULL;
+}
+
+static PyObject *
+SharedLRU_clear(SharedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    if (shared_check(self) < 0 || shm_lock(self) < 0)
+        return NULL;
+    while (SHM_HEADER(self)->last != SHM_NIL)
+        shm_remove(self, SHM_HEADER(self)->last);
+    shm_unlock(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+SharedLRU_get_stats(SharedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    uint64_t hits, misses;
+    if (shared_check(self) < 0 || shm_lock(self) < 0)
+        return NULL;
+    hits = SHM_HEADER(self)->hits;
+    misses = SHM_HEADER(self)->misses;
+    shm_unlock(self);
+    return Py_BuildValue("KK", (unsigned long long)hits, (unsigned long long)misses);
+}
+
+static PyObject *
+SharedLRU_get_capacity(SharedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    if (shared_check(self) < 0)
+        return NULL;
+    return Py_BuildValue("KI", (unsigned long long)SHM_HEADER(self)->data_size,
+                         SHM_HEADER(self)->max_entries);
+}
+
+static PyObject *
+SharedLRU_get_used_bytes(SharedLRU *self, PyObject *Py_UNUSED(ignored))
+{
+    uint64_t used;
+    if (shared_check(self) < 0 || shm_lock(self) < 0)
+        return NULL;
+    used = SHM_HEADER(self)->used_bytes;
+    shm_unlock(self);
+    return PyLong_FromUnsignedLongLong(used);
+}
+
+static void
+shared_unmap(SharedLRU *self)
+{
+    if (self->base) {
+        munmap(self->base, self->map_size);
+        self->base = NULL;
+    }
+    Py_CLEAR(self->path);
+}
+
+/* Opens a path, or a name without slash as a POSIX shared memory object. */
+static int
+shared_open(const char *path)
+{
+    if (strchr(path, '/'))
+        return open(path, O_RDWR | O_CREAT, 0600);
+#ifdef __linux__
+    {
+        /* /dev/shm is what shm_open uses, without needing librt on older glibc. */
+        char buf[4096];
+        if (snprintf(buf, sizeof(buf), "/dev/shm/%s", path) >= (int)sizeof(buf)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        return open(buf, O_RDWR | O_CREAT, 0600);
+    }
+#else
     {
-        return moduleinit();
+        char buf[256];
+        if (snprintf(buf, sizeof(buf), "/%s", path) >= (int)sizeof(buf)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        return shm_open(buf, O_RDWR | O_CREAT, 0600);
+    }
+#endif
+}
+
+/* Lays out and initializes a new segment of the given geometry in fd. */
+static int
+shared_create(SharedLRU *self, int fd, uint64_t capacity, uint64_t max_entries)
+{
+    uint64_t nbuckets = 1, entries_off, buckets_off, data_off, size;
+    pthread_mutexattr_t attr;
+    ShmHeader *h;
+
+    while (nbuckets < max_entries)
+        nbuckets <<= 1;
+    entries_off = (sizeof(ShmHeader) + 63) & ~(uint64_t)63;
+    buckets_off = entries_off + max_entries * sizeof(ShmEntry);
+    data_off = (buckets_off + nbuckets * sizeof(uint32_t) + 63) & ~(uint64_t)63;
+    size = data_off + capacity;
+    if (size > (uint64_t)PY_SSIZE_T_MAX || ftruncate(fd, (off_t)size) < 0)
+        return -1;
+    self->base = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (self->base == MAP_FAILED) {
+        self->base = NULL;
+        return -1;
+    }
+    self->map_size = (size_t)size;
+    h = SHM_HEADER(self);
+    memset(h, 0, sizeof(ShmHeader));
+    h->version = SHM_VERSION;
+    h->max_entries = (uint32_t)max_entries;
+    h->nbuckets = (uint32_t)nbuckets;
+    h->map_size = size;
+    h->entries_off = entries_off;
+    h->buckets_off = buckets_off;
+    h->data_off = data_off;
+    h->data_size = capacity;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(&h->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    shm_reset(self);
+    /* Last, a segment without its magic is not initialized yet. */
+    h->magic = SHM_MAGIC;
+    return 0;
+}
+
+static int
+shared_attach(SharedLRU *self, int fd, uint64_t size)
+{
+    ShmHeader *h;
+
+    self->base = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (self->base == MAP_FAILED) {
+        self->base = NULL;
+        return -1;
+    }
+    self->map_size = (size_t)size;
+    h = SHM_HEADER(self);
+    if (size < sizeof(ShmHeader) || h->magic != SHM_MAGIC || h->version != SHM_VERSION ||
+        h->map_size != size) {
+        munmap(self->base, self->map_size);
+        self->base = NULL;
+        errno = EINVAL;
+        return -2;
+    }
+    return 0;
+}
+
+static int
+SharedLRU_init(SharedLRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", "capacity_bytes", "max_entries", NULL};
+    PyObject *path;
+    Py_ssize_t capacity, max_entries = 0;
+    struct stat st;
+    int fd, res;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&n|n", kwlist, PyUnicode_FSConverter, &path,
+                                     &capacity, &max_entries))
+        return -1;
+    shared_unmap(self);
+    self->path = path;
+    if (capacity < SHM_MIN_BLOCK) {
+        PyErr_Format(PyExc_ValueError, "capacity_bytes should be at least %d", SHM_MIN_BLOCK);
+        return -1;
+    }
+    if (max_entries < 0 || (uint64_t)max_entries >= SHM_MAX_ENTRIES) {
+        PyErr_SetString(PyExc_ValueError, "max_entries is out of range");
+        return -1;
+    }
+    if (!max_entries)
+        max_entries = Py_MAX(Py_MIN(capacity / 128, (Py_ssize_t)(SHM_MAX_ENTRIES - 1)), 16);
+    capacity &= ~(Py_ssize_t)7;
+
+    fd = shared_open(PyBytes_AS_STRING(path));
+    if (fd < 0)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path), -1;
+    /* The file lock serialises the creation against processes opening it at the same time. */
+    res = flock(fd, LOCK_EX);
+    if (res == 0) {
+        res = fstat(fd, &st);
+        if (res == 0 && st.st_size == 0)
+            res = shared_create(self, fd, (uint64_t)capacity, (uint64_t)max_entries);
+        else if (res == 0)
+            res = shared_attach(self, fd, (uint64_t)st.st_size);
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+    if (res == -2) {
+        PyErr_Format(PyExc_ValueError, "%R is not a SharedLRU segment", path);
+        return -1;
+    }
+    if (res < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+SharedLRU_dealloc(SharedLRU *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    shared_unmap(self);
+    PyObject_Del((PyObject*)self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+SharedLRU_repr(SharedLRU *self)
+{
+    if (!self->path)
+        return PyUnicode_FromString("<SharedLRU>");
+    return PyUnicode_FromFormat("<SharedLRU %R>", self->path);
+}
+
+static PyMethodDef SharedLRU_methods[] = {
+    {"get", (PyCFunction)(void(*)(void))SharedLRU_get, METH_FASTCALL | METH_KEYWORDS,
+                    PyDoc_STR("L.get(key, default=None) -> memoryview of L[key] if L has key, otherwise default")},
+    {"keys", (PyCFunction)SharedLRU_keys, METH_NOARGS,
+                    PyDoc_STR("L.keys() -> list of L's keys as bytes in MRU order")},
+    {"clear", (PyCFunction)SharedLRU_clear, METH_NOARGS,
+                    PyDoc_STR("L.clear() -> clear L, for every process")},
+    {"get_stats", (PyCFunction)SharedLRU_get_stats, METH_NOARGS,
+                    PyDoc_STR("L.get_stats() -> returns a tuple with cache hits and misses of all processes")},
+    {"get_capacity", (PyCFunction)SharedLRU_get_capacity, METH_NOARGS,
+                    PyDoc_STR("L.get_capacity() -> returns a tuple with the data bytes and the max entries of L")},
+    {"get_used_bytes", (PyCFunction)SharedLRU_get_used_bytes, METH_NOARGS,
+                    PyDoc_STR("L.get_used_bytes() -> returns the bytes of the data area in use")},
+    {NULL,	NULL},
+};
+
+PyDoc_STRVAR(shared_doc,
+"SharedLRU(path, capacity_bytes, max_entries=None) -> LRU dict of bytes\n"
+"kept in a memory mapped segment shared by all the processes opening path.\n"
+"Keys and values are bytes-like objects, stored in capacity_bytes of data.\n"
+"The least recently used items are evicted when the data or the max_entries\n"
+"slots are full. A path without slash names a POSIX shared memory object.\n"
+"An existing segment is opened as is, capacity_bytes and max_entries only\n"
+"apply when it is created. L[key] returns a read only memoryview of the value\n"
+"in the segment, which stays valid while the memoryview is alive, unless a\n"
+"process dies while updating: the segment is then reset and the bytes seen\n"
+"by the views taken before are undefined.\n");
+
+static PyType_Slot shared_slots[] = {
+    {Py_tp_dealloc, SharedLRU_dealloc},
+    {Py_tp_repr, SharedLRU_repr},
+    {Py_sq_contains, shared_contains},
+    {Py_mp_length, shared_length},
+    {Py_mp_subscript, shared_subscript},
+    {Py_mp_ass_subscript, shared_ass_sub},
+    {Py_tp_doc, (void *)shared_doc},
+    {Py_tp_methods, SharedLRU_methods},
+    {Py_tp_init, SharedLRU_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL},
+};
+
+static PyType_Spec shared_spec = {
+    "lru.SharedLRU", sizeof(SharedLRU), 0, LRU_TPFLAGS, shared_slots,
+};
+
+#endif /* HAVE_SHARED_LRU */
+
+/*
+ * simulate(trace, sizes, policies=None) replays events written by flush_trace() against an
+ * LRU of every policy and size in one pass over them. The LRUs are real ones, so they
+ * behave exactly as the policies do in production, keyed by the hashes of the trace. A
+ * lookup that misses inserts its key, as the application would after a miss in a cache of
+ * that size, and the set that follows a miss which was one in the trace too is skipped.
+ * Evictions in the trace are those of the traced LRU, they are skipped, and expiry isn't
+ * simulated.
+ */
+static PyObject *
+lru_simulate(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"trace", "sizes", "policies", NULL};
+    Py_buffer view;
+    PyObject *sizes, *policies = NULL, *options = NULL, *result = NULL, *key = NULL;
+    PyObject *curve, *item, *value;
+    LRU **sims = NULL, *sim;
+    uint64_t *fills = NULL, hash;
+    Py_ssize_t nsizes, npolicies, nsims = 0, i, j, k, nevents;
+    const unsigned char *p, *end;
+    LruState *state = (LruState *)PyModule_GetState(module);
+    int op;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*O|O:simulate", kwlist, &view, &sizes,
+                                     &policies))
+        return NULL;
+    if (view.len % TRACE_EVENT_SIZE) {
+        PyErr_Format(PyExc_ValueError, "trace should be a sequence of %d byte events",
+                     TRACE_EVENT_SIZE);
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    sizes = PySequence_Fast(sizes, "sizes must be an iterable of sizes");
+    if (!policies || policies == Py_None)
+        policies = Py_BuildValue("(sssss)", policy_names[0], policy_names[1], policy_names[2],
+                                 policy_names[3], policy_names[4]);
+    else
+        policies = PySequence_Fast(policies, "policies must be an iterable of policy names");
+    if (!sizes || !policies || !(options = PyDict_New()))
+        goto done;
+    nsizes = PySequence_Fast_GET_SIZE(sizes);
+    npolicies = PySequence_Fast_GET_SIZE(policies);
+
+    nsims = nsizes * npolicies;
+    sims = PyMem_New(LRU *, nsims ? nsims : 1);
+    /* The hash each LRU inserted on its last miss, + 1 so that 0 is none. */
+    fills = PyMem_Calloc(nsims ? nsims : 1, sizeof(uint64_t));
+    if (!sims || !fills) {
+        PyErr_NoMemory();
+        nsims = 0;
+        goto done;
+    }
+    for (k = 0; k < nsims; k++)
+        sims[k] = NULL;
+    for (i = 0; i < npolicies; i++) {
+        if (PyDict_SetItemString(options, "policy", PySequence_Fast_GET_ITEM(policies, i)) < 0)
+            goto done;
+        for (j = 0; j < nsizes; j++) {
+            item = PyTuple_Pack(1, PySequence_Fast_GET_ITEM(sizes, j));
+            if (!item)
+                goto done;
+            sims[i * nsizes + j] = (LRU *)PyObject_Call((PyObject *)state->LRUType, item, options);
+            Py_DECREF(item);
+            if (!sims[i * nsizes + j])
+                goto done;
+        }
+    }
+
+    nevents = view.len / TRACE_EVENT_SIZE;
+    end = (const unsigned char *)view.buf + nevents * TRACE_EVENT_SIZE;
+    for (p = view.buf; p < end; p += TRACE_EVENT_SIZE) {
+        op = (int)(trace_get64(p + 8) & 0xff);
+        if (op == TRACE_EVICT)
+            continue;
+        if (op == TRACE_CLEAR) {
+            for (k = 0; k < nsims; k++) {
+                if (!(item = LRU_clear_impl(sims[k])))
+                    goto done;
+                Py_DECREF(item);
+            }
+            continue;
+        }
+        hash = trace_get64(p);
+        key = PyLong_FromUnsignedLongLong(hash);
+        if (!key)
+            goto done;
+        for (k = 0; k < nsims; k++) {
+            sim = sims[k];
+            switch (op) {
+            case TRACE_HIT:
+            case TRACE_MISS:
+                if ((value = lru_find(sim, key))) {
+                    Py_DECREF(value);
+                    break;
+                }
+                if (PyErr_Occurred() || lru_store(sim, key, Py_None, WHEEL_DEFAULT_TTL, -1) < 0)
+                    goto done;
+                fills[k] = hash + 1;
+                break;
+            case TRACE_SET:
+                if (fills[k] != hash + 1 &&
+                    lru_store(sim, key, Py_None, WHEEL_DEFAULT_TTL, -1) < 0)
+                    goto done;
+                fills[k] = 0;
+                break;
+            case TRACE_DELETE:
+                if (lru_delete(sim, key) < 0) {
+                    if (!PyErr_ExceptionMatches(PyExc_KeyError))
+                        goto done;
+                    PyErr_Clear();
+                }
+                break;
+            }
+        }
+        Py_CLEAR(key);
+    }
+
+    if (!(result = PyDict_New()))
+        goto done;
+    for (i = 0; i < npolicies; i++) {
+        if (!(curve = PyList_New(nsizes)))
+            goto error;
+        for (j = 0; j < nsizes; j++) {
+            sim = sims[i * nsizes + j];
+            item = Py_BuildValue("nd", sim->size, sim->hits + sim->misses ?
+                                 (double)sim->misses / (double)(sim->hits + sim->misses) : 0.0);
+            if (!item) {
+                Py_DECREF(curve);
+                goto error;
+            }
+            PyList_SET_ITEM(curve, j, item);
+        }
+        if (PyDict_SetItem(result, PySequence_Fast_GET_ITEM(policies, i), curve) < 0) {
+            Py_DECREF(curve);
+            goto error;
+        }
+        Py_DECREF(curve);
+    }
+    goto done;
+
+error:
+    Py_CLEAR(result);
+done:
+    Py_XDECREF(key);
+    for (k = 0; k < nsims; k++)
+        Py_XDECREF(sims[k]);
+    PyMem_Free(sims);
+    PyMem_Free(fills);
+    Py_XDECREF(options);
+    Py_XDECREF(sizes);
+    Py_XDECREF(policies);
+    PyBuffer_Release(&view);
+    return result;
+}
+
+static PyMethodDef lru_module_methods[] = {
+    {"simulate", (PyCFunction)lru_simulate, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("simulate(trace, sizes, policies=None) -> {policy: [(size, miss ratio)]} of the trace written by flush_trace() replayed against an LRU of each policy and size")},
+    {NULL, NULL},
+};
+
+static int
+lru_module_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    LruState *state = (LruState *)PyModule_GetState(m);
+    int i;
+
+    Py_VISIT(state->NodeType);
+    Py_VISIT(state->LRUType);
+    Py_VISIT(state->ShardedLRUType);
+    Py_VISIT(state->LRUIterType);
+    Py_VISIT(state->LRUViewType);
+    Py_VISIT(state->CacheWrapperType);
+    Py_VISIT(state->SharedLRUType);
+    Py_VISIT(state->SharedValueType);
+    Py_VISIT(state->ArenaValueType);
+    for (i = 0; i < EVICT_REASONS; i++)
+        Py_VISIT(state->evict_reasons[i]);
+    Py_VISIT(state->cache_kwd_mark);
+    return 0;
+}
+
+static int
+lru_module_clear(PyObject *m)
+{
+    LruState *state = (LruState *)PyModule_GetState(m);
+    int i;
+
+    Py_CLEAR(state->NodeType);
+    Py_CLEAR(state->LRUType);
+    Py_CLEAR(state->ShardedLRUType);
+    Py_CLEAR(state->LRUIterType);
+    Py_CLEAR(state->LRUViewType);
+    Py_CLEAR(state->CacheWrapperType);
+    Py_CLEAR(state->SharedLRUType);
+    Py_CLEAR(state->SharedValueType);
+    Py_CLEAR(state->ArenaValueType);
+    for (i = 0; i < EVICT_REASONS; i++)
+        Py_CLEAR(state->evict_reasons[i]);
+    Py_CLEAR(state->cache_kwd_mark);
+    return 0;
+}
+
+static void
+lru_module_free(void *m)
+{
+    lru_module_clear((PyObject *)m);
+}
+
+/* Makes the type of spec for module m into *type, and adds it to m as name unless NULL. */
+static int
+lru_add_type(PyObject *m, PyType_Spec *spec, const char *name, PyTypeObject **type)
+{
+#if PY_VERSION_HEX < 0x030A0000
+    PyType_Slot *slot;
+#endif
+
+#if PY_VERSION_HEX >= 0x03090000
+    *type = (PyTypeObject *)PyType_FromModuleAndSpec(m, spec, NULL);
+#else
+    *type = (PyTypeObject *)PyType_FromSpec(spec);
+#endif
+    if (!*type)
+        return -1;
+#if PY_VERSION_HEX < 0x030A0000
+    /* Those without tp_new can't be instantiated, as static types without one. */
+    for (slot = spec->slots; slot->slot && slot->slot != Py_tp_new; slot++)
+        ;
+    if (!slot->slot)
+        (*type)->tp_new = NULL;
+#endif
+    if (!name)
+        return 0;
+    Py_INCREF(*type);
+    if (PyModule_AddObject(m, name, (PyObject *)*type) < 0) {
+        Py_DECREF(*type);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+lru_module_exec(PyObject *m)
+{
+    LruState *state = (LruState *)PyModule_GetState(m);
+    int i;
+
+    if (lru_add_type(m, &node_spec, NULL, &state->NodeType) < 0 ||
+        lru_add_type(m, &lru_spec, "LRU", &state->LRUType) < 0 ||
+        lru_add_type(m, &sharded_spec, "ShardedLRU", &state->ShardedLRUType) < 0 ||
+        lru_add_type(m, &lru_iter_spec, NULL, &state->LRUIterType) < 0 ||
+        lru_add_type(m, &lru_view_spec, NULL, &state->LRUViewType) < 0 ||
+        lru_add_type(m, &cache_spec, "_cache_wrapper", &state->CacheWrapperType) < 0)
+        return -1;
+#if PY_VERSION_HEX < 0x03090000
+    /* The offsets of the members and the buffer slots are only read from the spec from 3.9 on. */
+    state->CacheWrapperType->tp_vectorcall_offset = offsetof(CacheWrapper, vectorcall);
+    state->CacheWrapperType->tp_weaklistoffset = offsetof(CacheWrapper, weakreflist);
+    state->CacheWrapperType->tp_dictoffset = offsetof(CacheWrapper, dict);
+#endif
+    if (lru_add_type(m, &arena_value_spec, NULL, &state->ArenaValueType) < 0)
+        return -1;
+#if PY_VERSION_HEX < 0x03090000
+    state->ArenaValueType->tp_as_buffer->bf_getbuffer = (getbufferproc)arena_value_getbuffer;
+    state->ArenaValueType->tp_as_buffer->bf_releasebuffer = (releasebufferproc)arena_value_releasebuffer;
+#endif
+#ifdef HAVE_SHARED_LRU
+    if (lru_add_type(m, &shared_spec, "SharedLRU", &state->SharedLRUType) < 0 ||
+        lru_add_type(m, &shared_value_spec, NULL, &state->SharedValueType) < 0)
+        return -1;
+#if PY_VERSION_HEX < 0x03090000
+    state->SharedValueType->tp_as_buffer->bf_getbuffer = (getbufferproc)shared_value_getbuffer;
+#endif
+#endif
+
+    state->cache_kwd_mark = PyObject_CallObject((PyObject *)&PyBaseObject_Type, NULL);
+    if (!state->cache_kwd_mark)
+        return -1;
+    for (i = 0; i < EVICT_REASONS; i++) {
+        if (!(state->evict_reasons[i] = PyUnicode_InternFromString(evict_reason_names[i])))
+            return -1;
+    }
+
+    /* Shared by the interpreters, so that the stamps of all the traces of the process can be
+     * merged. Imports racing in two interpreters only pick times a few microseconds apart. */
+    if (!trace_epoch)
+        trace_epoch = lru_monotonic_ns();
+
+#if PY_VERSION_HEX < 0x03090000
+    if (!lru_legacy_state) {
+        Py_INCREF(m);
+        lru_legacy_state = state;
     }
 #endif
+    return 0;
+}
+
+static PyModuleDef_Slot lru_module_slots[] = {
+    {Py_mod_exec, lru_module_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL},
+};
+
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_lru",                 /* m_name */
+    lru_doc,                /* m_doc */
+    sizeof(LruState),       /* m_size */
+    lru_module_methods,     /* m_methods */
+    lru_module_slots,       /* m_slots */
+    lru_module_traverse,    /* m_traverse */
+    lru_module_clear,       /* m_clear */
+    lru_module_free,        /* m_free */
+};
+
+PyMODINIT_FUNC
+PyInit__lru(void)
+{
+    return PyModuleDef_Init(&moduledef);
+}
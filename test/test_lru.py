@@ -1,8 +1,30 @@
+import asyncio
 import gc
+import io
+import os
+import pickle
 import random
+import struct
 import sys
+import tempfile
+import threading
+import time
 import unittest
-from lru import LRU
+import weakref
+from lru import AsyncLRU, LRU, ShardedLRU, cache
+
+try:
+    from lru import SharedLRU
+except ImportError:  # pragma: no cover
+    SharedLRU = None
+
+try:
+    import _interpreters as interpreters
+except ImportError:  # pragma: no cover
+    try:
+        import _xxsubinterpreters as interpreters
+    except ImportError:
+        interpreters = None
 
 SIZES = [1, 2, 10, 1000]
 
@@ -128,6 +150,64 @@ class TestLRU(unittest.TestCase):
         l.update(a=2)
         self.assertEqual(('a', 2), l.peek_first_item())
 
+    def test_update_pairs(self):
+        l = LRU(3)
+        l.update([('a', 1), ['b', 2]], c=3)
+        self.assertEqual([('c', 3), ('b', 2), ('a', 1)], l.items())
+        l.update({'d': 4}, e=5)
+        self.assertEqual([('e', 5), ('d', 4), ('c', 3)], l.items())
+        l.update(iter([('f', 6)]))
+        self.assertEqual(('f', 6), l.peek_first_item())
+        self.assertRaises(ValueError, l.update, [('a', 1, 2)])
+        self.assertRaises(TypeError, l.update, [1])
+        self.assertRaises(TypeError, l.update, [([], 1)])
+
+        class Mapping:
+            def keys(self):
+                return ['x', 'y']
+
+            def __getitem__(self, key):
+                return key * 2
+
+        l.update(Mapping())
+        self.assertEqual([('y', 'yy'), ('x', 'xx'), ('f', 6)], l.items())
+
+    def test_get_many(self):
+        l = LRU(3)
+        l.update(a=1, b=2, c=3)
+        self.assertEqual([1, None, 3], l.get_many(['a', 'z', 'c']))
+        self.assertEqual(['c', 'a', 'b'], l.keys())
+        self.assertEqual((2, 1), l.get_stats())
+        self.assertEqual([0, 2], l.get_many(iter(['y', 'b']), default=0))
+        self.assertEqual([], l.get_many(()))
+        self.assertRaises(TypeError, l.get_many, [[]])
+        self.assertRaises(TypeError, l.get_many, 1)
+
+    def test_set_many(self):
+        evicted = []
+
+        def callback(key, value):
+            # Deferred callbacks see the LRU after the whole batch is applied
+            evicted.append((key, value, len(l), l.peek_first_item()))
+
+        l = LRU(2, callback=callback)
+        l.set_many([(1, '1'), (2, '2'), (3, '3'), (4, '4')])
+        self._check_kvi([4, 3], l)
+        self.assertEqual([(1, '1', 2, (4, '4')), (2, '2', 2, (4, '4'))], evicted)
+        del evicted[:]
+        with self.assertRaises(TypeError):
+            l.set_many([(5, '5'), ([], '6')])
+        self.assertEqual([(3, '3', 2, (5, '5'))], evicted)
+
+    def test_delete_many(self):
+        l = LRU(4)
+        for i in range(4):
+            l[i] = str(i)
+        self.assertEqual(2, l.delete_many([0, 2, 7]))
+        self._check_kvi([3, 1], l)
+        self.assertEqual(0, l.delete_many([]))
+        self.assertRaises(TypeError, l.delete_many, [{}])
+
     def test_peek_first_item(self):
         l = LRU(2)
         self.assertEqual(None, l.peek_first_item())
@@ -200,6 +280,231 @@ class TestLRU(unittest.TestCase):
             l.clear()
             self.assertTrue(len(l) == 0)
 
+    def test_invalidate_all(self):
+        for policy in ('lru', 'clock', 'slru', 'tinylfu'):
+            evicted = []
+            l = LRU(100, lambda *args: evicted.append(args), policy=policy,
+                    callback_reason=True)
+            for i in range(100):
+                l[i] = i
+            l.invalidate_all()
+            self.assertNotIn(0, l)
+            self.assertIsNone(l.get(1))
+            self.assertEqual('x', l.pop(2, 'x'))
+            self.assertEqual([(0, 0, 'explicit'), (1, 1, 'explicit'), (2, 2, 'explicit')],
+                             evicted)
+            l[3] = 'new'
+            self.assertEqual('new', l[3])
+            for i in range(100, 200):
+                l[i] = i
+            self.assertTrue(all(l.get(i) is None for i in range(4, 100)))
+            self.assertEqual(100, len(l))
+            if policy == 'lru':
+                # Inserts reclaimed the invalidated entries before evicting live ones.
+                self.assertEqual(list(range(199, 99, -1)), l.keys())
+
+        l = LRU(10)
+        l[1] = 1
+        l.invalidate_all()
+        self.assertEqual([], pickle.loads(pickle.dumps(l)).keys())
+
+        # Invalidated entries aren't returned by the methods reading the ends or the values.
+        l = LRU(20)
+        for i in range(10):
+            l[i] = i
+        l.invalidate_all()
+        l['a'] = 'a'
+        l[10] = 10
+        self.assertEqual(8, len(l))
+        self.assertEqual([(10, 10), ('a', 'a')], l.items())
+        self.assertEqual([10, 'a'], l.values())
+        self.assertEqual([10, 'a'], l.keys())
+        self.assertEqual([10, 'a'], list(l))
+        self.assertEqual(['a', 10], list(reversed(l)))
+        self.assertEqual(dict(l.items()), dict(l.iteritems()))
+        self.assertEqual([10, 'a'], list(l.itervalues()))
+        self.assertEqual([(10, 10), ('a', 'a')], list(l.viewitems()))
+        self.assertEqual(['a', 10], list(reversed(l.viewvalues())))
+        self.assertEqual(2, len(l.viewkeys()))
+        s = ShardedLRU(40, shards=4)
+        for i in range(20):
+            s[i] = i
+        s.invalidate_all()
+        s['a'] = 'a'
+        self.assertEqual(['a'], list(s))
+        self.assertEqual([('a', 'a')], list(s.iteritems()))
+        self.assertEqual(1, len(s.viewitems()))
+        self.assertEqual(('a', 'a'), l.peek_last_item())
+        self.assertEqual((10, 10), l.peek_first_item())
+        self.assertEqual(('a', 'a'), l.popitem())
+        del l[10]
+        self.assertIsNone(l.peek_last_item())
+        self.assertIsNone(l.peek_first_item())
+        self.assertRaises(KeyError, l.popitem)
+        self.assertEqual(0, len(l))
+        self.assertRaises(ValueError, LRU(1, engine='compact').invalidate_all)
+        self.assertRaises(ValueError, LRU(1, read_buffer=4).invalidate_all)
+
+    def test_tags(self):
+        for l in (LRU(10), LRU(10, policy='slru'), ShardedLRU(10, shards=2)):
+            l.set('a1', 1, tags=('a',))
+            l.set('a2', 2, tags=['a', 'x', 'a'])
+            l.set('b1', 3, tags=('b', 'x'))
+            l['c'] = 4
+            self.assertEqual(2, l.invalidate_tag('a'))
+            self.assertEqual(['b1', 'c'], sorted(l.keys()))
+            self.assertEqual(0, l.invalidate_tag('a'))
+            self.assertEqual(0, l.invalidate_tag('missing'))
+            # Setting without tags keeps them, tags replaces them.
+            l['b1'] = 5
+            l.set('c', 6, None, None, ('x',))
+            self.assertEqual(2, l.invalidate_tag('x'))
+            self.assertEqual(0, len(l))
+            l.set('d', 7, tags=('d',))
+            l.set('d', 8, tags=())
+            self.assertEqual(0, l.invalidate_tag('d'))
+            self.assertEqual(8, l['d'])
+
+        # Evicted and deleted entries leave their tags.
+        l = LRU(2)
+        for i in range(4):
+            l.set(i, i, tags=('t', i))
+        del l[3]
+        self.assertEqual(0, l.invalidate_tag(0))
+        self.assertEqual(1, l.invalidate_tag('t'))
+        self.assertEqual(0, len(l))
+        l.set(1, 1, tags=('t',))
+        l.clear()
+        self.assertEqual(0, l.invalidate_tag('t'))
+        l.set(1, 1, tags=('t',))
+        l.invalidate_all()
+        self.assertEqual(0, l.invalidate_tag('t'))
+
+        self.assertRaises(TypeError, l.set, 1, 1, tags='t')
+        self.assertRaises(TypeError, l.set, 1, 1, tags=[[]])
+        self.assertRaises(TypeError, l.invalidate_tag, [])
+        self.assertRaises(ValueError, LRU(1, engine='compact').set, 1, 1, tags=('t',))
+
+        # Callbacks see consistent tags, even when they tag new items.
+        def callback(key, value, reason):
+            l.set(('again', key), value, tags=('t',))
+
+        l = LRU(10, callback, callback_reason=True)
+        l.set(1, 1, tags=('t',))
+        self.assertEqual(1, l.invalidate_tag('t'))
+        self.assertEqual([('again', 1)], l.keys())
+
+        # A tag is dropped once the call that emptied it is done, its __del__ may use the LRU.
+        class Tag:
+            def __del__(self):
+                seen.append(l.keys())
+                l['from_del'] = 0
+
+        seen = []
+        l = LRU(2)
+        l.set(1, 1, tags=(Tag(),))
+        l[2] = 2
+        l[3] = 3
+        self.assertEqual([[3, 2]], seen)
+        self.assertEqual(['from_del', 3], l.keys())
+
+    def test_clear_budget(self):
+        evicted = []
+        l = LRU(100, lambda *args: evicted.append(args), callback_reason=True)
+        for i in range(100):
+            l[i] = i
+        l.get(0)
+        self.assertEqual(90, l.clear(budget=10))
+        self.assertEqual((0, 0), l.get_stats())
+        self.assertEqual(90, len(l))
+        self.assertEqual(10, len(evicted))
+        self.assertIsNone(l.get(50))
+        l['new'] = 1
+        self.assertEqual(87, l.clear(budget=1))
+        self.assertNotIn('new', l)
+        while l.clear(budget=20):
+            pass
+        self.assertEqual(0, len(l))
+        self.assertEqual(101, len(evicted))
+        self.assertRaises(ValueError, l.clear, budget=-1)
+        self.assertRaises(ValueError, LRU(1, engine='compact').clear, 1)
+        self.assertIsNone(l.clear())
+
+        l = ShardedLRU(100, shards=4)
+        for i in range(100):
+            l[i] = i
+        self.assertEqual(len(l) - 10, l.clear(budget=10))
+        l.invalidate_all()
+        self.assertIsNone(l.get(99))
+        self.assertEqual(0, l.clear(budget=100))
+        self.assertEqual(0, len(l))
+
+    def test_trim(self):
+        for engine in ('dict', 'compact'):
+            l = LRU(10, engine=engine)
+            for i in range(10):
+                l[i] = str(i)
+            l[0]
+            self.assertEqual([], l.trim())
+            self.assertEqual([(1, '1'), (2, '2')], l.trim(2))
+            self.assertEqual([(3, '3')], l.trim(5, budget_items=1))
+            self.assertEqual(7, len(l))
+            self.assertEqual([(i, str(i)) for i in range(4, 10)] + [(0, '0')], l.trim(100))
+            self.assertEqual(0, len(l))
+            self.assertEqual([], l.trim(1))
+            self.assertRaises(ValueError, l.trim, -1)
+            self.assertRaises(ValueError, l.trim, budget_items=-1)
+
+        calls = []
+        l = LRU(10, callback=calls.append, callback_batch=True, callback_reason=True)
+        for i in range(10):
+            l[i] = i
+        self.assertEqual(2, l.trim(n=2))
+        self.assertEqual([[(0, 0, 'resize'), (1, 1, 'resize')]], calls)
+
+        l = LRU(4, value_store='arena')
+        l[1] = b'one'
+        (key, value), = l.trim(1)
+        self.assertEqual((1, b'one'), (key, bytes(value)))
+
+    def test_set_size_incremental(self):
+        evicted = []
+        l = LRU(1000, lambda key, value: evicted.append(key))
+        for i in range(1000):
+            l[i] = i
+        l.set_size(100, incremental=True)
+        self.assertEqual(100, l.get_size())
+        self.assertEqual(1000, len(l))
+        self.assertEqual([], evicted)
+        l['new'] = 1
+        self.assertEqual(list(range(65)), evicted)
+        self.assertEqual(936, len(l))
+        self.assertEqual(10, l.trim(budget_items=10))
+        self.assertEqual(826, l.trim())
+        self.assertEqual(100, len(l))
+        self.assertIn('new', l)
+        l['newer'] = 1
+        self.assertEqual(100, len(l))
+        self.assertEqual(902, len(evicted))
+
+        l = LRU(1000, engine='compact')
+        for i in range(1000):
+            l[i] = i
+        l.set_size(size=100, incremental=True)
+        for i in range(1000, 1020):
+            l[i] = i
+        self.assertEqual(100, len(l))
+        self.assertEqual(list(range(1019, 939, -1)), l.keys()[:80])
+
+        l = ShardedLRU(64, shards=8)
+        for i in range(1000):
+            l[i] = i
+        l.set_size(16, incremental=True)
+        self.assertEqual(16, l.get_size())
+        self.assertEqual(64, len(l))
+        l.set_size(16)
+        self.assertEqual(16, len(l))
+
     def test_get_and_del(self):
         l = LRU(2)
         l[1] = '1'
@@ -228,6 +533,65 @@ class TestLRU(unittest.TestCase):
         l[3] = '3'
         self.assertTrue(val)
 
+    def test_peek(self):
+        for l in (LRU(3), LRU(3, engine='compact'), LRU(3, read_buffer=4),
+                  ShardedLRU(3, shards=1)):
+            for i in range(3):
+                l[i] = str(i)
+            self.assertEqual('0', l.peek(0))
+            self.assertEqual('0', l.get(0, promote=False))
+            self.assertEqual('x', l.peek(5, 'x'))
+            self.assertIsNone(l.get(5, promote=False))
+            self.assertEqual('x', l.get(5, 'x', promote=0))
+            self.assertEqual([2, 1, 0], l.keys())
+            self.assertEqual((0, 0), l.get_stats())
+            self.assertEqual([True, False, True], l.contains_many([0, 5, 2]))
+            self.assertEqual([True], l.contains_many(iter([1])))
+            self.assertEqual([2, 1, 0], l.keys())
+            self.assertEqual((0, 0), l.get_stats())
+            self.assertEqual('0', l.get(0, promote=True))
+            self.assertEqual(0, l.keys()[0])
+            self.assertRaises(TypeError, l.peek)
+            self.assertRaises(TypeError, l.peek, [])
+            self.assertRaises(TypeError, l.get, 1, None, False)
+            self.assertRaises(TypeError, l.contains_many, [[]])
+            self.assertRaises(TypeError, l.contains_many, 1)
+
+        now = [0]
+        l = LRU(3, ttl=1, timer=lambda: now[0])
+        l[1] = 1
+        now[0] = 2
+        self.assertIsNone(l.peek(1))
+        self.assertEqual([False], l.contains_many([1]))
+
+    def test_get_or_load(self):
+        for l in (LRU(2), LRU(2, engine='compact'), ShardedLRU(4, shards=2)):
+            calls = []
+
+            def loader(key):
+                calls.append(key)
+                return str(key)
+
+            self.assertEqual('1', l.get_or_load(1, loader))
+            self.assertEqual('1', l.get_or_load(1, loader))
+            self.assertEqual([1], calls)
+            self.assertEqual('1', l[1])
+
+            def failing(key):
+                raise KeyError(key)
+
+            self.assertRaises(KeyError, l.get_or_load, 2, failing)
+            self.assertNotIn(2, l)
+            self.assertEqual('2', l.get_or_load(2, loader))
+
+            def recursive(key):
+                return l.get_or_load(key, loader)
+
+            self.assertRaises(RuntimeError, l.get_or_load, 3, recursive)
+            self.assertEqual('54', l.get_or_load(4, lambda key: l.get_or_load(5, loader) + '4'))
+            self.assertRaises(TypeError, l.get_or_load, 6)
+            self.assertRaises(TypeError, l.get_or_load, 6, None)
+
     def test_pop(self):
         l = LRU(2)
         v = '2' * 4096
@@ -253,6 +617,24 @@ class TestLRU(unittest.TestCase):
         with self.assertRaises(TypeError):
             l.pop()  # type: ignore
 
+    def test_method_arguments(self):
+        l = LRU(2)
+        l[1] = '1'
+        self.assertEqual('1', l.get(key=1))
+        self.assertEqual('x', l.get(2, default='x'))
+        self.assertEqual('x', l.get(default='x', key=2))
+        self.assertEqual('x', l.pop(key=2, default='x'))
+        self.assertRaises(TypeError, l.get)
+        self.assertRaises(TypeError, l.get, 1, 2, 3)
+        self.assertRaises(TypeError, l.get, 1, key=1)
+        self.assertRaises(TypeError, l.get, 1, bogus=1)
+        self.assertRaises(TypeError, l.pop, default=1)
+        self.assertRaises(TypeError, l.setdefault)
+        self.assertRaises(TypeError, l.setdefault, 1, 2, 3)
+        self.assertRaises(TypeError, l.popitem, True, False)
+        self.assertRaises(TypeError, l.has_key)
+        self.assertEqual((1, '1'), l.popitem(least_recent=0))
+
     def test_popitem(self):
         l = LRU(3)
         l[1] = '1'
@@ -374,6 +756,1653 @@ class TestLRU(unittest.TestCase):
         self.assertEqual(counter[0], 2)  # callback invoked
         self.assertEqual(l.keys(), ['b'])
 
+    def test_churn_at_capacity(self):
+        for size in SIZES:
+            l = LRU(size)
+            for i in range(size * 10):
+                l[i] = str(i)
+                if i % 7 == 0:
+                    del l[i]
+            valid = [i for i in range(size * 10 - 1, -1, -1) if i % 7][:size]
+            self._check_kvi(valid, l)
+            l.set_size(1)
+            l.set_size(size)
+            for i in range(size):
+                l[i] = str(i)
+            self._check_kvi(range(size - 1, -1, -1), l)
+
+    def test_callback_inserts_evicting_key(self):
+        def callback(key, value):
+            if key == 'a':
+                l['c'] = 'from callback'
+
+        l = LRU(2, callback=callback)
+        l['a'] = 1
+        l['b'] = 2
+        l['c'] = 3
+        self.assertEqual([('c', 3), ('b', 2)], l.items())
+
+    def test_callback_batch(self):
+        for engine in ('dict', 'compact'):
+            calls = []
+            l = LRU(10, callback=calls.append, callback_batch=True, engine=engine)
+            for i in range(10):
+                l[i] = str(i)
+            self.assertEqual(calls, [])
+            l.set_size(3)
+            self.assertEqual(calls, [[(i, str(i)) for i in range(7)]])
+            l[10] = '10'
+            self.assertEqual(calls[1:], [[(7, '7')]])
+            del calls[:]
+            l.update({11: '11', 12: '12'})
+            self.assertEqual(calls, [[(8, '8'), (9, '9')]])
+            del calls[:]
+            del l[12]
+            l[10]
+            self.assertEqual(calls, [])
+
+        calls = []
+        l = LRU(2, callback=calls.append, callback_batch=True, callback_reason=True)
+        l[1] = 1
+        l[2] = 2
+        l[3] = 3
+        l.pop(3)
+        self.assertEqual(calls, [[(1, 1, 'capacity')], [(3, 3, 'explicit')]])
+
+    def test_callback_reasons(self):
+        now = [0.0]
+        evicted = []
+        l = LRU(3, callback=lambda *args: evicted.append(args), callback_reason=True,
+                ttl=10, timer=lambda: now[0], max_weight=10)
+        for i in range(4):
+            l[i] = i
+        l.set_size(2)
+        l.set(4, 4, weight=5)
+        l.set_max_weight(5)
+        now[0] = 20
+        l[5] = 5
+        self.assertNotIn(4, l)
+        l[6] = 6
+        del l[6]
+        l[7] = 7
+        l.pop(7)
+        l[8] = 8
+        l[9] = 9
+        l.popitem()
+        l.delete_many([9])
+        l[10] = 10
+        l.clear()
+        self.assertEqual(evicted, [
+            (0, 0, 'capacity'), (1, 1, 'resize'), (2, 2, 'capacity'), (3, 3, 'resize'),
+            (4, 4, 'expired'), (6, 6, 'explicit'), (7, 7, 'explicit'), (5, 5, 'capacity'),
+            (8, 8, 'explicit'), (9, 9, 'explicit'), (10, 10, 'explicit'),
+        ])
+
+        # Without callback_reason explicit removals are not reported.
+        evicted = []
+        l = LRU(1, callback=lambda *args: evicted.append(args))
+        l[1] = 1
+        del l[1]
+        l[2] = 2
+        l.clear()
+        self.assertEqual(evicted, [])
+
+    def test_callback_exception(self):
+        def callback(key, value):
+            raise RuntimeError(key)
+
+        for engine in ('dict', 'compact'):
+            l = LRU(1, callback=callback, engine=engine)
+            l[1] = 1
+            with self.assertRaisesRegex(RuntimeError, '1'):
+                l[2] = 2
+            self.assertEqual(l.items(), [(2, 2)])
+            with self.assertRaisesRegex(RuntimeError, '2'):
+                l.set_many([(3, 3)])
+            self.assertEqual(l.items(), [(3, 3)])
+            self.assertEqual(l[3], 3)
+
+        def batch_callback(items):
+            raise RuntimeError(len(items))
+
+        l = LRU(5, callback=batch_callback, callback_batch=True)
+        l.update(dict.fromkeys(range(5), 0))
+        with self.assertRaisesRegex(RuntimeError, '4'):
+            l.set_size(1)
+        self.assertEqual(l.keys(), [4])
+
+        # The error of the operation wins over the one of the callback.
+        l = LRU(1, callback=callback)
+        l[1] = 1
+        with self.assertRaises(KeyError):
+            l.pop(2)
+        self.assertEqual(l.keys(), [1])
+
+    def test_metrics(self):
+        self.assertRaises(ValueError, LRU(1).get_metrics)
+        now = [0.0]
+        seen = []
+        for engine in ['dict', 'compact']:
+            options = {} if engine == 'compact' else {'timer': lambda: now[0]}
+            l = LRU(4, callback=lambda k, v: seen.append(k), engine=engine, metrics=True,
+                    **options)
+            for i in range(6):
+                l[i] = i
+            l[5] = 'x'
+            del l[5]
+            self.assertEqual(4, l.pop(4))
+            self.assertEqual(None, l.get(4))
+            self.assertRaises(KeyError, l.__getitem__, 4)
+            self.assertEqual(3, l[3])
+            l.set_size(1)
+            l.clear()
+            m = l.get_metrics()
+            latency = m.pop('latency')
+            self.assertEqual({
+                'hits': 0, 'misses': 0, 'get_misses': 1, 'inserts': 6, 'updates': 1,
+                'deletes': 3, 'evictions': {'capacity': 2, 'resize': 1, 'expired': 0},
+                'callback_calls': 3, 'callback_time': m['callback_time'],
+                'latency_sample': 64,
+            }, m)
+            self.assertTrue(m['callback_time'] > 0)
+            self.assertEqual(['get', 'set', 'delete'], list(latency))
+            self.assertEqual([(0,) * 32] * 3, list(latency.values()))
+            for i in range(64 * 3):
+                l.get(i)
+                l[i] = i
+            for i in range(64):
+                del l[64 * 3 - 1]
+                l[64 * 3 - 1] = 0
+            latency = l.get_metrics()['latency']
+            self.assertEqual([3, 4, 1], [sum(latency[op]) for op in ['get', 'set', 'delete']])
+            self.assertEqual(32, len(latency['get']))
+
+        l = LRU(2, ttl=1, timer=lambda: now[0], metrics=True)
+        l['a'] = 1
+        now[0] += 2
+        self.assertEqual(1, l.expire())
+        self.assertEqual(1, l.get_metrics()['evictions']['expired'])
+        self.assertTrue(pickle.loads(pickle.dumps(LRU(2, metrics=True))).get_metrics())
+        l = LRU(4, metrics=True)
+        l[1] = 1
+        self.assertEqual([1, None, None], l.get_many([1, 2, 3]))
+        self.assertEqual(2, l.get_metrics()['get_misses'])
+        self.assertRaises(ValueError, LRU, 1, metrics=True, read_buffer=4)
+        self.assertRaises(ValueError, ShardedLRU, 4, metrics=True, read_buffer=4)
+
+    def test_metrics_batch(self):
+        l = LRU(1, callback=lambda evicted: None, callback_batch=True, metrics=True)
+        l.update([(1, 1), (2, 2), (3, 3)])
+        m = l.get_metrics()
+        self.assertEqual(1, m['callback_calls'])
+        self.assertEqual(2, m['evictions']['capacity'])
+
+        s = ShardedLRU(64, shards=4, metrics=True)
+        for i in range(1000):
+            s[i] = i
+        m = s.get_metrics()
+        self.assertEqual(1000, m['inserts'])
+        self.assertEqual(1000 - 64, m['evictions']['capacity'])
+        self.assertRaises(ValueError, ShardedLRU(64).get_metrics)
+
+    def test_miss_ratio_curve(self):
+        self.assertRaises(ValueError, LRU(1).miss_ratio_curve)
+        self.assertRaises(ValueError, LRU, 1, mrc=-1)
+        self.assertRaises(ValueError, LRU, 1, mrc=10, read_buffer=8)
+        self.assertEqual([(5, 0.0), (10, 0.0)], LRU(1, mrc=10).miss_ratio_curve([5, 10]))
+
+        keys = [i % 10 for i in range(100)] + [i % 3 for i in range(30)]
+        for engine in ['dict', 'compact']:
+            # Up to 2048 keys are all sampled, the curve is exact.
+            l = LRU(4, engine=engine, mrc=16)
+            for key in keys:
+                if l.get(key) is None:
+                    l[key] = key
+            curve = l.miss_ratio_curve()
+            self.assertEqual(list(range(1, 17)), [size for size, _ in curve])
+            for size, ratio in curve:
+                actual = LRU(size, engine=engine)
+                for key in keys:
+                    if actual.get(key) is None:
+                        actual[key] = key
+                hits, misses = actual.get_stats()
+                self.assertAlmostEqual(misses / (hits + misses), ratio)
+            self.assertRaises(ValueError, l.miss_ratio_curve, [17])
+            self.assertRaises(ValueError, l.miss_ratio_curve, [0])
+
+            # Deleted keys miss at every size.
+            l = LRU(4, engine=engine, mrc=16)
+            l['a'] = 1
+            del l['a']
+            l.get('a')
+            self.assertEqual([(16, 1.0)], l.miss_ratio_curve([16]))
+            self.assertEqual([(16, 0.0)], pickle.loads(pickle.dumps(l)).miss_ratio_curve([16]))
+
+    def test_miss_ratio_curve_sampled(self):
+        random.seed(1)
+        keys = [int(random.paretovariate(1.2)) for _ in range(20000)]
+        for l in [LRU(100, mrc=20000), ShardedLRU(100, shards=4, mrc=20000)]:
+            for key in keys:
+                if l.get(key) is None:
+                    l[key] = key
+            for size, ratio in l.miss_ratio_curve([100, 1000, 10000]):
+                actual = LRU(size)
+                for key in keys:
+                    if actual.get(key) is None:
+                        actual[key] = key
+                hits, misses = actual.get_stats()
+                self.assertAlmostEqual(misses / (hits + misses), ratio, delta=0.05)
+        self.assertEqual(20000, pickle.loads(pickle.dumps(l)).miss_ratio_curve()[-1][0])
+        self.assertRaises(ValueError, ShardedLRU, 100, shards=4, mrc=2)
+
+    def test_trace(self):
+        self.assertRaises(ValueError, LRU(1).flush_trace, io.BytesIO())
+        self.assertRaises(ValueError, LRU, 1, trace=-1)
+        self.assertRaises(ValueError, LRU, 1, trace=10, read_buffer=8)
+
+        def events(data):
+            return [(h, stamp >> 8, stamp & 0xff) for h, stamp in struct.iter_unpack('<QQ', data)]
+
+        mask = (1 << 64) - 1
+        for engine in ['dict', 'compact']:
+            l = LRU(2, engine=engine, trace=100)
+            l['a'] = 1
+            l.get('a')
+            self.assertRaises(KeyError, l.__getitem__, 'b')
+            l['b'] = 2
+            l['c'] = 3
+            del l['b']
+            l.clear()
+            f = io.BytesIO()
+            self.assertEqual((8, 0), l.flush_trace(f))
+            trace = events(f.getvalue())
+            self.assertEqual([(hash('a') & mask, 2), (hash('a') & mask, 0), (hash('b') & mask, 1),
+                              (hash('b') & mask, 2), (hash('c') & mask, 2), (hash('a') & mask, 4),
+                              (hash('b') & mask, 3), (0, 5)], [(h, op) for h, _, op in trace])
+            times = [t for _, t, _ in trace]
+            self.assertEqual(sorted(times), times)
+            self.assertEqual((0, 0), l.flush_trace(f))
+
+        l = LRU(10, trace=3)
+        for i in range(5):
+            l[i] = i
+        f = io.BytesIO()
+        self.assertEqual((3, 2), l.flush_trace(f))
+        self.assertEqual([2, 3, 4], [h for h, _, _ in events(f.getvalue())])
+        # Unpickling loads the entries, which are traced as sets.
+        self.assertEqual((3, 2), pickle.loads(pickle.dumps(l)).flush_trace(f))
+
+        # The events stay in the trace until they are written out.
+        class Failing:
+            def write(self, data):
+                raise OSError("disk full")
+
+        class Busy:
+            def write(self, data):
+                self.data = data
+                l[5] = 5
+                l[6] = 6
+
+        l = LRU(10, trace=4)
+        l[0] = 0
+        l[1] = 1
+        self.assertRaises(OSError, l.flush_trace, Failing())
+        busy = Busy()
+        self.assertEqual((2, 0), l.flush_trace(busy))
+        self.assertEqual([0, 1], [h for h, _, _ in events(busy.data)])
+        # The sets during the write are kept for the next flush.
+        f = io.BytesIO()
+        self.assertEqual((2, 0), l.flush_trace(f))
+        self.assertEqual([5, 6], [h for h, _, _ in events(f.getvalue())])
+        # Even when they overwrite events being written, which aren't counted as dropped.
+        for i in range(3):
+            l[i] = i
+        self.assertEqual((3, 0), l.flush_trace(busy))
+        f = io.BytesIO()
+        self.assertEqual((2, 0), l.flush_trace(f))
+        self.assertEqual([5, 6], [h for h, _, _ in events(f.getvalue())])
+
+        s = ShardedLRU(10, shards=4, trace=100)
+        for i in range(20):
+            s[i] = i
+        f = io.BytesIO()
+        self.assertEqual((30, 0), s.flush_trace(f))
+        trace = events(f.getvalue())
+        self.assertEqual(sorted(t for _, t, _ in trace), [t for _, t, _ in trace])
+        self.assertEqual(list(range(20)), [h for h, _, op in trace if op == 2])
+        self.assertRaises(ValueError, ShardedLRU, 10, shards=4, trace=2)
+
+    def test_simulate(self):
+        from lru import simulate
+        random.seed(2)
+        keys = [int(random.paretovariate(1.0)) for _ in range(5000)]
+        for policy in ['lru', 'clock', 'slru', '2q', 'tinylfu']:
+            l = LRU(50, policy=policy, trace=len(keys) * 2)
+            for key in keys:
+                if l.get(key) is None:
+                    l[key] = key
+                if key % 7 == 0:
+                    del l[key]
+            f = io.BytesIO()
+            l.flush_trace(f)
+            hits, misses = l.get_stats()
+            curve = simulate(f.getvalue(), [10, 50, 200], [policy])
+            self.assertEqual([policy], list(curve))
+            self.assertEqual([10, 50, 200], [size for size, _ in curve[policy]])
+            self.assertAlmostEqual(misses / (hits + misses), curve[policy][1][1])
+            ratios = [ratio for _, ratio in curve[policy]]
+            self.assertEqual(sorted(ratios, reverse=True), ratios)
+        curve = simulate(f.getvalue(), [50])
+        self.assertEqual(['lru', 'clock', 'slru', '2q', 'tinylfu'], list(curve))
+        self.assertEqual({'lru': [(50, 0.0)]}, simulate(b'', [50], ['lru']))
+        self.assertRaises(ValueError, simulate, b'x' * 17, [50])
+        self.assertRaises(ValueError, simulate, b'', [50], ['mru'])
+        self.assertRaises(ValueError, simulate, b'', [0])
+
+    def test_iteration(self):
+        for kwargs in ({}, {'engine': 'compact'}, {'policy': 'tinylfu'}, {'read_buffer': 4}):
+            l = LRU(5, **kwargs)
+            self.assertEqual(list(l), [])
+            for i in range(8):
+                l[i] = str(i)
+            keys = l.keys()
+            self.assertEqual(list(l), keys)
+            self.assertEqual(list(l.iterkeys()), keys)
+            self.assertEqual(list(reversed(l)), keys[::-1])
+            self.assertEqual(list(l.itervalues()), l.values())
+            self.assertEqual(list(l.iteritems()), l.items())
+            self.assertEqual(l.get_stats(), (0, 0))  # iterating is not a lookup
+
+            keys, values, items = l.viewkeys(), l.viewvalues(), l.viewitems()
+            self.assertEqual(list(keys), l.keys())
+            self.assertEqual(list(reversed(values)), l.values()[::-1])
+            self.assertEqual(list(items), l.items())
+            self.assertEqual(len(items), 5)
+            self.assertTrue(7 in keys)
+            self.assertFalse(100 in keys)
+            self.assertTrue('7' in values)
+            self.assertTrue(l.items()[0] in items)
+            self.assertFalse((7, 'x') in items)
+            self.assertFalse(7 in items)
+            self.assertEqual(l.keys()[0], 7)    # contains doesn't promote
+            l[8] = '8'
+            self.assertEqual(len(keys), 5)
+            self.assertEqual(list(keys), l.keys())
+            self.assertEqual(repr(keys), 'LRU_keys(%r)' % l.keys())
+
+    def test_iteration_guard(self):
+        for engine in ('dict', 'compact'):
+            l = LRU(5, engine=engine)
+            for i in range(5):
+                l[i] = i
+            it = iter(l)
+            self.assertEqual(next(it), 4)
+            l[2]
+            with self.assertRaises(RuntimeError):
+                next(it)
+            it = l.iteritems()
+            next(it)
+            del l[0]
+            with self.assertRaises(RuntimeError):
+                next(it)
+            it = iter(l)
+            l.clear()
+            with self.assertRaises(RuntimeError):
+                next(it)
+
+            # Updating values in place is not a change of the order.
+            l = LRU(5, engine=engine, policy='lru')
+            for i in range(5):
+                l[i] = i
+            for key in l.keys():
+                l[key] = -key
+            self.assertEqual(list(l.itervalues()), [-i for i in range(5)])
+
+    def test_dump_load(self):
+        values = [b'bytes', 'str', 'n\xefn ascii', -5, 2 ** 70, 1 << 63, -(1 << 63), (1, 2),
+                  'surrogate \udcff', None]
+        for kwargs in ({}, {'engine': 'compact'}, {'policy': 'slru'}, {'max_weight': 100}):
+            l = LRU(len(values), **kwargs)
+            for i, v in enumerate(values):
+                l[v if isinstance(v, (str, bytes)) else i] = v
+            l[3]
+            f = io.BytesIO()
+            l.dump(f)
+            f.seek(0)
+            restored = LRU(len(values), **kwargs)
+            self.assertEqual(restored.load(f), len(values))
+            self.assertEqual(restored.items(), l.items())
+
+            # A smaller LRU keeps the most recent entries.
+            f.seek(0)
+            small = LRU(3, **kwargs)
+            self.assertEqual(small.load(f), 3)
+            self.assertEqual(small.items(), l.items()[:3])
+
+        f = io.BytesIO()
+        LRU(1).dump(f)
+        self.assertEqual(LRU(1).load(io.BytesIO(f.getvalue())), 0)
+        self.assertRaises(ValueError, LRU(1).load, io.BytesIO(b'not a dump at all'))
+        l = LRU(2)
+        l['big'] = b'x' * 200000
+        f = io.BytesIO()
+        l.dump(f)
+        self.assertRaises(ValueError, LRU(1).load, io.BytesIO(f.getvalue()[:-1]))
+        restored = LRU(1)
+        restored.load(io.BytesIO(f.getvalue()))
+        self.assertEqual(restored['big'], l['big'])
+
+    def test_dump_load_ttl_weight(self):
+        now = [0.0]
+        l = LRU(10, ttl=10, timer=lambda: now[0], max_weight=20)
+        l.set('a', 1, weight=5)
+        l.set('b', 2, ttl=1)
+        l.set('c', 3, ttl=100)
+        now[0] = 5
+        f = io.BytesIO()
+        l.dump(f)
+        f.seek(0)
+        restored = LRU(10, max_weight=20, timer=lambda: now[0])
+        self.assertEqual(restored.load(f), 2)
+        self.assertEqual(restored.items(), [('c', 3), ('a', 1)])
+        self.assertEqual(restored.get_current_weight(), 6)
+        now[0] = 10
+        self.assertNotIn('a', restored)
+        now[0] = 99
+        self.assertIn('c', restored)
+        now[0] = 100
+        self.assertNotIn('c', restored)
+
+    def test_pickle(self):
+        l = LRU(5, None, 'dict', 0, 'slru', max_weight=10)
+        for i in range(7):
+            l[i] = str(i)
+        l[3]
+        restored = pickle.loads(pickle.dumps(l))
+        self.assertEqual(restored.items(), l.items())
+        self.assertEqual(restored.get_size(), 5)
+        self.assertEqual(restored.get_max_weight(), 10)
+        self.assertRaises(ValueError, restored.set, 'x', 1, weight=11)
+        compact = LRU(3, engine='compact')
+        compact.update(a=1, b=2)
+        self.assertEqual(pickle.loads(pickle.dumps(compact)).items(), compact.items())
+
+        sharded = ShardedLRU(20, shards=3, max_weight=30)
+        for i in range(15):
+            sharded[i] = str(i)
+        restored = pickle.loads(pickle.dumps(sharded))
+        self.assertEqual(restored.items(), sharded.items())
+        self.assertEqual(restored.get_shards(), 3)
+        self.assertEqual(restored.get_max_weight(), 30)
+
+    def test_compact_engine(self):
+        for size in SIZES:
+            l = LRU(size, engine='compact')
+            n = size * 2
+            for i in range(n):
+                l[i] = str(i)
+            self._check_kvi(range(n - 1, size - 1, -1), l)
+            for i in range(size):
+                self.assertFalse(i in l)
+                with self.assertRaises(KeyError):
+                    l[i]
+            for i in range(size, n):
+                self.assertEqual(l[i], str(i))
+                self.assertTrue(l.has_key(i))
+            self._check_kvi(range(n - 1, size - 1, -1), l)
+            for i in range(size, n, 2):
+                del l[i]
+            self._check_kvi(range(n - 1, size, -2), l)
+            self.assertEqual(len(l), size // 2)
+
+    def test_compact_engine_api(self):
+        l = LRU(3, engine='compact')
+        self.assertEqual(None, l.peek_first_item())
+        l.update({'a': 1, 'b': 2})
+        l.update(c=3)
+        self.assertEqual(('c', 3), l.peek_first_item())
+        self.assertEqual(('a', 1), l.peek_last_item())
+        self.assertEqual(1, l.get('a'))
+        self.assertEqual(None, l.get('z'))
+        self.assertEqual((1, 1), l.get_stats())
+        self.assertEqual(2, l.pop('b'))
+        self.assertEqual('x', l.pop('b', 'x'))
+        self.assertEqual(4, l.setdefault('d', 4))
+        self.assertEqual(('c', 3), l.popitem())
+        self.assertEqual(('d', 4), l.popitem(least_recent=False))
+        self.assertEqual("{'a': 1}", repr(l))
+        l['b'] = 2
+        l['b'] = 3
+        self.assertEqual([('b', 3), ('a', 1)], l.items())
+        l.clear()
+        self.assertEqual(0, len(l))
+        self.assertEqual((0, 0), l.get_stats())
+        self.assertRaises(TypeError, lambda: l[{'a': 'b'}])
+        with self.assertRaises(TypeError):
+            l[['1']] = '2'
+        self.assertRaises(ValueError, LRU, 1, engine='bogus')
+
+    def test_compact_engine_growth(self):
+        l = LRU(1000, engine='compact')
+        for i in range(5000):
+            l[str(i)] = i
+            if i % 3 == 0:
+                del l[str(i)]
+        self.assertEqual(1000, len(l))
+        for i in range(4000, 5000):
+            if i % 3:
+                self.assertEqual(i, l[str(i)])
+            else:
+                self.assertFalse(str(i) in l)
+        l.set_size(10)
+        self.assertEqual(10, len(l))
+        self.assertEqual(l.keys()[0], '4999')
+
+    def test_compact_engine_callback(self):
+        evicted = []
+        l = LRU(2, callback=lambda k, v: evicted.append((k, v)), engine='compact')
+        l['a'] = 1
+        l['b'] = 2
+        l['a']
+        l['c'] = 3
+        self.assertEqual([('b', 2)], evicted)
+        l.set_size(1)
+        self.assertEqual([('b', 2), ('a', 1)], evicted)
+        self.assertEqual(['c'], l.keys())
+
+    def test_compact_engine_colliding_keys(self):
+        class Key:
+            def __init__(self, v):
+                self.v = v
+
+            def __hash__(self):
+                return 1
+
+            def __eq__(self, other):
+                return self.v == other.v
+
+        l = LRU(100, engine='compact')
+        for i in range(50):
+            l[Key(i)] = i
+        for i in range(0, 50, 2):
+            del l[Key(i)]
+        for i in range(50):
+            self.assertEqual(i % 2 == 1, Key(i) in l)
+            if i % 2:
+                self.assertEqual(i, l[Key(i)])
+
+    def test_compact_key_types(self):
+        class Str(str):
+            pass
+
+        l = LRU(100, engine='compact')
+        keys = ['user:1', 'user:\u20ac', 'user:\U0001f600', b'user:1', 2 ** 70, 1, '']
+        for i, k in enumerate(keys):
+            l[k] = i
+        # Equal keys that are other objects, of the same or of another type
+        for i, k in enumerate(keys):
+            copy = pickle.loads(pickle.dumps(k))
+            self.assertEqual(i, l[copy])
+        self.assertEqual(0, l[Str('user:1')])
+        self.assertEqual(5, l[1.0])
+        self.assertEqual(5, l[True])
+        self.assertFalse('user:' in l)
+        self.assertFalse('user:\u20ad' in l)
+        self.assertFalse(b'user:2' in l)
+        self.assertFalse(2 ** 70 + 1 in l)
+        self.assertEqual(len(keys), len(l))
+
+    def test_read_buffer(self):
+        l = LRU(3, read_buffer=4)
+        for k in 'abc':
+            l[k] = k
+        self.assertEqual('a', l['a'])
+        self.assertEqual('b', l.get('b'))
+        self.assertEqual(None, l.get('z'))
+        self.assertEqual((0, 0), l.get_read_buffer_stats())
+        self.assertEqual(['b', 'a', 'c'], l.keys())   # Applies the buffered moves
+        self.assertEqual((2, 0), l.get_read_buffer_stats())
+        self.assertEqual((2, 1), l.get_stats())
+        for _ in range(4):
+            l['c']                                       # Fills the buffer
+        self.assertEqual((6, 0), l.get_read_buffer_stats())
+        self.assertEqual(('c', 'c'), l.peek_first_item())
+        l['b']
+        l['d'] = 'd'                                     # Moves are applied before evicting
+        self.assertEqual(['d', 'b', 'c'], l.keys())
+        l['b'] = 'B'
+        self.assertEqual('B', l['b'])
+        self.assertEqual([('b', 'B'), ('d', 'd'), ('c', 'c')], l.items())
+        l['c']
+        del l['c']
+        self.assertEqual(['b', 'd'], l.keys())
+        self.assertRaises(KeyError, lambda: l['c'])
+        l.clear()
+        self.assertEqual((0, 0), l.get_read_buffer_stats())
+        self.assertEqual((0, 0), l.get_stats())
+        self.assertEqual((0, 0), LRU(1).get_read_buffer_stats())
+        self.assertRaises(ValueError, LRU, 1, read_buffer=-1)
+        self.assertRaises(ValueError, LRU, 1, engine='compact', read_buffer=1)
+
+    def test_read_buffer_threads(self):
+        l = ShardedLRU(500, shards=4, read_buffer=16)
+        for i in range(500):
+            l[i] = i
+
+        def reader():
+            for _ in range(20):
+                for i in range(0, 500, 3):
+                    v = l.get(i)
+                    self.assertTrue(v is None or v == i)
+
+        def writer():
+            for i in range(5000):
+                l[i % 700] = i % 700
+
+        threads = [threading.Thread(target=reader) for _ in range(4)]
+        threads.append(threading.Thread(target=writer))
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertTrue(len(l) <= 500)
+        self.assertEqual(len(l), len(l.items()))
+
+    def test_clock_policy(self):
+        evicted = []
+        l = LRU(3, policy='clock', callback=lambda k, v: evicted.append(k))
+        for k in 'abc':
+            l[k] = k
+        self.assertEqual('a', l['a'])                    # Only marks 'a'
+        self.assertEqual(['c', 'b', 'a'], l.keys())
+        l['d'] = 'd'                                     # 'a' gets a second chance
+        self.assertEqual(['b'], evicted)
+        self.assertEqual(['d', 'a', 'c'], l.keys())
+        l['c'] = 'C'                                     # Updates mark too
+        l['e'] = 'e'
+        self.assertEqual(['b', 'a'], evicted)
+        self.assertEqual(['e', 'c', 'd'], l.keys())
+        self.assertEqual('C', l['c'])
+        l['d'], l['e']
+        l['f'] = 'f'                                     # All marked, a full sweep
+        self.assertEqual(['b', 'a', 'd'], evicted)
+        self.assertEqual(['f', 'e', 'c'], l.keys())
+        self.assertEqual((4, 0), l.get_stats())
+        self.assertEqual(('c', 'C'), l.popitem(least_recent=True))
+        l.set_size(1)
+        self.assertEqual(1, len(l))
+        self.assertRaises(ValueError, LRU, 1, policy='lfu')
+        self.assertRaises(ValueError, LRU, 1, policy='clock', engine='compact')
+        self.assertRaises(ValueError, LRU, 1, policy='clock', read_buffer=8)
+        del evicted[:]
+        s = ShardedLRU(4, shards=2, policy='clock', callback=lambda k, v: evicted.append(k))
+        for i in range(10):
+            s[i] = i
+        self.assertEqual(4, len(s))
+        self.assertEqual(6, len(evicted))
+
+    def test_slru_policy(self):
+        l = LRU(5, policy='slru')                        # 4 protected slots
+        for k in 'abcde':
+            l[k] = k
+        l['a'], l['b']                                   # Promoted to protected
+        self.assertEqual(['b', 'a', 'e', 'd', 'c'], l.keys())
+        l['f'] = 'f'                                     # Probation LRU goes first
+        self.assertEqual(['b', 'a', 'f', 'e', 'd'], l.keys())
+        l['d'], l['e'], l['f']                           # Protected overflows into probation
+        self.assertEqual(['f', 'e', 'd', 'b', 'a'], l.keys())
+        for k in 'xyz':
+            l[k] = k                                     # A scan only churns probation
+        self.assertEqual(['f', 'e', 'd', 'b', 'z'], l.keys())
+
+    def test_2q_policy(self):
+        l = LRU(8, policy='2q')                          # A1in holds 2
+        for k in range(8):
+            l[k] = k
+        l[0]                                             # Hits don't reorder A1in
+        self.assertEqual([7, 6, 5, 4, 3, 2, 1, 0], l.keys())
+        l[8] = 8
+        self.assertFalse(0 in l)
+        l[0] = 0                                         # Remembered, admitted to Am
+        l[9] = 9
+        self.assertTrue(0 in l)
+        self.assertEqual([0, 9, 8, 7, 6, 5, 4, 3], l.keys())
+
+    def test_tinylfu_policy(self):
+        l = LRU(100, policy='tinylfu')
+        for _ in range(5):
+            for k in range(50):
+                if l.get(k) is None:
+                    l[k] = k
+        for k in range(1000, 2000):                      # One hit wonders
+            l[k] = k
+        self.assertEqual(100, len(l))
+        self.assertEqual(50, sum(1 for k in range(50) if k in l))
+
+    def test_scan_resistance(self):
+        def hit_ratio(policy):
+            l = LRU(100, policy=policy)
+            hits = total = 0
+            scan = 10 ** 6
+            for _ in range(10):
+                for _ in range(3):
+                    for k in range(50):
+                        total += 1
+                        if l.get(k) is None:
+                            l[k] = k
+                        else:
+                            hits += 1
+                for _ in range(300):
+                    scan += 1
+                    l[scan] = scan
+            return hits / total
+        baseline = hit_ratio('lru')
+        for policy in ('slru', '2q', 'tinylfu'):
+            self.assertTrue(hit_ratio(policy) > baseline, policy)
+
+    def test_segmented_policies_api(self):
+        random.seed(7)
+        for policy in ('slru', '2q', 'tinylfu'):
+            evicted = []
+            l = LRU(20, policy=policy, callback=lambda k, v: evicted.append(k))
+            shadow = {}
+            for _ in range(2000):
+                k = random.randint(0, 60)
+                op = random.random()
+                if op < 0.5:
+                    l[k] = shadow[k] = random.random()
+                elif op < 0.8:
+                    self.assertEqual(shadow.get(k) if k in l else None, l.get(k))
+                elif op < 0.9:
+                    if k in l:
+                        del l[k]
+                else:
+                    expected = shadow.get(k) if k in l else None
+                    self.assertEqual(expected, l.pop(k, None))
+                self.assertTrue(len(l) <= 20)
+            self.assertEqual(len(l), len(l.keys()))
+            for k, v in l.items():
+                self.assertEqual(shadow[k], v)
+            self.assertEqual(l.peek_last_item(), l.popitem(least_recent=True))
+            l.set_size(5)
+            self.assertEqual(5, len(l))
+            for k in range(100):
+                l[k] = k
+            self.assertEqual(5, len(l))
+            l.clear()
+            self.assertEqual([], l.keys())
+            for k in range(10):
+                l[k] = k
+            self.assertEqual(5, len(l))
+            self.assertRaises(ValueError, LRU, 1, policy=policy, engine='compact')
+            self.assertRaises(TypeError, l.__setitem__, [], 1)
+
+    def test_ttl(self):
+        now = [100.0]
+        l = LRU(10, ttl=5, timer=lambda: now[0])
+        l['a'] = 1
+        l.set('b', 2, ttl=60)
+        l.set('c', 3, ttl=None)                          # The default TTL
+        now[0] += 4
+        l['c'] = 3                                       # Writes restart the TTL
+        self.assertEqual(1, l['a'])
+        now[0] += 1
+        self.assertRaises(KeyError, lambda: l['a'])
+        self.assertEqual(2, len(l))
+        self.assertEqual(2, l.get('b'))
+        self.assertTrue('c' in l)
+        now[0] += 4
+        self.assertFalse('c' in l)
+        self.assertEqual(None, l.get('c'))
+        self.assertEqual((2, 2), l.get_stats())
+        now[0] += 100
+        self.assertEqual(1, len(l))                     # Expired, but not looked up yet
+        self.assertEqual(1, l.expire())
+        self.assertEqual(0, len(l))
+        self.assertEqual(0, l.expire())
+        l['d'] = 4
+        now[0] += 5
+        self.assertEqual('x', l.pop('d', 'x'))          # Expired entries pop as absent
+        self.assertEqual(0, len(l))
+        evicted = []
+        l = LRU(10, lambda *args: evicted.append(args), ttl=5, timer=lambda: now[0],
+                callback_reason=True)
+        for i in range(3):
+            l[i] = i
+        l.set('live', 1, ttl=60)
+        l[3] = 3
+        now[0] += 10
+        self.assertEqual(('live', 1), l.peek_last_item())  # And the ends skip them
+        self.assertEqual(('live', 1), l.peek_first_item())
+        self.assertEqual(('live', 1), l.popitem())
+        self.assertRaises(KeyError, l.popitem)
+        self.assertEqual([(i, i, 'expired') for i in range(4)] + [('live', 1, 'explicit')],
+                         evicted)
+
+        l = LRU(10)
+        l.set('a', 1, ttl=0.05)
+        l.set('b', 2, ttl=3600)
+        l['c'] = 3
+        time.sleep(0.1)
+        self.assertEqual(1, l.expire())
+        self.assertEqual(['c', 'b'], l.keys())
+        self.assertRaises(ValueError, l.set, 'a', 1, ttl=0)
+        self.assertRaises(ValueError, l.set, 'a', 1, ttl=-1)
+        self.assertRaises(TypeError, l.set, 'a', 1, ttl='1')
+        self.assertRaises(TypeError, LRU, 1, timer=1)
+        self.assertRaises(ValueError, LRU, 1, ttl=1, engine='compact')
+        self.assertRaises(ValueError, LRU, 1, ttl=1, read_buffer=4)
+        self.assertRaises(ValueError, LRU(1, engine='compact').set, 'a', 1, ttl=1)
+        self.assertEqual(0, LRU(1).expire())
+
+    def test_ttl_timer_changes_lru(self):
+        # The timer runs before the lookup, so the nodes it frees aren't used afterwards.
+        def timer():
+            if actions:
+                actions.pop()()
+            return 0.0
+
+        actions = []
+        l = LRU(8, ttl=10, timer=timer)
+        for op in (l.get, l.__contains__, l.peek, lambda key: l.pop(key, None),
+                   lambda key: l.dump(io.BytesIO())):
+            for i in range(8):
+                l[i] = i
+            actions.append(l.clear)
+            op(3)
+            self.assertEqual(0, len(l))
+        actions.append(lambda: l.__setitem__('a', 2))
+        l['a'] = 1
+        self.assertEqual([('a', 1)], l.items())
+
+    def test_ttl_wheel(self):
+        now = [0.0]
+        evicted = []
+        l = LRU(100000, timer=lambda: now[0],
+                callback=lambda k, v, reason: evicted.append((k, reason)), callback_reason=True)
+        ttls = [0.5, 2, 30, 90, 4000, 90000, 432000, 10 ** 6, 10 ** 7]
+        for i in range(900):
+            l.set(i, i, ttl=ttls[i % len(ttls)])
+        for horizon in [1, 3, 60, 100, 5000, 10 ** 5, 3 * 10 ** 5, 5 * 10 ** 5, 2 * 10 ** 6,
+                        2 * 10 ** 7]:
+            now[0] = horizon
+            l.expire()
+            alive = [i for i in range(900) if ttls[i % len(ttls)] > horizon]
+            self.assertEqual(sorted(alive), sorted(l.keys()))
+        self.assertEqual(900, len(evicted))
+        self.assertEqual({'expired'}, set(reason for _, reason in evicted))
+
+        # A full LRU drops expired entries before evicting live ones.
+        del evicted[:]
+        l = LRU(3, ttl=10, timer=lambda: now[0],
+                callback=lambda k, v, reason: evicted.append((k, reason)), callback_reason=True)
+        l.set('a', 1, ttl=3600)
+        l['b'] = 2
+        l['c'] = 3
+        now[0] += 20
+        l['d'] = 4
+        self.assertEqual(['d', 'a'], l.keys())
+        self.assertEqual([('b', 'expired'), ('c', 'expired')], evicted)
+        l['e'] = 5
+        l['f'] = 6
+        self.assertEqual(('a', 'capacity'), evicted[-1])
+
+        s = ShardedLRU(100, shards=4, ttl=1, timer=lambda: now[0])
+        for i in range(50):
+            s.set(i, i, ttl=100 if i % 2 else None)
+        now[0] += 2
+        self.assertEqual(25, s.expire())
+        self.assertEqual(25, len(s))
+
+    def test_max_weight(self):
+        evicted = []
+        l = LRU(100, max_weight=10, weigher=lambda k, v: len(v),
+                callback=lambda k, v: evicted.append(k))
+        self.assertEqual(10, l.get_max_weight())
+        l['a'] = 'xxxx'
+        l['b'] = 'xxxx'
+        l['c'] = 'xx'
+        self.assertEqual(10, l.get_current_weight())
+        l['d'] = 'xxx'                                   # Evicts by weight, not count
+        self.assertEqual(['d', 'c', 'b'], l.keys())
+        self.assertEqual(9, l.get_current_weight())
+        l['c'] = 'xxxxxxx'                               # Updates can evict too
+        self.assertEqual(['c', 'd'], l.keys())
+        self.assertEqual(['a', 'b'], evicted)
+        l.set('e', 'e', weight=0)
+        self.assertEqual(10, l.get_current_weight())
+        self.assertRaises(ValueError, l.__setitem__, 'f', 'x' * 11)
+        self.assertEqual(['e', 'c', 'd'], l.keys())
+        del l['c']
+        self.assertEqual(3, l.get_current_weight())
+        self.assertEqual('xxx', l.pop('d'))
+        self.assertEqual(0, l.get_current_weight())
+        l.update(g='xxxxxx', h='xxxxxx')
+        self.assertEqual(['h'], l.keys())
+        l['i'] = 'x'
+        l.set_max_weight(1)                              # Keeps one item even if it's too heavy
+        self.assertEqual(['i'], l.keys())
+        l.set_max_weight(10)
+        l['j'] = 'x' * 8
+        self.assertEqual(['j', 'i'], l.keys())
+        l.set_max_weight(5)
+        self.assertEqual(['j'], l.keys())
+        l.clear()
+        self.assertEqual(0, l.get_current_weight())
+
+        l = LRU(2, max_weight=100)                       # Weight 1 per item without a weigher
+        for i in range(5):
+            l[i] = i
+        self.assertEqual(2, l.get_current_weight())
+        self.assertEqual(None, LRU(1).get_max_weight())
+        self.assertEqual(0, LRU(1).get_current_weight())
+        self.assertRaises(ValueError, LRU, 1, max_weight=0)
+        self.assertRaises(ValueError, LRU, 1, weigher=len)
+        self.assertRaises(TypeError, LRU, 1, max_weight=1, weigher=1)
+        self.assertRaises(ValueError, LRU, 1, max_weight=1, engine='compact')
+        self.assertRaises(ValueError, LRU(1).set, 'a', 1, weight=1)
+        self.assertRaises(ValueError, LRU(1).set_max_weight, 1)
+        self.assertRaises(ValueError, l.set, 'a', 1, weight=-1)
+        self.assertRaises(ValueError, LRU(1, max_weight=1, weigher=lambda k, v: -1).__setitem__, 1, 1)
+        self.assertRaises(ZeroDivisionError, LRU(1, max_weight=1, weigher=lambda k, v: 1 // 0).__setitem__, 1, 1)
+
+        s = ShardedLRU(100, shards=4, max_weight=40)
+        self.assertEqual(40, s.get_max_weight())
+        for i in range(100):
+            s.set(i, i, weight=3)
+        self.assertTrue(len(s) <= 13)
+        self.assertTrue(s.get_current_weight() <= 40)
+        s.set_max_weight(8)
+        self.assertEqual(8, s.get_max_weight())
+        self.assertTrue(s.get_current_weight() <= 12)
+
+    def test_sharded(self):
+        l = ShardedLRU(100, shards=4)
+        self.assertEqual(100, l.get_size())
+        self.assertEqual(4, l.get_shards())
+        for i in range(100):
+            l[i] = str(i)
+        self.assertTrue(len(l) <= 100)
+        present = [i for i in range(100) if i in l]
+        self.assertEqual(len(l), len(present))
+        for i in present:
+            self.assertEqual(str(i), l[i])
+            self.assertEqual(str(i), l.get(i))
+            self.assertTrue(l.has_key(i))
+        self.assertEqual((2 * len(present), 0), l.get_stats())
+        self.assertEqual(sorted(present), sorted(l.keys()))
+        self.assertEqual(sorted(map(str, present)), sorted(l.values()))
+        self.assertEqual(len(present), len(l.items()))
+        self.assertEqual('x', l.get('missing', 'x'))
+        self.assertRaises(KeyError, lambda: l['missing'])
+        self.assertEqual(str(present[0]), l.pop(present[0]))
+        self.assertEqual('x', l.pop(present[0], default='x'))
+        self.assertEqual('y', l.setdefault('new', 'y'))
+        l.update({'a': 1}, b=2)
+        l.set_many([('c', 3)])
+        self.assertEqual([1, 2, 3, None], l.get_many(['a', 'b', 'c', 'd']))
+        self.assertEqual(2, l.delete_many(['a', 'b', 'd']))
+        del l['c']
+        self.assertFalse('c' in l)
+        k, v = l.popitem()
+        self.assertFalse(k in l)
+        self.assertRaises(TypeError, lambda: l[[]])
+        l.clear()
+        self.assertEqual(0, len(l))
+        self.assertRaises(KeyError, l.popitem)
+        self.assertRaises(ValueError, ShardedLRU, 0)
+        self.assertRaises(ValueError, ShardedLRU, 10, shards=0)
+        self.assertEqual(3, ShardedLRU(3, shards=8).get_shards())
+
+    def test_sharded_iteration(self):
+        l = ShardedLRU(100, shards=4)
+        for i in range(50):
+            l[i] = str(i)
+        self.assertEqual(list(l), l.keys())
+        self.assertEqual(list(reversed(l)), l.keys()[::-1])
+        self.assertEqual(list(l.iteritems()), l.items())
+        self.assertEqual(list(l.viewvalues()), l.values())
+        self.assertEqual(len(l.viewkeys()), 50)
+        self.assertTrue((3, '3') in l.viewitems())
+        self.assertFalse((3, 3) in l.viewitems())
+        self.assertEqual(sorted(l.itervalues(), key=int), [str(i) for i in range(50)])
+        it = iter(l)
+        next(it)
+        l.clear()
+        self.assertRaises(RuntimeError, list, it)
+
+    def test_sharded_capacity(self):
+        evicted = []
+        l = ShardedLRU(64, shards=8, callback=lambda k, v: evicted.append(k), engine='compact')
+        for i in range(1000):
+            l[i] = i
+        self.assertEqual(64, len(l))
+        self.assertEqual(1000 - 64, len(evicted))
+        l.set_size(16)
+        self.assertEqual(16, len(l))
+        self.assertEqual(16, l.get_size())
+        self.assertRaises(ValueError, l.set_size, 4)
+
+    def test_sharded_threads(self):
+        l = ShardedLRU(1000, shards=8)
+        errors = []
+
+        def worker(n):
+            try:
+                for i in range(2000):
+                    key = (n, i % 300)
+                    l[key] = i
+                    l.get(key)
+                    if i % 5 == 0:
+                        l.pop(key, None)
+            except Exception as e:  # pragma: no cover
+                errors.append(e)
+
+        threads = [threading.Thread(target=worker, args=(n,)) for n in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual([], errors)
+        self.assertTrue(len(l) <= 1000)
+        self.assertEqual(len(l), len(l.keys()))
+
+
+    def test_get_or_load_threads(self):
+        for l in (LRU(10), ShardedLRU(10, shards=2)):
+            calls = []
+            release = threading.Event()
+
+            def loader(key):
+                calls.append(key)
+                release.wait()
+                if key == 'bad':
+                    raise ValueError(key)
+                return key * 2
+
+            def worker(key, results):
+                try:
+                    results.append(l.get_or_load(key, loader))
+                except ValueError as e:
+                    results.append(e)
+
+            results = {'a': [], 'bad': []}
+            threads = [threading.Thread(target=worker, args=(key, results[key]))
+                       for key in results for _ in range(8)]
+            for t in threads:
+                t.start()
+            time.sleep(0.1)
+            release.set()
+            for t in threads:
+                t.join()
+            self.assertEqual(['a', 'bad'], sorted(calls))
+            self.assertEqual(['aa'] * 8, results['a'])
+            self.assertEqual(1, len(set(map(id, results['bad']))))
+            self.assertEqual({'a': 'aa'}, dict(l.items()))
+
+    def test_async_lru(self):
+        calls = []
+
+        async def load(key):
+            calls.append(key)
+            await asyncio.sleep(0.01)
+            if key == 'bad':
+                raise ValueError(key)
+            return key * 2
+
+        async def main():
+            l = AsyncLRU(1)
+            results = await asyncio.gather(*[l.get_or_load('a', load) for _ in range(5)])
+            self.assertEqual(['aa'] * 5, results)
+            self.assertEqual(['a'], calls)
+            self.assertEqual((0, 5), l.get_stats())
+            self.assertEqual('aa', await l.get_or_load('a', load))
+            self.assertEqual((1, 5), l.get_stats())
+
+            # Pending loads don't take room or get evicted.
+            loading = [asyncio.ensure_future(l.get_or_load(k, load)) for k in 'bcb']
+            await asyncio.sleep(0)
+            self.assertEqual(2, l.pending())
+            self.assertEqual(['a'], l.keys())
+            self.assertEqual(['bb', 'cc', 'bb'], await asyncio.gather(*loading))
+            self.assertEqual(0, l.pending())
+            self.assertEqual(1, len(l))
+
+            errors = await asyncio.gather(*[l.get_or_load('bad', load) for _ in range(3)],
+                                          return_exceptions=True)
+            self.assertEqual(1, len(set(map(id, errors))))
+            self.assertIsInstance(errors[0], ValueError)
+            self.assertNotIn('bad', l)
+
+            # A cancelled caller doesn't cancel the load for the others.
+            first = asyncio.ensure_future(l.get_or_load('d', load))
+            second = asyncio.ensure_future(l.get_or_load('d', load))
+            await asyncio.sleep(0)
+            first.cancel()
+            self.assertEqual('dd', await second)
+            self.assertTrue(first.cancelled())
+
+            # set() wins over the load in flight.
+            loading = asyncio.ensure_future(l.get_or_load('e', load))
+            await asyncio.sleep(0)
+            l.set('e', 'set')
+            self.assertEqual('ee', await loading)
+            self.assertEqual('set', l.get('e'))
+
+        asyncio.run(main())
+        self.assertRaises(ValueError, AsyncLRU, 1, refresh_ahead=1)
+        self.assertRaises(ValueError, AsyncLRU, 1, ttl=1, refresh_ahead=1)
+
+    def test_async_lru_refresh_ahead(self):
+        now = [0.0]
+        versions = []
+
+        async def load(key):
+            versions.append(key)
+            return len(versions)
+
+        async def main():
+            l = AsyncLRU(4, ttl=10, refresh_ahead=2, timer=lambda: now[0])
+            self.assertEqual(1, await l.get_or_load('a', load))
+            now[0] = 7.0
+            self.assertEqual(1, await l.get_or_load('a', load))
+            self.assertEqual(0, l.pending())
+            now[0] = 8.5
+            self.assertEqual(1, await l.get_or_load('a', load))
+            self.assertEqual(1, l.pending())
+            self.assertEqual(1, await l.get_or_load('a', load))
+            await asyncio.sleep(0)
+            self.assertEqual(0, l.pending())
+            self.assertEqual(2, await l.get_or_load('a', load))
+            now[0] = 16.0
+            self.assertEqual(2, await l.get_or_load('a', load))
+            now[0] = 19.0
+            self.assertEqual(3, await l.get_or_load('a', load))
+
+        asyncio.run(main())
+        self.assertEqual(['a'] * 3, versions)
+
+    def _shared_path(self):
+        fd, path = tempfile.mkstemp()
+        os.close(fd)
+        self.addCleanup(os.unlink, path)
+        return path
+
+    @unittest.skipIf(SharedLRU is None, "SharedLRU is not available")
+    def test_shared(self):
+        path = self._shared_path()
+        l = SharedLRU(path, 4096, max_entries=4)
+        self.assertEqual((4096, 4), l.get_capacity())
+        l[b'a'] = b'1'
+        l[bytearray(b'b')] = memoryview(b'22')
+        self.assertEqual(b'22', bytes(l[b'b']))
+        self.assertTrue(b'a' in l)
+        self.assertFalse(b'z' in l)
+        self.assertIsNone(l.get(b'z'))
+        self.assertEqual(3, l.get(b'z', 3))
+        self.assertRaises(KeyError, l.__getitem__, b'z')
+        self.assertRaises(TypeError, l.__setitem__, 'a', b'1')
+        self.assertEqual([b'b', b'a'], l.keys())
+        self.assertEqual((1, 3), l.get_stats())
+        for k in [b'c', b'd', b'e']:
+            l[k] = k
+        # Out of slots, so the least recently used key went
+        self.assertEqual([b'e', b'd', b'c', b'b'], l.keys())
+        with l.get(b'c') as v:
+            self.assertTrue(v.readonly)
+            self.assertRaises(TypeError, v.__setitem__, 0, 0)
+        del l[b'c']
+        self.assertRaises(KeyError, l.__delitem__, b'c')
+        self.assertEqual(3, len(l))
+        # Everything is in the file, a second mapping sees the same items
+        other = SharedLRU(path, 64)
+        self.assertEqual((4096, 4), other.get_capacity())
+        self.assertEqual([b'e', b'd', b'b'], other.keys())
+        other[b'd'] = b'x' * 1000
+        self.assertEqual(b'x' * 1000, bytes(l[b'd']))
+        self.assertRaises(ValueError, l.__setitem__, b'big', b'x' * 5000)
+        l.clear()
+        self.assertEqual(0, len(other))
+        self.assertEqual(0, l.get_used_bytes())
+
+    @unittest.skipIf(SharedLRU is None, "SharedLRU is not available")
+    def test_shared_eviction(self):
+        l = SharedLRU(self._shared_path(), 8192, max_entries=1000)
+        for i in range(2000):
+            l[str(i).encode()] = bytes(i % 300)
+        self.assertTrue(l.get_used_bytes() <= 8192)
+        keys = l.keys()
+        self.assertEqual(len(l), len(keys))
+        self.assertEqual(b'1999', keys[0])
+        for k in keys:
+            self.assertEqual(bytes(int(k) % 300), bytes(l[k]))
+        for k in keys:
+            del l[k]
+        self.assertEqual(0, l.get_used_bytes())
+        # The free blocks were merged back into one
+        l[b'big'] = bytes(8000)
+
+    @unittest.skipIf(SharedLRU is None, "SharedLRU is not available")
+    def test_shared_oversized(self):
+        l = SharedLRU(self._shared_path(), 4096, max_entries=16)
+        for i in range(5):
+            l[str(i).encode()] = bytes(i)
+        keys = l.keys()
+        self.assertRaises(ValueError, l.__setitem__, b'big', b'x' * 10000)
+        self.assertRaises(ValueError, l.__setitem__, b'1', b'x' * 10000)
+        self.assertEqual(keys, l.keys())
+        self.assertEqual(bytes(1), bytes(l[b'1']))
+
+    @unittest.skipIf(SharedLRU is None, "SharedLRU is not available")
+    def test_shared_pins(self):
+        l = SharedLRU(self._shared_path(), 1024, max_entries=16)
+        l[b'a'] = b'x' * 500
+        view = l[b'a']
+        used = l.get_used_bytes()
+        # Replaced while a view is alive, the old value stays readable
+        l[b'a'] = b'y' * 400
+        self.assertEqual(b'x' * 500, bytes(view))
+        self.assertEqual(b'y' * 400, bytes(l[b'a']))
+        self.assertTrue(l.get_used_bytes() > used)
+        self.assertRaises(ValueError, l.__setitem__, b'b', b'z' * 500)
+        view.release()
+        l[b'b'] = b'z' * 500
+        self.assertEqual([b'b'], l.keys())
+        # The exporter keeps the mapping alive
+        view = l[b'b']
+        del l
+        gc.collect()
+        self.assertEqual(b'z' * 500, bytes(view))
+
+    @unittest.skipIf(SharedLRU is None or not sys.platform.startswith('linux'),
+                     "needs SharedLRU with a robust lock")
+    def test_shared_owner_died(self):
+        import ctypes
+        import mmap
+        path = self._shared_path()
+        l = SharedLRU(path, 1024, max_entries=4)
+        l[b'a'] = b'x' * 100
+        view = l[b'a']
+        pid = os.fork()
+        if pid == 0:  # pragma: no cover
+            # Die holding the mutex of the segment, which follows the header fields.
+            with open(path, 'r+b') as f:
+                m = mmap.mmap(f.fileno(), 0)
+            mutex = ctypes.c_char.from_buffer(m, struct.calcsize('QIIIIII10Q48Q'))
+            ctypes.CDLL(None).pthread_mutex_lock(ctypes.byref(mutex))
+            os._exit(0)
+        os.waitpid(pid, 0)
+        # The next operation resets the segment, the entry of a reuses the slot of a.
+        l[b'b'] = b'y' * 100
+        self.assertEqual([b'b'], l.keys())
+        # Releasing the view taken before the reset doesn't unpin the new entry.
+        view.release()
+        del l[b'b']
+        self.assertEqual(0, len(l))
+        self.assertEqual(0, l.get_used_bytes())
+
+    @unittest.skipIf(SharedLRU is None or not hasattr(os, 'fork'), "needs SharedLRU and fork")
+    def test_shared_processes(self):
+        path = self._shared_path()
+        l = SharedLRU(path, 1 << 16)
+        children = []
+        for n in range(4):
+            pid = os.fork()
+            if pid == 0:  # pragma: no cover
+                code = 1
+                try:
+                    c = SharedLRU(path, 1 << 16)
+                    for i in range(500):
+                        c[b'%d-%d' % (n, i % 50)] = b'%d' % i
+                        c.get(b'%d-%d' % ((n + 1) % 4, i % 50))
+                    code = 0
+                finally:
+                    os._exit(code)
+            children.append(pid)
+        for pid in children:
+            self.assertEqual(0, os.waitpid(pid, 0)[1])
+        for n in range(4):
+            for i in range(450, 500):
+                self.assertEqual(b'%d' % i, bytes(l[b'%d-%d' % (n, i % 50)]))
+        self.assertEqual(200, len(l))
+        hits, misses = l.get_stats()
+        self.assertEqual(2000, hits + misses - 200)
+
+    def test_arena(self):
+        evicted = []
+        l = LRU(2, value_store='arena', callback=lambda k, v: evicted.append((k, bytes(v))))
+        l[1] = b'one'
+        l[2] = bytearray(b'two')
+        view = l[1]
+        self.assertIsInstance(view, memoryview)
+        self.assertTrue(view.readonly)
+        self.assertEqual(b'one', view)
+        # Hits share the exporter of the block
+        self.assertIs(view.obj, l[1].obj)
+        self.assertEqual(b'one', memoryview(view.obj))
+        self.assertEqual([b'one', b'two'], [bytes(v) for v in l.values()])
+        self.assertEqual([(1, b'one'), (2, b'two')], [(k, bytes(v)) for k, v in l.items()])
+        self.assertEqual(b'two', l.peek(2))
+        self.assertEqual(b'two', l.peek_last_item()[1])
+        reserved, used = l.get_arena_stats()
+        self.assertTrue(reserved >= used > 0)
+        # An evicted value stays readable, and in use, while a view of it is alive
+        l[3] = memoryview(b'three')
+        self.assertEqual([(2, b'two')], evicted)
+        l[4] = b'four'
+        self.assertEqual(b'one', view)
+        pinned = l.get_arena_stats()[1]
+        self.assertTrue(pinned > used)
+        view.release()
+        del view
+        self.assertEqual(used, l.get_arena_stats()[1])
+        self.assertEqual(b'four', l.pop(4))
+        self.assertEqual(b'three', l.get(3, promote=False))
+        self.assertEqual([False, True], l.contains_many([4, 3]))
+        # Updates copy the new bytes, a failed one keeps the old value
+        l[3] = b'x' * 10000
+        self.assertEqual(b'x' * 10000, l[3])
+        self.assertRaises(TypeError, l.__setitem__, 3, 'text')
+        self.assertRaises(TypeError, l.__setitem__, 5, 1)
+        self.assertEqual(b'x' * 10000, l[3])
+        self.assertEqual([3], l.keys())
+        # Views keep the LRU alive
+        view = l[3]
+        del l
+        gc.collect()
+        self.assertEqual(b'x' * 10000, view)
+        exporter = view.obj
+        view.release()
+        self.assertRaises(BufferError, memoryview, exporter)
+
+    def test_arena_options(self):
+        l = LRU(4, value_store='arena', copy_values=True)
+        l['a'] = b'abc'
+        self.assertEqual(b'abc', l['a'])
+        self.assertEqual([('a', b'abc')], l.items())
+        dumped = pickle.loads(pickle.dumps(l))
+        self.assertEqual([('a', b'abc')], dumped.items())
+        self.assertEqual(l.get_arena_stats(), dumped.get_arena_stats())
+        buf = io.BytesIO()
+        l = LRU(4, value_store='arena')
+        l.update([(1, b'x'), (2, b'yy')])
+        l.dump(buf)
+        buf.seek(0)
+        loaded = LRU(4)
+        loaded.load(buf)
+        self.assertEqual([(2, b'yy'), (1, b'x')], loaded.items())
+        self.assertEqual((0, 0), loaded.get_arena_stats())
+        s = ShardedLRU(8, 2, value_store='arena')
+        s['k'] = b'v'
+        self.assertEqual(b'v', s['k'])
+        dumped = pickle.loads(pickle.dumps(s))
+        self.assertIsInstance(dumped['k'], memoryview)
+        self.assertEqual(b'v', dumped['k'])
+        s = ShardedLRU(8, 2, value_store='arena', copy_values=True)
+        s['k'] = b'v'
+        dumped = pickle.loads(pickle.dumps(s))
+        self.assertIsInstance(dumped['k'], bytes)
+        self.assertRaises(ValueError, LRU, 4, value_store='heap')
+        self.assertRaises(ValueError, LRU, 4, value_store='arena', engine='compact')
+        self.assertRaises(ValueError, LRU, 4, value_store='arena', read_buffer=8)
+        self.assertRaises(ValueError, LRU, 4, copy_values=True)
+
+    def test_l2(self):
+        l = LRU(2, l2_path=self._shared_path(), l2_size=4096)
+        for i in range(5):
+            l[i] = 'v%d' % i
+        self.assertEqual([4, 3], l.keys())
+        self.assertEqual((0, 0, 3), l.get_l2_stats()[:3])
+        # Hits on the disk tier move the entry back to memory, evicting one to disk
+        self.assertEqual('v0', l[0])
+        self.assertEqual([0, 4], l.keys())
+        self.assertEqual('v1', l.get(1))
+        self.assertIsNone(l.get(9))
+        self.assertEqual((2, 1, 3), l.get_l2_stats()[:3])
+        self.assertEqual((0, 3), l.get_stats())
+        # Disk entries are found without promotion, and can be replaced or removed
+        self.assertTrue(2 in l)
+        self.assertEqual('v2', l.peek(2))
+        self.assertEqual([1, 0], l.keys())
+        self.assertEqual('v2', l.pop(2))
+        self.assertFalse(2 in l)
+        del l[3]
+        self.assertRaises(KeyError, l.__delitem__, 3)
+        l[4] = 'new'
+        self.assertEqual('new', l[4])
+        self.assertEqual([4, 1], l.keys())
+        self.assertEqual(1, l.get_l2_stats()[2])
+        # Entries that can't be pickled are only evicted
+        l[5] = lambda: None
+        l[6] = 6
+        l[7] = 7
+        self.assertFalse(5 in l)
+        self.assertEqual(3, l.get_l2_stats()[2])
+        l.clear()
+        self.assertEqual((0, 0), l.get_l2_stats()[2:])
+        self.assertRaises(ValueError, LRU, 2, l2_path=self._shared_path())
+        self.assertRaises(ValueError, LRU, 2, l2_size=4096)
+        self.assertRaises(ValueError, LRU, 2, l2_path=self._shared_path(), l2_size=4096, ttl=1)
+        self.assertRaises(ValueError, LRU, 2, l2_path=self._shared_path(), l2_size=4096,
+                          engine='compact')
+        self.assertRaises(ValueError, ShardedLRU, 4, l2_path=self._shared_path(), l2_size=4096)
+
+    def test_l2_log(self):
+        # The log wraps around many times, dropping its oldest records
+        model = {}
+        l = LRU(20, l2_path=self._shared_path(), l2_size=8192, max_weight=1000)
+        rand = random.Random(5)
+        for step in range(20000):
+            k = rand.randrange(200)
+            op = rand.random()
+            if op < 0.5:
+                value = l.get(k)
+                if value is not None:
+                    self.assertEqual(model[k], value)
+            elif op < 0.9:
+                model[k] = (k, step, b'x' * rand.randrange(300))
+                l.set(k, model[k], weight=k + 1)
+            else:
+                l.pop(k, None)
+                model.pop(k, None)
+        hits, misses, entries, used = l.get_l2_stats()
+        self.assertTrue(hits > 0 and misses > 0)
+        self.assertTrue(0 < used <= 8192)
+        self.assertEqual(l.get_current_weight(), sum(k + 1 for k in l.keys()))
+
+    def test_hash_calls(self):
+        hashes = []
+
+        class Key:
+            def __init__(self, n):
+                self.n = n
+
+            def __hash__(self):
+                hashes.append(self.n)
+                return self.n
+
+            def __eq__(self, other):
+                return isinstance(other, Key) and self.n == other.n
+
+        for policy in ['lru', 'clock', 'slru', 'tinylfu']:
+            l = LRU(2, policy=policy)
+            keys = [Key(n) for n in range(4)]
+            del hashes[:]
+            l[keys[0]] = 0
+            l[keys[1]] = 1
+            l[keys[1]] = 2
+            self.assertEqual([0, 1, 1], hashes)
+            del hashes[:]
+            # Evicting keys[0] or keys[1] uses the hash kept in the node
+            l[keys[2]] = 3
+            self.assertEqual([2], hashes)
+            del hashes[:]
+            key = l.keys()[0]
+            self.assertEqual(l[key], l.pop(key))
+            self.assertEqual([key.n, key.n], hashes)
+            del hashes[:]
+            del l[l.keys()[0]]
+            self.assertEqual(1, len(hashes))
+            self.assertEqual('x', l.pop(keys[3], 'x'))
+            self.assertRaises(KeyError, l.pop, keys[3])
+            self.assertRaises(TypeError, l.pop, [])
+
+        evicted = []
+        l = LRU(2, lambda k, v, reason: evicted.append(k), engine='compact',
+                callback_reason=True)
+        l[Key(0)] = 0
+        del hashes[:]
+        self.assertEqual(0, l.pop(Key(0)))
+        self.assertEqual([0], hashes)
+        self.assertEqual([0], [k.n for k in evicted])
+        self.assertEqual(0, len(l))
+        self.assertEqual('x', l.pop(Key(1), 'x'))
+        self.assertRaises(KeyError, l.pop, Key(1))
+        self.assertEqual((1, 2), l.get_stats())
+
+    def test_cache(self):
+        calls = []
+
+        @cache(maxsize=2)
+        def square(x):
+            """Squares x."""
+            calls.append(x)
+            return x * x
+
+        self.assertEqual('square', square.__name__)
+        self.assertEqual("Squares x.", square.__doc__)
+        self.assertEqual({'maxsize': 2, 'typed': False}, square.cache_parameters())
+        self.assertEqual(4, square(2))
+        self.assertEqual(4, square(2))
+        self.assertEqual(9, square(3))
+        self.assertEqual(16, square(4))  # evicts 2
+        self.assertEqual(4, square(2))
+        self.assertEqual([2, 3, 4, 2], calls)
+        info = square.cache_info()
+        self.assertEqual((1, 4, 2, 2), info)
+        self.assertEqual(1, info.hits)
+        # 1 and 1.0 are the same key unless typed
+        self.assertEqual(1, square(1))
+        self.assertEqual(1, square(1.0))
+        self.assertEqual(1, square((1,)[0]))
+        self.assertEqual([2, 3, 4, 2, 1], calls)
+        square.cache_clear()
+        self.assertEqual((0, 0, 2, 0), square.cache_info())
+        self.assertRaises(TypeError, square, [1])
+
+    def test_cache_keys(self):
+        @cache(maxsize=None)
+        def f(*args, **kwargs):
+            return args, sorted(kwargs.items())
+
+        self.assertEqual(((1, 2), []), f(1, 2))
+        self.assertEqual((((1, 2),), []), f((1, 2)))
+        self.assertEqual(((1,), [('b', 2)]), f(1, b=2))
+        self.assertEqual(((1, 2), []), f(1, 2))
+        self.assertEqual(((), []), f())
+        self.assertEqual(((), []), f())
+        self.assertEqual((('a',), []), f('a'))
+        self.assertEqual(((b'a',), []), f(b'a'))
+        self.assertEqual((2, 6, None, 6), f.cache_info())
+
+        @cache(typed=True)
+        def g(x, y=0):
+            return type(x)
+
+        self.assertIs(int, g(1))
+        self.assertIs(float, g(1.0))
+        self.assertIs(int, g(1, y=1))
+        self.assertIs(float, g(1.0, y=1))
+        self.assertEqual((0, 4, 128, 4), g.cache_info())
+
+    def test_cache_calls(self):
+        @cache(maxsize=0)
+        def nocache(x):
+            return x
+
+        self.assertEqual(1, nocache(1))
+        self.assertEqual(1, nocache(1))
+        self.assertEqual((0, 2, 0, 0), nocache.cache_info())
+
+        @cache
+        def fib(n):
+            return n if n < 2 else fib(n - 1) + fib(n - 2)
+
+        self.assertEqual(354224848179261915075, fib(100))
+        self.assertEqual((98, 101, 128, 101), fib.cache_info())
+
+        failures = []
+
+        @cache(2)
+        def fails(x):
+            failures.append(x)
+            raise ValueError(x)
+
+        self.assertRaises(ValueError, fails, 1)
+        self.assertRaises(ValueError, fails, 1)
+        self.assertEqual([1, 1], failures)
+        self.assertEqual(0, fails.cache_info().currsize)
+        self.assertRaises(TypeError, cache, 'a')
+
+    def test_cache_method(self):
+        class Point:
+            def __init__(self, x):
+                self.x = x
+
+            @cache(maxsize=8)
+            def scaled(self, k):
+                return self.x * k
+
+        a, b = Point(1), Point(2)
+        self.assertEqual(3, a.scaled(3))
+        self.assertEqual(6, b.scaled(3))
+        self.assertEqual(3, a.scaled(3))
+        self.assertEqual(1, Point.scaled.cache_info().hits)
+        self.assertEqual(6, Point.scaled(b, 3))
+        self.assertIs(Point.__dict__['scaled'], Point.scaled)
+        self.assertEqual(2, Point.scaled.cache_info().hits)
+
+    def test_cache_gc(self):
+        @cache(4)
+        def f(x):
+            return x
+
+        f(1)
+        wrapper = weakref.ref(f)
+        del f
+        gc.collect()
+        self.assertIsNone(wrapper())
+        self.assertIs(cached_identity, pickle.loads(pickle.dumps(cached_identity)))
+
+    @unittest.skipIf(interpreters is None, "subinterpreters are not available")
+    def test_subinterpreters(self):
+        code = "\n".join([
+            "import lru",
+            "l = lru.LRU(3, callback=lambda *args: None, callback_reason=True)",
+            "for i in range(10): l[i] = i",
+            "assert l.keys() == [9, 8, 7] and list(l.items())[0] == (9, 9)",
+            "f = lru.cache(2)(lambda x: x)",
+            "assert f(1) == 1 and f(x=2) == 2",
+            "s = lru.ShardedLRU(8, shards=2)",
+            "s[1] = 1",
+            "assert s.keys() == [1]",
+        ])
+        for _ in range(2):
+            interp = interpreters.create()
+            try:
+                self.assertIsNone(interpreters.run_string(interp, code))
+            finally:
+                interpreters.destroy(interp)
+        l = LRU(2)
+        l[1] = 1
+        self.assertEqual(l.keys(), [1])
+        with self.assertRaises(TypeError):
+            type(iter(l))()
+
+@cache
+def cached_identity(x):
+    return x
+
 
 if __name__ == '__main__':
     unittest.main()